@@ -16,11 +16,17 @@
 
 #include "LinearAligner.h"
 #include "MATCHAligner.h"
+#include "ChunkedMATCHAligner.h"
 #include "TransformDTWAligner.h"
 #include "ExternalProgramAligner.h"
+#include "DTWScheduler.h"
+#include "AlignmentCache.h"
+#include "CachedAligner.h"
 
 #include "framework/Document.h"
 
+#include "data/model/AlignmentModel.h"
+
 #include "transform/Transform.h"
 #include "transform/TransformFactory.h"
 
@@ -28,6 +34,7 @@
 
 #include <QSettings>
 #include <QTimer>
+#include <QThread>
 
 using std::make_shared;
 
@@ -52,6 +59,8 @@ Align::getAlignmentTypeTag(AlignmentType type)
         return "transform-driven-alignment";
     case ExternalProgramAlignment:
         return "external-program-alignment";
+    case ChunkedMATCHAlignment:
+        return "chunked-match-alignment";
     }
 }
 
@@ -71,25 +80,271 @@ Align::alignModel(Document *doc,
                   ModelId reference,
                   ModelId toAlign)
 {
+    removeQueuedAlignment(toAlign);
+
     if (addAligner(doc, reference, toAlign)) {
-        m_aligners[toAlign]->begin();
+        std::shared_ptr<Aligner> aligner;
+        {
+            QMutexLocker locker(&m_mutex);
+            aligner = m_aligners[toAlign];
+        }
+        notifyQueueChanged();
+        aligner->begin();
     }
 }
 
 void
 Align::scheduleAlignment(Document *doc,
                          ModelId reference,
-                         ModelId toAlign)
+                         ModelId toAlign,
+                         int priority)
 {
-    int delay = 700 * int(m_aligners.size());
-    if (delay > 3500) {
-        delay = 3500;
-    }
-    if (!addAligner(doc, reference, toAlign)) {
+    // Any earlier alignment of this model, queued or running, is
+    // superseded by this one
+    cancelAlignment(toAlign);
+
+    // A cached alignment costs almost nothing to apply, so there is
+    // no reason to make it wait behind others in the queue
+    QString key;
+    if (getAlignmentPreference() != NoAlignment &&
+        findCachedAlignment(reference, toAlign, key)) {
+        alignModel(doc, reference, toAlign);
         return;
     }
-    SVCERR << "Align::scheduleAlignment: delaying " << delay << "ms" << endl;
-    QTimer::singleShot(delay, m_aligners[toAlign].get(), SLOT(begin()));
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_queue.push_back({ doc, reference, toAlign, priority,
+                            m_nextSequence++ });
+        SVCERR << "Align::scheduleAlignment: queued alignment of "
+               << toAlign << " with priority " << priority << " ("
+               << m_queue.size() << " queued, " << m_aligners.size()
+               << " running)" << endl;
+    }
+    
+    notifyQueueChanged();
+    QTimer::singleShot(0, this, SLOT(startQueuedAlignments()));
+}
+
+void
+Align::prioritiseAlignment(ModelId toAlign)
+{
+    QMutexLocker locker(&m_mutex);
+
+    int highest = 0;
+    for (const auto &q: m_queue) {
+        highest = std::max(highest, q.priority);
+    }
+    for (auto &q: m_queue) {
+        if (q.toAlign == toAlign) {
+            q.priority = highest + 1;
+            break;
+        }
+    }
+}
+
+void
+Align::cancelAlignment(ModelId toAlign)
+{
+    bool changed = removeQueuedAlignment(toAlign);
+
+    std::shared_ptr<Aligner> aligner;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_aligners.find(toAlign) != m_aligners.end()) {
+            aligner = m_aligners[toAlign];
+            m_aligners.erase(toAlign);
+        }
+        m_cacheKeys.erase(toAlign);
+    }
+
+    if (aligner) {
+        // Destroying the aligner (when our last reference goes out of
+        // scope) stops the alignment
+        disconnect(aligner.get(), nullptr, this, nullptr);
+        changed = true;
+    }
+
+    if (changed) {
+        notifyQueueChanged();
+        QTimer::singleShot(0, this, SLOT(startQueuedAlignments()));
+    }
+}
+
+int
+Align::getQueuedAlignmentCount() const
+{
+    QMutexLocker locker(&m_mutex);
+    return int(m_queue.size());
+}
+
+int
+Align::getRunningAlignmentCount() const
+{
+    QMutexLocker locker(&m_mutex);
+    return int(m_aligners.size());
+}
+
+bool
+Align::removeQueuedAlignment(ModelId toAlign)
+{
+    QMutexLocker locker(&m_mutex);
+
+    for (auto i = m_queue.begin(); i != m_queue.end(); ++i) {
+        if (i->toAlign == toAlign) {
+            m_queue.erase(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+Align::reapAbandonedAligners()
+{
+    // An aligner whose models have been deleted may return without
+    // ever signalling completion or failure; don't let it hold on to
+    // a slot in the queue
+    
+    std::vector<std::shared_ptr<Aligner>> abandoned;
+    {
+        QMutexLocker locker(&m_mutex);
+        for (auto i = m_aligners.begin(); i != m_aligners.end(); ) {
+            if (!ModelById::get(i->first)) {
+                abandoned.push_back(i->second);
+                i = m_aligners.erase(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    for (auto a: abandoned) {
+        disconnect(a.get(), nullptr, this, nullptr);
+    }
+}
+
+void
+Align::startQueuedAlignments()
+{
+    reapAbandonedAligners();
+    
+    int limit = getMaxConcurrentAlignments();
+
+    while (true) {
+
+        QueuedAlignment next;
+        
+        {
+            QMutexLocker locker(&m_mutex);
+
+            if (m_queue.empty() || int(m_aligners.size()) >= limit) {
+                break;
+            }
+
+            auto chosen = m_queue.begin();
+            for (auto i = m_queue.begin(); i != m_queue.end(); ++i) {
+                if (i->priority > chosen->priority) {
+                    chosen = i;
+                }
+            }
+
+            next = *chosen;
+            m_queue.erase(chosen);
+        }
+
+        SVCERR << "Align::startQueuedAlignments: starting alignment of "
+               << next.toAlign << endl;
+
+        if (!addAligner(next.doc, next.reference, next.toAlign)) {
+            continue;
+        }
+
+        std::shared_ptr<Aligner> aligner;
+        {
+            QMutexLocker locker(&m_mutex);
+            aligner = m_aligners[next.toAlign];
+        }
+        
+        notifyQueueChanged();
+
+        // This may complete (or fail) synchronously, or may process
+        // events and so re-enter this function: either is fine, as we
+        // re-examine the queue and running set on every iteration
+        aligner->begin();
+    }
+
+    notifyQueueChanged();
+}
+
+void
+Align::notifyQueueChanged()
+{
+    int queued = 0, running = 0;
+    {
+        QMutexLocker locker(&m_mutex);
+        queued = int(m_queue.size());
+        running = int(m_aligners.size());
+    }
+    emit alignmentQueueChanged(queued, running);
+}
+
+QString
+Align::getAlignmentParameterDescription()
+{
+    // Everything in the preferences that may affect the outcome of
+    // an alignment, so that a change to any of it invalidates the
+    // cached results
+    
+    AlignmentType type = getAlignmentPreference();
+    DTWBand band = getDTWBandPreference();
+
+    QStringList parts;
+    parts << getAlignmentTypeTag(type);
+    parts << (getUseSubsequenceAlignment() ? "subsequence" : "full");
+
+    switch (type) {
+    case SungNoteContourAlignment:
+    case TransformDrivenDTWAlignment:
+        parts << QString("band:%1:%2")
+            .arg(int(band.getType())).arg(band.getRadius());
+        parts << (getUseMultiscaleDTW() ? "multiscale" : "exact");
+        if (type == TransformDrivenDTWAlignment) {
+            parts << getPreferredAlignmentTransform().toXmlString();
+        }
+        break;
+    case ExternalProgramAlignment:
+        parts << getPreferredAlignmentProgram();
+        break;
+    case ChunkedMATCHAlignment:
+        parts << QString("chunk:%1").arg(getMATCHChunkDuration());
+        break;
+    default:
+        break;
+    }
+
+    return parts.join("\n");
+}
+
+std::shared_ptr<Path>
+Align::findCachedAlignment(ModelId reference,
+                           ModelId toAlign,
+                           QString &key)
+{
+    key = QString();
+    
+    if (!getUseAlignmentCache()) {
+        return {};
+    }
+
+    key = AlignmentCache::getInstance()->getKey
+        (reference, toAlign, getAlignmentParameterDescription());
+    if (key == "") {
+        return {};
+    }
+
+    return AlignmentCache::getInstance()->lookup(key);
 }
 
 bool
@@ -101,6 +356,12 @@ Align::addAligner(Document *doc,
     
     std::shared_ptr<Aligner> aligner;
 
+    if (type == SungNoteContourAlignment ||
+        type == TransformDrivenDTWAlignment) {
+        DTWScheduler::getInstance()->setBudget
+            (size_t(getDTWMemoryBudget()) * 1024 * 1024);
+    }
+
     if (m_aligners.find(toAlign) != m_aligners.end()) {
         // We don't want a callback on removeAligner to happen during
         // our own call to addAligner! Disconnect and delete the old
@@ -108,6 +369,12 @@ Align::addAligner(Document *doc,
         disconnect(m_aligners[toAlign].get(), nullptr, this, nullptr);
         m_aligners.erase(toAlign);
     }
+
+    QString cacheKey;
+    std::shared_ptr<Path> cachedPath;
+    if (type != NoAlignment) {
+        cachedPath = findCachedAlignment(reference, toAlign, cacheKey);
+    }
     
     {
         // Replace the aligner with a new one. This also stops any
@@ -116,83 +383,137 @@ Align::addAligner(Document *doc,
         
         QMutexLocker locker(&m_mutex);
 
-        switch (type) {
+        if (cachedPath) {
 
-        case NoAlignment:
-            return false;
-
-        case LinearAlignment:
-        case TrimmedLinearAlignment: {
-            bool trimmed = (type == TrimmedLinearAlignment);
-            aligner = make_shared<LinearAligner>(doc,
+            aligner = make_shared<CachedAligner>(doc,
                                                  reference,
                                                  toAlign,
-                                                 trimmed);
-            break;
-        }
+                                                 cachedPath);
 
-        case MATCHAlignment:
-        case MATCHAlignmentWithPitchCompare: {
+        } else {
 
-            bool withTuningDifference =
-                (type == MATCHAlignmentWithPitchCompare);
-            
-            aligner = make_shared<MATCHAligner>(doc,
-                                                reference,
-                                                toAlign,
-                                                getUseSubsequenceAlignment(),
-                                                withTuningDifference);
-            break;
-        }
+            switch (type) {
 
-        case SungNoteContourAlignment:
-        {
-            auto refModel = ModelById::get(reference);
-            if (!refModel) return false;
-
-            Transform transform = TransformFactory::getInstance()->
-                getDefaultTransformFor("vamp:pyin:pyin:notes",
-                                       refModel->getSampleRate());
-
-            aligner = make_shared<TransformDTWAligner>
-                (doc,
-                 reference,
-                 toAlign,
-                 getUseSubsequenceAlignment(),
-                 transform,
-                 [](double prev, double curr) {
-                     RiseFallDTW::Value v;
-                     if (curr <= 0.0) {
-                         v = { RiseFallDTW::Direction::None, 0.0 };
-                     } else if (prev <= 0.0) {
-                         v = { RiseFallDTW::Direction::Up, 0.0 };
-                     } else {
-                         double prevP = Pitch::getPitchForFrequency(prev);
-                         double currP = Pitch::getPitchForFrequency(curr);
-                         if (currP >= prevP) {
-                             v = { RiseFallDTW::Direction::Up, currP - prevP };
+            case NoAlignment:
+                return false;
+
+            case LinearAlignment:
+            case TrimmedLinearAlignment: {
+                bool trimmed = (type == TrimmedLinearAlignment);
+                aligner = make_shared<LinearAligner>(doc,
+                                                     reference,
+                                                     toAlign,
+                                                     trimmed);
+                break;
+            }
+
+            case MATCHAlignment:
+            case MATCHAlignmentWithPitchCompare: {
+
+                bool withTuningDifference =
+                    (type == MATCHAlignmentWithPitchCompare);
+            
+                aligner = make_shared<MATCHAligner>(doc,
+                                                    reference,
+                                                    toAlign,
+                                                    getUseSubsequenceAlignment(),
+                                                    withTuningDifference);
+                break;
+            }
+
+            case SungNoteContourAlignment:
+            {
+                auto refModel = ModelById::get(reference);
+                if (!refModel) return false;
+
+                Transform transform = TransformFactory::getInstance()->
+                    getDefaultTransformFor("vamp:pyin:pyin:notes",
+                                           refModel->getSampleRate());
+
+                auto dtwAligner = make_shared<TransformDTWAligner>
+                    (doc,
+                     reference,
+                     toAlign,
+                     getUseSubsequenceAlignment(),
+                     transform,
+                     [](double prev, double curr) {
+                         RiseFallDTW::Value v;
+                         if (curr <= 0.0) {
+                             v = { RiseFallDTW::Direction::None, 0.0 };
+                         } else if (prev <= 0.0) {
+                             v = { RiseFallDTW::Direction::Up, 0.0 };
                          } else {
-                             v = { RiseFallDTW::Direction::Down, prevP - currP };
+                             double prevP = Pitch::getPitchForFrequency(prev);
+                             double currP = Pitch::getPitchForFrequency(curr);
+                             if (currP >= prevP) {
+                                 v = { RiseFallDTW::Direction::Up, currP - prevP };
+                             } else {
+                                 v = { RiseFallDTW::Direction::Down, prevP - currP };
+                             }
                          }
-                     }
-                     return v;
-                 });
-            break;
-        }
+                         return v;
+                     });
+                dtwAligner->setBand(getDTWBandPreference());
+                dtwAligner->setStrategy(getUseMultiscaleDTW() ?
+                                        TransformDTWAligner::Multiscale :
+                                        TransformDTWAligner::Exact);
+                dtwAligner->setOnline(getUseOnlineDTW());
+                aligner = dtwAligner;
+                break;
+            }
         
-        case TransformDrivenDTWAlignment:
-            throw std::logic_error("Not yet implemented"); //!!!
-
-        case ExternalProgramAlignment: {
-            aligner = make_shared<ExternalProgramAligner>
-                (doc,
-                 reference,
-                 toAlign,
-                 getPreferredAlignmentProgram());
-        }
+            case TransformDrivenDTWAlignment:
+            {
+                Transform transform = getPreferredAlignmentTransform();
+                if (transform.getIdentifier() == "") {
+                    SVCERR << "Align::addAligner: No transform set for "
+                           << "transform-driven alignment" << endl;
+                    return false;
+                }
+
+                auto dtwAligner = make_shared<TransformDTWAligner>
+                    (doc,
+                     reference,
+                     toAlign,
+                     getUseSubsequenceAlignment(),
+                     transform,
+                     TransformDTWAligner::Magnitude);
+                dtwAligner->setBand(getDTWBandPreference());
+                dtwAligner->setStrategy(getUseMultiscaleDTW() ?
+                                        TransformDTWAligner::Multiscale :
+                                        TransformDTWAligner::Exact);
+                dtwAligner->setOnline(getUseOnlineDTW());
+                aligner = dtwAligner;
+                break;
+            }
+
+            case ChunkedMATCHAlignment:
+                aligner = make_shared<ChunkedMATCHAligner>
+                    (doc,
+                     reference,
+                     toAlign,
+                     getMATCHChunkDuration());
+                break;
+
+            case ExternalProgramAlignment: {
+                aligner = make_shared<ExternalProgramAligner>
+                    (doc,
+                     reference,
+                     toAlign,
+                     getPreferredAlignmentProgram(),
+                     getUseStreamingAlignmentProgram());
+            }
+            }
         }
 
         m_aligners[toAlign] = aligner;
+
+        if (cachedPath || type == NoAlignment || !getUseAlignmentCache()) {
+            m_cacheKeys.erase(toAlign);
+        } else {
+            m_cacheKeys[toAlign] = { cacheKey, reference,
+                                     getAlignmentParameterDescription() };
+        }
     }
 
     connect(aligner.get(), SIGNAL(complete(ModelId)),
@@ -222,6 +543,22 @@ Align::getPreferredAlignmentProgram()
     return settings.value("alignment-program", "").toString();
 }
 
+bool
+Align::getUseStreamingAlignmentProgram()
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    return settings.value("alignment-program-streaming", false).toBool();
+}
+
+double
+Align::getMATCHChunkDuration()
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    return settings.value("match-chunk-duration", 300.0).toDouble();
+}
+
 Transform
 Align::getPreferredAlignmentTransform()
 {
@@ -239,6 +576,64 @@ Align::getUseSubsequenceAlignment()
     return settings.value("alignment-subsequence", false).toBool();
 }
 
+DTWBand
+Align::getDTWBandPreference()
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    QString tag = settings.value("dtw-band-type", "unconstrained").toString();
+    double radius = settings.value("dtw-band-radius", 0.0).toDouble();
+    if (tag == "fixed") {
+        return DTWBand(DTWBand::Type::Fixed, radius);
+    } else if (tag == "relative") {
+        return DTWBand(DTWBand::Type::Relative, radius);
+    } else {
+        return DTWBand();
+    }
+}
+
+int
+Align::getDTWMemoryBudget()
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    return settings.value("dtw-memory-budget", 1024).toInt();
+}
+
+int
+Align::getMaxConcurrentAlignments()
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    int def = std::max(2, QThread::idealThreadCount() / 2);
+    int n = settings.value("alignment-concurrency", def).toInt();
+    return std::max(1, n);
+}
+
+bool
+Align::getUseMultiscaleDTW()
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    return settings.value("dtw-multiscale", false).toBool();
+}
+
+bool
+Align::getUseOnlineDTW()
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    return settings.value("dtw-online", false).toBool();
+}
+
+bool
+Align::getUseAlignmentCache()
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    return settings.value("alignment-cache", true).toBool();
+}
+
 void
 Align::setAlignmentPreference(AlignmentType type)
 {
@@ -270,6 +665,24 @@ Align::setPreferredAlignmentProgram(QString program)
     settings.endGroup();
 }
 
+void
+Align::setUseStreamingAlignmentProgram(bool streaming)
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    settings.setValue("alignment-program-streaming", streaming);
+    settings.endGroup();
+}
+
+void
+Align::setMATCHChunkDuration(double seconds)
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    settings.setValue("match-chunk-duration", seconds);
+    settings.endGroup();
+}
+
 void
 Align::setPreferredAlignmentTransform(Transform transform)
 {
@@ -288,6 +701,69 @@ Align::setUseSubsequenceAlignment(bool subsequence)
     settings.endGroup();
 }
 
+void
+Align::setDTWBandPreference(DTWBand band)
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    QString tag;
+    switch (band.getType()) {
+    case DTWBand::Type::Unconstrained: tag = "unconstrained"; break;
+    case DTWBand::Type::Fixed: tag = "fixed"; break;
+    case DTWBand::Type::Relative: tag = "relative"; break;
+    }
+    settings.setValue("dtw-band-type", tag);
+    settings.setValue("dtw-band-radius", band.getRadius());
+    settings.endGroup();
+}
+
+void
+Align::setUseMultiscaleDTW(bool multiscale)
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    settings.setValue("dtw-multiscale", multiscale);
+    settings.endGroup();
+}
+
+void
+Align::setUseOnlineDTW(bool online)
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    settings.setValue("dtw-online", online);
+    settings.endGroup();
+}
+
+void
+Align::setDTWMemoryBudget(int megabytes)
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    settings.setValue("dtw-memory-budget", megabytes);
+    settings.endGroup();
+
+    DTWScheduler::getInstance()->setBudget(size_t(megabytes) * 1024 * 1024);
+}
+
+void
+Align::setUseAlignmentCache(bool use)
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    settings.setValue("alignment-cache", use);
+    settings.endGroup();
+}
+
+void
+Align::setMaxConcurrentAlignments(int n)
+{
+    QSettings settings;
+    settings.beginGroup("Alignment");
+    settings.setValue("alignment-concurrency", n);
+    settings.endGroup();
+}
+
 bool
 Align::canAlign() 
 {
@@ -311,14 +787,48 @@ Align::canAlign()
 void
 Align::alignerComplete(ModelId alignmentModel)
 {
+    QString key;
+    if (auto am = ModelById::getAs<AlignmentModel>(alignmentModel)) {
+        ModelId toAlign = am->getAlignedModel();
+        CacheEntry entry;
+        bool found = false;
+        {
+            QMutexLocker locker(&m_mutex);
+            auto itr = m_cacheKeys.find(toAlign);
+            if (itr != m_cacheKeys.end()) {
+                entry = itr->second;
+                found = true;
+                m_cacheKeys.erase(itr);
+            }
+        }
+        key = entry.key;
+        if (found && key == "") {
+            // The hashes were still being calculated when the
+            // alignment started, but are probably ready by now
+            key = AlignmentCache::getInstance()->getKey
+                (entry.reference, toAlign, entry.parameters);
+        }
+    }
+    if (key != "") {
+        AlignmentCache::getInstance()->store(key, alignmentModel);
+    }
+    
     removeAligner(sender());
+    notifyQueueChanged();
+    QTimer::singleShot(0, this, SLOT(startQueuedAlignments()));
     emit alignmentComplete(alignmentModel);
 }
 
 void
 Align::alignerFailed(ModelId toAlign, QString error)
 {
+    {
+        QMutexLocker locker(&m_mutex);
+        m_cacheKeys.erase(toAlign);
+    }
     removeAligner(sender());
+    notifyQueueChanged();
+    QTimer::singleShot(0, this, SLOT(startQueuedAlignments()));
     emit alignmentFailed(toAlign, error);
 }
 
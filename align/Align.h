@@ -20,20 +20,25 @@
 #include <QProcess>
 #include <QMutex>
 #include <set>
+#include <map>
+#include <vector>
+#include <cstdint>
 
 #include "Aligner.h"
+#include "DTW.h"
 
 #include "transform/Transform.h"
 
 class AlignmentModel;
 class Document;
+class Path;
 
 class Align : public QObject
 {
     Q_OBJECT
     
 public:
-    Align() { }
+    Align() : m_nextSequence(0) { }
 
     enum AlignmentType {
         NoAlignment,
@@ -44,8 +49,9 @@ public:
         SungNoteContourAlignment,
         TransformDrivenDTWAlignment,
         ExternalProgramAlignment,
+        ChunkedMATCHAlignment,
 
-        LastAlignmentType = ExternalProgramAlignment
+        LastAlignmentType = ChunkedMATCHAlignment
     };
 
     /**
@@ -103,6 +109,37 @@ public:
      * that it actually is the path of a program, or anything else.
      */
     static void setPreferredAlignmentProgram(QString program);
+
+    /**
+     * Return true if the external program for ExternalProgramAlignment
+     * should be given the audio through its standard input rather
+     * than as file paths (see ExternalProgramAligner for the
+     * protocol). Streaming works with models that have no audio file,
+     * such as recordings, but requires a program that supports it.
+     * The default is false.
+     */
+    static bool getUseStreamingAlignmentProgram();
+
+    /**
+     * Set whether the external alignment program should be given
+     * the audio through its standard input.
+     */
+    static void setUseStreamingAlignmentProgram(bool streaming);
+
+    /**
+     * Return the approximate duration, in seconds, of the windows
+     * into which the reference is divided for ChunkedMATCHAlignment.
+     * The windows are aligned concurrently, so shorter windows make
+     * better use of many processors, but each window also carries a
+     * fixed overlap with its neighbours. The default is 300.
+     */
+    static double getMATCHChunkDuration();
+
+    /**
+     * Set the approximate duration, in seconds, of the windows used
+     * for ChunkedMATCHAlignment.
+     */
+    static void setMATCHChunkDuration(double seconds);
     
     /**
      * Get the transform associated with the
@@ -136,6 +173,84 @@ public:
      * Set whether subsequence alignment is to be preferred.
      */
     static void setUseSubsequenceAlignment(bool subsequence);
+
+    /**
+     * Return the band to which DTW-based alignment (as used by
+     * SungNoteContourAlignment) is constrained. A constrained band
+     * uses much less memory than the full cost matrix, at the
+     * expense of being unable to follow large deviations from a
+     * linear alignment. The band does not apply to subsequence
+     * alignment. The default is unconstrained.
+     */
+    static DTWBand getDTWBandPreference();
+
+    /**
+     * Set the band to which DTW-based alignment is constrained.
+     */
+    static void setDTWBandPreference(DTWBand band);
+
+    /**
+     * Return true if DTW-based alignment (SungNoteContourAlignment
+     * and TransformDrivenDTWAlignment) should use the approximate
+     * multiscale method rather than exact DTW. This is much faster
+     * and uses far less memory for long recordings, but may miss the
+     * optimal alignment. The default is false.
+     */
+    static bool getUseMultiscaleDTW();
+
+    /**
+     * Set whether DTW-based alignment should use the multiscale
+     * method.
+     */
+    static void setUseMultiscaleDTW(bool multiscale);
+
+    /**
+     * Return true if DTW-based alignment should publish a
+     * provisional alignment, calculated online as the feature
+     * transforms produce their output, before the full alignment is
+     * available. This does not apply to subsequence alignment, and
+     * produces nothing for transforms that only return their
+     * features at the end, such as the default pYIN notes. The
+     * online DTW is extended on the GUI thread at each progress
+     * update. The default is false.
+     */
+    static bool getUseOnlineDTW();
+
+    /**
+     * Set whether DTW-based alignment should publish an online
+     * provisional alignment.
+     */
+    static void setUseOnlineDTW(bool online);
+
+    /**
+     * Return the memory budget, in megabytes, within which DTW-based
+     * alignments may run concurrently. Alignments are admitted to run
+     * in parallel for as long as the total estimated size of their
+     * cost matrices fits within the budget; an alignment too large
+     * for the budget runs only when no other is running. The default
+     * is 1024.
+     */
+    static int getDTWMemoryBudget();
+
+    /**
+     * Set the memory budget, in megabytes, for concurrent DTW-based
+     * alignments.
+     */
+    static void setDTWMemoryBudget(int megabytes);
+
+    /**
+     * Return true if completed alignments should be stored in, and
+     * subsequently reused from, the persistent alignment cache (see
+     * AlignmentCache). A cached alignment is reused only when the
+     * same audio content is aligned again using the same method and
+     * parameters. The default is true.
+     */
+    static bool getUseAlignmentCache();
+
+    /**
+     * Set whether the persistent alignment cache should be used.
+     */
+    static void setUseAlignmentCache(bool use);
     
     /**
      * Align the "other" model to the reference, attaching an
@@ -169,18 +284,59 @@ public:
 
     /**
      * As alignModel, except that the alignment does not begin
-     * immediately, but is instead placed behind an event callback
-     * with a small delay. Useful to avoid an unresponsive GUI when
-     * firing off alignments while doing something else as well. Any
-     * error is reported by firing the alignmentFailed signal.
+     * immediately, but is instead placed in a queue. Queued
+     * alignments are started from an event callback, for UI
+     * responsiveness, and no more than getMaxConcurrentAlignments()
+     * of them run at once. Alignments are taken from the queue in
+     * order of priority (highest first) and then in the order in
+     * which they were scheduled. Any error is reported by firing the
+     * alignmentFailed signal.
      *
-     * Scheduled alignments are not queued or serialised - many could
-     * happen at once. They are just delayed a little for UI
-     * responsiveness.
+     * Scheduling an alignment for a toAlign model that already has
+     * an alignment queued or running replaces that alignment.
      */
     void scheduleAlignment(Document *doc,
                            ModelId reference,
-                           ModelId toAlign);
+                           ModelId toAlign,
+                           int priority = 0);
+
+    /**
+     * If an alignment of the given toAlign model is waiting in the
+     * queue, move it ahead of all other queued alignments. This is
+     * intended for use when the model becomes visible, so that the
+     * user sees it aligned first.
+     */
+    void prioritiseAlignment(ModelId toAlign);
+
+    /**
+     * Cancel any queued or running alignment of the given toAlign
+     * model. A running alignment is stopped and its alignment model
+     * detached from the toAlign model. No signal other than
+     * alignmentQueueChanged is emitted.
+     */
+    void cancelAlignment(ModelId toAlign);
+
+    /**
+     * Return the number of alignments waiting in the queue.
+     */
+    int getQueuedAlignmentCount() const;
+
+    /**
+     * Return the number of alignments currently running.
+     */
+    int getRunningAlignmentCount() const;
+
+    /**
+     * Get the maximum number of scheduled alignments that may run
+     * at once, from the global application settings.
+     */
+    static int getMaxConcurrentAlignments();
+
+    /**
+     * Set the maximum number of scheduled alignments that may run at
+     * once.
+     */
+    static void setMaxConcurrentAlignments(int n);
     
     /**
      * Return true if the preferred alignment facility is available
@@ -202,12 +358,34 @@ signals:
      */
     void alignmentFailed(ModelId toAlign, QString errorText);
 
+    /**
+     * Emitted whenever an alignment is queued, started, finished or
+     * cancelled, with the resulting numbers of queued and running
+     * alignments. The progress of an individual running alignment
+     * can be obtained from the completion of its AlignmentModel.
+     */
+    void alignmentQueueChanged(int queued, int running);
+
 private slots:
     void alignerComplete(ModelId alignmentModel); // an AlignmentModel
     void alignerFailed(ModelId toAlign, QString errorText);
+    void startQueuedAlignments();
     
 private:
-    QMutex m_mutex;
+    mutable QMutex m_mutex;
+
+    struct QueuedAlignment {
+        Document *doc;
+        ModelId reference;
+        ModelId toAlign;
+        int priority;
+        uint64_t sequence;
+    };
+
+    // alignments scheduled but not yet started, in the order they
+    // were scheduled
+    std::vector<QueuedAlignment> m_queue;
+    uint64_t m_nextSequence;
 
     // maps toAlign -> aligner for ongoing alignment - note that
     // although we can calculate alignments with different references,
@@ -215,8 +393,28 @@ private:
     // we don't key this on the whole (reference, toAlign) pair
     std::map<ModelId, std::shared_ptr<Aligner>> m_aligners;
 
+    // maps toAlign -> alignment cache key for ongoing alignments
+    // whose result should be stored in the cache when complete. The
+    // key is empty if the content hashes were not ready when the
+    // alignment started, in which case it is made on completion from
+    // the reference and parameters recorded here
+    struct CacheEntry {
+        QString key;
+        ModelId reference;
+        QString parameters;
+    };
+    std::map<ModelId, CacheEntry> m_cacheKeys;
+
+    std::shared_ptr<Path> findCachedAlignment(ModelId reference,
+                                              ModelId toAlign,
+                                              QString &key);
+    static QString getAlignmentParameterDescription();
+    
     bool addAligner(Document *doc, ModelId reference, ModelId toAlign);
     void removeAligner(QObject *);
+    bool removeQueuedAlignment(ModelId toAlign);
+    void reapAbandonedAligners();
+    void notifyQueueChanged();
 };
 
 #endif
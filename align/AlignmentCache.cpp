@@ -0,0 +1,291 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "AlignmentCache.h"
+
+#include "data/model/ReadOnlyWaveFileModel.h"
+#include "data/model/AlignmentModel.h"
+
+#include "base/Debug.h"
+
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDir>
+#include <QTextStream>
+#include <QMutexLocker>
+
+//#define DEBUG_ALIGNMENT_CACHE 1
+
+static const int cacheFormatVersion = 1;
+
+// The resolution at which alignments are sampled for storage
+static const int storedResolution = 512;
+
+// Files are read for hashing a block of this many bytes at a time,
+// checking for exit between blocks
+static const qint64 hashBlockBytes = 1048576;
+
+AlignmentCache *
+AlignmentCache::getInstance()
+{
+    static AlignmentCache instance;
+    return &instance;
+}
+
+AlignmentCache::AlignmentCache() :
+    m_exiting(false),
+    m_thread(nullptr)
+{
+    QDir dir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
+    if (dir.mkpath("alignments")) {
+        m_directory = dir.filePath("alignments");
+    } else {
+        SVCERR << "WARNING: AlignmentCache: Failed to create cache directory "
+               << "in " << dir.path() << ", alignments will not be cached"
+               << endl;
+    }
+}
+
+AlignmentCache::~AlignmentCache()
+{
+    if (!m_thread) return;
+    {
+        QMutexLocker locker(&m_mutex);
+        m_exiting = true;
+        m_condition.wakeAll();
+    }
+    m_thread->wait();
+    delete m_thread;
+}
+
+QString
+AlignmentCache::getContentHash(ModelId modelId)
+{
+    auto model = ModelById::getAs<ReadOnlyWaveFileModel>(modelId);
+    if (!model) return "";
+
+    QString path = model->getLocalFilename();
+    if (path == "") return "";
+
+    QFileInfo info(path);
+    if (!info.exists()) return "";
+
+    // The model's rate is included, as the audio may have been
+    // resampled on load and the path frames are at the model rate
+    QString stamp = QString("%1|%2|%3|%4")
+        .arg(info.canonicalFilePath())
+        .arg(info.size())
+        .arg(info.lastModified().toMSecsSinceEpoch())
+        .arg(model->getSampleRate());
+
+    QMutexLocker locker(&m_mutex);
+
+    auto itr = m_hashes.find(stamp);
+    if (itr != m_hashes.end()) {
+        return itr->second;
+    }
+
+    if (m_hashesPending.find(stamp) == m_hashesPending.end()) {
+#ifdef DEBUG_ALIGNMENT_CACHE
+        SVCERR << "AlignmentCache::getContentHash: Queueing hash of "
+               << path << endl;
+#endif
+        m_hashesPending.insert(stamp);
+        m_hashJobs.push_back({ stamp, path, model->getSampleRate() });
+        if (!m_thread) {
+            m_thread = new HashThread(*this);
+            m_thread->start();
+        }
+        m_condition.wakeAll();
+    }
+
+    return "";
+}
+
+void
+AlignmentCache::runHashes()
+{
+    QMutexLocker locker(&m_mutex);
+
+    while (!m_exiting) {
+
+        if (m_hashJobs.empty()) {
+            m_condition.wait(&m_mutex);
+            continue;
+        }
+
+        HashJob job = m_hashJobs.front();
+        m_hashJobs.pop_front();
+
+        locker.unlock();
+        QString result = calculateHash(job);
+        locker.relock();
+
+        m_hashesPending.erase(job.stamp);
+        
+        // A failed hash is remembered as empty, so that the file is
+        // not read again until it changes
+        m_hashes[job.stamp] = result;
+    }
+}
+
+QString
+AlignmentCache::calculateHash(const HashJob &job) const
+{
+    QFile file(job.path);
+    if (!file.open(QFile::ReadOnly)) return "";
+
+    qint64 size = file.size();
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(QString("%1|%2").arg(size).arg(job.sampleRate).toUtf8());
+
+    qint64 total = 0;
+    while (total < size) {
+        if (m_exiting) return "";
+        QByteArray data = file.read(hashBlockBytes);
+        if (data.isEmpty()) return "";
+        hash.addData(data);
+        total += data.size();
+    }
+    
+    QString result = QString::fromLatin1(hash.result().toHex());
+
+#ifdef DEBUG_ALIGNMENT_CACHE
+    SVCERR << "AlignmentCache::calculateHash: Hashed " << total
+           << " bytes of " << job.path << endl;
+#endif
+
+    return result;
+}
+
+QString
+AlignmentCache::getKey(ModelId reference, ModelId toAlign, QString parameters)
+{
+    if (m_directory == "") return "";
+    
+    // Ask for both before giving up on either, so that both are
+    // calculated if neither is ready yet
+    QString refHash = getContentHash(reference);
+    QString otherHash = getContentHash(toAlign);
+    if (refHash == "" || otherHash == "") return "";
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(refHash.toLatin1());
+    hash.addData(otherHash.toLatin1());
+    hash.addData(parameters.toUtf8());
+    return QString::fromLatin1(hash.result().toHex());
+}
+
+QString
+AlignmentCache::getFilePath(QString key) const
+{
+    return QDir(m_directory).filePath(key + ".path");
+}
+
+std::shared_ptr<Path>
+AlignmentCache::lookup(QString key)
+{
+    if (key == "" || m_directory == "") return {};
+
+    QFile file(getFilePath(key));
+    if (!file.open(QFile::ReadOnly | QFile::Text)) return {};
+
+    QTextStream stream(&file);
+
+    QString tag;
+    int version = 0, resolution = 0;
+    double sampleRate = 0.0;
+    stream >> tag >> version >> sampleRate >> resolution;
+
+    if (tag != "sv-alignment-path" || version != cacheFormatVersion ||
+        sampleRate <= 0.0 || resolution <= 0) {
+        SVCERR << "WARNING: AlignmentCache: Ignoring invalid cache file "
+               << file.fileName() << endl;
+        return {};
+    }
+
+    auto path = std::make_shared<Path>(sampleRate, resolution);
+
+    while (!stream.atEnd()) {
+        qlonglong mapFrame = 0, mapTo = 0;
+        stream >> mapFrame >> mapTo;
+        if (stream.status() != QTextStream::Ok) break;
+        path->add(PathPoint(sv_frame_t(mapFrame), sv_frame_t(mapTo)));
+    }
+
+#ifdef DEBUG_ALIGNMENT_CACHE
+    SVCERR << "AlignmentCache::lookup: Found cached path for key " << key
+           << " with " << path->getPointCount() << " points" << endl;
+#endif
+    
+    return path;
+}
+
+void
+AlignmentCache::store(QString key, ModelId alignmentModelId)
+{
+    if (key == "" || m_directory == "") return;
+
+    auto alignmentModel = ModelById::getAs<AlignmentModel>(alignmentModelId);
+    if (!alignmentModel || alignmentModel->getError() != "") return;
+    
+    auto aligned = ModelById::get(alignmentModel->getAlignedModel());
+    if (!aligned) return;
+
+    // Write to a temporary file and rename, so that a concurrent
+    // reader never sees a partial file
+    QString filePath = getFilePath(key);
+    QString tmpPath = filePath + ".tmp";
+    
+    QFile file(tmpPath);
+    if (!file.open(QFile::WriteOnly | QFile::Text | QFile::Truncate)) {
+        SVCERR << "WARNING: AlignmentCache: Failed to open " << tmpPath
+               << " for writing" << endl;
+        return;
+    }
+
+    QTextStream stream(&file);
+    stream << "sv-alignment-path " << cacheFormatVersion << " "
+           << alignmentModel->getSampleRate() << " "
+           << storedResolution << "\n";
+
+    sv_frame_t start = aligned->getStartFrame();
+    sv_frame_t end = aligned->getEndFrame();
+    
+    for (sv_frame_t f = start; f < end; f += storedResolution) {
+        stream << qlonglong(f) << " "
+               << qlonglong(alignmentModel->toReference(f)) << "\n";
+    }
+    stream << qlonglong(end) << " "
+           << qlonglong(alignmentModel->toReference(end)) << "\n";
+
+    stream.flush();
+    file.close();
+
+    QFile::remove(filePath);
+    if (!QFile::rename(tmpPath, filePath)) {
+        SVCERR << "WARNING: AlignmentCache: Failed to rename " << tmpPath
+               << " to " << filePath << endl;
+        QFile::remove(tmpPath);
+        return;
+    }
+
+#ifdef DEBUG_ALIGNMENT_CACHE
+    SVCERR << "AlignmentCache::store: Stored path for key " << key << endl;
+#endif
+}
@@ -0,0 +1,122 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_ALIGNMENT_CACHE_H
+#define SV_ALIGNMENT_CACHE_H
+
+#include "data/model/Model.h"
+#include "data/model/Path.h"
+
+#include "base/Thread.h"
+
+#include <QString>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <map>
+#include <set>
+#include <deque>
+#include <atomic>
+#include <memory>
+
+/**
+ * Persistent on-disk cache of completed alignment paths. Entries are
+ * keyed by a hash of the audio content of the reference and toAlign
+ * models, together with a string describing the alignment type and
+ * its parameters, so a cached path is reused only if the same audio
+ * would be aligned in the same way again.
+ *
+ * Only models backed by a local audio file can be identified by
+ * content; for any other model no key is available and nothing is
+ * cached. The content of a file is hashed in full, on a thread of
+ * the cache's own, and no key is available for it until that is done.
+ */
+class AlignmentCache
+{
+public:
+    static AlignmentCache *getInstance();
+
+    /**
+     * Return the cache key for an alignment of toAlign against
+     * reference with the given parameter description, or an empty
+     * string if either model cannot be identified by content, or
+     * its content hash is not yet ready.
+     */
+    QString getKey(ModelId reference, ModelId toAlign, QString parameters);
+
+    /**
+     * Return the cached path for the given key, or a null pointer if
+     * there is none.
+     */
+    std::shared_ptr<Path> lookup(QString key);
+
+    /**
+     * Store the path of the given completed AlignmentModel under the
+     * given key. The path is recorded by sampling the alignment
+     * across the extent of its aligned model.
+     */
+    void store(QString key, ModelId alignmentModel);
+
+    /**
+     * Return a hash identifying the audio content of the given model
+     * at its current sample rate, or an empty string if it is not a
+     * model backed by a local audio file. The hash covers the whole
+     * of the file. If it has not been calculated yet, start
+     * calculating it in the background and return an empty string
+     * for now, so that a caller treats the model as uncacheable
+     * rather than waiting. Hashes are remembered for as long as the
+     * file is unchanged.
+     */
+    QString getContentHash(ModelId model);
+
+private:
+    AlignmentCache();
+    ~AlignmentCache();
+
+    QString getFilePath(QString key) const;
+    
+    QString m_directory;
+
+    class HashThread : public Thread
+    {
+    public:
+        HashThread(AlignmentCache &cache) :
+            Thread(Thread::NonRTThread), m_cache(cache) { }
+        void run() override { m_cache.runHashes(); }
+    private:
+        AlignmentCache &m_cache;
+    };
+
+    struct HashJob {
+        QString stamp;
+        QString path;
+        sv_samplerate_t sampleRate;
+    };
+    
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+
+    // file path + size + modification time + model rate -> content hash
+    std::map<QString, QString> m_hashes;
+
+    std::deque<HashJob> m_hashJobs;
+    std::set<QString> m_hashesPending; // stamps queued or in progress
+    std::atomic<bool> m_exiting;
+    HashThread *m_thread; // created when first needed
+
+    void runHashes();
+    QString calculateHash(const HashJob &job) const;
+};
+
+#endif
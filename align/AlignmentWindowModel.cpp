@@ -0,0 +1,130 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+#include "AlignmentWindowModel.h"
+
+#include <QTextStream>
+
+AlignmentWindowModel::AlignmentWindowModel(ModelId first,
+                                           sv_frame_t firstStart,
+                                           sv_frame_t firstEnd,
+                                           ModelId second,
+                                           sv_frame_t secondStart,
+                                           sv_frame_t secondEnd) :
+    m_first(first),
+    m_firstStart(firstStart),
+    m_firstEnd(std::max(firstStart, firstEnd)),
+    m_second(second),
+    m_secondStart(secondStart),
+    m_secondEnd(std::max(secondStart, secondEnd)),
+    m_length(std::max(m_firstEnd - m_firstStart,
+                      m_secondEnd - m_secondStart))
+{
+}
+
+AlignmentWindowModel::~AlignmentWindowModel()
+{
+}
+
+bool
+AlignmentWindowModel::isOK() const
+{
+    auto first = ModelById::getAs<DenseTimeValueModel>(m_first);
+    auto second = ModelById::getAs<DenseTimeValueModel>(m_second);
+    return (first && first->isOK() && second && second->isOK());
+}
+
+bool
+AlignmentWindowModel::isReady(int *completion) const
+{
+    int c = getCompletion();
+    if (completion) *completion = c;
+    return (c == 100);
+}
+
+int
+AlignmentWindowModel::getCompletion() const
+{
+    auto first = ModelById::get(m_first);
+    auto second = ModelById::get(m_second);
+    if (!first || !second) return 0;
+    int c1 = 0, c2 = 0;
+    first->isReady(&c1);
+    second->isReady(&c2);
+    return std::min(c1, c2);
+}
+
+sv_samplerate_t
+AlignmentWindowModel::getSampleRate() const
+{
+    auto first = ModelById::get(m_first);
+    return first ? first->getSampleRate() : 0.0;
+}
+
+floatvec_t
+AlignmentWindowModel::getData(int channel, sv_frame_t start,
+                              sv_frame_t count) const
+{
+    if (channel == -1) {
+        auto both = getMultiChannelData(0, 1, start, count);
+        floatvec_t mixed(both[0].size(), 0.f);
+        for (size_t i = 0; i < mixed.size(); ++i) {
+            mixed[i] = (both[0][i] + both[1][i]) * 0.5f;
+        }
+        return mixed;
+    }
+    
+    if (start < 0 || start >= m_length || count <= 0) {
+        return {};
+    }
+    count = std::min(count, m_length - start);
+    
+    ModelId id = (channel == 0 ? m_first : m_second);
+    sv_frame_t sourceStart = getSourceFrame(channel, start);
+    sv_frame_t sourceEnd = (channel == 0 ? m_firstEnd : m_secondEnd);
+
+    floatvec_t result;
+    if (auto model = ModelById::getAs<DenseTimeValueModel>(id)) {
+        sv_frame_t available = std::max(sv_frame_t(0),
+                                        std::min(count,
+                                                 sourceEnd - sourceStart));
+        if (available > 0) {
+            result = model->getData(-1, sourceStart, available);
+        }
+    }
+
+    // Pad beyond the end of the window (or of the source model)
+    result.resize(count, 0.f);
+    return result;
+}
+
+std::vector<floatvec_t>
+AlignmentWindowModel::getMultiChannelData(int fromchannel,
+                                          int tochannel,
+                                          sv_frame_t start,
+                                          sv_frame_t count) const
+{
+    std::vector<floatvec_t> result;
+    for (int c = std::max(0, fromchannel); c <= std::min(1, tochannel); ++c) {
+        result.push_back(getData(c, start, count));
+    }
+    return result;
+}
+
+void
+AlignmentWindowModel::toXml(QTextStream &,
+                            QString,
+                            QString) const
+{
+    // Transient model used only as alignment input; never saved
+}
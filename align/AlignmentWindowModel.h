@@ -0,0 +1,93 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+#ifndef SV_ALIGNMENT_WINDOW_MODEL_H
+#define SV_ALIGNMENT_WINDOW_MODEL_H
+
+#include "data/model/DenseTimeValueModel.h"
+
+/**
+ * A two-channel DenseTimeValueModel presenting a window of the
+ * mixdown of one model in its first channel, and a window (which may
+ * start at a different frame and have a different length) of the
+ * mixdown of another model in its second. Both windows start at
+ * frame zero of this model, and the shorter is padded with silence
+ * to the length of the longer.
+ *
+ * This is used to give an alignment plugin that takes the two audio
+ * streams as the channels of a single input, such as MATCH, a pair of
+ * corresponding excerpts rather than the whole of both models.
+ *
+ * The model holds no audio itself, but reads from the underlying
+ * models on demand, so they must outlive it.
+ */
+class AlignmentWindowModel : public DenseTimeValueModel
+{
+    Q_OBJECT
+
+public:
+    AlignmentWindowModel(ModelId first,
+                         sv_frame_t firstStart, sv_frame_t firstEnd,
+                         ModelId second,
+                         sv_frame_t secondStart, sv_frame_t secondEnd);
+
+    ~AlignmentWindowModel();
+
+    bool isOK() const override;
+    bool isReady(int *completion = 0) const override;
+    int getCompletion() const override;
+    
+    QString getTypeName() const override { return tr("Alignment Window"); }
+
+    float getValueMinimum() const override { return -1.0f; }
+    float getValueMaximum() const override { return  1.0f; }
+
+    int getChannelCount() const override { return 2; }
+    sv_samplerate_t getSampleRate() const override;
+
+    sv_frame_t getStartFrame() const override { return 0; }
+    sv_frame_t getTrueEndFrame() const override { return m_length; }
+
+    floatvec_t getData(int channel, sv_frame_t start,
+                       sv_frame_t count) const override;
+
+    std::vector<floatvec_t> getMultiChannelData(int fromchannel,
+                                                int tochannel,
+                                                sv_frame_t start,
+                                                sv_frame_t count)
+        const override;
+
+    /**
+     * Return the frame in the given underlying model (0 for the
+     * first, 1 for the second) that corresponds to the given frame
+     * in this model.
+     */
+    sv_frame_t getSourceFrame(int channel, sv_frame_t frame) const {
+        return (channel == 0 ? m_firstStart : m_secondStart) + frame;
+    }
+
+    void toXml(QTextStream &out,
+               QString indent = "",
+               QString extraAttributes = "") const override;
+
+private:
+    ModelId m_first;
+    sv_frame_t m_firstStart;
+    sv_frame_t m_firstEnd;
+    ModelId m_second;
+    sv_frame_t m_secondStart;
+    sv_frame_t m_secondEnd;
+    sv_frame_t m_length;
+};
+
+#endif
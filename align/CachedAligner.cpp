@@ -0,0 +1,62 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "CachedAligner.h"
+
+#include "data/model/AlignmentModel.h"
+
+#include "framework/Document.h"
+
+CachedAligner::CachedAligner(Document *doc,
+                             ModelId reference,
+                             ModelId toAlign,
+                             std::shared_ptr<Path> path) :
+    m_document(doc),
+    m_reference(reference),
+    m_toAlign(toAlign),
+    m_path(path)
+{
+}
+
+CachedAligner::~CachedAligner()
+{
+}
+
+void
+CachedAligner::begin()
+{
+    auto reference = ModelById::get(m_reference);
+    auto toAlign = ModelById::get(m_toAlign);
+
+    if (!reference || !toAlign || !m_path) {
+        emit failed(m_toAlign, tr("Cached alignment is not available"));
+        return;
+    }
+
+    SVCERR << "CachedAligner: using cached alignment of " << m_toAlign
+           << " against " << m_reference << endl;
+    
+    auto alignment = std::make_shared<AlignmentModel>(m_reference,
+                                                      m_toAlign,
+                                                      ModelId());
+
+    auto alignmentModelId = ModelById::add(alignment);
+
+    alignment->setPath(*m_path);
+    alignment->setCompletion(100);
+    toAlign->setAlignment(alignmentModelId);
+    m_document->addNonDerivedModel(alignmentModelId);
+
+    emit complete(alignmentModelId);
+}
@@ -0,0 +1,51 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_CACHED_ALIGNER_H
+#define SV_CACHED_ALIGNER_H
+
+#include "Aligner.h"
+
+#include "data/model/Path.h"
+
+#include <memory>
+
+class Document;
+
+/**
+ * Aligner that applies a previously calculated path, retrieved from
+ * the AlignmentCache, without recalculating anything.
+ */
+class CachedAligner : public Aligner
+{
+    Q_OBJECT
+
+public:
+    CachedAligner(Document *doc,
+                  ModelId reference,
+                  ModelId toAlign,
+                  std::shared_ptr<Path> path);
+
+    ~CachedAligner();
+
+    void begin() override;
+
+private:
+    Document *m_document;
+    ModelId m_reference;
+    ModelId m_toAlign;
+    std::shared_ptr<Path> m_path;
+};
+
+#endif
@@ -0,0 +1,580 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+#include "ChunkedMATCHAligner.h"
+#include "MATCHAligner.h"
+#include "AlignmentWindowModel.h"
+#include "DTW.h"
+
+#include "data/model/SparseTimeValueModel.h"
+#include "data/model/RangeSummarisableTimeValueModel.h"
+#include "data/model/AlignmentModel.h"
+
+#include "framework/Document.h"
+
+#include "transform/ModelTransformerFactory.h"
+
+#include <QThread>
+
+#include <cmath>
+
+//#define DEBUG_CHUNKED_MATCH_ALIGNER 1
+
+// Overlap of each reference window with its neighbours, and extra
+// width either side of the estimated window in the model to align,
+// both in seconds. The margin must be comfortably less than the
+// overlap, or a window's unreliable ends may reach its core.
+static const double chunkOverlap = 60.0;
+static const double chunkMargin = 20.0;
+
+// Block size requested from the model summaries for the level
+// envelopes used in the coarse alignment
+static const int coarseBlockSize = 4096;
+
+ChunkedMATCHAligner::ChunkedMATCHAligner(Document *doc,
+                                         ModelId reference,
+                                         ModelId toAlign,
+                                         double chunkDuration) :
+    m_document(doc),
+    m_reference(reference),
+    m_toAlign(toAlign),
+    m_chunkDuration(std::max(chunkDuration, 2.0 * chunkOverlap)),
+    m_started(false),
+    m_incomplete(true),
+    m_coarseThread(nullptr),
+    m_coarseHop(0),
+    m_maxRunning(std::max(1, QThread::idealThreadCount()))
+{
+}
+
+ChunkedMATCHAligner::~ChunkedMATCHAligner()
+{
+    if (m_coarseThread) {
+        m_coarseThread->wait();
+        delete m_coarseThread;
+    }
+    
+    for (auto &chunk: m_chunks) {
+        ModelById::release(chunk.pathOutputModel);
+        ModelById::release(chunk.windowModel);
+    }
+    
+    if (m_incomplete) {
+        if (auto other = ModelById::get(m_toAlign)) {
+            other->setAlignment({});
+        }
+    }
+}
+
+bool
+ChunkedMATCHAligner::isAvailable()
+{
+    return MATCHAligner::isAvailable(false, false);
+}
+
+void
+ChunkedMATCHAligner::begin()
+{
+    auto reference =
+        ModelById::getAs<RangeSummarisableTimeValueModel>(m_reference);
+    auto other =
+        ModelById::getAs<RangeSummarisableTimeValueModel>(m_toAlign);
+
+    if (!reference || !other) return;
+
+    auto alignmentModel = std::make_shared<AlignmentModel>
+        (m_reference, m_toAlign, ModelId());
+    m_alignmentModel = ModelById::add(alignmentModel);
+    
+    other->setAlignment(m_alignmentModel);
+    m_document->addNonDerivedModel(m_alignmentModel);
+
+    // The coarse alignment needs complete summaries, so wait for
+    // both models to be ready
+    
+    connect(reference.get(), SIGNAL(completionChanged(ModelId)),
+            this, SLOT(modelCompletionChanged(ModelId)));
+    connect(other.get(), SIGNAL(completionChanged(ModelId)),
+            this, SLOT(modelCompletionChanged(ModelId)));
+
+    modelCompletionChanged(m_toAlign);
+}
+
+void
+ChunkedMATCHAligner::modelCompletionChanged(ModelId)
+{
+    if (m_started) {
+        return;
+    }
+    
+    auto reference = ModelById::get(m_reference);
+    auto other = ModelById::get(m_toAlign);
+    if (!reference || !other) {
+        return;
+    }
+    
+    if (!reference->isReady(nullptr) || !other->isReady(nullptr)) {
+        return;
+    }
+
+    disconnect(reference.get(), nullptr, this, nullptr);
+    disconnect(other.get(), nullptr, this, nullptr);
+    m_started = true;
+
+    SVCERR << "ChunkedMATCHAligner[" << this << "]: models ready, "
+           << "starting coarse alignment" << endl;
+    
+    m_coarseThread = new CoarseThread([this]() {
+                                          calculateCoarseMapping();
+                                      });
+    connect(m_coarseThread, SIGNAL(finished()),
+            this, SLOT(coarseAlignmentFinished()));
+    m_coarseThread->start();
+}
+
+static bool
+getLevelEnvelope(ModelId modelId, int &blockSize, std::vector<double> &envelope)
+{
+    auto model = ModelById::getAs<RangeSummarisableTimeValueModel>(modelId);
+    if (!model) return false;
+
+    int channels = model->getChannelCount();
+    if (channels < 1) return false;
+
+    sv_frame_t start = model->getStartFrame();
+    sv_frame_t end = model->getEndFrame();
+    if (end <= start) return false;
+
+    std::vector<double> levels;
+    
+    for (int c = 0; c < channels; ++c) {
+        RangeSummarisableTimeValueModel::RangeBlock ranges;
+        int channelBlockSize = blockSize;
+        model->getSummaries(c, start, end - start, ranges, channelBlockSize);
+        if (ranges.empty()) return false;
+        if (c == 0) {
+            blockSize = channelBlockSize;
+            levels = std::vector<double>(ranges.size(), 0.0);
+        } else if (channelBlockSize != blockSize) {
+            return false;
+        }
+        for (size_t i = 0; i < ranges.size() && i < levels.size(); ++i) {
+            levels[i] += ranges[i].absmean();
+        }
+    }
+
+    // Log level, normalised to zero mean and unit variance so that
+    // recordings made at different gains are comparable
+    
+    double mean = 0.0;
+    for (auto &l: levels) {
+        l = log10(l / channels + 1e-6);
+        mean += l;
+    }
+    mean /= double(levels.size());
+
+    double variance = 0.0;
+    for (auto l: levels) {
+        variance += (l - mean) * (l - mean);
+    }
+    double sd = sqrt(variance / double(levels.size()));
+    if (sd <= 0.0) sd = 1.0;
+
+    envelope.clear();
+    for (auto l: levels) {
+        envelope.push_back((l - mean) / sd);
+    }
+    return true;
+}
+
+void
+ChunkedMATCHAligner::calculateCoarseMapping()
+{
+    // Runs in the coarse alignment thread. Produces, for each block
+    // of m_coarseHop frames of the reference, the index of the
+    // corresponding block in the model to align.
+    
+    m_coarseMapping.clear();
+    
+    int refHop = coarseBlockSize, otherHop = coarseBlockSize;
+    std::vector<double> refEnvelope, otherEnvelope;
+
+    if (getLevelEnvelope(m_reference, refHop, refEnvelope) &&
+        getLevelEnvelope(m_toAlign, otherHop, otherEnvelope) &&
+        refHop == otherHop) {
+
+        MagnitudeDTW dtw;
+        dtw.setMultiscale(true);
+        std::vector<size_t> alignment =
+            dtw.alignSequences(refEnvelope, otherEnvelope);
+
+        // The alignment gives the reference block for each block of
+        // the model to align; we want the inverse
+        m_coarseMapping = std::vector<sv_frame_t>(refEnvelope.size(), 0);
+        size_t j = 0;
+        for (size_t i = 0; i < refEnvelope.size(); ++i) {
+            while (j + 1 < alignment.size() && alignment[j] < i) {
+                ++j;
+            }
+            m_coarseMapping[i] = sv_frame_t(j);
+        }
+        m_coarseHop = refHop;
+        
+#ifdef DEBUG_CHUNKED_MATCH_ALIGNER
+        SVCERR << "ChunkedMATCHAligner: coarse alignment of "
+               << refEnvelope.size() << " against " << otherEnvelope.size()
+               << " blocks of " << refHop << " frames" << endl;
+#endif
+        return;
+    }
+
+    // No usable summaries: fall back to a linear mapping
+    
+    SVCERR << "ChunkedMATCHAligner: No summaries available, using linear "
+           << "estimate for window placement" << endl;
+
+    auto reference = ModelById::get(m_reference);
+    auto other = ModelById::get(m_toAlign);
+    if (!reference || !other) return;
+
+    m_coarseHop = coarseBlockSize;
+    sv_frame_t refBlocks = (reference->getEndFrame() -
+                            reference->getStartFrame()) / m_coarseHop + 1;
+    sv_frame_t otherBlocks = (other->getEndFrame() -
+                              other->getStartFrame()) / m_coarseHop + 1;
+    for (sv_frame_t i = 0; i < refBlocks; ++i) {
+        m_coarseMapping.push_back((i * otherBlocks) / refBlocks);
+    }
+}
+
+void
+ChunkedMATCHAligner::coarseAlignmentFinished()
+{
+    if (!m_coarseThread) {
+        return;
+    }
+
+    m_coarseThread->wait();
+    delete m_coarseThread;
+    m_coarseThread = nullptr;
+
+    if (m_coarseMapping.empty()) {
+        abandon(tr("Failed to estimate alignment windows"));
+        return;
+    }
+    
+    makeChunks();
+
+    SVCERR << "ChunkedMATCHAligner[" << this << "]: aligning in "
+           << m_chunks.size() << " windows, up to " << m_maxRunning
+           << " at once" << endl;
+    
+    if (!startChunks()) {
+        abandon(tr("Failed to start alignment (no MATCH plugin?)"));
+    }
+}
+
+void
+ChunkedMATCHAligner::makeChunks()
+{
+    auto reference = ModelById::get(m_reference);
+    auto other = ModelById::get(m_toAlign);
+    if (!reference || !other) return;
+
+    sv_samplerate_t rate = reference->getSampleRate();
+    
+    sv_frame_t refStart = reference->getStartFrame();
+    sv_frame_t refEnd = reference->getEndFrame();
+    sv_frame_t otherStart = other->getStartFrame();
+    sv_frame_t otherEnd = other->getEndFrame();
+
+    sv_frame_t overlap = sv_frame_t(round(chunkOverlap * rate));
+    sv_frame_t margin = sv_frame_t(round(chunkMargin * rate));
+
+    auto toOther = [&](sv_frame_t refFrame) {
+                       sv_frame_t block = (refFrame - refStart) / m_coarseHop;
+                       block = std::max(sv_frame_t(0), block);
+                       block = std::min(sv_frame_t(m_coarseMapping.size()) - 1,
+                                        block);
+                       return otherStart + m_coarseMapping[block] * m_coarseHop;
+                   };
+
+    // Divide the reference evenly into cores of roughly the
+    // requested duration
+    sv_frame_t length = refEnd - refStart;
+    sv_frame_t chunkFrames = sv_frame_t(round(m_chunkDuration * rate));
+    sv_frame_t n = std::max(sv_frame_t(1),
+                            sv_frame_t(round(double(length) /
+                                             double(chunkFrames))));
+
+    m_chunks.clear();
+    
+    for (sv_frame_t k = 0; k < n; ++k) {
+
+        Chunk chunk;
+        chunk.coreStart = refStart + (length * k) / n;
+        chunk.coreEnd = refStart + (length * (k + 1)) / n;
+        chunk.refStart = std::max(refStart, chunk.coreStart - overlap);
+        chunk.refEnd = std::min(refEnd, chunk.coreEnd + overlap);
+
+        // The first and last windows are anchored at the ends of the
+        // model to align, as a whole-sequence alignment would be
+        if (k == 0) {
+            chunk.otherStart = otherStart;
+        } else {
+            chunk.otherStart =
+                std::max(otherStart, toOther(chunk.refStart) - margin);
+        }
+        if (k == n - 1) {
+            chunk.otherEnd = otherEnd;
+        } else {
+            chunk.otherEnd =
+                std::min(otherEnd, toOther(chunk.refEnd) + margin);
+        }
+
+        chunk.completion = 0;
+        chunk.started = false;
+        chunk.done = false;
+        
+#ifdef DEBUG_CHUNKED_MATCH_ALIGNER
+        SVCERR << "ChunkedMATCHAligner: window " << k << ": reference "
+               << chunk.refStart << " -> " << chunk.refEnd << " (core "
+               << chunk.coreStart << " -> " << chunk.coreEnd << "), other "
+               << chunk.otherStart << " -> " << chunk.otherEnd << endl;
+#endif
+        
+        m_chunks.push_back(chunk);
+    }
+}
+
+bool
+ChunkedMATCHAligner::startChunks()
+{
+    auto reference = ModelById::get(m_reference);
+    if (!reference) return false;
+    
+    int running = 0;
+    for (const auto &chunk: m_chunks) {
+        if (chunk.started && !chunk.done) ++running;
+    }
+
+    ModelTransformerFactory *mtf = ModelTransformerFactory::getInstance();
+
+    for (auto &chunk: m_chunks) {
+
+        if (running >= m_maxRunning) break;
+        if (chunk.started) continue;
+        
+        auto windowModel = std::make_shared<AlignmentWindowModel>
+            (m_reference, chunk.refStart, chunk.refEnd,
+             m_toAlign, chunk.otherStart, chunk.otherEnd);
+        chunk.windowModel = ModelById::add(windowModel);
+
+        Transform transform = MATCHAligner::getAlignmentTransform
+            (reference->getSampleRate(), false);
+
+        // The plugin can otherwise serialise its runs, which would
+        // defeat the object here
+        transform.setParameter("serialise", 0);
+        
+        QString message;
+        chunk.pathOutputModel = mtf->transform
+            (transform, chunk.windowModel, message);
+
+        if (chunk.pathOutputModel.isNone()) {
+            transform.setStepSize(0);
+            chunk.pathOutputModel = mtf->transform
+                (transform, chunk.windowModel, message);
+        }
+
+        auto pathOutputModel =
+            ModelById::getAs<SparseTimeValueModel>(chunk.pathOutputModel);
+        if (!pathOutputModel) {
+            SVCERR << "ChunkedMATCHAligner: ERROR: Failed to create alignment "
+                   << "path for window: " << message << endl;
+            return false;
+        }
+
+        chunk.started = true;
+        ++running;
+        
+        connect(pathOutputModel.get(), SIGNAL(completionChanged(ModelId)),
+                this, SLOT(chunkCompletionChanged(ModelId)));
+    }
+
+    return true;
+}
+
+void
+ChunkedMATCHAligner::chunkCompletionChanged(ModelId pathOutputModelId)
+{
+    Chunk *chunk = nullptr;
+    for (auto &c: m_chunks) {
+        if (c.pathOutputModel == pathOutputModelId) {
+            chunk = &c;
+            break;
+        }
+    }
+    if (!chunk || chunk->done) {
+        return;
+    }
+
+    auto pathOutputModel =
+        ModelById::getAs<SparseTimeValueModel>(pathOutputModelId);
+    if (!pathOutputModel) {
+        return;
+    }
+
+    int completion = 0;
+    bool ready = pathOutputModel->isReady(&completion);
+    chunk->completion = completion;
+
+    if (ready) {
+        finishChunk(*chunk);
+        if (!startChunks()) {
+            abandon(tr("Failed to start alignment (no MATCH plugin?)"));
+            return;
+        }
+    }
+
+    updateCompletion();
+
+    for (const auto &c: m_chunks) {
+        if (!c.done) return;
+    }
+
+    // This should be the last thing we do, as the recipient of
+    // the completion signal may delete us
+    finish();
+}
+
+void
+ChunkedMATCHAligner::finishChunk(Chunk &chunk)
+{
+    auto pathOutputModel =
+        ModelById::getAs<SparseTimeValueModel>(chunk.pathOutputModel);
+    auto windowModel =
+        ModelById::getAs<AlignmentWindowModel>(chunk.windowModel);
+
+    if (pathOutputModel && windowModel) {
+
+        // The path maps frames in the model to align (the event
+        // frame, in the second channel) onto times in the reference
+        // (the value, in seconds, in the first channel)
+
+        sv_samplerate_t rate = windowModel->getSampleRate();
+        bool last = (&chunk == &m_chunks.back());
+        
+        for (const auto &e: pathOutputModel->getAllEvents()) {
+            sv_frame_t otherFrame = windowModel->getSourceFrame
+                (1, e.getFrame());
+            sv_frame_t refFrame = windowModel->getSourceFrame
+                (0, sv_frame_t(round(e.getValue() * rate)));
+            if (otherFrame >= chunk.otherEnd) continue;
+            if (refFrame < chunk.coreStart) continue;
+            if (refFrame >= chunk.coreEnd && !last) continue;
+            chunk.points.push_back(PathPoint(otherFrame, refFrame));
+        }
+    }
+
+#ifdef DEBUG_CHUNKED_MATCH_ALIGNER
+    SVCERR << "ChunkedMATCHAligner: window at " << chunk.coreStart
+           << " complete with " << chunk.points.size() << " points" << endl;
+#endif
+    
+    chunk.done = true;
+    chunk.completion = 100;
+    
+    ModelById::release(chunk.pathOutputModel);
+    chunk.pathOutputModel = {};
+    ModelById::release(chunk.windowModel);
+    chunk.windowModel = {};
+}
+
+void
+ChunkedMATCHAligner::updateCompletion()
+{
+    auto alignmentModel = ModelById::getAs<AlignmentModel>(m_alignmentModel);
+    if (!alignmentModel || m_chunks.empty()) {
+        return;
+    }
+
+    int total = 0;
+    for (const auto &c: m_chunks) {
+        total += c.completion;
+    }
+    int completion = 5 + (94 * total) / (100 * int(m_chunks.size()));
+    alignmentModel->setCompletion(std::min(99, completion));
+}
+
+void
+ChunkedMATCHAligner::finish()
+{
+    auto alignmentModel = ModelById::getAs<AlignmentModel>(m_alignmentModel);
+    if (!alignmentModel) {
+        return;
+    }
+
+    // Join the partial paths, discarding any point that would make
+    // the whole path go backwards at a window boundary
+    
+    Path path(alignmentModel->getSampleRate(), 1);
+
+    bool have = false;
+    sv_frame_t lastFrame = 0, lastTo = 0;
+    
+    for (const auto &chunk: m_chunks) {
+        for (const auto &p: chunk.points) {
+            if (have && (p.mapframe <= lastFrame || p.mapto < lastTo)) {
+                continue;
+            }
+            path.add(p);
+            lastFrame = p.mapframe;
+            lastTo = p.mapto;
+            have = true;
+        }
+    }
+
+    if (!have) {
+        abandon(tr("Alignment produced no path"));
+        return;
+    }
+
+    SVCERR << "ChunkedMATCHAligner[" << this << "]: setting alignment path ("
+           << path.getPointCount() << " point(s))" << endl;
+    
+    alignmentModel->setPath(path);
+    alignmentModel->setCompletion(100);
+
+    m_incomplete = false;
+    emit complete(m_alignmentModel);
+}
+
+void
+ChunkedMATCHAligner::abandon(QString error)
+{
+    // Stop listening to any windows still running, so that we fail
+    // only once
+    for (auto &chunk: m_chunks) {
+        if (auto pathOutputModel = ModelById::get(chunk.pathOutputModel)) {
+            disconnect(pathOutputModel.get(), nullptr, this, nullptr);
+        }
+        chunk.done = true;
+    }
+    
+    if (auto alignmentModel =
+        ModelById::getAs<AlignmentModel>(m_alignmentModel)) {
+        alignmentModel->setError(error);
+    }
+    emit failed(m_toAlign, error);
+}
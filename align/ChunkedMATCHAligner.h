@@ -0,0 +1,129 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+#ifndef SV_CHUNKED_MATCH_ALIGNER_H
+#define SV_CHUNKED_MATCH_ALIGNER_H
+
+#include "Aligner.h"
+
+#include "data/model/Path.h"
+
+#include "base/Thread.h"
+
+#include <functional>
+#include <vector>
+
+class AlignmentModel;
+class Document;
+
+/**
+ * Aligner for very long recordings, which divides the material into
+ * overlapping windows, aligns the windows concurrently using MATCH,
+ * and joins the resulting partial paths into one.
+ *
+ * The corresponding windows in the two recordings are found using a
+ * fast approximate alignment of their level envelopes, obtained from
+ * the models' summaries. Each window in the model to align is then
+ * made somewhat wider than that estimate suggests, and each MATCH
+ * path is used only within the central part of its window in the
+ * reference, away from the overlaps with its neighbours, where its
+ * ends may be unreliable.
+ *
+ * Tuning-difference and subsequence alignment are not supported.
+ */
+class ChunkedMATCHAligner : public Aligner
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Create an aligner that uses windows of approximately the
+     * given duration, in seconds, of the reference.
+     */
+    ChunkedMATCHAligner(Document *doc,
+                        ModelId reference,
+                        ModelId toAlign,
+                        double chunkDuration);
+
+    // Destroy the aligner, cleanly cancelling any ongoing alignment
+    ~ChunkedMATCHAligner();
+
+    void begin() override;
+
+    static bool isAvailable();
+
+private slots:
+    void modelCompletionChanged(ModelId);
+    void coarseAlignmentFinished();
+    void chunkCompletionChanged(ModelId);
+
+private:
+    class CoarseThread : public Thread
+    {
+    public:
+        CoarseThread(std::function<void()> job) :
+            Thread(Thread::NonRTThread),
+            m_job(job) { }
+
+        void run() override {
+            m_job();
+        }
+
+    private:
+        std::function<void()> m_job;
+    };
+
+    struct Chunk {
+        // Windows in the reference and the model to align
+        sv_frame_t refStart;
+        sv_frame_t refEnd;
+        sv_frame_t otherStart;
+        sv_frame_t otherEnd;
+
+        // The part of the reference window whose path is kept
+        sv_frame_t coreStart;
+        sv_frame_t coreEnd;
+
+        ModelId windowModel; // AlignmentWindowModel, unreg'd with doc
+        ModelId pathOutputModel; // SparseTimeValueModel, unreg'd with doc
+        int completion;
+        bool started;
+        bool done;
+        std::vector<PathPoint> points;
+    };
+
+    Document *m_document;
+    ModelId m_reference;
+    ModelId m_toAlign;
+    ModelId m_alignmentModel;
+    double m_chunkDuration;
+    bool m_started;
+    bool m_incomplete;
+
+    CoarseThread *m_coarseThread;
+    int m_coarseHop;
+    std::vector<sv_frame_t> m_coarseMapping; // ref block -> other block
+
+    std::vector<Chunk> m_chunks;
+    int m_maxRunning;
+
+    void calculateCoarseMapping();
+    void makeChunks();
+    bool startChunks();
+    void finishChunk(Chunk &chunk);
+    void updateCompletion();
+    void finish();
+    void abandon(QString error);
+};
+
+#endif
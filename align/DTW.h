@@ -17,22 +17,215 @@
 
 #include <vector>
 #include <functional>
+#include <algorithm>
+#include <utility>
+#include <limits>
+#include <stdexcept>
+#include <cmath>
+#include <ostream>
 
 //#define DEBUG_DTW 1
 
+/**
+ * Trace the lowest-cost path back through a completed DTW cost
+ * matrix for sequences s1 and s2 of lengths n1 and n2, returning the
+ * index into s1 for each element in s2. CostMatrix must provide
+ * get(j, i) for index j into s1 and i into s2, returning infinity
+ * for any cell that was not calculated.
+ */
+template <typename CostMatrix>
+std::vector<size_t> traceDTWPath(const CostMatrix &costs,
+                                 size_t n1, size_t n2,
+                                 bool subsequence)
+{
+    typedef double cost_t;
+    
+    std::vector<size_t> alignment(n2, 0);
+
+    size_t j = n1 - 1;
+    size_t i = n2 - 1;
+
+    if (subsequence) {
+        cost_t min = 0.0;
+        size_t minidx = 0;
+        for (size_t j = 0; j < n1; ++j) {
+            if (j == 0 || costs.get(j, i) < min) {
+                min = costs.get(j, i);
+                minidx = j;
+            }
+        }
+        j = minidx;
+#ifdef DEBUG_DTW
+        SVCERR << "Lowest cost at end of subsequence = " << min
+               << " at index " << j << ", tracking back from there" << endl;
+#endif
+    }
+    
+    while (i > 0 || j > 0) {
+
+        alignment[i] = j;
+        
+        if (i == 0) {
+            if (subsequence) {
+                break;
+            } else {
+                --j;
+                continue;
+            }
+        }
+        
+        if (j == 0) {
+            --i;
+            continue;
+        }
+
+        // Cells that were not calculated (e.g. because they are
+        // outside a band) read as infinite, so are never chosen here
+        cost_t a = costs.get(j-1, i);
+        cost_t b = costs.get(j, i-1);
+        cost_t both = costs.get(j-1, i-1);
+
+        if (a < b) {
+            --j;
+            if (both <= a) {
+                --i;
+            }
+        } else {
+            --i;
+            if (both <= b) {
+                --j;
+            }
+        }
+    }
+
+    if (subsequence) {
+        alignment[0] = j;
+    }
+    
+    return alignment;
+}
+
+/**
+ * A constraint on the region of the DTW cost matrix that will be
+ * calculated. An unconstrained band covers the whole matrix, using
+ * memory proportional to the product of the two sequence lengths. A
+ * fixed or relative band restricts the calculation to a window of
+ * cells either side of the diagonal running from the start of both
+ * sequences to the end of both (a Sakoe-Chiba band, skewed to follow
+ * the ratio of the sequence lengths), so that the memory used is
+ * proportional to the sequence length times the band width.
+ *
+ * The radius of a Fixed band is a number of elements of the second
+ * (toAlign) sequence either side of the diagonal. The radius of a
+ * Relative band is a proportion of the length of the second
+ * sequence. In either case the radius is widened if necessary so
+ * that the band remains wide enough to contain a path with the slope
+ * implied by the length ratio of the sequences.
+ *
+ * Bands only apply to whole-sequence alignment. Subsequence
+ * alignment, which has no fixed endpoint in the reference sequence,
+ * always uses the whole matrix.
+ */
+class DTWBand
+{
+public:
+    enum class Type {
+        Unconstrained,
+        Fixed,
+        Relative
+    };
+    
+    DTWBand() : m_type(Type::Unconstrained), m_radius(0.0) { }
+    DTWBand(Type type, double radius) : m_type(type), m_radius(radius) { }
+
+    Type getType() const { return m_type; }
+    double getRadius() const { return m_radius; }
+
+    /**
+     * Calculate the extent of the band for each element of a
+     * sequence s1 of length n1 aligned against a sequence s2 of
+     * length n2. On return, lo and hi have n1 elements each, and the
+     * cells to be calculated for element j of s1 are those with
+     * indices into s2 from lo[j] (inclusive) to hi[j] (exclusive).
+     */
+    void getExtents(size_t n1, size_t n2,
+                    std::vector<size_t> &lo,
+                    std::vector<size_t> &hi) const {
+
+        lo = std::vector<size_t>(n1, 0);
+        hi = std::vector<size_t>(n1, n2);
+
+        if (m_type == Type::Unconstrained || n1 < 2 || n2 < 2) {
+            return;
+        }
+
+        double slope = double(n2 - 1) / double(n1 - 1);
+
+        double radius = m_radius;
+        if (m_type == Type::Relative) {
+            radius = m_radius * double(n2);
+        }
+        radius = std::max(radius, std::ceil(slope));
+        
+        if (2.0 * radius + 1.0 >= double(n2)) {
+            return;
+        }
+
+        for (size_t j = 0; j < n1; ++j) {
+            double centre = double(j) * slope;
+            double l = std::ceil(centre - radius);
+            double h = std::floor(centre + radius) + 1.0;
+            lo[j] = (l < 0.0 ? 0 : size_t(l));
+            hi[j] = (h > double(n2) ? n2 : size_t(h));
+        }
+    }
+
+    /**
+     * Return the number of cost matrix cells that will be calculated
+     * when aligning sequences of lengths n1 and n2 within this band.
+     */
+    size_t getCellCount(size_t n1, size_t n2) const {
+        std::vector<size_t> lo, hi;
+        getExtents(n1, n2, lo, hi);
+        size_t count = 0;
+        for (size_t j = 0; j < n1; ++j) {
+            count += hi[j] - lo[j];
+        }
+        return count;
+    }
+    
+private:
+    Type m_type;
+    double m_radius;
+};
+
 template <typename Value>
 class DTW
 {
 public:
-    DTW(std::function<double(const Value &, const Value &)> distanceMetric) :
-        m_metric(distanceMetric) { }
+    DTW(std::function<double(const Value &, const Value &)> distanceMetric,
+        DTWBand band = DTWBand()) :
+        m_metric(distanceMetric),
+        m_band(band) { }
+
+    /**
+     * Set the band within which whole-sequence alignments will be
+     * calculated. The default is unconstrained.
+     */
+    void setBand(DTWBand band) {
+        m_band = band;
+    }
 
+    DTWBand getBand() const {
+        return m_band;
+    }
+    
     /**
      * Align the sequence s2 against the whole of the sequence s1,
      * returning the index into s1 for each element in s2.
      */
-    std::vector<size_t> alignSequences(std::vector<Value> s1,
-                                       std::vector<Value> s2) {
+    std::vector<size_t> alignSequences(const std::vector<Value> &s1,
+                                       const std::vector<Value> &s2) {
         return align(s1, s2, false);
     }
 
@@ -40,13 +233,52 @@ public:
      * Align the sequence sub against the best-matching subsequence of
      * s, returning the index into s for each element in sub.
      */
-    std::vector<size_t> alignSubsequence(std::vector<Value> s,
-                                         std::vector<Value> sub) {
+    std::vector<size_t> alignSubsequence(const std::vector<Value> &s,
+                                         const std::vector<Value> &sub) {
         return align(s, sub, true);
     }
 
+    /**
+     * Align the sequence s2 against s1, or against the best-matching
+     * subsequence of s1 if subsequence is true, calculating only the
+     * cost matrix cells within the given window (ignoring any band
+     * that has been set). The window has one pair of extents per
+     * element of s1, in the form described for
+     * DTWBand::getExtents(): the cells calculated for element j of
+     * s1 are those from lo[j] to hi[j]-1. Both lo and hi must be
+     * non-decreasing. Cells in the window that cannot be reached
+     * from the start of the alignment are ignored.
+     */
+    std::vector<size_t> alignWindowed(const std::vector<Value> &s1,
+                                      const std::vector<Value> &s2,
+                                      const std::vector<size_t> &lo,
+                                      const std::vector<size_t> &hi,
+                                      bool subsequence) {
+
+        // Return the index into s1 for each element in s2
+        
+        if (s1.empty() || s2.empty()) {
+            return std::vector<size_t>(s2.size(), 0);
+        }
+
+        auto costs = costSequences(s1, s2, lo, hi, subsequence);
+
+#ifdef DEBUG_DTW
+        SVCERR << "Cost matrix:" << endl;
+        for (size_t j = 0; j < s1.size(); ++j) {
+            for (size_t i = 0; i < s2.size(); ++i) {
+                SVCERR << costs.get(j, i) << " ";
+            }
+            SVCERR << "\n";
+        }
+#endif
+
+        return traceDTWPath(costs, s1.size(), s2.size(), subsequence);
+    }
+
 private:
     std::function<double(const Value &, const Value &)> m_metric;
+    DTWBand m_band;
     
     typedef double cost_t;
 
@@ -62,38 +294,88 @@ private:
             }
             return std::min(std::min(x.cost, y.cost), d.cost);
         } else if (x.present) {
-            return x.cost;
+            return d.present ? std::min(x.cost, d.cost) : x.cost;
         } else if (y.present) {
-            return y.cost;
+            return d.present ? std::min(y.cost, d.cost) : y.cost;
+        } else if (d.present) {
+            return d.cost;
         } else {
             return 0.0;
         }
     }
 
-    std::vector<std::vector<cost_t>> costSequences(std::vector<Value> s1,
-                                                   std::vector<Value> s2,
-                                                   bool subsequence) {
+    /**
+     * Cost matrix storing only the cells within a band or window,
+     * each row (element of s1) laid out contiguously in a single
+     * buffer. Cells outside the band read as infinite cost.
+     */
+    class CostMatrix
+    {
+    public:
+        CostMatrix(const std::vector<size_t> &lo,
+                   const std::vector<size_t> &hi) :
+            m_lo(lo), m_hi(hi), m_start(lo.size(), 0) {
+            size_t total = 0;
+            for (size_t j = 0; j < m_lo.size(); ++j) {
+                m_start[j] = total;
+                total += m_hi[j] - m_lo[j];
+            }
+            m_costs = std::vector<cost_t>(total, 0.0);
+        }
 
-        std::vector<std::vector<cost_t>> costs
-            (s1.size(), std::vector<cost_t>(s2.size(), 0.0));
+        size_t lo(size_t j) const { return m_lo[j]; }
+        size_t hi(size_t j) const { return m_hi[j]; }
+        
+        bool contains(size_t j, size_t i) const {
+            return j < m_lo.size() && i >= m_lo[j] && i < m_hi[j];
+        }
+
+        cost_t get(size_t j, size_t i) const {
+            if (!contains(j, i)) {
+                return std::numeric_limits<cost_t>::infinity();
+            }
+            return m_costs[m_start[j] + i - m_lo[j]];
+        }
+
+        void set(size_t j, size_t i, cost_t c) {
+            m_costs[m_start[j] + i - m_lo[j]] = c;
+        }
+
+    private:
+        std::vector<size_t> m_lo;
+        std::vector<size_t> m_hi;
+        std::vector<size_t> m_start;
+        std::vector<cost_t> m_costs;
+    };
+    
+    CostMatrix costSequences(const std::vector<Value> &s1,
+                             const std::vector<Value> &s2,
+                             const std::vector<size_t> &lo,
+                             const std::vector<size_t> &hi,
+                             bool subsequence) {
+
+        CostMatrix costs(lo, hi);
 
         for (size_t j = 0; j < s1.size(); ++j) {
-            for (size_t i = 0; i < s2.size(); ++i) {
+            for (size_t i = costs.lo(j); i < costs.hi(j); ++i) {
                 cost_t c = m_metric(s1[j], s2[i]);
                 if (i == 0 && subsequence) {
-                    costs[j][i] = c;
+                    costs.set(j, i, c);
                 } else {
-                    costs[j][i] = choose
-                        (
-                            { j > 0,
-                              j > 0 ? c + costs[j-1][i] : 0.0
-                            },
-                            { i > 0,
-                              i > 0 ? c + costs[j][i-1] : 0.0
-                            },
-                            { j > 0 && i > 0,
-                              j > 0 && i > 0 ? c + costs[j-1][i-1] : 0.0
-                            });
+                    bool x = (j > 0 && costs.contains(j-1, i));
+                    bool y = (i > 0 && costs.contains(j, i-1));
+                    bool d = (j > 0 && i > 0 && costs.contains(j-1, i-1));
+                    if ((j > 0 || i > 0) && !x && !y && !d) {
+                        // Unreachable cell at the edge of a window
+                        costs.set(j, i, std::numeric_limits<cost_t>::infinity());
+                        continue;
+                    }
+                    costs.set(j, i, choose
+                              (
+                                  { x, x ? c + costs.get(j-1, i) : 0.0 },
+                                  { y, y ? c + costs.get(j, i-1) : 0.0 },
+                                  { d, d ? c + costs.get(j-1, i-1) : 0.0 }
+                              ));
                 }
             }
         }
@@ -105,109 +387,580 @@ private:
                               const std::vector<Value> &s2,
                               bool subsequence) {
 
-        // Return the index into s1 for each element in s2
+        std::vector<size_t> lo, hi;
+        if (subsequence) {
+            DTWBand().getExtents(s1.size(), s2.size(), lo, hi);
+        } else {
+            m_band.getExtents(s1.size(), s2.size(), lo, hi);
+        }
+
+        return alignWindowed(s1, s2, lo, hi, subsequence);
+    }
+};
+
+/**
+ * An unconstrained DTW engine equivalent to DTW (producing identical
+ * alignments) but with the distance metric supplied as a template
+ * parameter so that it can be inlined. Metric must be a type
+ * providing
+ *
+ *     static double distance(const Value &a, const Value &b);
+ *
+ * The cost matrix is held in a single row-major buffer, and each row
+ * is calculated in two passes: first the distances and the costs via
+ * the vertical and diagonal predecessors, which have no dependency
+ * within the row and so can be vectorised by the compiler for a
+ * simple metric; then a scalar pass folding in the horizontal
+ * predecessor.
+ */
+template <typename Value, typename Metric>
+class FlatDTW
+{
+public:
+    /**
+     * Align the sequence s2 against the whole of the sequence s1,
+     * returning the index into s1 for each element in s2.
+     */
+    std::vector<size_t> alignSequences(const std::vector<Value> &s1,
+                                       const std::vector<Value> &s2) const {
+        return align(s1, s2, false);
+    }
+
+    /**
+     * Align the sequence sub against the best-matching subsequence of
+     * s, returning the index into s for each element in sub.
+     */
+    std::vector<size_t> alignSubsequence(const std::vector<Value> &s,
+                                         const std::vector<Value> &sub) const {
+        return align(s, sub, true);
+    }
+
+private:
+    typedef double cost_t;
+
+    class CostMatrix
+    {
+    public:
+        CostMatrix(size_t n1, size_t n2) :
+            m_n2(n2), m_costs(n1 * n2, 0.0) { }
+
+        cost_t get(size_t j, size_t i) const {
+            return m_costs[j * m_n2 + i];
+        }
+
+        cost_t *row(size_t j) {
+            return m_costs.data() + j * m_n2;
+        }
+
+    private:
+        size_t m_n2;
+        std::vector<cost_t> m_costs;
+    };
+    
+    static void costRow(const Value &a,
+                        const Value *s2,
+                        const cost_t *prev, // nullptr for the first row
+                        cost_t *work,
+                        cost_t *out,
+                        size_t n,
+                        bool subsequence) {
+
+        for (size_t i = 0; i < n; ++i) {
+            work[i] = Metric::distance(a, s2[i]);
+        }
         
-        std::vector<size_t> alignment(s2.size(), 0);
+        if (!prev) {
+            out[0] = (subsequence ? work[0] : 0.0);
+        } else {
+            out[0] = (subsequence ? work[0] : work[0] + prev[0]);
+            for (size_t i = 1; i < n; ++i) {
+                out[i] = work[i] + std::min(prev[i], prev[i-1]);
+            }
+        }
+
+        for (size_t i = 1; i < n; ++i) {
+            cost_t c = work[i] + out[i-1];
+            if (!prev || c < out[i]) {
+                out[i] = c;
+            }
+        }
+    }
+    
+    std::vector<size_t> align(const std::vector<Value> &s1,
+                              const std::vector<Value> &s2,
+                              bool subsequence) const {
 
+        // Return the index into s1 for each element in s2
+        
         if (s1.empty() || s2.empty()) {
-            return alignment;
+            return std::vector<size_t>(s2.size(), 0);
         }
 
-        auto costs = costSequences(s1, s2, subsequence);
+        size_t n1 = s1.size(), n2 = s2.size();
+        
+        CostMatrix costs(n1, n2);
+        std::vector<cost_t> work(n2, 0.0);
 
-#ifdef DEBUG_DTW
-        SVCERR << "Cost matrix:" << endl;
-        for (auto v: cost) {
-            for (auto x: v) {
-                SVCERR << x << " ";
-            }
-            SVCERR << "\n";
+        for (size_t j = 0; j < n1; ++j) {
+            costRow(s1[j], s2.data(),
+                    j > 0 ? costs.row(j-1) : nullptr,
+                    work.data(), costs.row(j), n2,
+                    subsequence);
         }
-#endif
+        
+        return traceDTWPath(costs, n1, n2, subsequence);
+    }
+};
+
+/**
+ * Approximate multiscale DTW, after FastDTW (Salvador and Chan,
+ * 2007). Both sequences are repeatedly halved in length, by merging
+ * adjacent pairs of values using the supplied reducer function, until
+ * they are short enough to align exactly. The alignment at each
+ * level is then projected onto the next finer level and widened by
+ * the given radius, and the finer level is aligned only within that
+ * window. The cost is linear in the sequence length for a given
+ * radius, but the result is not guaranteed to be optimal.
+ */
+template <typename Value>
+class MultiscaleDTW
+{
+public:
+    typedef std::function<Value(const Value &, const Value &)> Reducer;
 
-        size_t j = s1.size() - 1;
-        size_t i = s2.size() - 1;
+    MultiscaleDTW(std::function<double(const Value &, const Value &)> metric,
+                  Reducer reducer,
+                  size_t radius = 16) :
+        m_dtw(metric),
+        m_reducer(reducer),
+        m_radius(radius) { }
 
-        if (subsequence) {
-            cost_t min = 0.0;
-            size_t minidx = 0;
-            for (size_t j = 0; j < s1.size(); ++j) {
-                if (j == 0 || costs[j][i] < min) {
-                    min = costs[j][i];
-                    minidx = j;
-                }
+    /**
+     * Align the sequence s2 against the whole of the sequence s1,
+     * returning the index into s1 for each element in s2.
+     */
+    std::vector<size_t> alignSequences(const std::vector<Value> &s1,
+                                       const std::vector<Value> &s2) {
+        return align(s1, s2, false);
+    }
+
+    /**
+     * Align the sequence sub against the best-matching subsequence of
+     * s, returning the index into s for each element in sub.
+     */
+    std::vector<size_t> alignSubsequence(const std::vector<Value> &s,
+                                         const std::vector<Value> &sub) {
+        return align(s, sub, true);
+    }
+
+    /**
+     * Return a rough upper estimate of the number of cost matrix
+     * cells stored at any one time when aligning sequences of
+     * lengths n1 and n2.
+     */
+    size_t getCellCountEstimate(size_t n1, size_t n2) const {
+        // Each level's window is about (2r + 4) cells wide per
+        // element of s1, plus the steps needed to follow the slope,
+        // and the coarser levels add at most as much again
+        size_t estimate = 2 * (n1 * (2 * m_radius + 4) + 2 * n2);
+        return std::min(estimate, n1 * n2);
+    }
+
+private:
+    DTW<Value> m_dtw;
+    Reducer m_reducer;
+    size_t m_radius;
+
+    std::vector<Value> reduce(const std::vector<Value> &s) {
+        std::vector<Value> r;
+        r.reserve((s.size() + 1) / 2);
+        for (size_t i = 0; i < s.size(); i += 2) {
+            if (i + 1 < s.size()) {
+                r.push_back(m_reducer(s[i], s[i+1]));
+            } else {
+                r.push_back(s[i]);
             }
-            j = minidx;
-#ifdef DEBUG_DTW
-            SVCERR << "Lowest cost at end of subsequence = " << min
-                   << " at index " << j << ", tracking back from there" << endl;
-#endif
         }
+        return r;
+    }
+
+    std::vector<size_t> align(const std::vector<Value> &s1,
+                              const std::vector<Value> &s2,
+                              bool subsequence) {
+
+        // Return the index into s1 for each element in s2
+
+        size_t n1 = s1.size(), n2 = s2.size();
+        size_t minSize = m_radius + 2;
+
+        if (n1 <= minSize || n2 <= minSize) {
+            std::vector<size_t> lo, hi;
+            DTWBand().getExtents(n1, n2, lo, hi);
+            return m_dtw.alignWindowed(s1, s2, lo, hi, subsequence);
+        }
+
+        std::vector<size_t> coarse = align(reduce(s1), reduce(s2),
+                                           subsequence);
+
+        // Project the coarse path onto this level. Each element of
+        // the coarse alignment gives the lowest index into the
+        // coarse s1 for that element of the coarse s2; the path
+        // occupies the cells from there up to the next element's
+        // index. Every coarse cell covers a 2x2 block of fine cells,
+        // which we widen by the radius in both directions.
+
+        long r = long(m_radius);
+        long last1 = long(n1) - 1, last2 = long(n2) - 1;
+        
+        std::vector<size_t> lo(n1, n2), hi(n1, 0);
         
-        while (i > 0 || j > 0) {
+        for (size_t ci = 0; ci < coarse.size(); ++ci) {
+            long cj0 = long(coarse[ci]);
+            long cj1 = (ci + 1 < coarse.size() ?
+                        std::max(cj0, long(coarse[ci + 1])) : cj0);
+            long i0 = std::max(0L, long(ci) * 2 - r);
+            long i1 = std::min(last2, long(ci) * 2 + 1 + r);
+            long j0 = std::max(0L, cj0 * 2 - r);
+            long j1 = std::min(last1, cj1 * 2 + 1 + r);
+            for (long j = j0; j <= j1; ++j) {
+                lo[j] = std::min(lo[j], size_t(i0));
+                hi[j] = std::max(hi[j], size_t(i1 + 1));
+            }
+        }
 
-            alignment[i] = j;
-            
-            if (i == 0) {
-                if (subsequence) {
-                    break;
-                } else {
-                    --j;
-                    continue;
+        if (!subsequence) {
+            lo[0] = 0;
+            hi[n1 - 1] = n2;
+        }
+
+        // Make the window extents non-decreasing and ensure each row
+        // overlaps the one before it, so that the window is connected
+        
+        for (size_t j = n1 - 1; j > 0; --j) {
+            lo[j - 1] = std::min(lo[j - 1], lo[j]);
+        }
+        for (size_t j = 0; j < n1; ++j) {
+            if (j > 0) {
+                hi[j] = std::max(hi[j], hi[j - 1]);
+                if (hi[j - 1] > lo[j - 1]) {
+                    lo[j] = std::min(lo[j], hi[j - 1]);
                 }
             }
-            
-            if (j == 0) {
-                --i;
-                continue;
+            hi[j] = std::max(hi[j], lo[j]);
+        }
+
+        return m_dtw.alignWindowed(s1, s2, lo, hi, subsequence);
+    }
+};
+
+/**
+ * Online time warping, after Dixon (2005) as used in the forward
+ * path of MATCH. Either sequence may be extended at any time, and
+ * the alignment is advanced as far as the data so far permits. At
+ * each step the cost matrix is extended by a row (an element of s1),
+ * a column (an element of s2), or both, in whichever direction the
+ * lowest normalised cost on the current frontier indicates; only the
+ * cells within the given window of the frontier are calculated, and
+ * only those rows still within the window are retained, so memory
+ * use is bounded by the window size rather than the sequence lengths.
+ *
+ * The resulting path follows the best frontier cell at each step and
+ * is never revised, so it is only an approximation of the optimal
+ * whole-sequence alignment. It is intended for provisional results
+ * while the sequences are still being produced.
+ */
+template <typename Value>
+class OnlineDTW
+{
+public:
+    OnlineDTW(std::function<double(const Value &, const Value &)> metric,
+              size_t window = 500,
+              int maxRunCount = 3) :
+        m_metric(metric),
+        m_window(std::max(window, size_t(1))),
+        m_maxRunCount(maxRunCount),
+        m_n1(0),
+        m_n2(0),
+        m_firstRow(0),
+        m_lastStep(Step::Both),
+        m_runCount(0),
+        m_best1(0),
+        m_best2(0) { }
+
+    /**
+     * Append the given elements to sequences s1 and s2 respectively
+     * (either may be empty) and advance the alignment as far as
+     * possible.
+     */
+    void extend(const std::vector<Value> &more1,
+                const std::vector<Value> &more2) {
+        m_s1.insert(m_s1.end(), more1.begin(), more1.end());
+        m_s2.insert(m_s2.end(), more2.begin(), more2.end());
+        advance();
+    }
+
+    /**
+     * Return the provisional alignment so far, as the index into s1
+     * for each element of s2 that the path has reached. This may be
+     * shorter than the part of s2 supplied so far.
+     */
+    std::vector<size_t> getPath() const {
+        std::vector<size_t> path;
+        for (const auto &p: m_path) {
+            while (path.size() <= p.second) {
+                path.push_back(p.first);
             }
+        }
+        return path;
+    }
 
-            cost_t a = costs[j-1][i];
-            cost_t b = costs[j][i-1];
-            cost_t both = costs[j-1][i-1];
+    /**
+     * Return the number of elements of s1 and s2 respectively that
+     * have been consumed by the alignment so far.
+     */
+    size_t getConsumed1() const { return m_n1; }
+    size_t getConsumed2() const { return m_n2; }
 
-            if (a < b) {
-                --j;
-                if (both <= a) {
-                    --i;
-                }
-            } else {
-                --i;
-                if (both <= b) {
-                    --j;
-                }
+private:
+    typedef double cost_t;
+
+    enum class Step { Row, Column, Both };
+    
+    struct Row {
+        size_t lo;                 // index into s2 of first cell
+        std::vector<cost_t> costs;
+    };
+    
+    std::function<double(const Value &, const Value &)> m_metric;
+    size_t m_window;
+    int m_maxRunCount;
+
+    std::vector<Value> m_s1;
+    std::vector<Value> m_s2;
+    size_t m_n1;                   // rows calculated so far
+    size_t m_n2;                   // columns calculated so far
+    
+    std::vector<Row> m_rows;       // rows m_firstRow to m_n1-1
+    size_t m_firstRow;
+
+    Step m_lastStep;
+    int m_runCount;
+    size_t m_best1;
+    size_t m_best2;
+    
+    // Points (index into s1, index into s2) on the forward path,
+    // non-decreasing in both
+    std::vector<std::pair<size_t, size_t>> m_path;
+    
+    cost_t get(size_t j, size_t i) const {
+        if (j < m_firstRow || j >= m_firstRow + m_rows.size()) {
+            return std::numeric_limits<cost_t>::infinity();
+        }
+        const Row &row = m_rows[j - m_firstRow];
+        if (i < row.lo || i >= row.lo + row.costs.size()) {
+            return std::numeric_limits<cost_t>::infinity();
+        }
+        return row.costs[i - row.lo];
+    }
+
+    cost_t calculate(size_t j, size_t i) const {
+        cost_t c = m_metric(m_s1[j], m_s2[i]);
+        if (j == 0 && i == 0) {
+            return c;
+        }
+        cost_t prev = std::numeric_limits<cost_t>::infinity();
+        if (j > 0) prev = std::min(prev, get(j-1, i));
+        if (i > 0) prev = std::min(prev, get(j, i-1));
+        if (j > 0 && i > 0) prev = std::min(prev, get(j-1, i-1));
+        return c + prev;
+    }
+
+    void addRow() {
+        size_t j = m_n1;
+        Row row;
+        row.lo = (m_n2 > m_window ? m_n2 - m_window : 0);
+        m_rows.push_back(row);
+        for (size_t i = m_rows.back().lo; i < m_n2; ++i) {
+            cost_t c = calculate(j, i);
+            m_rows.back().costs.push_back(c);
+        }
+        ++m_n1;
+
+        // Retain one row beyond the window, as predecessors for the
+        // first row within it
+        size_t retained = m_window + 1;
+        if (m_rows.size() > 4 * retained) {
+            size_t drop = m_rows.size() - retained;
+            m_rows.erase(m_rows.begin(), m_rows.begin() + drop);
+            m_firstRow += drop;
+        }
+    }
+
+    void addColumn() {
+        size_t i = m_n2;
+        size_t j0 = (m_n1 > m_window ? m_n1 - m_window : 0);
+        for (size_t j = j0; j < m_n1; ++j) {
+            // Every row within the window has been extended at each
+            // column step since it was added, so it ends at column i
+            cost_t c = calculate(j, i);
+            m_rows[j - m_firstRow].costs.push_back(c);
+        }
+        ++m_n2;
+    }
+
+    void findBest() {
+        // Lowest cost cell in the last row or column, normalised by
+        // path length so that cells at different distances from the
+        // origin are comparable
+        cost_t best = std::numeric_limits<cost_t>::infinity();
+        size_t j = m_n1 - 1, i = m_n2 - 1;
+        m_best1 = j;
+        m_best2 = i;
+        const Row &last = m_rows.back();
+        for (size_t k = 0; k < last.costs.size(); ++k) {
+            cost_t c = last.costs[k] / cost_t(j + last.lo + k + 2);
+            if (c < best) {
+                best = c;
+                m_best1 = j;
+                m_best2 = last.lo + k;
+            }
+        }
+        size_t j0 = (m_n1 > m_window ? m_n1 - m_window : 0);
+        for (size_t jj = j0; jj < m_n1; ++jj) {
+            cost_t c = get(jj, i) / cost_t(jj + i + 2);
+            if (c < best) {
+                best = c;
+                m_best1 = jj;
+                m_best2 = i;
             }
         }
 
-        if (subsequence) {
-            alignment[0] = j;
+        size_t p1 = m_best1, p2 = m_best2;
+        if (!m_path.empty()) {
+            p1 = std::max(p1, m_path.back().first);
+            p2 = std::max(p2, m_path.back().second);
+            if (p1 == m_path.back().first && p2 == m_path.back().second) {
+                return;
+            }
+        }
+        m_path.push_back({ p1, p2 });
+    }
+
+    Step getNextStep() const {
+        if (m_n1 < m_window && m_n2 < m_window) {
+            return Step::Both;
+        }
+        if (m_lastStep != Step::Both && m_runCount >= m_maxRunCount) {
+            return (m_lastStep == Step::Row ? Step::Column : Step::Row);
+        }
+        if (m_best1 + 1 == m_n1 && m_best2 + 1 == m_n2) {
+            return Step::Both;
+        } else if (m_best1 + 1 == m_n1) {
+            // Best match for the latest element of s1 is an earlier
+            // element of s2, so s2 is ahead
+            return Step::Row;
+        } else {
+            return Step::Column;
+        }
+    }
+
+    void advance() {
+        while (true) {
+            Step step = getNextStep();
+            bool canRow = (m_n1 < m_s1.size());
+            bool canColumn = (m_n2 < m_s2.size());
+            if ((step != Step::Column && !canRow) ||
+                (step != Step::Row && !canColumn)) {
+                break;
+            }
+            if (step != Step::Column) addRow();
+            if (step != Step::Row) addColumn();
+            if (step == m_lastStep && step != Step::Both) {
+                ++m_runCount;
+            } else {
+                m_runCount = 1;
+            }
+            m_lastStep = step;
+            findBest();
         }
-        
-        return alignment;
     }
 };
 
 class MagnitudeDTW
 {
 public:
-    MagnitudeDTW() : m_dtw(metric) { }
+    MagnitudeDTW(DTWBand band = DTWBand()) :
+        m_dtw(Metric::distance, band),
+        m_multiscaleDTW(Metric::distance, reduce),
+        m_multiscale(false) { }
 
-    std::vector<size_t> alignSequences(std::vector<double> s1,
-                                       std::vector<double> s2) {
+    /**
+     * Select multiscale approximate alignment (see MultiscaleDTW)
+     * instead of exact alignment. If multiscale alignment is
+     * selected, any band is ignored. The default is exact.
+     */
+    void setMultiscale(bool multiscale) {
+        m_multiscale = multiscale;
+    }
+
+    /**
+     * Return an estimate of the number of cost matrix cells that
+     * will be stored when aligning sequences of lengths n1 and n2
+     * with the current settings.
+     */
+    size_t getCellCountEstimate(size_t n1, size_t n2, bool subsequence) const {
+        if (m_multiscale) {
+            return m_multiscaleDTW.getCellCountEstimate(n1, n2);
+        } else if (subsequence) {
+            return n1 * n2;
+        } else {
+            return m_dtw.getBand().getCellCount(n1, n2);
+        }
+    }
+
+    std::vector<size_t> alignSequences(const std::vector<double> &s1,
+                                       const std::vector<double> &s2) {
+        if (m_multiscale) {
+            return m_multiscaleDTW.alignSequences(s1, s2);
+        }
+        if (m_dtw.getBand().getType() == DTWBand::Type::Unconstrained) {
+            return m_flat.alignSequences(s1, s2);
+        }
         return m_dtw.alignSequences(s1, s2);
     }
 
-    std::vector<size_t> alignSubsequence(std::vector<double> s,
-                                         std::vector<double> sub) {
-        return m_dtw.alignSubsequence(s, sub);
+    std::vector<size_t> alignSubsequence(const std::vector<double> &s,
+                                         const std::vector<double> &sub) {
+        if (m_multiscale) {
+            return m_multiscaleDTW.alignSubsequence(s, sub);
+        }
+        return m_flat.alignSubsequence(s, sub);
+    }
+
+    /**
+     * Return an online aligner (see OnlineDTW) using the same
+     * distance metric, for the provisional alignment of sequences
+     * that are still being produced.
+     */
+    static OnlineDTW<double> makeOnlineDTW() {
+        return OnlineDTW<double>(Metric::distance);
     }
 
 private:
-    DTW<double> m_dtw;
+    struct Metric {
+        static double distance(const double &a, const double &b) {
+            return std::abs(b - a);
+        }
+    };
 
-    static double metric(const double &a, const double &b) {
-        return std::abs(b - a);
+    static double reduce(const double &a, const double &b) {
+        return (a + b) / 2.0;
     }
+
+    DTW<double> m_dtw;
+    FlatDTW<double, Metric> m_flat;
+    MultiscaleDTW<double> m_multiscaleDTW;
+    bool m_multiscale;
 };
 
 class RiseFallDTW
@@ -224,49 +977,118 @@ public:
         double distance;
     };
 
-    RiseFallDTW() : m_dtw(metric) { }
+    RiseFallDTW(DTWBand band = DTWBand()) :
+        m_dtw(Metric::distance, band),
+        m_multiscaleDTW(Metric::distance, reduce),
+        m_multiscale(false) { }
 
-    std::vector<size_t> alignSequences(std::vector<Value> s1,
-                                       std::vector<Value> s2) {
+    /**
+     * Select multiscale approximate alignment (see MultiscaleDTW)
+     * instead of exact alignment. If multiscale alignment is
+     * selected, any band is ignored. The default is exact.
+     */
+    void setMultiscale(bool multiscale) {
+        m_multiscale = multiscale;
+    }
+
+    /**
+     * Return an estimate of the number of cost matrix cells that
+     * will be stored when aligning sequences of lengths n1 and n2
+     * with the current settings.
+     */
+    size_t getCellCountEstimate(size_t n1, size_t n2, bool subsequence) const {
+        if (m_multiscale) {
+            return m_multiscaleDTW.getCellCountEstimate(n1, n2);
+        } else if (subsequence) {
+            return n1 * n2;
+        } else {
+            return m_dtw.getBand().getCellCount(n1, n2);
+        }
+    }
+
+    std::vector<size_t> alignSequences(const std::vector<Value> &s1,
+                                       const std::vector<Value> &s2) {
+        if (m_multiscale) {
+            return m_multiscaleDTW.alignSequences(s1, s2);
+        }
+        if (m_dtw.getBand().getType() == DTWBand::Type::Unconstrained) {
+            return m_flat.alignSequences(s1, s2);
+        }
         return m_dtw.alignSequences(s1, s2);
     }
 
-    std::vector<size_t> alignSubsequence(std::vector<Value> s,
-                                         std::vector<Value> sub) {
-        return m_dtw.alignSubsequence(s, sub);
+    std::vector<size_t> alignSubsequence(const std::vector<Value> &s,
+                                         const std::vector<Value> &sub) {
+        if (m_multiscale) {
+            return m_multiscaleDTW.alignSubsequence(s, sub);
+        }
+        return m_flat.alignSubsequence(s, sub);
     }
 
-private:
-    DTW<Value> m_dtw;
+    /**
+     * Return an online aligner (see OnlineDTW) using the same
+     * distance metric, for the provisional alignment of sequences
+     * that are still being produced.
+     */
+    static OnlineDTW<Value> makeOnlineDTW() {
+        return OnlineDTW<Value>(Metric::distance);
+    }
 
-    static double metric(const Value &a, const Value &b) {
+private:
+    struct Metric {
+        static double distance(const Value &a, const Value &b) {
         
-        auto together = [](double c1, double c2) {
-                            auto diff = std::abs(c1 - c2);
-                            return (diff < 1.0 ? -1.0 :
-                                    diff > 3.0 ?  1.0 :
-                                    0.0);
-                        };
-        auto opposing = [](double c1, double c2) {
-                            auto diff = c1 + c2;
-                            return (diff < 2.0 ? 1.0 :
-                                    2.0);
-                        };
-
-        if (a.direction == Direction::None || b.direction == Direction::None) {
-            if (a.direction == b.direction) {
-                return 0.0;
+            auto together = [](double c1, double c2) {
+                                auto diff = std::abs(c1 - c2);
+                                return (diff < 1.0 ? -1.0 :
+                                        diff > 3.0 ?  1.0 :
+                                        0.0);
+                            };
+            auto opposing = [](double c1, double c2) {
+                                auto diff = c1 + c2;
+                                return (diff < 2.0 ? 1.0 :
+                                        2.0);
+                            };
+
+            if (a.direction == Direction::None ||
+                b.direction == Direction::None) {
+                if (a.direction == b.direction) {
+                    return 0.0;
+                } else {
+                    return 1.0;
+                }
             } else {
-                return 1.0;
+                if (a.direction == b.direction) {
+                    return together (a.distance, b.distance);
+                } else {
+                    return opposing (a.distance, b.distance);
+                }
             }
+        }
+    };
+
+    // Merge two consecutive rise/fall steps into the single step
+    // with the same net movement
+    static Value reduce(const Value &a, const Value &b) {
+        double net = 0.0;
+        for (const Value &v: { a, b }) {
+            if (v.direction == Direction::Up) net += v.distance;
+            else if (v.direction == Direction::Down) net -= v.distance;
+        }
+        if (a.direction == Direction::None &&
+            b.direction == Direction::None) {
+            return { Direction::None, 0.0 };
+        } else if (net >= 0.0) {
+            return { Direction::Up, net };
         } else {
-            if (a.direction == b.direction) {
-                return together (a.distance, b.distance);
-            } else {
-                return opposing (a.distance, b.distance);
-            }
+            return { Direction::Down, -net };
         }
     }
+
+    DTW<Value> m_dtw;
+    FlatDTW<Value, Metric> m_flat;
+    MultiscaleDTW<Value> m_multiscaleDTW;
+    bool m_multiscale;
 };
 
 inline std::ostream &operator<<(std::ostream &s, const RiseFallDTW::Value v) {
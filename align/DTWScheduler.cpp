@@ -0,0 +1,135 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "DTWScheduler.h"
+
+#include "base/Debug.h"
+
+#include <QMutexLocker>
+
+//#define DEBUG_DTW_SCHEDULER 1
+
+DTWScheduler *
+DTWScheduler::getInstance()
+{
+    static DTWScheduler instance;
+    return &instance;
+}
+
+DTWScheduler::DTWScheduler() :
+    m_budget(size_t(1024) * 1024 * 1024),
+    m_inUse(0),
+    m_running(0),
+    m_nextTicket(0),
+    m_nowServing(0)
+{
+}
+
+void
+DTWScheduler::setBudget(size_t bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_budget = bytes;
+    m_condition.wakeAll();
+}
+
+size_t
+DTWScheduler::getBudget() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_budget;
+}
+
+bool
+DTWScheduler::acquire(size_t bytes, const std::atomic<bool> *abandoned)
+{
+    QMutexLocker locker(&m_mutex);
+
+    uint64_t ticket = m_nextTicket++;
+
+#ifdef DEBUG_DTW_SCHEDULER
+    SVCERR << "DTWScheduler::acquire: ticket " << ticket << " wants "
+           << bytes << " bytes (" << m_inUse << " of " << m_budget
+           << " in use by " << m_running << " jobs)" << endl;
+#endif
+
+    while (true) {
+        if (abandoned && *abandoned) {
+#ifdef DEBUG_DTW_SCHEDULER
+            SVCERR << "DTWScheduler::acquire: ticket " << ticket
+                   << " abandoned" << endl;
+#endif
+            m_abandoned.insert(ticket);
+            skipAbandoned();
+            m_condition.wakeAll();
+            return false;
+        }
+        if (ticket == m_nowServing) {
+            if (m_running == 0 || m_inUse + bytes <= m_budget) {
+                break;
+            }
+        }
+        m_condition.wait(&m_mutex);
+    }
+
+    ++m_nowServing;
+    skipAbandoned();
+    ++m_running;
+    m_inUse += bytes;
+    
+#ifdef DEBUG_DTW_SCHEDULER
+    SVCERR << "DTWScheduler::acquire: ticket " << ticket << " admitted ("
+           << m_inUse << " bytes now in use by " << m_running << " jobs)"
+           << endl;
+#endif
+
+    // The next ticket may also fit
+    m_condition.wakeAll();
+    return true;
+}
+
+void
+DTWScheduler::interrupt()
+{
+    QMutexLocker locker(&m_mutex);
+    m_condition.wakeAll();
+}
+
+void
+DTWScheduler::skipAbandoned()
+{
+    // A ticket abandoned while waiting for an earlier one would
+    // otherwise hold up every ticket after it
+    while (!m_abandoned.empty() && *m_abandoned.begin() == m_nowServing) {
+        m_abandoned.erase(m_abandoned.begin());
+        ++m_nowServing;
+    }
+}
+
+void
+DTWScheduler::release(size_t bytes)
+{
+    QMutexLocker locker(&m_mutex);
+
+    --m_running;
+    m_inUse = (bytes > m_inUse ? 0 : m_inUse - bytes);
+
+#ifdef DEBUG_DTW_SCHEDULER
+    SVCERR << "DTWScheduler::release: " << bytes << " bytes released ("
+           << m_inUse << " bytes now in use by " << m_running << " jobs)"
+           << endl;
+#endif
+    
+    m_condition.wakeAll();
+}
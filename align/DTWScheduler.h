@@ -0,0 +1,117 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_DTW_SCHEDULER_H
+#define SV_DTW_SCHEDULER_H
+
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <set>
+
+/**
+ * Process-wide admission control for DTW calculations. Each job
+ * declares an estimate of the memory its cost matrix will need, and
+ * jobs are admitted to run concurrently for as long as the total of
+ * their estimates stays within a memory budget. A job whose estimate
+ * exceeds the whole budget is admitted only when no other job is
+ * running, so that large alignments are serialised while small ones
+ * run in parallel. Jobs are admitted in the order in which they ask.
+ */
+class DTWScheduler
+{
+public:
+    static DTWScheduler *getInstance();
+
+    /**
+     * Set the memory budget in bytes. Jobs that are already running
+     * are unaffected.
+     */
+    void setBudget(size_t bytes);
+
+    size_t getBudget() const;
+
+    /**
+     * Block until a job estimated to need the given number of bytes
+     * can run, and return true. Every successful call to acquire()
+     * must be matched by a call to release() with the same argument
+     * once the job has finished.
+     *
+     * If abandoned is non-null, it is checked before each wait, and
+     * acquire() gives up its place in the queue and returns false as
+     * soon as it is found to be set. Call interrupt() after setting it
+     * to have waiting jobs check their flags straight away.
+     */
+    bool acquire(size_t bytes, const std::atomic<bool> *abandoned = nullptr);
+
+    /**
+     * Wake all jobs waiting in acquire(), so that any whose abandon
+     * flag has been set can return.
+     */
+    void interrupt();
+
+    /**
+     * Release the memory claimed by a job through acquire().
+     */
+    void release(size_t bytes);
+
+    /**
+     * Scoped admission: acquire on construction and release on
+     * destruction.
+     */
+    class Admission
+    {
+    public:
+        Admission(size_t bytes,
+                  const std::atomic<bool> *abandoned = nullptr) :
+            m_bytes(bytes),
+            m_admitted(DTWScheduler::getInstance()->acquire(m_bytes,
+                                                            abandoned)) { }
+        ~Admission() {
+            if (m_admitted) {
+                DTWScheduler::getInstance()->release(m_bytes);
+            }
+        }
+
+        /**
+         * Return false if the job was abandoned before being admitted.
+         */
+        bool isAdmitted() const { return m_admitted; }
+
+    private:
+        size_t m_bytes;
+        bool m_admitted;
+        Admission(const Admission &) =delete;
+        Admission &operator=(const Admission &) =delete;
+    };
+
+private:
+    DTWScheduler();
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_condition;
+    size_t m_budget;
+    size_t m_inUse;
+    int m_running;
+    uint64_t m_nextTicket;
+    uint64_t m_nowServing;
+    std::set<uint64_t> m_abandoned; // tickets given up before their turn
+
+    void skipAbandoned(); // call with m_mutex held
+};
+
+#endif
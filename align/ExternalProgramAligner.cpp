@@ -18,22 +18,35 @@
 #include <QApplication>
 
 #include "data/model/ReadOnlyWaveFileModel.h"
-#include "data/model/SparseTimeValueModel.h"
+#include "data/model/DenseTimeValueModel.h"
 #include "data/model/AlignmentModel.h"
+#include "data/model/Path.h"
 
-#include "data/fileio/CSVFileReader.h"
+#include "data/fileio/FileSource.h"
 
 #include "framework/Document.h"
 
+#include <cmath>
+
+//#define DEBUG_EXTERNAL_PROGRAM_ALIGNER 1
+
+static const int publishInterval = 500; // ms
+
 ExternalProgramAligner::ExternalProgramAligner(Document *doc,
                                                ModelId reference,
                                                ModelId toAlign,
-                                               QString program) :
+                                               QString program,
+                                               bool streaming) :
     m_document(doc),
     m_reference(reference),
     m_toAlign(toAlign),
     m_program(program),
-    m_process(nullptr)
+    m_streaming(streaming),
+    m_started(false),
+    m_process(nullptr),
+    m_otherDuration(0),
+    m_feedIndex(0),
+    m_feedFrame(0)
 {
 }
 
@@ -56,13 +69,21 @@ ExternalProgramAligner::isAvailable(QString program)
 void
 ExternalProgramAligner::begin()
 {
-    // Run an external program, passing to it paths to the main
-    // model's audio file and the new model's audio file. It returns
-    // the path in CSV form through stdout.
+    // Run an external program, passing to it either paths to the
+    // main model's audio file and the new model's audio file, or (in
+    // streaming mode) the audio itself through stdin. It returns the
+    // path in CSV form through stdout.
 
-    auto reference = ModelById::getAs<ReadOnlyWaveFileModel>(m_reference);
-    auto other = ModelById::getAs<ReadOnlyWaveFileModel>(m_toAlign);
+    auto reference = ModelById::getAs<DenseTimeValueModel>(m_reference);
+    auto other = ModelById::getAs<DenseTimeValueModel>(m_toAlign);
     if (!reference || !other) {
+        SVCERR << "ERROR: ExternalProgramAligner: Can't align non-audio models via program" << endl;
+        return;
+    }
+    
+    if (!m_streaming &&
+        (!ModelById::isa<ReadOnlyWaveFileModel>(m_reference) ||
+         !ModelById::isa<ReadOnlyWaveFileModel>(m_toAlign))) {
         SVCERR << "ERROR: ExternalProgramAligner: Can't align non-read-only models via program (no local filename available)" << endl;
         return;
     }
@@ -72,32 +93,103 @@ ExternalProgramAligner::begin()
         return;
     }
 
-    while (!reference->isReady(nullptr) || !other->isReady(nullptr)) {
-        qApp->processEvents();
+    auto alignmentModel =
+        std::make_shared<AlignmentModel>(m_reference, m_toAlign, ModelId());
+
+    m_alignmentModel = ModelById::add(alignmentModel);
+    other->setAlignment(m_alignmentModel);
+
+    // Wait for both models to be ready before starting, but without
+    // blocking the event loop
+    
+    connect(reference.get(), SIGNAL(completionChanged(ModelId)),
+            this, SLOT(modelCompletionChanged(ModelId)));
+    connect(other.get(), SIGNAL(completionChanged(ModelId)),
+            this, SLOT(modelCompletionChanged(ModelId)));
+
+    modelCompletionChanged(m_toAlign);
+}
+
+void
+ExternalProgramAligner::modelCompletionChanged(ModelId)
+{
+    if (m_started) {
+        return;
     }
     
-    QString refPath = reference->getLocalFilename();
-    if (refPath == "") {
-        refPath = FileSource(reference->getLocation()).getLocalFilename();
+    auto reference = ModelById::get(m_reference);
+    auto other = ModelById::get(m_toAlign);
+    if (!reference || !other) {
+        return;
     }
     
-    QString otherPath = other->getLocalFilename();
-    if (otherPath == "") {
-        otherPath = FileSource(other->getLocation()).getLocalFilename();
+    if (!reference->isReady(nullptr) || !other->isReady(nullptr)) {
+        return;
     }
 
-    if (refPath == "" || otherPath == "") {
-        emit failed(m_toAlign,
-                    tr("Failed to find local filepath for wave-file model"));
-        return;
+    disconnect(reference.get(), nullptr, this, nullptr);
+    disconnect(other.get(), nullptr, this, nullptr);
+    m_started = true;
+
+    // May fail, in which case it has already cleaned up; either way
+    // this should be the last thing we do here
+    startProgram();
+}
+
+bool
+ExternalProgramAligner::startProgram()
+{
+    auto reference = ModelById::getAs<DenseTimeValueModel>(m_reference);
+    auto other = ModelById::getAs<DenseTimeValueModel>(m_toAlign);
+    auto alignmentModel = ModelById::getAs<AlignmentModel>(m_alignmentModel);
+    if (!reference || !other || !alignmentModel) {
+        return false;
     }
 
-    auto alignmentModel =
-        std::make_shared<AlignmentModel>(m_reference, m_toAlign, ModelId());
+    QStringList args;
 
-    m_alignmentModel = ModelById::add(alignmentModel);
-    other->setAlignment(m_alignmentModel);
+    if (m_streaming) {
 
+        args << "--stdin"
+             << QString("%1").arg(reference->getSampleRate())
+             << QString("%1").arg(reference->getEndFrame() -
+                                  reference->getStartFrame())
+             << QString("%1").arg(other->getSampleRate())
+             << QString("%1").arg(other->getEndFrame() -
+                                  other->getStartFrame());
+
+    } else {
+
+        auto referenceFile =
+            ModelById::getAs<ReadOnlyWaveFileModel>(m_reference);
+        auto otherFile =
+            ModelById::getAs<ReadOnlyWaveFileModel>(m_toAlign);
+    
+        QString refPath = referenceFile->getLocalFilename();
+        if (refPath == "") {
+            refPath = FileSource(referenceFile->getLocation()).getLocalFilename();
+        }
+    
+        QString otherPath = otherFile->getLocalFilename();
+        if (otherPath == "") {
+            otherPath = FileSource(otherFile->getLocation()).getLocalFilename();
+        }
+
+        if (refPath == "" || otherPath == "") {
+            other->setAlignment({});
+            ModelById::release(m_alignmentModel);
+            emit failed(m_toAlign,
+                        tr("Failed to find local filepath for wave-file model"));
+            return false;
+        }
+
+        args << refPath << otherPath;
+    }
+
+    m_path.reset(new Path(alignmentModel->getSampleRate(), 1));
+    m_outputBuffer.clear();
+    m_otherDuration = other->getEndFrame() - other->getStartFrame();
+    
     m_process = new QProcess;
     m_process->setProcessChannelMode(QProcess::SeparateChannels);
 
@@ -111,9 +203,18 @@ ExternalProgramAligner::begin()
             this,
             SLOT(logStderrOutput()));
 
-    QStringList args;
-    args << refPath << otherPath;
+    connect(m_process,
+            SIGNAL(readyReadStandardOutput()),
+            this,
+            SLOT(readStdoutOutput()));
 
+    if (m_streaming) {
+        connect(m_process,
+                SIGNAL(bytesWritten(qint64)),
+                this,
+                SLOT(feedStdin()));
+    }
+    
     SVCERR << "ExternalProgramAligner: Starting program \""
            << m_program << "\" with args: ";
     for (auto a: args) {
@@ -137,10 +238,86 @@ ExternalProgramAligner::begin()
         emit failed(m_toAlign,
                     tr("Alignment program \"%1\" did not start")
                     .arg(m_program));
-        
-    } else {
-        alignmentModel->setCompletion(10);
-        m_document->addNonDerivedModel(m_alignmentModel);
+        return false;
+    }
+
+    alignmentModel->setCompletion(10);
+    m_document->addNonDerivedModel(m_alignmentModel);
+
+    if (m_streaming) {
+        m_feedIndex = 0;
+        m_feedFrame = reference->getStartFrame();
+        feedStdin();
+    }
+
+    return true;
+}
+
+void
+ExternalProgramAligner::feedStdin()
+{
+    // Keep the pipe topped up without buffering the whole of either
+    // model in the process object at once
+    
+    static const sv_frame_t blockFrames = 65536;
+    static const qint64 maxPending = 4 * blockFrames * sizeof(float);
+
+    if (!m_process || m_feedIndex > 1) {
+        return;
+    }
+
+    while (m_feedIndex < 2 && m_process->bytesToWrite() < maxPending) {
+
+        ModelId id = (m_feedIndex == 0 ? m_reference : m_toAlign);
+        auto model = ModelById::getAs<DenseTimeValueModel>(id);
+        if (!model) {
+            SVCERR << "ExternalProgramAligner: Model " << id
+                   << " disappeared while streaming" << endl;
+            m_feedIndex = 2;
+            m_process->closeWriteChannel();
+            return;
+        }
+
+        sv_frame_t end = model->getEndFrame();
+        sv_frame_t count = std::min(blockFrames, end - m_feedFrame);
+
+        if (count <= 0) {
+            if (++m_feedIndex < 2) {
+                if (auto next = ModelById::get(m_toAlign)) {
+                    m_feedFrame = next->getStartFrame();
+                }
+            } else {
+#ifdef DEBUG_EXTERNAL_PROGRAM_ALIGNER
+                SVCERR << "ExternalProgramAligner: Finished streaming audio"
+                       << endl;
+#endif
+                m_process->closeWriteChannel();
+            }
+            continue;
+        }
+
+        floatvec_t samples = model->getData(-1, m_feedFrame, count);
+        if (samples.empty()) {
+            // Write nothing further from this model
+            m_feedFrame = end;
+            continue;
+        }
+
+        // Pad a short read, so that the program always receives the
+        // number of frames it was told to expect
+        samples.resize(count, 0.f);
+
+        qint64 bytes = qint64(samples.size() * sizeof(float));
+        if (m_process->write(reinterpret_cast<const char *>(samples.data()),
+                             bytes) != bytes) {
+            SVCERR << "ERROR: ExternalProgramAligner: Failed to write audio "
+                   << "to program" << endl;
+            m_feedIndex = 2;
+            m_process->closeWriteChannel();
+            return;
+        }
+
+        m_feedFrame += count;
     }
 }
 
@@ -206,67 +383,29 @@ ExternalProgramAligner::programFinished(int exitCode,
     
     if (exitCode == 0 && status == 0) {
 
-        CSVFormat format;
-        format.setModelType(CSVFormat::TwoDimensionalModel);
-        format.setTimingType(CSVFormat::ExplicitTiming);
-        format.setTimeUnits(CSVFormat::TimeSeconds);
-        format.setColumnCount(2);
-        // The output format has time in the reference file first, and
-        // time in the "other" file in the second column. This is a
-        // more natural approach for a command-line alignment tool,
-        // but it's the opposite of what we expect for native
-        // alignment paths, which map from "other" file to
-        // reference. These column purpose settings reflect that.
-        format.setColumnPurpose(1, CSVFormat::ColumnStartTime);
-        format.setColumnPurpose(0, CSVFormat::ColumnValue);
-        format.setAllowQuoting(false);
-        format.setSeparator(',');
-
-        CSVFileReader reader(process, format, alignmentModel->getSampleRate());
-        if (!reader.isOK()) {
-            SVCERR << "ERROR: ExternalProgramAligner: Failed to parse output"
-                   << endl;
-            errorText = tr("Failed to parse output of program: %1")
-                .arg(reader.getError());
-            alignmentModel->setError(errorText);
-            goto done;
+        // Pick up anything not yet read, including a final line
+        // with no terminating newline
+        readStdoutOutput();
+        if (!m_outputBuffer.isEmpty()) {
+            parseOutputLine(m_outputBuffer);
+            m_outputBuffer.clear();
         }
-
-        //!!! to use ById?
         
-        Model *csvOutput = reader.load();
-
-        SparseTimeValueModel *path =
-            qobject_cast<SparseTimeValueModel *>(csvOutput);
-        if (!path) {
-            SVCERR << "ERROR: ExternalProgramAligner: Output did not convert to sparse time-value model"
-                   << endl;
-            errorText =
-                tr("Output of alignment program was not in the proper format");
-            alignmentModel->setError(errorText);
-            delete csvOutput;
-            goto done;
-        }
-                       
-        if (path->isEmpty()) {
+        if (!m_path || m_path->getPointCount() == 0) {
             SVCERR << "ERROR: ExternalProgramAligner: Output contained no mappings"
                    << endl;
             errorText = 
                 tr("Output of alignment program contained no mappings");
             alignmentModel->setError(errorText);
-            delete path;
-            goto done;
-        }
 
-        SVCERR << "ExternalProgramAligner: Setting alignment path ("
-             << path->getEventCount() << " point(s))" << endl;
+        } else {
 
-        auto pathId =
-            ModelById::add(std::shared_ptr<SparseTimeValueModel>(path));
-        alignmentModel->setPathFrom(pathId);
-        alignmentModel->setCompletion(100);
+            SVCERR << "ExternalProgramAligner: Setting alignment path ("
+                   << m_path->getPointCount() << " point(s))" << endl;
 
-        ModelById::release(pathId);
+            alignmentModel->setPath(*m_path);
+            alignmentModel->setCompletion(100);
+        }
         
     } else {
         SVCERR << "ERROR: ExternalProgramAligner: Aligner program "
@@ -276,7 +415,6 @@ ExternalProgramAligner::programFinished(int exitCode,
         alignmentModel->setError(errorText);
     }
 
-done:
     delete m_process;
     m_process = nullptr;
 
@@ -288,3 +426,72 @@ done:
         emit failed(m_toAlign, errorText);
     }
 }
+
+void
+ExternalProgramAligner::readStdoutOutput()
+{
+    if (!m_process || !m_path) return;
+
+    m_process->setReadChannel(QProcess::StandardOutput);
+    m_outputBuffer.append(m_process->readAll());
+
+    int added = 0;
+    int nl;
+    while ((nl = m_outputBuffer.indexOf('\n')) >= 0) {
+        if (parseOutputLine(m_outputBuffer.left(nl))) {
+            ++added;
+        }
+        m_outputBuffer.remove(0, nl + 1);
+    }
+
+    if (added == 0) {
+        return;
+    }
+
+    auto alignmentModel = ModelById::getAs<AlignmentModel>(m_alignmentModel);
+    if (!alignmentModel) {
+        return;
+    }
+
+    if (!m_sincePublished.isValid() ||
+        m_sincePublished.elapsed() >= publishInterval) {
+        alignmentModel->setPath(*m_path);
+        m_sincePublished.start();
+    }
+
+    // Report progress through the model to align, from 10% when the
+    // program starts up to 99% at the end of the model
+    if (m_otherDuration > 0 && !m_path->getPoints().empty()) {
+        sv_frame_t reached = m_path->getPoints().rbegin()->mapframe;
+        int completion = 10 + int((89 * reached) / m_otherDuration);
+        alignmentModel->setCompletion(std::max(10, std::min(99, completion)));
+    }
+}
+
+bool
+ExternalProgramAligner::parseOutputLine(const QByteArray &line)
+{
+    // The output format has time in the reference file first, and
+    // time in the "other" file in the second column. This is a more
+    // natural approach for a command-line alignment tool, but it's
+    // the opposite of what we expect for native alignment paths,
+    // which map from "other" file to reference.
+
+    QList<QByteArray> columns = line.trimmed().split(',');
+    if (columns.size() != 2) {
+        return false;
+    }
+
+    bool ok0 = false, ok1 = false;
+    double refTime = columns[0].trimmed().toDouble(&ok0);
+    double otherTime = columns[1].trimmed().toDouble(&ok1);
+    if (!ok0 || !ok1) {
+        // Header or other non-numeric line
+        return false;
+    }
+
+    sv_samplerate_t rate = m_path->getSampleRate();
+    m_path->add(PathPoint(sv_frame_t(round(otherTime * rate)),
+                          sv_frame_t(round(refTime * rate))));
+    return true;
+}
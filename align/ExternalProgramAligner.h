@@ -19,10 +19,34 @@
 
 #include <QProcess>
 #include <QString>
+#include <QByteArray>
+#include <QElapsedTimer>
+
+#include <memory>
 
 class AlignmentModel;
 class Document;
+class Path;
 
+/**
+ * Aligner that runs an external program and reads the alignment path
+ * from its standard output, as lines of comma-separated pairs of
+ * times in seconds, the first in the reference and the second in the
+ * model to align. The path is read progressively as the program
+ * writes it, and published to the alignment model at intervals as it
+ * arrives.
+ *
+ * In the default mode the program is given the paths of the two
+ * audio files as its arguments, so both models must be backed by
+ * files. In streaming mode the program is instead invoked as
+ *
+ *     program --stdin refRate refFrames otherRate otherFrames
+ *
+ * and the mono mixdowns of the reference and then the model to
+ * align, as native-endian 32-bit float samples of the given counts
+ * and rates, are written to its standard input. This works with any
+ * dense audio model, including recordings that have no file.
+ */
 class ExternalProgramAligner : public Aligner
 {
     Q_OBJECT
@@ -31,7 +55,8 @@ public:
     ExternalProgramAligner(Document *doc,
                            ModelId reference,
                            ModelId toAlign,
-                           QString program);
+                           QString program,
+                           bool streaming = false);
 
     // Destroy the aligner, cleanly cancelling any ongoing alignment
     ~ExternalProgramAligner();
@@ -41,8 +66,11 @@ public:
     static bool isAvailable(QString program);
 
 private slots:
+    void modelCompletionChanged(ModelId);
     void programFinished(int, QProcess::ExitStatus);
     void logStderrOutput();
+    void readStdoutOutput();
+    void feedStdin();
 
 private:
     Document *m_document;
@@ -50,7 +78,29 @@ private:
     ModelId m_toAlign;
     ModelId m_alignmentModel;
     QString m_program;
+    bool m_streaming;
+    bool m_started;
     QProcess *m_process;
+
+    // Path as read so far from the program's output, and any
+    // incomplete line following it
+    std::unique_ptr<Path> m_path;
+    QByteArray m_outputBuffer;
+    sv_frame_t m_otherDuration;
+
+    // Time since the path was last published to the alignment
+    // model. Publishing copies the whole path, so it is done at most
+    // once per publishInterval while the program runs, and once more
+    // when it finishes
+    QElapsedTimer m_sincePublished;
+
+    // Streaming input position: model being written (0 for the
+    // reference, 1 for the model to align, 2 when done) and frame
+    int m_feedIndex;
+    sv_frame_t m_feedFrame;
+
+    bool startProgram();
+    bool parseOutputLine(const QByteArray &line);
 };
 
 #endif
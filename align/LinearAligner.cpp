@@ -22,9 +22,42 @@
 #include "framework/Document.h"
 
 #include "svcore/data/model/DenseTimeValueModel.h"
+#include "svcore/data/model/RangeSummarisableTimeValueModel.h"
 
 #include <QApplication>
 
+#include <cmath>
+
+// Trimming looks for the first and last chunk whose RMS level
+// exceeds the threshold
+static const sv_frame_t trimChunkSize = 1024;
+static const double trimThreshold = 1e-2;
+
+// Number of chunks retrieved from the model at once
+static const sv_frame_t trimChunksPerRead = 32;
+
+// Block size requested from the model summaries for the coarse scan
+static const int trimSummaryBlockSize = 8192;
+
+static double
+getChunkRMS(const float *samples, sv_frame_t n)
+{
+    // Four independent accumulators, so that the compiler can
+    // vectorise the loop without having to reorder a single sum
+    float acc[4] = { 0.f, 0.f, 0.f, 0.f };
+    sv_frame_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int k = 0; k < 4; ++k) {
+            acc[k] += samples[i + k] * samples[i + k];
+        }
+    }
+    double sum = double(acc[0]) + acc[1] + acc[2] + acc[3];
+    for (; i < n; ++i) {
+        sum += samples[i] * samples[i];
+    }
+    return sqrt(sum / double(n));
+}
+
 LinearAligner::LinearAligner(Document *doc,
                              ModelId reference,
                              ModelId toAlign,
@@ -77,8 +110,16 @@ LinearAligner::begin()
     e1 = toAlign->getEndFrame();
 
     if (m_trimmed) {
-        getTrimmedExtents(m_reference, s0, e0);
-        getTrimmedExtents(m_toAlign, s1, e1);
+        // If either model turns out to be entirely silent, align it
+        // untrimmed instead
+        if (!getTrimmedExtents(m_reference, s0, e0)) {
+            s0 = reference->getStartFrame();
+            e0 = reference->getEndFrame();
+        }
+        if (!getTrimmedExtents(m_toAlign, s1, e1)) {
+            s1 = toAlign->getStartFrame();
+            e1 = toAlign->getEndFrame();
+        }
         SVCERR << "Trimmed extents: reference: " << s0 << " to " << e0
                << ", toAlign: " << s1 << " to " << e1 << endl;
     }
@@ -121,52 +162,158 @@ LinearAligner::getTrimmedExtents(ModelId modelId,
     auto model = ModelById::getAs<DenseTimeValueModel>(modelId);
     if (!model) return false;
 
-    sv_frame_t chunksize = 1024;
-    double threshold = 1e-2;
-
-    auto rms = [](const floatvec_t &samples) {
-                   double rms = 0.0;
-                   for (auto s: samples) {
-                       rms += s * s;
-                   }
-                   rms /= double(samples.size());
-                   rms = sqrt(rms);
-                   return rms;
-               };
+    // Skip the silent lead-in and tail using the model's summaries
+    // where available, then refine at sample level. The refinement
+    // starts on the same chunk boundaries as a full scan from the
+    // original extents would, so the result is the same.
+
+    sv_frame_t coarseStart = start, coarseEnd = end;
+    if (getCoarseExtents(modelId, coarseStart, coarseEnd)) {
+        start += ((coarseStart - start) / trimChunkSize) * trimChunkSize;
+        end -= ((end - coarseEnd) / trimChunkSize) * trimChunkSize;
+    } else if (coarseStart >= coarseEnd) {
+        return false; // summaries show no non-silent content
+    }
+
+    sv_frame_t scanStart = start;
+    ScanThread endScan([&]() {
+                           scanForEnd(model.get(), scanStart, end);
+                       });
+    endScan.start();
+
+    bool found = scanForStart(model.get(), start, end);
+    
+    endScan.wait();
+
+    return found && (end > start);
+}
+
+bool
+LinearAligner::getCoarseExtents(ModelId modelId,
+                                sv_frame_t &start,
+                                sv_frame_t &end)
+{
+    // Return false without changing start and end if no summaries
+    // are available; otherwise return false with start == end if
+    // the whole model is silent, or true with start and end narrowed
+    // to a region that contains all non-silent content
+
+    auto model = ModelById::getAs<RangeSummarisableTimeValueModel>(modelId);
+    if (!model || start >= end) return false;
+
+    int channels = model->getChannelCount();
+    if (channels < 1) return false;
     
+    std::vector<float> peaks;
+    int blockSize = model->getSummaryBlockSize(trimSummaryBlockSize);
+
+    for (int c = 0; c < channels; ++c) {
+        RangeSummarisableTimeValueModel::RangeBlock ranges;
+        int channelBlockSize = blockSize;
+        model->getSummaries(c, start, end - start, ranges, channelBlockSize);
+        if (ranges.empty() || channelBlockSize != blockSize) {
+            return false;
+        }
+        if (peaks.size() < ranges.size()) {
+            peaks.resize(ranges.size(), 0.f);
+        }
+        // The peak of the mixdown can be no greater than the sum of
+        // the channel peaks, whether it is a sum or a mean
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            peaks[i] += std::max(fabsf(ranges[i].min()),
+                                 fabsf(ranges[i].max()));
+        }
+    }
+
+    size_t first = peaks.size(), last = 0;
+    for (size_t i = 0; i < peaks.size(); ++i) {
+        if (peaks[i] > trimThreshold) {
+            if (first == peaks.size()) first = i;
+            last = i;
+        }
+    }
+
+    if (first == peaks.size()) {
+        end = start;
+        return false;
+    }
+
+    // Blocks may be aligned either to the start frame or to
+    // multiples of the block size, so allow a block's grace either
+    // side
+    sv_frame_t base = (start / blockSize) * blockSize;
+    sv_frame_t s = base + (sv_frame_t(first) - 1) * blockSize;
+    sv_frame_t e = base + sv_frame_t(last + 2) * blockSize;
+    if (first == 0) s = start;
+    
+    start = std::max(start, s);
+    end = std::min(end, e);
+    return true;
+}
+
+bool
+LinearAligner::scanForStart(const DenseTimeValueModel *model,
+                            sv_frame_t &start,
+                            sv_frame_t end)
+{
     while (start < end) {
-        floatvec_t samples = model->getData(-1, start, chunksize);
+        floatvec_t samples = model->getData
+            (-1, start, trimChunkSize * trimChunksPerRead);
         if (samples.empty()) {
             return false; // no non-silent content found
         }
-        if (rms(samples) > threshold) {
-            for (auto s: samples) {
-                if (fabsf(s) > threshold) {
-                    break;
+        sv_frame_t n = sv_frame_t(samples.size());
+        for (sv_frame_t off = 0; off < n && start < end;
+             off += trimChunkSize) {
+            sv_frame_t count = std::min(trimChunkSize, n - off);
+            const float *chunk = samples.data() + off;
+            if (getChunkRMS(chunk, count) > trimThreshold) {
+                for (sv_frame_t i = 0; i < count; ++i) {
+                    if (fabsf(chunk[i]) > trimThreshold) {
+                        break;
+                    }
+                    ++start;
                 }
-                ++start;
+                return (start < end);
             }
-            break;
+            start += trimChunkSize;
         }
-        start += chunksize;
-    }
-    
-    if (start >= end) {
-        return false;
     }
 
+    return false;
+}
+
+void
+LinearAligner::scanForEnd(const DenseTimeValueModel *model,
+                          sv_frame_t start,
+                          sv_frame_t &end)
+{
     while (end > start) {
-        sv_frame_t probe = end - chunksize;
-        if (probe < 0) probe = 0;
-        floatvec_t samples = model->getData(-1, probe, chunksize);
-        if (samples.empty()) {
-            break;
+
+        // Read as many whole chunks preceding end as we can at once;
+        // if less than a chunk remains before the model start, probe
+        // a single chunk from zero
+        sv_frame_t chunks = std::min(trimChunksPerRead, end / trimChunkSize);
+        sv_frame_t probe = end - chunks * trimChunkSize;
+        if (chunks == 0) {
+            chunks = 1;
+            probe = 0;
         }
-        if (rms(samples) > threshold) {
-            break;
+
+        floatvec_t samples = model->getData
+            (-1, probe, chunks * trimChunkSize);
+        sv_frame_t n = sv_frame_t(samples.size());
+
+        for (sv_frame_t k = chunks - 1; k >= 0 && end > start; --k) {
+            sv_frame_t off = k * trimChunkSize;
+            if (off >= n) {
+                return;
+            }
+            sv_frame_t count = std::min(trimChunkSize, n - off);
+            if (getChunkRMS(samples.data() + off, count) > trimThreshold) {
+                return;
+            }
+            end = probe + off;
         }
-        end = probe;
     }
-
-    return (end > start);
 }
@@ -17,8 +17,13 @@
 
 #include "Aligner.h"
 
+#include "base/Thread.h"
+
+#include <functional>
+
 class AlignmentModel;
 class Document;
+class DenseTimeValueModel;
 
 class LinearAligner : public Aligner
 {
@@ -44,7 +49,33 @@ private:
     ModelId m_toAlign;
     bool m_trimmed;
 
+    /**
+     * Thread that runs a single extent scan, so that the scans from
+     * the start and end of a model can proceed concurrently.
+     */
+    class ScanThread : public Thread
+    {
+    public:
+        ScanThread(std::function<void()> scan) :
+            Thread(Thread::NonRTThread),
+            m_scan(scan) { }
+
+        void run() override {
+            m_scan();
+        }
+
+    private:
+        std::function<void()> m_scan;
+    };
+    
     bool getTrimmedExtents(ModelId model, sv_frame_t &start, sv_frame_t &end);
+
+    static bool getCoarseExtents(ModelId model,
+                                 sv_frame_t &start, sv_frame_t &end);
+    static bool scanForStart(const DenseTimeValueModel *model,
+                             sv_frame_t &start, sv_frame_t end);
+    static void scanForEnd(const DenseTimeValueModel *model,
+                           sv_frame_t start, sv_frame_t &end);
 };
 
 #endif
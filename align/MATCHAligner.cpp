@@ -174,6 +174,15 @@ MATCHAligner::begin()
         (m_reference, m_toAlign, ModelId());
     m_alignmentModel = ModelById::add(alignmentModel);
 
+    // Each alignment against the same reference analyses the
+    // reference again, both here and in MATCH itself. The plugins
+    // take their two inputs as channels of one stream and compute
+    // features for both internally, and the Vamp interface offers no
+    // way to hand them features already computed for one channel, so
+    // there is nothing of the reference's analysis that could be
+    // shared across alignments. Repeating an identical alignment is
+    // avoided by the alignment cache instead (see AlignmentCache).
+    
     TransformId tdId;
     if (m_withTuningDifference) {
         tdId = getTuningDifferenceTransformName();
@@ -293,16 +302,36 @@ MATCHAligner::tuningDifferenceCompletionChanged(ModelId tuningDiffOutputModelId)
     beginAlignmentPhase();
 }
 
+Transform
+MATCHAligner::getAlignmentTransform(sv_samplerate_t sampleRate,
+                                    bool subsequence,
+                                    float tuningFrequency)
+{
+    TransformFactory *tf = TransformFactory::getInstance();
+
+    Transform transform = tf->getDefaultTransformFor
+        (getAlignmentTransformName(subsequence), sampleRate);
+
+    transform.setStepSize(transform.getBlockSize()/2);
+    transform.setParameter("serialise", 1);
+    transform.setParameter("smooth", 0);
+    transform.setParameter("zonewidth", 40);
+    transform.setParameter("noise", true);
+    transform.setParameter("minfreq", 500);
+
+    if (tuningFrequency != 0.f) {
+        transform.setParameter("freq2", tuningFrequency);
+    }
+
+    return transform;
+}
+
 bool
 MATCHAligner::beginAlignmentPhase()
 {
-    TransformId id = getAlignmentTransformName(m_subsequence);
-    
     SVDEBUG << "MATCHAligner::beginAlignmentPhase: transform is "
-            << id << endl;
+            << getAlignmentTransformName(m_subsequence) << endl;
     
-    TransformFactory *tf = TransformFactory::getInstance();
-
     auto aggregateModel =
         ModelById::getAs<AggregateWaveModel>(m_aggregateModel);
     auto alignmentModel =
@@ -313,21 +342,12 @@ MATCHAligner::beginAlignmentPhase()
         return false;
     }
     
-    Transform transform = tf->getDefaultTransformFor
-        (id, aggregateModel->getSampleRate());
-
-    transform.setStepSize(transform.getBlockSize()/2);
-    transform.setParameter("serialise", 1);
-    transform.setParameter("smooth", 0);
-    transform.setParameter("zonewidth", 40);
-    transform.setParameter("noise", true);
-    transform.setParameter("minfreq", 500);
+    Transform transform = getAlignmentTransform
+        (aggregateModel->getSampleRate(), m_subsequence, m_tuningFrequency);
 
     int cents = 0;
     
     if (m_tuningFrequency != 0.f) {
-        transform.setParameter("freq2", m_tuningFrequency);
-
         double centsOffset = 0.f;
         int pitch = Pitch::getPitchForFrequency(m_tuningFrequency,
                                                 &centsOffset);
@@ -17,6 +17,8 @@
 
 #include "Aligner.h"
 
+#include "transform/Transform.h"
+
 class AlignmentModel;
 class Document;
 
@@ -39,6 +41,17 @@ public:
     static bool isAvailable(bool subsequence,
                             bool withTuningDifference);
 
+    /**
+     * Return the MATCH transform, with the parameters used for
+     * alignment, for input at the given sample rate. The tuning
+     * frequency, if given, is that of the second input channel
+     * relative to A=440 in the first; if it is zero, the plugin's own
+     * default is left in place.
+     */
+    static Transform getAlignmentTransform(sv_samplerate_t sampleRate,
+                                           bool subsequence,
+                                           float tuningFrequency = 0.f);
+
 private slots:
     void alignmentCompletionChanged(ModelId);
     void tuningDifferenceCompletionChanged(ModelId);
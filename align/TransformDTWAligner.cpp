@@ -14,6 +14,7 @@
 
 #include "TransformDTWAligner.h"
 #include "DTW.h"
+#include "DTWScheduler.h"
 
 #include "data/model/SparseTimeValueModel.h"
 #include "data/model/NoteModel.h"
@@ -27,8 +28,11 @@
 #include "transform/FeatureExtractionModelTransformer.h"
 
 #include <QSettings>
-#include <QMutex>
-#include <QMutexLocker>
+
+#include <algorithm>
+
+// Interval at which a provisional online alignment path is published
+static const int publishInterval = 500; // ms
 
 using std::vector;
 
@@ -50,9 +54,6 @@ TransformDTWAligner::RiseFallPreprocessor identityRiseFallPreprocessor =
         }
     };
 
-QMutex
-TransformDTWAligner::m_dtwMutex;
-
 TransformDTWAligner::TransformDTWAligner(Document *doc,
                                          ModelId reference,
                                          ModelId toAlign,
@@ -64,10 +65,14 @@ TransformDTWAligner::TransformDTWAligner(Document *doc,
     m_toAlign(toAlign),
     m_transform(transform),
     m_dtwType(dtwType),
+    m_strategy(Exact),
     m_subsequence(subsequence),
     m_incomplete(true),
     m_magnitudePreprocessor(identityMagnitudePreprocessor),
-    m_riseFallPreprocessor(identityRiseFallPreprocessor)
+    m_riseFallPreprocessor(identityRiseFallPreprocessor),
+    m_dtwThread(nullptr),
+    m_resolution(0),
+    m_online(false)
 {
 }
 
@@ -82,10 +87,14 @@ TransformDTWAligner::TransformDTWAligner(Document *doc,
     m_toAlign(toAlign),
     m_transform(transform),
     m_dtwType(Magnitude),
+    m_strategy(Exact),
     m_subsequence(subsequence),
     m_incomplete(true),
     m_magnitudePreprocessor(outputPreprocessor),
-    m_riseFallPreprocessor(identityRiseFallPreprocessor)
+    m_riseFallPreprocessor(identityRiseFallPreprocessor),
+    m_dtwThread(nullptr),
+    m_resolution(0),
+    m_online(false)
 {
 }
 
@@ -100,15 +109,29 @@ TransformDTWAligner::TransformDTWAligner(Document *doc,
     m_toAlign(toAlign),
     m_transform(transform),
     m_dtwType(RiseFall),
+    m_strategy(Exact),
     m_subsequence(subsequence),
     m_incomplete(true),
     m_magnitudePreprocessor(identityMagnitudePreprocessor),
-    m_riseFallPreprocessor(outputPreprocessor)
+    m_riseFallPreprocessor(outputPreprocessor),
+    m_dtwThread(nullptr),
+    m_resolution(0),
+    m_online(false)
 {
 }
 
 TransformDTWAligner::~TransformDTWAligner()
 {
+    if (m_dtwThread) {
+        // A job still queued behind other alignments in the scheduler
+        // is given up at once. The DTW itself can't be interrupted,
+        // but it holds only copies of its input data, so if it has
+        // started we just need to wait for it
+        m_dtwThread->abandon();
+        m_dtwThread->wait();
+        delete m_dtwThread;
+    }
+    
     if (m_incomplete) {
         if (auto toAlign = ModelById::get(m_toAlign)) {
             toAlign->setAlignment({});
@@ -119,6 +142,24 @@ TransformDTWAligner::~TransformDTWAligner()
     ModelById::release(m_toAlignOutputModel);
 }
 
+void
+TransformDTWAligner::setBand(DTWBand band)
+{
+    m_band = band;
+}
+
+void
+TransformDTWAligner::setStrategy(DTWStrategy strategy)
+{
+    m_strategy = strategy;
+}
+
+void
+TransformDTWAligner::setOnline(bool online)
+{
+    m_online = online;
+}
+
 bool
 TransformDTWAligner::isAvailable()
 {
@@ -191,9 +232,7 @@ TransformDTWAligner::begin()
         toAlignOutputModel->isReady(&completion)) {
         SVCERR << "TransformDTWAligner[" << this << "]: begin(): output models "
                << "are ready already! calling performAlignment" << endl;
-        if (performAlignment()) {
-            emit complete(m_alignmentModel);
-        } else {
+        if (!performAlignment()) {
             emit failed(m_toAlign, tr("Failed to calculate alignment using DTW"));
         }
     }
@@ -206,7 +245,7 @@ TransformDTWAligner::completionChanged(ModelId
 #endif
     )
 {
-    if (!m_incomplete) {
+    if (!m_incomplete || m_dtwThread) {
         return;
     }
 #ifdef DEBUG_TRANSFORM_DTW_ALIGNER
@@ -233,9 +272,7 @@ TransformDTWAligner::completionChanged(ModelId
 
         alignmentModel->setCompletion(95);
         
-        if (performAlignment()) {
-            emit complete(m_alignmentModel);
-        } else {
+        if (!performAlignment()) {
             emit failed(m_toAlign, tr("Alignment of transform outputs failed"));
         }
 
@@ -250,9 +287,116 @@ TransformDTWAligner::completionChanged(ModelId
                                   toAlignCompletion);
         completion = (completion * 94) / 100;
         alignmentModel->setCompletion(completion);
+
+        if (m_online && !m_subsequence) {
+            updateOnlineAlignment();
+        }
     }
 }
 
+void
+TransformDTWAligner::updateOnlineAlignment()
+{
+    auto alignmentModel = ModelById::getAs<AlignmentModel>(m_alignmentModel);
+    if (!alignmentModel) {
+        return;
+    }
+
+    OnlineState &state = m_onlineState;
+    
+    // Fetch only the events that have appeared since the last call
+    
+    vector<sv_frame_t> refFrames, otherFrames;
+    vector<double> refValues, otherValues;
+
+    if (!getValuesFrom(m_referenceOutputModel,
+                       refFrames, refValues, state.resolution,
+                       &state.refCursor) ||
+        !getValuesFrom(m_toAlignOutputModel,
+                       otherFrames, otherValues, state.resolution,
+                       &state.otherCursor)) {
+        return;
+    }
+
+    if (refValues.empty() && otherValues.empty()) {
+        return;
+    }
+
+    state.refFrames.insert(state.refFrames.end(),
+                           refFrames.begin(), refFrames.end());
+    state.otherFrames.insert(state.otherFrames.end(),
+                             otherFrames.begin(), otherFrames.end());
+
+    vector<size_t> alignment;
+    
+    if (m_dtwType == Magnitude) {
+
+        if (!state.magnitude) {
+            state.magnitude.reset(new OnlineDTW<double>
+                                  (MagnitudeDTW::makeOnlineDTW()));
+        }
+        
+        vector<double> s1, s2;
+        for (double v: refValues) {
+            s1.push_back(m_magnitudePreprocessor(v));
+        }
+        for (double v: otherValues) {
+            s2.push_back(m_magnitudePreprocessor(v));
+        }
+
+        state.magnitude->extend(s1, s2);
+
+    } else {
+
+        if (!state.riseFall) {
+            state.riseFall.reset(new OnlineDTW<RiseFallDTW::Value>
+                                 (RiseFallDTW::makeOnlineDTW()));
+        }
+        
+        vector<RiseFallDTW::Value> s1, s2;
+        for (double v: refValues) {
+            s1.push_back(m_riseFallPreprocessor(state.lastRefValue, v));
+            state.lastRefValue = v;
+        }
+        for (double v: otherValues) {
+            s2.push_back(m_riseFallPreprocessor(state.lastOtherValue, v));
+            state.lastOtherValue = v;
+        }
+
+        state.riseFall->extend(s1, s2);
+    }
+
+    if (state.sincePublished.isValid() &&
+        state.sincePublished.elapsed() < publishInterval) {
+        return;
+    }
+
+    if (m_dtwType == Magnitude) {
+        alignment = state.magnitude->getPath();
+    } else {
+        alignment = state.riseFall->getPath();
+    }
+    
+    if (alignment.size() <= state.published) {
+        return;
+    }
+
+#ifdef DEBUG_TRANSFORM_DTW_ALIGNER
+    SVCERR << "TransformDTWAligner[" << this << "]: updateOnlineAlignment: "
+           << "publishing provisional path for " << alignment.size()
+           << " of " << state.otherFrames.size() << " events" << endl;
+#endif
+    
+    state.published = alignment.size();
+    state.sincePublished.start();
+    
+    alignmentModel->setPath(makePath(alignment,
+                                     state.refFrames,
+                                     state.otherFrames,
+                                     alignmentModel->getSampleRate(),
+                                     state.resolution));
+}
+
 bool
 TransformDTWAligner::performAlignment()
 {
@@ -267,16 +411,34 @@ bool
 TransformDTWAligner::getValuesFrom(ModelId modelId,
                                    vector<sv_frame_t> &frames,
                                    vector<double> &values,
-                                   sv_frame_t &resolution)
+                                   sv_frame_t &resolution,
+                                   FetchCursor *cursor)
 {
     EventVector events;
 
+    // With a cursor, events are returned from the cursor's frame
+    // onwards, so that a model that is still being filled can be read
+    // incrementally
+    
+    bool all = (!cursor || !cursor->started);
+    sv_frame_t from = (all ? 0 : cursor->frame);
+    
     if (auto model = ModelById::getAs<SparseTimeValueModel>(modelId)) {
         resolution = model->getResolution();
-        events = model->getAllEvents();
+        if (all) {
+            events = model->getAllEvents();
+        } else {
+            sv_frame_t end = std::max(from, model->getEndFrame());
+            events = model->getEventsStartingWithin(from, end - from + 1);
+        }
     } else if (auto model = ModelById::getAs<NoteModel>(modelId)) {
         resolution = model->getResolution();
-        events = model->getAllEvents();
+        if (all) {
+            events = model->getAllEvents();
+        } else {
+            sv_frame_t end = std::max(from, model->getEndFrame());
+            events = model->getEventsStartingWithin(from, end - from + 1);
+        }
     } else {
         SVCERR << "TransformDTWAligner::getValuesFrom: Type of model "
                << modelId << " is not supported" << endl;
@@ -286,9 +448,34 @@ TransformDTWAligner::getValuesFrom(ModelId modelId,
     frames.clear();
     values.clear();
 
-    for (auto e: events) {
+    // Events at the cursor's frame may have been consumed already,
+    // each of them once
+    EventVector consumed;
+    if (!all) {
+        consumed = cursor->atFrame;
+    }
+
+    for (const auto &e: events) {
+        
+        if (!all && e.getFrame() == cursor->frame) {
+            auto itr = std::find(consumed.begin(), consumed.end(), e);
+            if (itr != consumed.end()) {
+                consumed.erase(itr);
+                continue;
+            }
+        }
+        
         frames.push_back(e.getFrame());
         values.push_back(e.getValue());
+
+        if (cursor) {
+            if (!cursor->started || e.getFrame() > cursor->frame) {
+                cursor->started = true;
+                cursor->frame = e.getFrame();
+                cursor->atFrame.clear();
+            }
+            cursor->atFrame.push_back(e);
+        }
     }
 
     return true;
@@ -329,22 +516,15 @@ TransformDTWAligner::makePath(const vector<size_t> &alignment,
 bool
 TransformDTWAligner::performAlignmentMagnitude()
 {
-    auto alignmentModel = ModelById::getAs<AlignmentModel>(m_alignmentModel);
-    if (!alignmentModel) {
-        return false;
-    }
-
-    vector<sv_frame_t> refFrames, otherFrames;
     vector<double> refValues, otherValues;
-    sv_frame_t resolution = 0;
 
     if (!getValuesFrom(m_referenceOutputModel,
-                       refFrames, refValues, resolution)) {
+                       m_refFrames, refValues, m_resolution)) {
         return false;
     }
 
     if (!getValuesFrom(m_toAlignOutputModel,
-                       otherFrames, otherValues, resolution)) {
+                       m_otherFrames, otherValues, m_resolution)) {
         return false;
     }
     
@@ -362,64 +542,36 @@ TransformDTWAligner::performAlignmentMagnitude()
            << s2.size() << " from toAlign" << endl;
 #endif
     
-    MagnitudeDTW dtw;
-    vector<size_t> alignment;
+    MagnitudeDTW dtw(m_band);
+    dtw.setMultiscale(m_strategy == Multiscale);
 
-    {
-#ifdef DEBUG_TRANSFORM_DTW_ALIGNER
-        SVCERR << "TransformDTWAligner[" << this
-               << "]: serialising DTW to avoid over-allocation" << endl;
-#endif
-        QMutexLocker locker(&m_dtwMutex);
-        if (m_subsequence) {
-            alignment = dtw.alignSubsequence(s1, s2);
-        } else {
-            alignment = dtw.alignSequences(s1, s2);
-        }
-    }
-
-#ifdef DEBUG_TRANSFORM_DTW_ALIGNER
-    SVCERR << "TransformDTWAligner[" << this << "]: performAlignmentMagnitude: "
-           << "DTW produced " << alignment.size() << " points:" << endl;
-    for (int i = 0; in_range_for(alignment, i) && i < 100; ++i) {
-        SVCERR << alignment[i] << " ";
-    }
-    SVCERR << endl;
-#endif
-
-    alignmentModel->setPath(makePath(alignment,
-                                     refFrames,
-                                     otherFrames,
-                                     alignmentModel->getSampleRate(),
-                                     resolution));
-    alignmentModel->setCompletion(100);
+    size_t bytes = sizeof(double) *
+        dtw.getCellCountEstimate(s1.size(), s2.size(), m_subsequence);
+    bool subsequence = m_subsequence;
 
-    SVCERR << "TransformDTWAligner[" << this
-           << "]: performAlignmentMagnitude: Done" << endl;
+    startDTW(bytes, [=]() mutable -> vector<size_t> {
+                        if (subsequence) {
+                            return dtw.alignSubsequence(s1, s2);
+                        } else {
+                            return dtw.alignSequences(s1, s2);
+                        }
+                    });
 
-    m_incomplete = false;
     return true;
 }
 
 bool
 TransformDTWAligner::performAlignmentRiseFall()
 {
-    auto alignmentModel = ModelById::getAs<AlignmentModel>(m_alignmentModel);
-    if (!alignmentModel) {
-        return false;
-    }
-
-    vector<sv_frame_t> refFrames, otherFrames;
     vector<double> refValues, otherValues;
-    sv_frame_t resolution = 0;
 
     if (!getValuesFrom(m_referenceOutputModel,
-                       refFrames, refValues, resolution)) {
+                       m_refFrames, refValues, m_resolution)) {
         return false;
     }
 
     if (!getValuesFrom(m_toAlignOutputModel,
-                       otherFrames, otherValues, resolution)) {
+                       m_otherFrames, otherValues, m_resolution)) {
         return false;
     }
     
@@ -455,42 +607,92 @@ TransformDTWAligner::performAlignmentRiseFall()
     SVCERR << endl;
 #endif
     
-    RiseFallDTW dtw;
-    vector<size_t> alignment;
+    RiseFallDTW dtw(m_band);
+    dtw.setMultiscale(m_strategy == Multiscale);
+
+    size_t bytes = sizeof(double) *
+        dtw.getCellCountEstimate(s1.size(), s2.size(), m_subsequence);
+    bool subsequence = m_subsequence;
+
+    startDTW(bytes, [=]() mutable -> vector<size_t> {
+                        if (subsequence) {
+                            return dtw.alignSubsequence(s1, s2);
+                        } else {
+                            return dtw.alignSequences(s1, s2);
+                        }
+                    });
+
+    return true;
+}
 
-    {
+void
+TransformDTWAligner::startDTW(size_t bytes, DTWThread::Job job)
+{
 #ifdef DEBUG_TRANSFORM_DTW_ALIGNER
-        SVCERR << "TransformDTWAligner[" << this
-               << "]: serialising DTW to avoid over-allocation" << endl;
+    SVCERR << "TransformDTWAligner[" << this << "]: startDTW: "
+           << "starting DTW thread with estimated cost matrix size "
+           << bytes << " bytes" << endl;
 #endif
-        QMutexLocker locker(&m_dtwMutex);
-        if (m_subsequence) {
-            alignment = dtw.alignSubsequence(s1, s2);
-        } else {
-            alignment = dtw.alignSequences(s1, s2);
-        }
+
+    m_dtwThread = new DTWThread(bytes, job);
+    connect(m_dtwThread, SIGNAL(finished()), this, SLOT(dtwFinished()));
+    m_dtwThread->start();
+}
+
+void
+TransformDTWAligner::dtwFinished()
+{
+    if (!m_dtwThread) {
+        return;
+    }
+
+    m_dtwThread->wait();
+    vector<size_t> alignment = m_dtwThread->getAlignment();
+    delete m_dtwThread;
+    m_dtwThread = nullptr;
+    
+    auto alignmentModel = ModelById::getAs<AlignmentModel>(m_alignmentModel);
+    if (!alignmentModel) {
+        emit failed(m_toAlign, tr("Alignment of transform outputs failed"));
+        return;
     }
 
 #ifdef DEBUG_TRANSFORM_DTW_ALIGNER
-    SVCERR << "TransformDTWAligner[" << this << "]: performAlignmentRiseFall: "
+    SVCERR << "TransformDTWAligner[" << this << "]: dtwFinished: "
            << "DTW produced " << alignment.size() << " points:" << endl;
-    for (int i = 0; i < alignment.size() && i < 100; ++i) {
+    for (int i = 0; in_range_for(alignment, i) && i < 100; ++i) {
         SVCERR << alignment[i] << " ";
     }
     SVCERR << endl;
 #endif
 
     alignmentModel->setPath(makePath(alignment,
-                                     refFrames,
-                                     otherFrames,
+                                     m_refFrames,
+                                     m_otherFrames,
                                      alignmentModel->getSampleRate(),
-                                     resolution));
-
+                                     m_resolution));
     alignmentModel->setCompletion(100);
 
     SVCERR << "TransformDTWAligner[" << this
-           << "]: performAlignmentRiseFall: Done" << endl;
+           << "]: dtwFinished: Done" << endl;
 
     m_incomplete = false;
-    return true;
+    emit complete(m_alignmentModel);
+}
+
+void
+TransformDTWAligner::DTWThread::run()
+{
+    DTWScheduler::Admission admission(m_bytes, &m_abandoned);
+    if (!admission.isAdmitted()) {
+        return;
+    }
+    m_alignment = m_job();
+}
+
+void
+TransformDTWAligner::DTWThread::abandon()
+{
+    m_abandoned = true;
+    DTWScheduler::getInstance()->interrupt();
 }
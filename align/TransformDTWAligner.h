@@ -20,10 +20,14 @@
 
 #include "transform/Transform.h"
 #include "svcore/data/model/Path.h"
+#include "base/Thread.h"
+#include "base/Event.h"
 
-#include <functional>
+#include <QElapsedTimer>
 
-#include <QMutex>
+#include <atomic>
+#include <functional>
+#include <memory>
 
 class AlignmentModel;
 class Document;
@@ -38,6 +42,11 @@ public:
         RiseFall
     };
 
+    enum DTWStrategy {
+        Exact,
+        Multiscale
+    };
+
     /**
      * Create a TransformDTWAligner that runs the given transform on
      * both models and feeds the resulting values into the given DTW
@@ -84,22 +93,105 @@ public:
     // Destroy the aligner, cleanly cancelling any ongoing alignment
     ~TransformDTWAligner();
 
+    /**
+     * Set the band within which the DTW cost matrix is calculated for
+     * whole-sequence alignment. The default is unconstrained. This
+     * must be called before begin() in order to have any effect.
+     */
+    void setBand(DTWBand band);
+
+    /**
+     * Set whether to use exact DTW or the approximate multiscale
+     * coarse-to-fine method (see MultiscaleDTW), whose cost is close
+     * to linear in the number of transform output events and which
+     * is therefore suitable for long recordings. The band set with
+     * setBand() applies only to Exact. The default is Exact. This
+     * must be called before begin() in order to have any effect.
+     */
+    void setStrategy(DTWStrategy strategy);
+
+    /**
+     * Set whether to run an online DTW (see OnlineDTW) on the
+     * transform outputs while the transforms are still running, and
+     * publish its provisional path to the alignment model as it
+     * goes. The provisional path is replaced by the result of the
+     * full alignment when the transforms are complete. This gives a
+     * usable alignment early on for long recordings, provided the
+     * transform returns its features progressively. It does not
+     * apply to subsequence alignment. The default is false. This
+     * must be called before begin() in order to have any effect.
+     */
+    void setOnline(bool online);
+
     void begin() override;
 
     static bool isAvailable();
 
 private slots:
     void completionChanged(ModelId);
+    void dtwFinished();
 
 private:
+    /**
+     * Thread that runs a single DTW calculation once the
+     * DTWScheduler has admitted it.
+     */
+    class DTWThread : public Thread
+    {
+    public:
+        typedef std::function<std::vector<size_t>()> Job;
+        
+        DTWThread(size_t bytes, Job job) :
+            Thread(Thread::NonRTThread),
+            m_bytes(bytes),
+            m_job(job),
+            m_abandoned(false) { }
+
+        void run() override;
+
+        /**
+         * Give up the job if it is still waiting for admission. A
+         * DTW that has already started runs to completion.
+         */
+        void abandon();
+
+        std::vector<size_t> getAlignment() const {
+            return m_alignment;
+        }
+
+    private:
+        size_t m_bytes;
+        Job m_job;
+        std::vector<size_t> m_alignment;
+        std::atomic<bool> m_abandoned;
+    };
+    
     bool performAlignment();
     bool performAlignmentMagnitude();
     bool performAlignmentRiseFall();
 
+    // How far through one output model the online alignment has
+    // read: the frame of the last event consumed, and all the events
+    // consumed at that frame, so that one arriving later at the same
+    // frame is still picked up
+    struct FetchCursor {
+        bool started = false;
+        sv_frame_t frame = 0;
+        EventVector atFrame;
+    };
+
+    // Fetch all the events of the model, or, if a cursor is given,
+    // only those not yet consumed according to it, advancing it past
+    // them
     bool getValuesFrom(ModelId modelId,
                        std::vector<sv_frame_t> &frames,
                        std::vector<double> &values,
-                       sv_frame_t &resolution);
+                       sv_frame_t &resolution,
+                       FetchCursor *cursor = nullptr);
+
+    void updateOnlineAlignment();
+
+    void startDTW(size_t bytes, DTWThread::Job job);
 
     Path makePath(const std::vector<size_t> &alignment,
                   const std::vector<sv_frame_t> &refFrames,
@@ -115,12 +207,40 @@ private:
     ModelId m_alignmentModel;
     Transform m_transform;
     DTWType m_dtwType;
+    DTWStrategy m_strategy;
     bool m_subsequence;
+    DTWBand m_band;
     bool m_incomplete;
     MagnitudePreprocessor m_magnitudePreprocessor;
     RiseFallPreprocessor m_riseFallPreprocessor;
-
-    static QMutex m_dtwMutex;
+    DTWThread *m_dtwThread;
+    std::vector<sv_frame_t> m_refFrames;
+    std::vector<sv_frame_t> m_otherFrames;
+    sv_frame_t m_resolution;
+
+    // Provisional alignment state, used only while the transforms
+    // are running and only if online alignment is enabled. The
+    // frame vectors hold the frames of all events consumed so far,
+    // and the last values are the most recent raw value from each
+    // model, needed as the predecessor for the rise/fall
+    // preprocessor. Publishing the path copies the whole of it, so
+    // it is done at most once per publishInterval; the final path
+    // replaces it when the transforms are complete.
+    struct OnlineState {
+        std::unique_ptr<OnlineDTW<double>> magnitude;
+        std::unique_ptr<OnlineDTW<RiseFallDTW::Value>> riseFall;
+        FetchCursor refCursor;
+        FetchCursor otherCursor;
+        std::vector<sv_frame_t> refFrames;
+        std::vector<sv_frame_t> otherFrames;
+        double lastRefValue = 0.0;
+        double lastOtherValue = 0.0;
+        sv_frame_t resolution = 0;
+        size_t published = 0;
+        QElapsedTimer sincePublished;
+    };
+    bool m_online;
+    OnlineState m_onlineState;
 };
 
 #endif
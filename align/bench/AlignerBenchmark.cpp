@@ -0,0 +1,348 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+/*
+    End-to-end benchmark for the aligners available through Align.
+    A reference recording is synthesised as a sequence of harmonic
+    tones of random pitch and length, and a second recording plays
+    the same tones with a smoothly varying tempo, so that the true
+    mapping between the two is known exactly. Each alignment type is
+    then run against the pair through Align::alignModel, and the
+    time taken, the peak resident memory and the error of the
+    resulting alignment against the known warp are reported as CSV.
+
+    Each alignment type runs in its own child process so that peak
+    memory can be attributed to it. The benchmark uses separate
+    application settings and disables the alignment cache, so it
+    does not disturb, or benefit from, a user's own configuration.
+
+    This must be built within the Sonic Visualiser source tree, next
+    to the svcore, svgui and svapp libraries that it links against.
+
+    Usage: aligner-benchmark [duration-seconds [alignment-program]]
+
+    The external program alignment type is only run if a program is
+    given.
+*/
+
+#include "align/Align.h"
+
+#include "framework/Document.h"
+
+#include "data/model/ReadOnlyWaveFileModel.h"
+#include "data/model/AlignmentModel.h"
+#include "data/fileio/WavFileWriter.h"
+#include "data/fileio/FileSource.h"
+
+#include <QApplication>
+#include <QProcess>
+#include <QEventLoop>
+#include <QTimer>
+#include <QTemporaryDir>
+#include <QElapsedTimer>
+#include <QStringList>
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+static const sv_samplerate_t sampleRate = 22050;
+
+// Give up on any one alignment after this long
+static const int timeoutMs = 20 * 60 * 1000;
+
+struct Note {
+    double frequency;
+    double duration;
+};
+
+/**
+ * The known warp, as a list of corresponding onset times in the
+ * reference and the other recording. Between onsets the mapping is
+ * linear, as each note is simply played for a different duration.
+ */
+struct Warp {
+    vector<double> referenceOnsets;
+    vector<double> otherOnsets;
+
+    double toReference(double otherTime) const {
+        size_t n = otherOnsets.size();
+        for (size_t i = 1; i < n; ++i) {
+            if (otherOnsets[i] >= otherTime) {
+                double p = (otherTime - otherOnsets[i-1]) /
+                    (otherOnsets[i] - otherOnsets[i-1]);
+                return referenceOnsets[i-1] +
+                    p * (referenceOnsets[i] - referenceOnsets[i-1]);
+            }
+        }
+        return referenceOnsets.empty() ? 0.0 : referenceOnsets[n-1];
+    }
+};
+
+static vector<Note>
+makeNotes(double totalDuration)
+{
+    std::mt19937 random { 42 };
+    std::uniform_real_distribution<double> duration(0.15, 0.6);
+    std::uniform_int_distribution<int> pitch(48, 76);
+    vector<Note> notes;
+    double t = 0.0;
+    while (t < totalDuration) {
+        Note n { 440.0 * pow(2.0, (pitch(random) - 69) / 12.0),
+                 duration(random) };
+        notes.push_back(n);
+        t += n.duration;
+    }
+    return notes;
+}
+
+static bool
+writeNotes(QString path, const vector<Note> &notes,
+           const vector<double> &stretch)
+{
+    vector<float> samples;
+    for (size_t i = 0; i < notes.size(); ++i) {
+        sv_frame_t n = sv_frame_t(round(notes[i].duration * stretch[i] *
+                                        sampleRate));
+        double w = 2.0 * M_PI * notes[i].frequency / sampleRate;
+        for (sv_frame_t j = 0; j < n; ++j) {
+            double env = exp(-3.0 * double(j) / double(n));
+            double v = 0.0;
+            for (int h = 1; h <= 4; ++h) {
+                v += sin(w * h * double(j)) / h;
+            }
+            samples.push_back(float(0.3 * env * v));
+        }
+    }
+    
+    WavFileWriter writer(path, sampleRate, 1,
+                         WavFileWriter::WriteToTarget);
+    if (!writer.isOK()) {
+        cerr << "ERROR: Failed to open " << path << " for writing: "
+             << writer.getError() << endl;
+        return false;
+    }
+    const float *channels[1] = { samples.data() };
+    writer.writeSamples(channels, sv_frame_t(samples.size()));
+    writer.close();
+    return writer.isOK();
+}
+
+static bool
+generate(QString dir, double duration, Warp &warp)
+{
+    vector<Note> notes = makeNotes(duration);
+
+    vector<double> unit(notes.size(), 1.0), stretch;
+    for (size_t i = 0; i < notes.size(); ++i) {
+        stretch.push_back(1.0 + 0.3 * sin(double(i) / 15.0));
+    }
+
+    double rt = 0.0, ot = 0.0;
+    for (size_t i = 0; i < notes.size(); ++i) {
+        warp.referenceOnsets.push_back(rt);
+        warp.otherOnsets.push_back(ot);
+        rt += round(notes[i].duration * sampleRate) / sampleRate;
+        ot += round(notes[i].duration * stretch[i] * sampleRate) / sampleRate;
+    }
+    warp.referenceOnsets.push_back(rt);
+    warp.otherOnsets.push_back(ot);
+
+    return writeNotes(dir + "/reference.wav", notes, unit) &&
+        writeNotes(dir + "/other.wav", notes, stretch);
+}
+
+static ModelId
+load(QString path)
+{
+    auto model = std::make_shared<ReadOnlyWaveFileModel>(FileSource(path));
+    if (!model->isOK()) {
+        cerr << "ERROR: Failed to load " << path << endl;
+        return {};
+    }
+    while (!model->isReady()) {
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 50);
+    }
+    return ModelById::add(model);
+}
+
+static long
+getPeakMemoryKB()
+{
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return long(usage.ru_maxrss / 1024); // reported in bytes on macOS
+#else
+        return long(usage.ru_maxrss);
+#endif
+    }
+#endif
+    return -1;
+}
+
+/**
+ * Run a single alignment type and print one CSV line for it. This
+ * is what each child process does.
+ */
+static int
+runType(Align::AlignmentType type, double duration, QString program)
+{
+    QString tag = Align::getAlignmentTypeTag(type);
+    
+    QTemporaryDir dir;
+    Warp warp;
+    if (!dir.isValid() || !generate(dir.path(), duration, warp)) {
+        return 1;
+    }
+
+    ModelId reference = load(dir.path() + "/reference.wav");
+    ModelId other = load(dir.path() + "/other.wav");
+    if (reference.isNone() || other.isNone()) {
+        return 1;
+    }
+
+    Document doc;
+    doc.setMainModel(reference);
+    doc.addNonDerivedModel(other);
+
+    Align::setAlignmentPreference(type);
+    Align::setPreferredAlignmentProgram(program);
+    Align::setUseAlignmentCache(false);
+
+    Align align;
+    if (!align.canAlign()) {
+        cout << tag << "," << duration << ",,,,,unavailable" << endl;
+        return 0;
+    }
+
+    QEventLoop loop;
+    ModelId alignmentId;
+    QString error;
+
+    QObject::connect(&align, &Align::alignmentComplete,
+                     [&](ModelId id) {
+                         alignmentId = id;
+                         loop.quit();
+                     });
+    QObject::connect(&align, &Align::alignmentFailed,
+                     [&](ModelId, QString text) {
+                         error = text;
+                         loop.quit();
+                     });
+    QTimer::singleShot(timeoutMs, &loop, [&]() {
+                                             error = "timed out";
+                                             loop.quit();
+                                         });
+
+    QElapsedTimer timer;
+    timer.start();
+    align.alignModel(&doc, reference, other);
+    if (alignmentId.isNone() && error == "") {
+        loop.exec();
+    }
+    qint64 ms = timer.elapsed();
+
+    auto alignment = ModelById::getAs<AlignmentModel>(alignmentId);
+    if (!alignment) {
+        cout << tag << "," << duration << "," << ms << ","
+             << getPeakMemoryKB() << ",,,failed: " << error << endl;
+        return 0;
+    }
+
+    // Compare against the known warp every 50ms through the other
+    // recording
+    double total = 0.0, maximum = 0.0;
+    int count = 0;
+    double otherDuration = warp.otherOnsets.back();
+    for (double t = 0.0; t < otherDuration; t += 0.05) {
+        sv_frame_t frame = sv_frame_t(round(t * sampleRate));
+        double aligned = double(alignment->toReference(frame)) / sampleRate;
+        double e = fabs(aligned - warp.toReference(t)) * 1000.0;
+        total += e;
+        maximum = std::max(maximum, e);
+        ++count;
+    }
+
+    cout << tag << "," << duration << "," << ms << ","
+         << getPeakMemoryKB() << ","
+         << (count > 0 ? total / count : 0.0) << "," << maximum
+         << ",ok" << endl;
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    
+    QApplication app(argc, argv);
+    QApplication::setOrganizationName("sv-aligner-benchmark");
+    QApplication::setApplicationName("aligner-benchmark");
+
+    QStringList args = app.arguments();
+    
+    if (args.size() > 3 && args[1] == "--type") {
+        return runType(Align::getAlignmentTypeForTag(args[2]),
+                       args[3].toDouble(),
+                       args.size() > 4 ? args[4] : QString());
+    }
+
+    double duration = 60.0;
+    if (args.size() > 1) {
+        duration = args[1].toDouble();
+    }
+    QString program;
+    if (args.size() > 2) {
+        program = args[2];
+    }
+
+    cout << "type,duration,ms,peak-kb,mean-error-ms,max-error-ms,status"
+         << endl;
+
+    for (int i = int(Align::LinearAlignment);
+         i <= int(Align::LastAlignmentType); ++i) {
+
+        Align::AlignmentType type = Align::AlignmentType(i);
+        if (type == Align::ExternalProgramAlignment && program == "") {
+            continue;
+        }
+        
+        QProcess child;
+        child.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        child.start(args[0], { "--type", Align::getAlignmentTypeTag(type),
+                               QString("%1").arg(duration), program });
+        if (!child.waitForFinished(-1)) {
+            cerr << "ERROR: Failed to run child for type "
+                 << Align::getAlignmentTypeTag(type) << endl;
+            continue;
+        }
+        cout << child.readAllStandardOutput().constData() << std::flush;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,299 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+/*
+    Benchmark and regression check for the DTW engines used by
+    TransformDTWAligner. MagnitudeDTW and RiseFallDTW are run, exact,
+    banded, multiscale and online, on synthetic pitch-like sequences
+    of increasing length, in which the second sequence is the first
+    played with a known, smoothly varying time warp. For each case
+    the benchmark reports the time taken, the peak resident memory of
+    the process that ran it, and the mean and maximum error of the
+    resulting path against the known warp, in sequence elements.
+
+    Each case is run in a child process, where available, so that
+    its peak memory can be measured separately.
+
+    The exit status is non-zero if any path is less accurate than the
+    regression tolerance, so the benchmark can be run as a check.
+
+    Usage: alignment-benchmark [maxlength]
+*/
+
+#include "align/DTW.h"
+
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <random>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+using std::vector;
+using std::string;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+// Maximum acceptable mean error, as a proportion of the sequence
+// length, before a case is reported as a regression
+static const double meanErrorTolerance = 0.02;
+
+struct Warp {
+    // For each element of the warped sequence, the element of the
+    // original that it was taken from
+    vector<size_t> source;
+};
+
+static vector<double>
+makePitchSequence(size_t n, std::mt19937 &random)
+{
+    // A sequence of "notes" of random length and pitch, with a
+    // little noise, resembling a pitch track
+    std::uniform_int_distribution<int> noteLength(5, 40);
+    std::uniform_int_distribution<int> notePitch(48, 72);
+    std::normal_distribution<double> noise(0.0, 0.1);
+    vector<double> s;
+    while (s.size() < n) {
+        int len = noteLength(random);
+        double pitch = notePitch(random);
+        for (int i = 0; i < len && s.size() < n; ++i) {
+            s.push_back(pitch + noise(random));
+        }
+    }
+    return s;
+}
+
+static vector<double>
+applyWarp(const vector<double> &s, Warp &warp, std::mt19937 &random)
+{
+    // Play back at a speed varying smoothly between about 0.7 and
+    // 1.3 times the original
+    std::normal_distribution<double> noise(0.0, 0.1);
+    vector<double> w;
+    warp.source.clear();
+    double pos = 0.0;
+    double n = double(s.size());
+    for (size_t k = 0; pos < n - 1.0; ++k) {
+        size_t i = size_t(pos);
+        w.push_back(s[i] + noise(random));
+        warp.source.push_back(i);
+        pos += 1.0 + 0.3 * sin(double(k) / (n / 12.0));
+    }
+    return w;
+}
+
+static vector<RiseFallDTW::Value>
+toRiseFall(const vector<double> &s)
+{
+    vector<RiseFallDTW::Value> r;
+    double prev = 0.0;
+    for (double curr: s) {
+        double d = curr - prev;
+        if (std::abs(d) < 0.5) {
+            r.push_back({ RiseFallDTW::Direction::None, 0.0 });
+        } else if (d > 0.0) {
+            r.push_back({ RiseFallDTW::Direction::Up, d });
+        } else {
+            r.push_back({ RiseFallDTW::Direction::Down, -d });
+        }
+        prev = curr;
+    }
+    return r;
+}
+
+struct Result {
+    double ms;
+    double meanError;
+    double maxError;
+    size_t pathLength;
+};
+
+static Result
+evaluate(const vector<size_t> &path, const Warp &warp, double ms)
+{
+    Result r { ms, 0.0, 0.0, path.size() };
+    if (path.empty()) {
+        r.meanError = r.maxError = HUGE_VAL;
+        return r;
+    }
+    double total = 0.0;
+    for (size_t i = 0; i < path.size() && i < warp.source.size(); ++i) {
+        double e = std::abs(double(path[i]) - double(warp.source[i]));
+        total += e;
+        r.maxError = std::max(r.maxError, e);
+    }
+    r.meanError = total / double(path.size());
+    return r;
+}
+
+template <typename F>
+static double
+timeMs(F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+static const char *const engines[] = {
+    "exact", "banded", "multiscale", "online"
+};
+
+template <typename DTWType, typename Value>
+static vector<size_t>
+runEngine(string engine, const vector<Value> &s1, const vector<Value> &s2)
+{
+    if (engine == "online") {
+        // Feed both sequences in small increments, as they would
+        // arrive from a running transform
+        auto online = DTWType::makeOnlineDTW();
+        size_t step = 64;
+        size_t n1 = s1.size(), n2 = s2.size();
+        for (size_t i = 0, j = 0; i < n1 || j < n2; i += step, j += step) {
+            vector<Value> m1(s1.begin() + std::min(i, n1),
+                             s1.begin() + std::min(i + step, n1));
+            vector<Value> m2(s2.begin() + std::min(j, n2),
+                             s2.begin() + std::min(j + step, n2));
+            online.extend(m1, m2);
+        }
+        return online.getPath();
+    }
+
+    DTWBand band;
+    if (engine == "banded") {
+        band = DTWBand(DTWBand::Type::Relative, 0.1);
+    }
+    DTWType dtw(band);
+    dtw.setMultiscale(engine == "multiscale");
+    return dtw.alignSequences(s1, s2);
+}
+
+static Result
+runCase(string type, string engine, size_t n)
+{
+    std::mt19937 random { unsigned(n) };
+    vector<double> s1 = makePitchSequence(n, random);
+    Warp warp;
+    vector<double> s2 = applyWarp(s1, warp, random);
+
+    vector<size_t> path;
+    double ms = 0.0;
+
+    if (type == "magnitude") {
+        ms = timeMs([&]() {
+                        path = runEngine<MagnitudeDTW, double>(engine, s1, s2);
+                    });
+    } else {
+        vector<RiseFallDTW::Value> r1 = toRiseFall(s1), r2 = toRiseFall(s2);
+        ms = timeMs([&]() {
+                        path = runEngine<RiseFallDTW, RiseFallDTW::Value>
+                            (engine, r1, r2);
+                    });
+    }
+
+    return evaluate(path, warp, ms);
+}
+
+static bool
+runCaseMeasured(string type, string engine, size_t n,
+                Result &result, long &peakKB)
+{
+    peakKB = -1;
+    
+#ifndef _WIN32
+    int fds[2];
+    if (pipe(fds) == 0) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            Result r = runCase(type, engine, n);
+            ssize_t written = write(fds[1], &r, sizeof(r));
+            _exit(written == ssize_t(sizeof(r)) ? 0 : 1);
+        }
+        close(fds[1]);
+        if (pid > 0) {
+            bool ok = (read(fds[0], &result, sizeof(result)) ==
+                       ssize_t(sizeof(result)));
+            close(fds[0]);
+            int status = 0;
+            struct rusage usage;
+            if (wait4(pid, &status, 0, &usage) == pid) {
+                peakKB = usage.ru_maxrss;
+#ifdef __APPLE__
+                peakKB /= 1024; // reported in bytes on macOS
+#endif
+            }
+            return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+        close(fds[0]);
+    }
+#endif
+
+    result = runCase(type, engine, n);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    size_t maxLength = 16000;
+    if (argc > 1) {
+        maxLength = size_t(atol(argv[1]));
+    }
+
+    cout << "type,engine,length,ms,peak-kb,mean-error,max-error,status"
+         << endl;
+
+    bool ok = true;
+
+    for (string type: { "magnitude", "risefall" }) {
+        for (const char *engine: engines) {
+            for (size_t n = 1000; n <= maxLength; n *= 2) {
+
+                // Exact unconstrained DTW has a quadratic cost matrix,
+                // so don't let it dominate the run time
+                if (string(engine) == "exact" && n > 8000) {
+                    continue;
+                }
+
+                Result r;
+                long peakKB = -1;
+                if (!runCaseMeasured(type, engine, n, r, peakKB)) {
+                    cerr << "ERROR: case " << type << "/" << engine
+                         << "/" << n << " failed to run" << endl;
+                    ok = false;
+                    continue;
+                }
+
+                bool pass = (r.meanError <= meanErrorTolerance * double(n));
+                if (!pass) ok = false;
+                
+                cout << type << "," << engine << "," << n << ","
+                     << r.ms << "," << peakKB << ","
+                     << r.meanError << "," << r.maxError << ","
+                     << (pass ? "ok" : "REGRESSION") << endl;
+            }
+        }
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,113 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+/*
+    Compare the std::function-based DTW engine with FlatDTW, on
+    synthetic magnitude sequences of increasing length. Reports the
+    time taken by each and checks that they produce identical
+    alignments.
+
+    Usage: dtw-benchmark [maxlength]
+*/
+
+#include "align/DTW.h"
+
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cmath>
+
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+struct AbsMetric {
+    static double distance(const double &a, const double &b) {
+        return std::abs(b - a);
+    }
+};
+
+static vector<double>
+makeSequence(size_t n, double rate)
+{
+    vector<double> s(n, 0.0);
+    for (size_t i = 0; i < n; ++i) {
+        s[i] = 60.0 + 12.0 * sin(double(i) * rate) + double(rand() % 3);
+    }
+    return s;
+}
+
+template <typename F>
+static double
+timeMs(F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    size_t maxLength = 8000;
+    if (argc > 1) {
+        maxLength = size_t(atol(argv[1]));
+    }
+
+    srand(0);
+
+    DTW<double> functionDTW([](const double &a, const double &b) {
+                                return std::abs(b - a);
+                            });
+    FlatDTW<double, AbsMetric> flatDTW;
+
+    cout << "length,mode,function-ms,flat-ms,speedup" << endl;
+
+    bool ok = true;
+    
+    for (size_t n = 500; n <= maxLength; n *= 2) {
+
+        // The toAlign sequence is the reference played 25% faster
+        vector<double> s1 = makeSequence(n, 0.01);
+        vector<double> s2 = makeSequence((n * 4) / 5, 0.0125);
+
+        for (int sub = 0; sub < 2; ++sub) {
+
+            vector<size_t> a1, a2;
+            
+            double t1 = timeMs([&]() {
+                                   a1 = (sub ?
+                                         functionDTW.alignSubsequence(s1, s2) :
+                                         functionDTW.alignSequences(s1, s2));
+                               });
+            double t2 = timeMs([&]() {
+                                   a2 = (sub ?
+                                         flatDTW.alignSubsequence(s1, s2) :
+                                         flatDTW.alignSequences(s1, s2));
+                               });
+
+            cout << n << "," << (sub ? "subsequence" : "sequence") << ","
+                 << t1 << "," << t2 << "," << (t2 > 0.0 ? t1 / t2 : 0.0)
+                 << endl;
+            
+            if (a1 != a2) {
+                cerr << "ERROR: alignments differ at length " << n << endl;
+                ok = false;
+            }
+        }
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,24 @@
+
+TEMPLATE = app
+
+CONFIG += console warn_on stl rtti exceptions c++14
+CONFIG -= app_bundle
+QT += network xml gui widgets
+
+TARGET = aligner-benchmark
+
+# Expects to be built from within the Sonic Visualiser source tree,
+# with svapp as a subdirectory alongside svcore and svgui
+
+exists(../../config.pri) {
+    include(../../config.pri)
+}
+
+INCLUDEPATH += ../.. ../../../svcore ../../../svgui ../../../bqaudioio ../../../piper-cpp
+LIBS += -L../.. -L../../../svgui -L../../../svcore -lsvapp -lsvgui -lsvcore $$LIBS
+PRE_TARGETDEPS += ../../libsvapp.a
+
+OBJECTS_DIR = o
+MOC_DIR = o
+
+SOURCES += AlignerBenchmark.cpp
@@ -0,0 +1,12 @@
+
+TEMPLATE = app
+
+CONFIG += console warn_on stl c++11
+CONFIG -= qt app_bundle
+
+TARGET = dtw-benchmark
+
+INCLUDEPATH += ../..
+OBJECTS_DIR = o
+
+SOURCES += DTWBenchmark.cpp
@@ -35,15 +35,42 @@
 #include "bqvec/VectorOps.h"
 
 using breakfastquay::v_zero_channels;
+using breakfastquay::v_zero;
+using breakfastquay::v_add;
 
 #include <iostream>
 #include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 
 //#define DEBUG_AUDIO_PLAY_SOURCE 1
 //#define DEBUG_AUDIO_PLAY_SOURCE_PLAYING 1
 
 static const int DEFAULT_RING_BUFFER_SIZE = 131071;
 
+// Low-latency mode tuning constants
+static const double LOW_LATENCY_BASE_MARGIN = 2.0;
+static const double LOW_LATENCY_MAX_MARGIN = 32.0;
+static const double LOW_LATENCY_INITIAL_WAKEUP = 0.02; // sec
+static const double LOW_LATENCY_WAKEUP_DECAY = 0.9995; // per wakeup
+static const double LOW_LATENCY_SHRINK_HOLDOFF = 5.0; // sec
+static const double LOW_LATENCY_CALM_PERIOD = 10.0; // sec
+
+// Prefetch cache limits
+static const double PREFETCH_DURATION = 0.5; // sec per cue
+static const int PREFETCH_MAX_CUES = 32;
+static const double LOOP_CACHE_MAX_DURATION = 60.0; // sec in total
+static const sv_frame_t LOOP_CACHE_MARGIN = 64; // frames, > longest fade/2
+static const sv_frame_t LOOP_CACHE_BUILD_BLOCK = 16384; // frames per pass
+
+static double
+monotonicSeconds()
+{
+    return std::chrono::duration<double>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 AudioCallbackPlaySource::AudioCallbackPlaySource(ViewManagerBase *manager,
                                                  QString clientName) :
     m_viewManager(manager),
@@ -74,6 +101,19 @@ AudioCallbackPlaySource::AudioCallbackPlaySource(ViewManagerBase *manager,
     m_levelsSet(false),
     m_playStartFrame(0),
     m_playStartFramePassed(false),
+    m_prefetchFrame(-1),
+    m_prefetchServed(false),
+    m_loopCacheEnabled(false),
+    m_stale(false),
+    m_staleStart(0),
+    m_staleEnd(0),
+    m_mixThreadCount(1),
+    m_mixWorkerCount(1),
+    m_rendering(false),
+    m_lowLatency(false),
+    m_fillChunkSize(0),
+    m_underruns(0),
+    m_overloads(0),
     m_fillThread(nullptr),
     m_resamplerWrapper(nullptr),
     m_timeStretchWrapper(nullptr),
@@ -111,15 +151,17 @@ AudioCallbackPlaySource::~AudioCallbackPlaySource()
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     cout << "AudioCallbackPlaySource dtor: awakening thread" << endl;
 #endif
-        m_condition.wakeAll();
+        m_fillSignal.signal();
         m_fillThread->wait();
         delete m_fillThread;
     }
 
+    stopMixThreads();
+
     clearModels();
     
     if (m_readBuffers != m_writeBuffers) {
-        delete m_readBuffers;
+        delete m_readBuffers.load();
     }
 
     delete m_writeBuffers;
@@ -160,9 +202,11 @@ AudioCallbackPlaySource::checkWrappers()
     }
     if (!m_auditioningEffectWrapper) {
         m_auditioningEffectWrapper = new EffectWrapper(m_resamplerWrapper);
+        m_auditioningEffectWrapper->setStatistics(&m_statistics);
     }
     if (!m_timeStretchWrapper) {
         m_timeStretchWrapper = new TimeStretchWrapper(m_auditioningEffectWrapper);
+        m_timeStretchWrapper->setStatistics(&m_statistics);
     }
 }
 
@@ -181,6 +225,7 @@ AudioCallbackPlaySource::addModel(ModelId modelId)
     m_mutex.lock();
 
     m_models.insert(modelId);
+    m_statistics.addModel(modelId);
 
     if (model->getEndFrame() > m_lastModelEndFrame) {
         m_lastModelEndFrame = model->getEndFrame();
@@ -278,6 +323,7 @@ AudioCallbackPlaySource::addModel(ModelId modelId)
     }
 
     rebuildRangeLists();
+    prepareMixThreads();
 
     m_mutex.unlock();
 
@@ -309,19 +355,31 @@ AudioCallbackPlaySource::addModel(ModelId modelId)
     cout << "AudioCallbackPlaySource::addModel: awakening thread" << endl;
 #endif
     
-    m_condition.wakeAll();
+    m_fillSignal.signal();
 }
 
 void
-AudioCallbackPlaySource::modelChangedWithin(ModelId, sv_frame_t 
-#ifdef DEBUG_AUDIO_PLAY_SOURCE
-                                            startFrame
-#endif
-                                            , sv_frame_t endFrame)
+AudioCallbackPlaySource::modelChangedWithin(ModelId, sv_frame_t startFrame,
+                                            sv_frame_t endFrame)
 {
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     SVDEBUG << "AudioCallbackPlaySource::modelChangedWithin(" << startFrame << "," << endFrame << ")" << endl;
 #endif
+    // Don't wait for m_mutex here, as models may change often while
+    // loading or recording: the cached audio over the changed range
+    // is discarded when the caches are next used
+    {
+        QMutexLocker locker(&m_staleMutex);
+        if (!m_stale) {
+            m_staleStart = startFrame;
+            m_staleEnd = endFrame;
+            m_stale = true;
+        } else {
+            m_staleStart = std::min(m_staleStart, startFrame);
+            m_staleEnd = std::max(m_staleEnd, endFrame);
+        }
+    }
+    
     if (endFrame > m_lastModelEndFrame) {
         m_lastModelEndFrame = endFrame;
         rebuildRangeLists();
@@ -346,6 +404,7 @@ AudioCallbackPlaySource::removeModel(ModelId modelId)
                this, SLOT(modelChangedWithin(ModelId, sv_frame_t, sv_frame_t)));
 
     m_models.erase(modelId);
+    m_statistics.removeModel(modelId);
 
     sv_frame_t lastEnd = 0;
     for (ModelId otherId: m_models) {
@@ -434,6 +493,11 @@ AudioCallbackPlaySource::clearRingBuffers(bool haveLock, int count)
     }
 
     m_audioGenerator->reset();
+
+    // Whatever invalidated the buffered audio has invalidated the
+    // prefetched and loop-cached audio too
+    m_prefetch.clear();
+    clearLoopCache();
     
 //    cout << "AudioCallbackPlaySource::clearRingBuffers: Created "
 //              << count << " write buffers" << endl;
@@ -453,33 +517,11 @@ AudioCallbackPlaySource::play(sv_frame_t startFrame)
         return;
     }
     
-    if (m_viewManager->getPlaySelectionMode() &&
-        !m_viewManager->getSelections().empty()) {
-
-#ifdef DEBUG_AUDIO_PLAY_SOURCE
-        cout << "AudioCallbackPlaySource::play: constraining frame " << startFrame << " to selection = ";
-#endif
-
-        startFrame = m_viewManager->constrainFrameToSelection(startFrame);
-
-#ifdef DEBUG_AUDIO_PLAY_SOURCE
-        cout << startFrame << endl;
-#endif
-
-    } else {
-        if (startFrame < 0) {
-            startFrame = 0;
-        }
-        if (startFrame >= m_lastModelEndFrame) {
-            startFrame = 0;
-        }
-    }
-
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
-    cout << "play(" << startFrame << ") -> aligned playback model ";
+    cout << "play(" << startFrame << ") -> playback frame ";
 #endif
 
-    startFrame = m_viewManager->alignReferenceToPlaybackFrame(startFrame);
+    startFrame = getPlaybackStartFrame(startFrame);
 
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     cout << startFrame << endl;
@@ -507,6 +549,60 @@ AudioCallbackPlaySource::play(sv_frame_t startFrame)
         }
     }
 
+    // If we have audio ready mixed from here, put it straight into
+    // the read buffers so that playback can begin at once, and leave
+    // the fill thread to carry on from where it ends
+
+    m_prefetchServed = false;
+
+    discardStaleCaches();
+    
+    const PrefetchEntry *entry = nullptr;
+    if (m_readBuffers && m_readBuffers == m_writeBuffers) {
+        entry = findPrefetch(startFrame, 0);
+    }
+    
+    if (entry) {
+
+        int channels = getTargetChannelCount();
+        sv_frame_t n = entry->length;
+        for (int c = 0; c < channels; ++c) {
+            RingBuffer<float> *rb = getReadRingBuffer(c);
+            if (!rb) {
+                n = 0;
+                break;
+            }
+            n = std::min(n, sv_frame_t(rb->getWriteSpace()));
+        }
+        sv_frame_t gbs = m_audioGenerator->getBlockSize();
+        n = (n / gbs) * gbs;
+
+        if (n > 0) {
+            
+            m_prefetchScratch.resize(channels);
+            m_prefetchPtrs.resize(channels);
+            for (int c = 0; c < channels; ++c) {
+                m_prefetchScratch[c].assign(n, 0.f);
+                m_prefetchPtrs[c] = m_prefetchScratch[c].data();
+            }
+
+            // This finds the whole of its first chunk in the cache
+            sv_frame_t f = startFrame;
+            sv_frame_t got = mixModels(f, n, m_prefetchPtrs.data());
+
+            for (int c = 0; c < channels; ++c) {
+                getReadRingBuffer(c)->write(m_prefetchPtrs[c], int(got));
+            }
+            m_readBufferFill = m_writeBufferFill = f;
+            m_prefetchServed = true;
+
+#ifdef DEBUG_AUDIO_PLAY_SOURCE
+            cout << "AudioCallbackPlaySource::play: served " << got
+                 << " prefetched frames from " << startFrame << endl;
+#endif
+        }
+    }
+
     m_mutex.unlock();
 
     m_audioGenerator->reset();
@@ -527,7 +623,7 @@ AudioCallbackPlaySource::play(sv_frame_t startFrame)
     cout << "AudioCallbackPlaySource::play: awakening thread" << endl;
 #endif
 
-    m_condition.wakeAll();
+    m_fillSignal.signal();
     if (changed) {
         emit playStatusChanged(m_playing);
         emit activity(tr("Play from %1").arg
@@ -536,6 +632,40 @@ AudioCallbackPlaySource::play(sv_frame_t startFrame)
     }
 }
 
+sv_frame_t
+AudioCallbackPlaySource::getPlaybackStartFrame(sv_frame_t startFrame) const
+{
+    if (m_viewManager->getPlaySelectionMode() &&
+        !m_viewManager->getSelections().empty()) {
+
+        startFrame = m_viewManager->constrainFrameToSelection(startFrame);
+
+    } else {
+        if (startFrame < 0) {
+            startFrame = 0;
+        }
+        if (startFrame >= m_lastModelEndFrame) {
+            startFrame = 0;
+        }
+    }
+
+    return m_viewManager->alignReferenceToPlaybackFrame(startFrame);
+}
+
+void
+AudioCallbackPlaySource::setPrefetchFrame(sv_frame_t frame)
+{
+    if (frame < 0) {
+        m_prefetchFrame = -1;
+    } else {
+        m_prefetchFrame = getPlaybackStartFrame(frame);
+    }
+
+    // The fill thread will pick this up when it next has nothing else
+    // to do; wake it in case it is waiting with nothing to do
+    m_fillSignal.signal();
+}
+
 void
 AudioCallbackPlaySource::stop()
 {
@@ -549,7 +679,7 @@ AudioCallbackPlaySource::stop()
     cout << "AudioCallbackPlaySource::stop: awakening thread" << endl;
 #endif
 
-    m_condition.wakeAll();
+    m_fillSignal.signal();
     m_lastRetrievalTimestamp = 0;
     if (changed) {
         emit playStatusChanged(m_playing);
@@ -603,8 +733,16 @@ AudioCallbackPlaySource::audioProcessingOverload()
 {
     SVCERR << "Audio processing overload!" << endl;
 
+    m_statistics.recordOverload();
+
     if (!m_playing) return;
 
+    if (m_lowLatency) {
+        // The fill thread will widen the ring buffers in response
+        ++m_overloads;
+        m_fillSignal.signal();
+    }
+
     if (m_auditioningEffectWrapper &&
         m_auditioningEffectWrapper->haveEffect() &&
         !m_auditioningEffectWrapper->isBypassed()) {
@@ -643,6 +781,8 @@ AudioCallbackPlaySource::setSystemPlaybackBlockSize(int size)
         if (m_writeBuffers && !m_writeBuffers->empty()) {
             clearRingBuffers();
         }
+        QMutexLocker locker(&m_mutex);
+        prepareMixThreads();
     }
 }
 
@@ -713,6 +853,23 @@ AudioCallbackPlaySource::getCurrentFrame(RealTime latency_t)
         }
     }
 
+    // Audio held in the time stretcher and the effect chain has also
+    // left the ring buffers without yet being played. Both run at
+    // the device rate
+    sv_frame_t wrapperLatency = 0;
+    if (m_timeStretchWrapper) {
+        wrapperLatency += m_timeStretchWrapper->getLatency();
+    }
+    if (m_auditioningEffectWrapper) {
+        wrapperLatency += m_auditioningEffectWrapper->getLatency();
+    }
+    if (wrapperLatency > 0) {
+        sv_samplerate_t deviceRate = getDeviceSampleRate();
+        if (deviceRate > 0) {
+            inbuffer += int(round(double(wrapperLatency) * rate / deviceRate));
+        }
+    }
+
     sv_frame_t readBufferFill = m_readBufferFill;
     sv_frame_t lastRetrievedBlockSize = m_lastRetrievedBlockSize;
     double lastRetrievalTimestamp = m_lastRetrievalTimestamp;
@@ -942,6 +1099,447 @@ AudioCallbackPlaySource::rebuildRangeLists()
 #endif
 }
 
+bool
+AudioCallbackPlaySource::canPrefetch() const
+{
+    if (m_models.empty() || !m_audioGenerator->getBlockSize()) {
+        return false;
+    }
+
+    // Wave models are mixed afresh from their data for every block,
+    // so a block can be mixed ahead of time and used later without
+    // anything else knowing. Note and synth models can't be, as their
+    // generators track what is sounding from one block to the next
+    for (ModelId modelId: m_models) {
+        auto model = ModelById::get(modelId);
+        if (!model || !model->canPlay()) continue;
+        if (!std::dynamic_pointer_cast<DenseTimeValueModel>(model)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::vector<AudioCallbackPlaySource::PrefetchCue>
+AudioCallbackPlaySource::getPrefetchCues() const
+{
+    std::vector<PrefetchCue> cues;
+
+    sv_samplerate_t rate = getSourceSampleRate();
+    if (rate == 0 || m_lastModelEndFrame == 0) return cues;
+
+    sv_frame_t gbs = m_audioGenerator->getBlockSize();
+    sv_frame_t length = sv_frame_t(round(PREFETCH_DURATION * rate));
+    length = std::max(gbs, (length / gbs) * gbs);
+
+    auto add = [&](sv_frame_t frame, sv_frame_t fadeIn, sv_frame_t end) {
+        if (frame < 0 || end <= frame) return;
+        if (int(cues.size()) >= PREFETCH_MAX_CUES) return;
+        for (const auto &c: cues) {
+            if (c.frame == frame && c.fadeIn == fadeIn) return;
+        }
+        cues.push_back({ frame, fadeIn, std::min(length, end - frame) });
+    };
+
+    sv_frame_t hint = m_prefetchFrame;
+    if (hint >= 0) {
+        add(hint, 0, m_lastModelEndFrame);
+    }
+    
+    bool constrained = (m_viewManager->getPlaySelectionMode() &&
+                        !m_viewManager->getSelections().empty());
+
+    if (!constrained) {
+        // Playback from the start, and looping back to it, have no
+        // fade
+        add(0, 0, m_lastModelEndFrame);
+        return cues;
+    }
+
+    // Starting playback within a selection has no fade, but moving
+    // into one from elsewhere, or looping back to it, has a fade-in
+    // that depends on the selection size in the same way as in
+    // mixModels
+    
+    for (const auto &sel: m_viewManager->getSelections()) {
+        sv_frame_t sf = m_viewManager->alignReferenceToPlaybackFrame
+            (sel.getStartFrame());
+        sv_frame_t ef = m_viewManager->alignReferenceToPlaybackFrame
+            (sel.getEndFrame());
+        sv_frame_t size = ef - sf;
+        sv_frame_t fadeIn = 50;
+        if (size < 100) fadeIn = 0;
+        else if (size < 300) fadeIn = 10;
+        add(sf, 0, ef);
+        if (fadeIn > 0) add(sf, fadeIn, ef);
+    }
+
+    return cues;
+}
+
+const AudioCallbackPlaySource::PrefetchEntry *
+AudioCallbackPlaySource::findPrefetch(sv_frame_t frame, sv_frame_t fadeIn)
+{
+    for (const auto &e: m_prefetch) {
+        if (e.frame == frame && e.fadeIn == fadeIn) {
+            if (int(e.data.size()) != getTargetChannelCount()) {
+                return nullptr;
+            }
+            return &e;
+        }
+    }
+    
+    return nullptr;
+}
+
+bool
+AudioCallbackPlaySource::updatePrefetchCache()
+{
+    discardStaleCaches();
+
+    if (!canPrefetch()) {
+        m_prefetch.clear();
+        return false;
+    }
+
+    std::vector<PrefetchCue> cues = getPrefetchCues();
+
+    auto wanted = [&](const PrefetchEntry &e) {
+        for (const auto &c: cues) {
+            if (c.frame == e.frame && c.fadeIn == e.fadeIn &&
+                c.length == e.length) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    m_prefetch.erase(std::remove_if(m_prefetch.begin(), m_prefetch.end(),
+                                    [&](const PrefetchEntry &e) {
+                                        return !wanted(e);
+                                    }),
+                     m_prefetch.end());
+
+    for (const auto &c: cues) {
+
+        bool have = false;
+        for (const auto &e: m_prefetch) {
+            if (e.frame == c.frame && e.fadeIn == c.fadeIn) {
+                have = true;
+                break;
+            }
+        }
+        if (have) continue;
+
+        int channels = getTargetChannelCount();
+        sv_frame_t lead = c.fadeIn / 2;
+        
+        PrefetchEntry e;
+        e.frame = c.frame;
+        e.fadeIn = c.fadeIn;
+        e.length = c.length;
+        e.data.resize(channels);
+
+        std::vector<float *> ptrs(channels);
+        for (int ch = 0; ch < channels; ++ch) {
+            e.data[ch].resize(lead + c.length, 0.f);
+            ptrs[ch] = e.data[ch].data() + lead;
+        }
+
+        for (ModelId modelId: m_models) {
+            (void) m_audioGenerator->mixModel(modelId, c.frame, c.length,
+                                              ptrs.data(), c.fadeIn, 0);
+        }
+
+#ifdef DEBUG_AUDIO_PLAY_SOURCE
+        cout << "AudioCallbackPlaySource::updatePrefetchCache: mixed "
+             << c.length << " frames at " << c.frame << " with fade-in "
+             << c.fadeIn << endl;
+#endif
+
+        m_prefetch.push_back(std::move(e));
+        return true;
+    }
+
+    return false;
+}
+
+void
+AudioCallbackPlaySource::mixPrefetchedChunks(float **buffers)
+{
+    if (m_prefetch.empty()) return;
+
+    discardStaleCaches();
+    
+    int channels = getTargetChannelCount();
+    
+    auto i = m_mixChunks.begin();
+    while (i != m_mixChunks.end()) {
+
+        const PrefetchEntry *e = nullptr;
+        if (i->fadeOut == 0) {
+            e = findPrefetch(i->start, i->fadeIn);
+        }
+        if (!e || i->size > e->length) {
+            ++i;
+            continue;
+        }
+
+        // The fade-in adds into the end of the preceding chunk. This
+        // is always within the buffers, as mixModels never asks for a
+        // fade-in of more than twice the chunk offset
+        sv_frame_t lead = e->fadeIn / 2;
+        for (int c = 0; c < channels; ++c) {
+            v_add(buffers[c] + i->offset - lead, e->data[c].data(),
+                  int(lead + i->size));
+        }
+
+#ifdef DEBUG_AUDIO_PLAY_SOURCE_PLAYING
+        cout << "mixPrefetchedChunks: served " << i->size << " frames at "
+             << i->start << " from cache" << endl;
+#endif
+        
+        i = m_mixChunks.erase(i);
+    }
+}
+
+void
+AudioCallbackPlaySource::discardStaleCaches()
+{
+    sv_frame_t start, end;
+    {
+        QMutexLocker locker(&m_staleMutex);
+        if (!m_stale) return;
+        start = m_staleStart;
+        end = m_staleEnd;
+        m_stale = false;
+    }
+
+#ifdef DEBUG_AUDIO_PLAY_SOURCE
+    cout << "AudioCallbackPlaySource::discardStaleCaches: " << start
+         << " -> " << end << endl;
+#endif
+    
+    m_prefetch.erase
+        (std::remove_if(m_prefetch.begin(), m_prefetch.end(),
+                        [&](const PrefetchEntry &e) {
+                            sv_frame_t ps = e.frame - e.fadeIn / 2;
+                            sv_frame_t pe = e.frame + e.length;
+                            return ps <= end && pe >= start;
+                        }),
+         m_prefetch.end());
+
+    for (auto &r: m_loopRanges) {
+        if (r.dataStart <= end && r.dataStart + r.getDataLength() >= start) {
+            for (auto &d: r.data) {
+                std::fill(d.begin(), d.end(), 0.f);
+            }
+            r.built = 0;
+        }
+    }
+}
+
+void
+AudioCallbackPlaySource::setLoopCacheEnabled(bool enabled)
+{
+    QMutexLocker locker(&m_mutex);
+    if (enabled == m_loopCacheEnabled) return;
+    m_loopCacheEnabled = enabled;
+    if (!enabled) clearLoopCache();
+    m_fillSignal.signal();
+}
+
+bool
+AudioCallbackPlaySource::getLoopCacheEnabled() const
+{
+    return m_loopCacheEnabled;
+}
+
+size_t
+AudioCallbackPlaySource::getLoopCacheMemoryUsage()
+{
+    QMutexLocker locker(&m_mutex);
+    size_t bytes = 0;
+    for (const auto &r: m_loopRanges) {
+        for (const auto &d: r.data) {
+            bytes += d.capacity() * sizeof(float);
+        }
+    }
+    return bytes;
+}
+
+void
+AudioCallbackPlaySource::discardLoopCache()
+{
+    QMutexLocker locker(&m_mutex);
+    clearLoopCache();
+}
+
+void
+AudioCallbackPlaySource::clearLoopCache()
+{
+    m_loopRanges.clear();
+    m_loopModels.clear();
+}
+
+bool
+AudioCallbackPlaySource::updateLoopCache()
+{
+    discardStaleCaches();
+
+    sv_samplerate_t rate = getSourceSampleRate();
+    
+    if (!m_loopCacheEnabled || !m_viewManager->getPlayLoopMode() ||
+        rate == 0 || m_lastModelEndFrame == 0) {
+        clearLoopCache();
+        return false;
+    }
+
+    // The ranges looped over are those mixModels plays
+    
+    std::vector<std::pair<sv_frame_t, sv_frame_t>> ranges;
+    
+    bool constrained = (m_viewManager->getPlaySelectionMode() &&
+                        !m_viewManager->getSelections().empty());
+    if (constrained) {
+        for (const auto &sel: m_viewManager->getSelections()) {
+            sv_frame_t sf = m_viewManager->alignReferenceToPlaybackFrame
+                (sel.getStartFrame());
+            sv_frame_t ef = m_viewManager->alignReferenceToPlaybackFrame
+                (sel.getEndFrame());
+            if (ef > sf) {
+                ranges.push_back({ sf, ef });
+            }
+        }
+    } else {
+        ranges.push_back({ 0, m_lastModelEndFrame });
+    }
+
+    sv_frame_t total = 0;
+    for (const auto &r: ranges) {
+        total += r.second - r.first;
+    }
+    if (total > sv_frame_t(LOOP_CACHE_MAX_DURATION * rate)) {
+        clearLoopCache();
+        return false;
+    }
+
+    std::set<ModelId> models;
+    for (ModelId modelId: m_models) {
+        auto model = ModelById::get(modelId);
+        if (model && model->canPlay() &&
+            std::dynamic_pointer_cast<DenseTimeValueModel>(model)) {
+            models.insert(modelId);
+        }
+    }
+    if (models.empty()) {
+        clearLoopCache();
+        return false;
+    }
+
+    int channels = getTargetChannelCount();
+    
+    bool same = (models == m_loopModels && ranges.size() == m_loopRanges.size());
+    for (int i = 0; same && i < int(ranges.size()); ++i) {
+        same = (ranges[i].first == m_loopRanges[i].start &&
+                ranges[i].second == m_loopRanges[i].end &&
+                int(m_loopRanges[i].data.size()) == channels);
+    }
+
+    if (!same) {
+        clearLoopCache();
+        m_loopModels = models;
+        for (const auto &r: ranges) {
+            LoopRange lr;
+            lr.start = r.first;
+            lr.end = r.second;
+            lr.dataStart = std::max(sv_frame_t(0), r.first - LOOP_CACHE_MARGIN);
+            lr.built = 0;
+            lr.data.resize(channels);
+            for (auto &d: lr.data) {
+                d.resize(r.second + LOOP_CACHE_MARGIN - lr.dataStart, 0.f);
+            }
+            m_loopRanges.push_back(std::move(lr));
+        }
+    }
+
+    for (auto &r: m_loopRanges) {
+
+        if (r.isComplete()) continue;
+
+        sv_frame_t n = std::min(LOOP_CACHE_BUILD_BLOCK,
+                                r.getDataLength() - r.built);
+
+        std::vector<float *> ptrs(channels);
+        for (int c = 0; c < channels; ++c) {
+            ptrs[c] = r.data[c].data() + r.built;
+        }
+
+        for (ModelId modelId: m_loopModels) {
+            (void) m_audioGenerator->mixModel(modelId, r.dataStart + r.built,
+                                              n, ptrs.data(), 0, 0);
+        }
+
+        r.built += n;
+
+#ifdef DEBUG_AUDIO_PLAY_SOURCE
+        cout << "AudioCallbackPlaySource::updateLoopCache: mixed " << r.built
+             << " of " << r.getDataLength() << " frames for range from "
+             << r.start << endl;
+#endif
+        return true;
+    }
+
+    return false;
+}
+
+void
+AudioCallbackPlaySource::mixLoopCachedChunks(float **buffers)
+{
+    if (m_loopRanges.empty()) return;
+
+    discardStaleCaches();
+
+    int channels = getTargetChannelCount();
+
+    for (MixChunk &chunk: m_mixChunks) {
+
+        // Find the source frames that mixing this chunk with its
+        // fades would read, and a complete range that holds them all
+        
+        sv_frame_t readStart, readCount, missing;
+        AudioGenerator::getFadedReadRegion(chunk.start, chunk.size,
+                                           chunk.fadeIn, chunk.fadeOut,
+                                           readStart, readCount, missing);
+
+        const LoopRange *range = nullptr;
+        for (const auto &r: m_loopRanges) {
+            if (r.isComplete() &&
+                int(r.data.size()) == channels &&
+                readStart >= r.dataStart &&
+                readStart + readCount <= r.dataStart + r.getDataLength()) {
+                range = &r;
+                break;
+            }
+        }
+        if (!range) continue;
+
+        // The cached data is already the gain-scaled sum of the
+        // models, so it can be faded as a whole just as each model
+        // would have been
+        for (int c = 0; c < channels; ++c) {
+            AudioGenerator::mixFadedChannel
+                (range->data[c].data() + (readStart - range->dataStart),
+                 missing, readCount + missing,
+                 buffers[c] + chunk.offset, 1.f,
+                 chunk.size, chunk.fadeIn, chunk.fadeOut);
+        }
+
+        chunk.premixed = true;
+    }
+}
+
 void
 AudioCallbackPlaySource::setOutputLevels(float left, float right)
 {
@@ -985,15 +1583,28 @@ AudioCallbackPlaySource::setAuditioningEffect(std::shared_ptr<Auditionable> a)
         SVCERR << "WARNING: AudioCallbackPlaySource::setAuditioningEffect: auditionable object " << a << " is not a real-time plugin instance" << endl;
     }
 
-    m_mutex.lock();
-    m_auditioningEffectWrapper->setEffect(plugin);
-    m_auditioningEffectWrapper->setBypassed(false);
-    m_mutex.unlock();
+    std::vector<std::shared_ptr<RealTimePluginInstance>> chain;
+    if (plugin) chain.push_back(plugin);
+    setAuditioningEffectChain(chain);
 
     SVDEBUG << "AudioCallbackPlaySource::setAuditioningEffect: set plugin to "
             << plugin << endl;
 }
 
+void
+AudioCallbackPlaySource::setAuditioningEffectChain
+(std::vector<std::shared_ptr<RealTimePluginInstance>> plugins)
+{
+    SVDEBUG << "AudioCallbackPlaySource::setAuditioningEffectChain: "
+            << plugins.size() << " plugin(s)" << endl;
+
+    // The wrapper swaps chains without blocking the audio thread, so
+    // there is no need to take our own mutex here and wait for the
+    // fill thread
+    m_auditioningEffectWrapper->setEffectChain(plugins);
+    m_auditioningEffectWrapper->setBypassed(false);
+}
+
 void
 AudioCallbackPlaySource::setSoloModelSet(std::set<ModelId> s)
 {
@@ -1049,11 +1660,307 @@ AudioCallbackPlaySource::setTimeStretch(double factor)
     emit activity(tr("Change time-stretch factor to %1").arg(factor));
 }
 
+void
+AudioCallbackPlaySource::setTimeStretchMultithreaded(bool multithreaded)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        checkWrappers();
+    }
+    
+    m_timeStretchWrapper->setMultithreaded(multithreaded);
+}
+
+void
+AudioCallbackPlaySource::setMixThreadCount(int threads)
+{
+    if (threads < 1) threads = 1;
+
+    QMutexLocker locker(&m_mutex);
+
+    m_mixThreadCount = threads;
+    if (int(m_mixThreads.size()) > threads - 1) {
+        stopMixThreads();
+    }
+    prepareMixThreads();
+
+    SVDEBUG << "AudioCallbackPlaySource::setMixThreadCount: "
+            << threads << endl;
+}
+
+int
+AudioCallbackPlaySource::getMixThreadCount() const
+{
+    return m_mixThreadCount;
+}
+
+PlaybackStatistics::Report
+AudioCallbackPlaySource::getPlaybackStatistics() const
+{
+    return m_statistics.getReport();
+}
+
+void
+AudioCallbackPlaySource::resetPlaybackStatistics()
+{
+    m_statistics.reset();
+}
+
+void
+AudioCallbackPlaySource::setLowLatencyMode(bool lowLatency)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (lowLatency == m_lowLatency) return;
+    
+    m_lowLatency = lowLatency;
+    m_tuning = LatencyTuning();
+    m_tuning.wakeupLatency = LOW_LATENCY_INITIAL_WAKEUP;
+    m_tuning.margin = LOW_LATENCY_BASE_MARGIN;
+    m_underruns = 0;
+    m_overloads = 0;
+
+    if (lowLatency) {
+        // retuneLatency will size the buffers on the next fill
+        m_tuning.lastResize = monotonicSeconds();
+    } else {
+        m_fillChunkSize = 0;
+        m_ringBufferSize = std::max(DEFAULT_RING_BUFFER_SIZE,
+                                    int(m_blockSize) * 4);
+        if (m_writeBuffers && !m_writeBuffers->empty()) {
+            clearRingBuffers(true);
+        }
+    }
+
+    SVDEBUG << "AudioCallbackPlaySource::setLowLatencyMode: "
+            << lowLatency << endl;
+}
+
+bool
+AudioCallbackPlaySource::getLowLatencyMode() const
+{
+    return m_lowLatency;
+}
+
+void
+AudioCallbackPlaySource::noteFillWakeup()
+{
+    // We have just been woken by the audio callback, which records
+    // the device time of its last read before signalling us. The
+    // difference is how long it took us to respond: track its peak,
+    // decaying slowly so that one bad moment is not held forever
+
+    if (!m_target || m_lastRetrievalTimestamp == 0) return;
+
+    double latency = m_target->getCurrentTime() - m_lastRetrievalTimestamp;
+    if (latency < 0.0 || latency > 1.0) return; // clock glitch
+
+    m_statistics.recordFillLag(latency);
+
+    if (!m_lowLatency) return;
+
+    m_tuning.wakeupLatency =
+        std::max(latency, m_tuning.wakeupLatency * LOW_LATENCY_WAKEUP_DECAY);
+}
+
+void
+AudioCallbackPlaySource::noteMixCost(sv_frame_t frames, double seconds)
+{
+    double perFrame = seconds / double(frames);
+    if (m_tuning.mixCost == 0.0 || perFrame > m_tuning.mixCost) {
+        // respond at once to things getting more expensive
+        m_tuning.mixCost = perFrame;
+    } else {
+        m_tuning.mixCost = m_tuning.mixCost * 0.95 + perFrame * 0.05;
+    }
+}
+
+void
+AudioCallbackPlaySource::retuneLatency()
+{
+    sv_samplerate_t rate = getSourceSampleRate();
+    if (!rate) return;
+
+    double now = monotonicSeconds();
+    
+    int incidents = m_underruns.exchange(0) + m_overloads.exchange(0);
+    if (incidents > 0) {
+        m_tuning.margin = std::min(LOW_LATENCY_MAX_MARGIN,
+                                   m_tuning.margin * 2.0);
+        m_tuning.lastIncident = now;
+        SVDEBUG << "AudioCallbackPlaySource::retuneLatency: " << incidents
+                << " overload(s) or underrun(s), widening margin to "
+                << m_tuning.margin << endl;
+    } else if (m_tuning.margin > LOW_LATENCY_BASE_MARGIN &&
+               now - m_tuning.lastIncident > LOW_LATENCY_CALM_PERIOD) {
+        m_tuning.margin = std::max(LOW_LATENCY_BASE_MARGIN,
+                                   m_tuning.margin * 0.75);
+        m_tuning.lastIncident = now;
+    }
+
+    // Fill in chunks of about two device blocks. After being woken
+    // late, the fill thread has to mix one chunk before the reader
+    // runs dry, so the buffered audio must cover the wakeup latency,
+    // the time taken to mix a chunk, and a chunk's worth of playback
+    
+    sv_frame_t generatorBlockSize = m_audioGenerator->getBlockSize();
+    sv_frame_t chunk = std::max(generatorBlockSize, m_blockSize * 2);
+    chunk = ((chunk + generatorBlockSize - 1) / generatorBlockSize) *
+        generatorBlockSize;
+    m_fillChunkSize = chunk;
+
+    double needed = m_tuning.margin *
+        (m_tuning.wakeupLatency + double(chunk) * m_tuning.mixCost) * rate;
+    sv_frame_t target = sv_frame_t(ceil(needed)) + chunk * 2;
+    target = std::max(target, std::max(chunk * 4, m_blockSize * 4));
+
+    // Ring buffer sizes are one less than a power of two, which gives
+    // us some hysteresis as well
+    int size = 1;
+    while (size - 1 < target && size - 1 < DEFAULT_RING_BUFFER_SIZE) {
+        size *= 2;
+    }
+    --size;
+
+    if (size == m_ringBufferSize) return;
+
+    // Grow at once, but shrink only if things have been steady for a
+    // while, and never while an incident is recent
+    if (size < m_ringBufferSize &&
+        (now - m_tuning.lastResize < LOW_LATENCY_SHRINK_HOLDOFF ||
+         now - m_tuning.lastIncident < LOW_LATENCY_SHRINK_HOLDOFF)) {
+        return;
+    }
+
+#ifdef DEBUG_AUDIO_PLAY_SOURCE
+    SVCERR << "AudioCallbackPlaySource::retuneLatency: wakeup latency "
+           << m_tuning.wakeupLatency << ", mix cost per frame "
+           << m_tuning.mixCost << ", margin " << m_tuning.margin
+           << ": ring buffer size " << m_ringBufferSize << " -> " << size
+           << ", fill chunk " << chunk << endl;
+#endif
+    
+    // This keeps the generator state and the prefetch and loop
+    // caches, as nothing that has been mixed is invalidated
+    if (!resizeRingBuffers(size)) {
+        return;
+    }
+    m_tuning.lastResize = now;
+}
+
+bool
+AudioCallbackPlaySource::resizeRingBuffers(int size)
+{
+    // The write buffers end at m_writeBufferFill. If they are also
+    // the read buffers, the audio thread may be reading from them,
+    // but only we write to them, so whatever is peeked from each one
+    // runs up to m_writeBufferFill even if the reader moves on
+    // meanwhile. The audio thread goes on reading the old buffers
+    // until unifyRingBuffers switches it to the new ones, skipping
+    // anything it has read in the meantime.
+    
+    int count = (m_writeBuffers ? int(m_writeBuffers->size()) : 0);
+
+    int buffered = 0;
+    for (int c = 0; c < count; ++c) {
+        int here = getWriteRingBuffer(c)->getReadSpace();
+        if (here > buffered) buffered = here;
+    }
+
+    if (buffered > size) {
+        // Try again once some has been played
+        return false;
+    }
+
+    std::vector<std::vector<float>> scratch(count);
+    std::vector<int> peeked(count, 0);
+    int common = buffered;
+    for (int c = 0; c < count; ++c) {
+        scratch[c].resize(buffered);
+        peeked[c] = getWriteRingBuffer(c)->peek(scratch[c].data(), buffered);
+        if (peeked[c] < common) common = peeked[c];
+    }
+
+    RingBufferVector *newBuffers = new RingBufferVector;
+    for (int c = 0; c < count; ++c) {
+        RingBuffer<float> *rb = new RingBuffer<float>(size);
+        rb->write(scratch[c].data() + (peeked[c] - common), common);
+        newBuffers->push_back(rb);
+    }
+
+    if (m_readBuffers != m_writeBuffers) {
+        delete m_writeBuffers;
+    }
+    m_writeBuffers = newBuffers;
+    m_ringBufferSize = size;
+
+    return true;
+}
+
+void
+AudioCallbackPlaySource::prepareMixThreads()
+{
+    int n = int(m_models.size());
+    int workers = std::min(m_mixThreadCount, n);
+
+    if (workers < 2) {
+        // Only serial mixing is possible, so nothing here is needed
+        std::vector<MixSlot>().swap(m_mixSlots);
+        std::vector<ModelId>().swap(m_mixModelList);
+        return;
+    }
+
+    // The fill thread never mixes more than will fit in the ring
+    // buffer, whose size it may retune up to the default size
+    int channels = getTargetChannelCount();
+    sv_frame_t frames = std::max(sv_frame_t(DEFAULT_RING_BUFFER_SIZE),
+                                 sv_frame_t(m_ringBufferSize));
+
+    if (int(m_mixModelList.capacity()) > n) {
+        std::vector<ModelId>().swap(m_mixModelList);
+    }
+    m_mixModelList.reserve(n);
+    
+    m_mixSlots.resize(n);
+    m_mixSlots.shrink_to_fit();
+    for (MixSlot &slot: m_mixSlots) {
+        slot.data.resize(channels * frames);
+        slot.data.shrink_to_fit();
+        slot.base.resize(channels);
+        slot.chunk.resize(channels);
+    }
+
+    while (int(m_mixThreads.size()) < workers - 1) {
+        MixThread *t = new MixThread(*this, int(m_mixThreads.size()) + 1);
+        t->start();
+        m_mixThreads.push_back(t);
+    }
+}
+
+void
+AudioCallbackPlaySource::stopMixThreads()
+{
+    // called with m_mutex held, or from the destructor once the fill
+    // thread has gone, so no mixing is in progress
+
+    for (MixThread *t: m_mixThreads) {
+        t->finish();
+    }
+    for (MixThread *t: m_mixThreads) {
+        t->wait();
+        delete t;
+    }
+    m_mixThreads.clear();
+}
+
 int
 AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
                                           int requestedChannels,
                                           int count)
 {
+    PlaybackStatistics::StageTimer timer
+        (&m_statistics, PlaybackStatistics::SourceStage);
+
     // In principle, the target will handle channel mapping in cases
     // where our channel count differs from the device's. But that
     // only holds if our channel count doesn't change -- i.e. if
@@ -1119,12 +2026,21 @@ AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
     cout << "AudioCallbackPlaySource::getSourceSamples: Playing" << endl;
 #endif
 
+    // Take a single snapshot of the read buffers for this callback,
+    // as the fill thread may swap them in unifyRingBuffers at any
+    // point. We don't lock anything here: the old buffers remain
+    // valid until scavenged, well after this callback has returned.
+    
+    RingBufferVector *readBuffers = m_readBuffers;
+    
     // Ensure that all buffers have at least the amount of data we
     // need -- else reduce the size of our requests correspondingly
 
+    int requested = count;
+
     for (int ch = 0; ch < channels; ++ch) {
 
-        RingBuffer<float> *rb = getReadRingBuffer(ch);
+        RingBuffer<float> *rb = getReadRingBuffer(readBuffers, ch);
         
         if (!rb) {
             SVCERR << "WARNING: AudioCallbackPlaySource::getSourceSamples: "
@@ -1135,6 +2051,8 @@ AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
         }
 
         int rs = rb->getReadSpace();
+        m_statistics.recordReadSpace(ch, rs);
+        
         if (rs < count) {
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
             cerr << "WARNING: AudioCallbackPlaySource::getSourceSamples: "
@@ -1148,6 +2066,13 @@ AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
         }
     }
 
+    if (count < requested && m_lastRetrievalTimestamp != 0 &&
+        m_readBufferFill < m_lastModelEndFrame) {
+        // we have been playing and have run dry before the end
+        m_statistics.recordUnderrun(requested, count);
+        if (m_lowLatency) ++m_underruns;
+    }
+    
     if (count == 0) return 0;
 
     if (m_target) {
@@ -1163,7 +2088,7 @@ AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
         
     for (int ch = 0; ch < channels; ++ch) {
 
-        RingBuffer<float> *rb = getReadRingBuffer(ch);
+        RingBuffer<float> *rb = getReadRingBuffer(readBuffers, ch);
 
         if (rb) {
 
@@ -1190,7 +2115,7 @@ AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
     cout << "AudioCallbackPlaySource::getSamples: awakening thread" << endl;
 #endif
 
-    m_condition.wakeAll();
+    m_fillSignal.signal();
 
     return got;
 }
@@ -1261,6 +2186,14 @@ AudioCallbackPlaySource::fillBuffers()
         return false;
     }
 
+    // in low-latency mode, fill in small chunks so that the first
+    // audio after a seek or reset reaches the ring buffer quickly
+    if (m_fillChunkSize > 0 && space > m_fillChunkSize) {
+        space = std::max(generatorBlockSize,
+                         (m_fillChunkSize / generatorBlockSize) *
+                         generatorBlockSize);
+    }
+
     if (tmpSize < channels * space) {
         delete[] tmp;
         tmp = new float[channels * space];
@@ -1276,8 +2209,14 @@ AudioCallbackPlaySource::fillBuffers()
         }
     }
 
+    double mixStart = (m_lowLatency ? monotonicSeconds() : 0.0);
+    
     sv_frame_t got = mixModels(f, space, bufferPtrs); // also modifies f
 
+    if (m_lowLatency && got > 0) {
+        noteMixCost(got, monotonicSeconds() - mixStart);
+    }
+
     for (int c = 0; c < channels; ++c) {
 
         RingBuffer<float> *wb = getWriteRingBuffer(c);
@@ -1310,7 +2249,8 @@ AudioCallbackPlaySource::fillBuffers()
 }    
 
 sv_frame_t
-AudioCallbackPlaySource::mixModels(sv_frame_t &frame, sv_frame_t count, float **buffers)
+AudioCallbackPlaySource::mixModels(sv_frame_t &frame, sv_frame_t count,
+                                   float **buffers, sv_frame_t *mixed)
 {
     sv_frame_t processed = 0;
     sv_frame_t chunkStart = frame;
@@ -1347,9 +2287,11 @@ AudioCallbackPlaySource::mixModels(sv_frame_t &frame, sv_frame_t count, float **
         chunkBufferPtrCount = channels;
     }
 
-    for (int c = 0; c < channels; ++c) {
-        chunkBufferPtrs[c] = buffers[c];
-    }
+    // First work out which chunks of which ranges are to be played,
+    // then mix them all from each model
+    
+    m_mixChunks.clear();
+    bool ended = false;
 
     while (processed < count) {
         
@@ -1432,7 +2374,8 @@ AudioCallbackPlaySource::mixModels(sv_frame_t &frame, sv_frame_t count, float **
             cout << "mixModels: ending at " << nextChunkStart << ", returning frame as "
                  << frame << endl;
 #endif
-            return count;
+            ended = true;
+            break;
         }
 
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
@@ -1459,22 +2402,53 @@ AudioCallbackPlaySource::mixModels(sv_frame_t &frame, sv_frame_t count, float **
             }
         }
 
-        for (std::set<ModelId>::iterator mi = m_models.begin();
-             mi != m_models.end(); ++mi) {
-            
-            (void) m_audioGenerator->mixModel(*mi, chunkStart, 
-                                              chunkSize, chunkBufferPtrs,
-                                              fadeIn, fadeOut);
-        }
-
-        for (int c = 0; c < channels; ++c) {
-            chunkBufferPtrs[c] += chunkSize;
-        }
+        m_mixChunks.push_back({ chunkStart, chunkSize, processed,
+                                fadeIn, fadeOut, false });
 
         processed += chunkSize;
         chunkStart = nextChunkStart;
     }
 
+    mixPrefetchedChunks(buffers);
+    mixLoopCachedChunks(buffers);
+    
+    m_mixWorkerCount = std::min(m_mixThreadCount, int(m_models.size()));
+    
+    if (m_mixWorkerCount > 1 && !m_mixChunks.empty() &&
+        mixModelsInParallel(count, buffers)) {
+
+        // done
+
+    } else {
+
+        for (const MixChunk &chunk: m_mixChunks) {
+
+            for (int c = 0; c < channels; ++c) {
+                chunkBufferPtrs[c] = buffers[c] + chunk.offset;
+            }
+
+            for (ModelId modelId: m_models) {
+                if (chunk.premixed && m_loopModels.count(modelId)) {
+                    continue;
+                }
+                double start = PlaybackStatistics::now();
+                (void) m_audioGenerator->mixModel(modelId, chunk.start,
+                                                  chunk.size, chunkBufferPtrs,
+                                                  chunk.fadeIn, chunk.fadeOut);
+                m_statistics.recordModelMixTime
+                    (modelId, chunk.size, PlaybackStatistics::now() - start);
+            }
+        }
+    }
+
+    if (mixed) {
+        *mixed = processed;
+    }
+    
+    if (ended) {
+        return count;
+    }
+    
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     cout << "mixModels returning " << processed << " frames to " << nextChunkStart << endl;
 #endif
@@ -1483,6 +2457,102 @@ AudioCallbackPlaySource::mixModels(sv_frame_t &frame, sv_frame_t count, float **
     return processed;
 }
 
+bool
+AudioCallbackPlaySource::mixModelsInParallel(sv_frame_t count, float **buffers)
+{
+    // Called from mixModels on the fill thread, with m_mutex held.
+    // Each model is mixed into its own zeroed scratch buffers, by the
+    // worker whose index it has modulo m_mixWorkerCount (the fill
+    // thread itself being worker 0), and the results are then added
+    // into the output in model order. The slots and threads have
+    // been made already, by prepareMixThreads.
+    
+    int channels = getTargetChannelCount();
+    int n = int(m_models.size());
+    sv_frame_t size = channels * count;
+
+    if (int(m_mixSlots.size()) < n ||
+        int(m_mixThreads.size()) < m_mixWorkerCount - 1 ||
+        int(m_mixModelList.capacity()) < n) {
+        return false;
+    }
+    for (int i = 0; i < n; ++i) {
+        const MixSlot &slot = m_mixSlots[i];
+        if (sv_frame_t(slot.data.size()) < size ||
+            int(slot.base.size()) < channels) {
+            return false;
+        }
+    }
+    
+    m_mixModelList.assign(m_models.begin(), m_models.end());
+
+    for (int i = 0; i < n; ++i) {
+        MixSlot &slot = m_mixSlots[i];
+        v_zero(slot.data.data(), int(size));
+        for (int c = 0; c < channels; ++c) {
+            slot.base[c] = slot.data.data() + c * count;
+        }
+    }
+
+    for (int w = 1; w < m_mixWorkerCount; ++w) {
+        m_mixThreads[w-1]->go();
+    }
+
+    mixAssignedModels(0);
+
+    m_mixDone.acquire(m_mixWorkerCount - 1);
+
+    for (int i = 0; i < n; ++i) {
+        for (int c = 0; c < channels; ++c) {
+            v_add(buffers[c], m_mixSlots[i].base[c], int(count));
+        }
+    }
+
+    return true;
+}
+
+void
+AudioCallbackPlaySource::mixAssignedModels(int worker)
+{
+    int n = int(m_mixModelList.size());
+    int channels = getTargetChannelCount();
+    
+    for (int i = worker; i < n; i += m_mixWorkerCount) {
+
+        MixSlot &slot = m_mixSlots[i];
+
+        for (const MixChunk &chunk: m_mixChunks) {
+
+            if (chunk.premixed && m_loopModels.count(m_mixModelList[i])) {
+                continue;
+            }
+            
+            for (int c = 0; c < channels; ++c) {
+                slot.chunk[c] = slot.base[c] + chunk.offset;
+            }
+            
+            double start = PlaybackStatistics::now();
+            (void) m_audioGenerator->mixModel(m_mixModelList[i], chunk.start,
+                                              chunk.size, slot.chunk.data(),
+                                              chunk.fadeIn, chunk.fadeOut);
+            m_statistics.recordModelMixTime
+                (m_mixModelList[i], chunk.size,
+                 PlaybackStatistics::now() - start);
+        }
+    }
+}
+
+void
+AudioCallbackPlaySource::MixThread::run()
+{
+    while (true) {
+        m_go.acquire();
+        if (m_finishing) break;
+        m_source.mixAssignedModels(m_worker);
+        m_source.m_mixDone.release();
+    }
+}
+
 void
 AudioCallbackPlaySource::unifyRingBuffers()
 {
@@ -1545,7 +2615,7 @@ AudioCallbackPlaySource::unifyRingBuffers()
     }
                     
     m_bufferScavenger.claim(m_readBuffers);
-    m_readBuffers = m_writeBuffers;
+    m_readBuffers.store(m_writeBuffers, std::memory_order_release);
     m_readBufferFill = m_writeBufferFill;
 #ifdef DEBUG_AUDIO_PLAY_SOURCE_PLAYING
     cout << "unified" << endl;
@@ -1565,6 +2635,7 @@ AudioCallbackPlaySource::FillThread::run()
 
     bool previouslyPlaying = s.m_playing;
     bool work = false;
+    bool prefetching = false;
 
     while (!s.m_exiting) {
 
@@ -1572,7 +2643,7 @@ AudioCallbackPlaySource::FillThread::run()
         s.m_bufferScavenger.scavenge();
         s.m_pluginScavenger.scavenge();
 
-        if (work && s.m_playing && s.getSourceSampleRate()) {
+        if (work && (s.m_playing || prefetching) && s.getSourceSampleRate()) {
             
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
             cout << "AudioCallbackPlaySourceFillThread: not waiting" << endl;
@@ -1595,7 +2666,19 @@ AudioCallbackPlaySource::FillThread::run()
             cout << "AudioCallbackPlaySourceFillThread: waiting for " << ms << "ms..." << endl;
 #endif
             
-            s.m_condition.wait(&s.m_mutex, int(ms));
+            // Wait without holding the mutex, so that nothing that
+            // signals us can be held up by it
+            s.m_mutex.unlock();
+            bool signalled = s.m_fillSignal.wait(int(ms));
+            s.m_mutex.lock();
+
+            if (signalled && s.m_playing) {
+                s.noteFillWakeup();
+            }
+        }
+
+        if (s.m_lowLatency && s.m_playing) {
+            s.retuneLatency();
         }
 
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
@@ -1604,6 +2687,12 @@ AudioCallbackPlaySource::FillThread::run()
 
         work = false;
 
+        if (s.m_rendering) {
+            // An OfflineRenderer owns the generator state until it
+            // has finished
+            continue;
+        }
+        
         if (!s.getSourceSampleRate()) {
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
             cout << "AudioCallbackPlaySourceFillThread: source sample rate is zero" << endl;
@@ -1613,7 +2702,7 @@ AudioCallbackPlaySource::FillThread::run()
 
         bool playing = s.m_playing;
 
-        if (playing && !previouslyPlaying) {
+        if (playing && !previouslyPlaying && !s.m_prefetchServed) {
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
             cout << "AudioCallbackPlaySourceFillThread: playback state changed, resetting" << endl;
 #endif
@@ -1622,9 +2711,18 @@ AudioCallbackPlaySource::FillThread::run()
                 if (rb) rb->reset();
             }
         }
+        if (playing) s.m_prefetchServed = false;
         previouslyPlaying = playing;
 
         work = s.fillBuffers();
+
+        // Prefetch only when the ring buffers are full
+        prefetching = false;
+        if (!work) {
+            prefetching = (s.updatePrefetchCache() ||
+                           s.updateLoopCache());
+            work = prefetching;
+        }
     }
 
     s.m_mutex.unlock();
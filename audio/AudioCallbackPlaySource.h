@@ -21,11 +21,14 @@
 #include "base/PropertyContainer.h"
 #include "base/Scavenger.h"
 
+#include "RTSignal.h"
+#include "PlaybackStatistics.h"
+
 #include <bqaudioio/ApplicationPlaybackSource.h>
 
 #include <QObject>
 #include <QMutex>
-#include <QWaitCondition>
+#include <QSemaphore>
 
 #include "base/Thread.h"
 #include "base/RealTime.h"
@@ -35,6 +38,8 @@
 
 #include <set>
 #include <map>
+#include <vector>
+#include <atomic>
 
 namespace breakfastquay {
     class ResamplerWrapper;
@@ -108,6 +113,47 @@ public:
      */
     virtual void stop() override;
 
+    /**
+     * Hint that playback is likely to be started next from the given
+     * frame, for example because the user has just placed the
+     * playback position there. Audio from this frame is mixed in
+     * advance, along with audio from the start of each play
+     * selection (or of the whole playback range), so that play() can
+     * start without waiting for the fill thread. Pass a negative
+     * frame to withdraw the hint.
+     *
+     * Prefetching is used only when every playing model is a wave
+     * model, as the synthesised models carry state from one block to
+     * the next.
+     */
+    void setPrefetchFrame(sv_frame_t frame);
+
+    /**
+     * Set whether to keep the mix of the wave models for the whole of
+     * each loop range in memory while looping, so that repeated
+     * passes need not mix them again. Ranges of up to a minute in
+     * total are cached. The cache is rebuilt when a model, its play
+     * parameters, the solo set or the selection changes. This is off
+     * by default.
+     */
+    void setLoopCacheEnabled(bool enabled);
+
+    /**
+     * Return true if the loop cache has been enabled.
+     */
+    bool getLoopCacheEnabled() const;
+
+    /**
+     * Return the number of bytes of audio held in the loop cache.
+     */
+    size_t getLoopCacheMemoryUsage();
+
+    /**
+     * Discard the loop cache. It is built again when next needed, so
+     * this frees memory for long only if playback is not looping.
+     */
+    void discardLoopCache();
+
     /**
      * Return whether playback is currently supposed to be happening.
      */
@@ -278,6 +324,12 @@ public:
      */
     void setTimeStretch(double factor);
 
+    /**
+     * Stretch each channel with its own stretcher on its own thread,
+     * see TimeStretchWrapper::setMultithreaded. Default is false.
+     */
+    void setTimeStretchMultithreaded(bool multithreaded);
+
     /**
      * Set a single real-time plugin as a processing effect for
      * auditioning during playback.
@@ -296,6 +348,19 @@ public:
     virtual void setAuditioningEffect(std::shared_ptr<Auditionable> plugin)
         override;
 
+    /**
+     * Set a chain of plugins to apply in series to the playback,
+     * replacing any auditioning effect or chain already set. Each
+     * must have been initialised as for setAuditioningEffect, and all
+     * must share a block size. The chain is swapped in without
+     * waiting for the audio or fill threads. Its total latency is
+     * taken into account by getCurrentPlayingFrame.
+     *
+     * Pass an empty vector to remove the current chain.
+     */
+    void setAuditioningEffectChain
+    (std::vector<std::shared_ptr<RealTimePluginInstance>> plugins);
+
     /**
      * Specify that only the given set of models should be played.
      */
@@ -307,6 +372,53 @@ public:
      */
     void clearSoloModelSet();
 
+    /**
+     * Set the number of threads to use when mixing models for
+     * playback. With more than one, models are mixed concurrently
+     * into separate buffers which are then summed in a fixed order,
+     * so the output does not depend on thread timing. Each model is
+     * mixed by only one thread at a time. The default is 1, for
+     * serial mixing on the fill thread.
+     */
+    void setMixThreadCount(int threads);
+
+    /**
+     * Return the number of threads used when mixing models for
+     * playback, as set with setMixThreadCount.
+     */
+    int getMixThreadCount() const;
+
+    /**
+     * Switch the adaptive low-latency playback mode on or off. In
+     * this mode the ring buffers are kept only as large as the
+     * measured fill thread wakeup latency and mixing cost require,
+     * with a safety margin, and they are filled in small chunks
+     * rather than all at once. Play, stop, seek and play parameter
+     * changes are then heard sooner. Processing overloads and buffer
+     * underruns widen the margin again. The default is off, in which
+     * case the ring buffers have a fixed size of several seconds.
+     */
+    void setLowLatencyMode(bool lowLatency);
+
+    /**
+     * Return true if the adaptive low-latency mode is on.
+     */
+    bool getLowLatencyMode() const;
+
+    /**
+     * Return a snapshot of the playback timing and fault counters
+     * gathered since construction or the last reset: callback and
+     * wrapper processing times, ring buffer read space minimums,
+     * fill thread wakeup lag, per-model mixing times, and underrun
+     * and overload counts. May be called from any thread.
+     */
+    PlaybackStatistics::Report getPlaybackStatistics() const;
+
+    /**
+     * Clear the playback timing and fault counters.
+     */
+    void resetPlaybackStatistics();
+
     virtual std::string getClientName() const override {
         return m_clientName;
     }
@@ -351,7 +463,12 @@ protected:
     };
 
     std::set<ModelId>                 m_models;
-    RingBufferVector                 *m_readBuffers;
+    // The read buffers are swapped for the write buffers by the fill
+    // thread in unifyRingBuffers, while the audio thread may be
+    // reading them. The audio thread takes one snapshot of this
+    // pointer per callback, and the old vector is only released via
+    // m_bufferScavenger once no callback can still be using it.
+    std::atomic<RingBufferVector *>   m_readBuffers;
     RingBufferVector                 *m_writeBuffers;
     sv_frame_t                        m_readBufferFill;
     sv_frame_t                        m_writeBufferFill;
@@ -388,7 +505,10 @@ protected:
     }
 
     RingBuffer<float> *getReadRingBuffer(int c) {
-        RingBufferVector *rb = m_readBuffers;
+        return getReadRingBuffer(m_readBuffers, c);
+    }
+
+    static RingBuffer<float> *getReadRingBuffer(RingBufferVector *rb, int c) {
         if (rb && c < (int)rb->size()) {
             return (*rb)[c];
         } else {
@@ -399,14 +519,180 @@ protected:
     void clearRingBuffers(bool haveLock = false, int count = 0);
     void unifyRingBuffers();
 
+    // Called from the fill thread, mutex held. Replace the write
+    // buffers with buffers of the given size that start out holding
+    // the audio already buffered, so that filling carries on from
+    // where it was. Return false, changing nothing, if the buffered
+    // audio would not fit
+    bool resizeRingBuffers(int size);
+
     // Called from fill thread, mutex held.  Return true if work done
     bool fillBuffers();
     
     // Called from fillBuffers.  Return the number of frames written,
     // which will be count or fewer.  Return in the frame argument the
     // new buffered frame position (which may be earlier than the
-    // frame argument passed in, in the case of looping).
-    sv_frame_t mixModels(sv_frame_t &frame, sv_frame_t count, float **buffers);
+    // frame argument passed in, in the case of looping). If mixed is
+    // non-null, return in it the number of frames actually mixed
+    // from the models, which is smaller than the return value if
+    // playback of a selection ends within the buffer.
+    sv_frame_t mixModels(sv_frame_t &frame, sv_frame_t count, float **buffers,
+                         sv_frame_t *mixed = nullptr);
+
+    friend class OfflineRenderer;
+
+    // A contiguous span of playback mixed by a single mixModel call
+    // for each model, at the given offset into the fill buffers
+    struct MixChunk {
+        sv_frame_t start;
+        sv_frame_t size;
+        sv_frame_t offset;
+        sv_frame_t fadeIn;
+        sv_frame_t fadeOut;
+        bool premixed; // m_loopModels already added from the loop cache
+    };
+    std::vector<MixChunk> m_mixChunks;
+
+    // Scratch buffers for mixing one model, in parallel mixing mode
+    struct MixSlot {
+        std::vector<float> data;
+        std::vector<float *> base;
+        std::vector<float *> chunk;
+    };
+    std::vector<MixSlot> m_mixSlots;
+    std::vector<ModelId> m_mixModelList;
+    
+    // Called from mixModels, to mix all of m_mixChunks for each model
+    // on m_mixWorkerCount threads. Return false, having mixed
+    // nothing, if the slots and threads made by prepareMixThreads are
+    // not enough for this mix; the caller then mixes serially
+    bool mixModelsInParallel(sv_frame_t count, float **buffers);
+
+    // Called with m_mutex held whenever the models, channel count,
+    // ring buffer size or mix thread count change, to size the mix
+    // slots for the largest mix the fill thread may ask for and start
+    // any mix threads needed, so that it never has to do either. The
+    // slots are sized exactly, so they shrink as well as grow, and
+    // are released when there is nothing to mix in parallel
+    void prepareMixThreads();
+
+    // Mix all of m_mixChunks for the models assigned to this worker
+    void mixAssignedModels(int worker);
+
+    void stopMixThreads();
+
+    // Audio already mixed from likely jump targets: the play
+    // selection starts, the loop start, and the hinted play
+    // position. Each entry holds what mixModels would add to its
+    // buffers for a chunk starting at that frame with that fade-in
+    // and no fade-out, so that a chunk no longer than the entry can
+    // be copied instead of mixed. Entries are built by the fill thread
+    // when it has nothing else to do. Guarded by m_mutex
+    struct PrefetchEntry {
+        sv_frame_t frame;
+        sv_frame_t fadeIn;
+        sv_frame_t length;
+        // per channel, fadeIn/2 frames of lead-in that the fade adds
+        // before the chunk start, followed by length frames
+        std::vector<std::vector<float>> data;
+    };
+    std::vector<PrefetchEntry> m_prefetch;
+    std::atomic<sv_frame_t> m_prefetchFrame; // playback frame, or -1
+    bool m_prefetchServed; // play() has refilled the read buffers
+    std::vector<std::vector<float>> m_prefetchScratch;
+    std::vector<float *> m_prefetchPtrs;
+
+    struct PrefetchCue {
+        sv_frame_t frame;
+        sv_frame_t fadeIn;
+        sv_frame_t length;
+    };
+    std::vector<PrefetchCue> getPrefetchCues() const;
+    bool canPrefetch() const;
+
+    // Constrain and align a reference frame passed to play() to the
+    // playback frame that playback would actually start from
+    sv_frame_t getPlaybackStartFrame(sv_frame_t referenceFrame) const;
+    const PrefetchEntry *findPrefetch(sv_frame_t frame, sv_frame_t fadeIn);
+
+    // Build one missing entry. Called from the fill thread with
+    // m_mutex held; return true if there may be more to do
+    bool updatePrefetchCache();
+
+    // Add any of m_mixChunks that can be served from the cache into
+    // the buffers, and remove them from m_mixChunks
+    void mixPrefetchedChunks(float **buffers);
+
+    // Optional cache of the mix of all wave models over each loop
+    // range, plus a margin either side for fades, so that looped
+    // playback need not read and mix them again on every pass. Any
+    // other models are still mixed live, as their generators have
+    // state. Built by the fill thread when it has nothing else to
+    // do, a block at a time; a range is used only once complete.
+    // Guarded by m_mutex
+    struct LoopRange {
+        sv_frame_t start;
+        sv_frame_t end;
+        sv_frame_t dataStart; // frame of first element of data
+        sv_frame_t built;     // frames of data mixed so far
+        std::vector<std::vector<float>> data; // per channel
+        sv_frame_t getDataLength() const {
+            return data.empty() ? 0 : sv_frame_t(data[0].size());
+        }
+        bool isComplete() const {
+            return !data.empty() && built == getDataLength();
+        }
+    };
+    bool m_loopCacheEnabled;
+    std::vector<LoopRange> m_loopRanges;
+    std::set<ModelId> m_loopModels; // models whose mix is in the cache
+
+    // Build one more block of the loop cache. Called from the fill
+    // thread with m_mutex held; return true if there is more to do
+    bool updateLoopCache();
+    void clearLoopCache();
+
+    // Add the cached mix for any of m_mixChunks that lie within a
+    // complete loop range, and mark them as premixed
+    void mixLoopCachedChunks(float **buffers);
+
+    // Set from modelChangedWithin, which must not wait for m_mutex,
+    // and consumed with m_mutex held by discardStaleCaches, which
+    // drops any cached audio overlapping the changed range
+    QMutex m_staleMutex;
+    bool m_stale;
+    sv_frame_t m_staleStart;
+    sv_frame_t m_staleEnd;
+    void discardStaleCaches();
+
+    // State for the adaptive low-latency mode. The mode flag, fill
+    // chunk size and tuning are changed only with m_mutex held; the
+    // counters are bumped from the audio thread and overload handler
+    // and consumed by the fill thread
+    struct LatencyTuning {
+        LatencyTuning() : wakeupLatency(0.0), mixCost(0.0), margin(0.0),
+                          lastIncident(0.0), lastResize(0.0) { }
+        double wakeupLatency; // peak delay from read to fill wakeup, sec
+        double mixCost;       // smoothed wall-clock mixing time per frame
+        double margin;        // safety multiplier, widened on incidents
+        double lastIncident;  // monotonic time of last overload/underrun
+        double lastResize;    // monotonic time of last ring buffer resize
+    };
+    bool m_lowLatency;
+    sv_frame_t m_fillChunkSize; // 0 for no limit
+    LatencyTuning m_tuning;
+    std::atomic<int> m_underruns;
+    std::atomic<int> m_overloads;
+
+    // Recorded from all playback threads, see PlaybackStatistics
+    PlaybackStatistics m_statistics;
+
+    // Called from the fill thread, mutex held. noteFillWakeup is
+    // called on every signalled wakeup while playing, the others in
+    // low-latency mode only
+    void noteFillWakeup();
+    void noteMixCost(sv_frame_t frames, double seconds);
+    void retuneLatency();
 
     // Ranges of current selections, if play selection is active
     std::vector<RealTime> m_rangeStarts;
@@ -428,8 +714,44 @@ protected:
         AudioCallbackPlaySource &m_source;
     };
 
+    class MixThread : public Thread
+    {
+    public:
+        MixThread(AudioCallbackPlaySource &source, int worker) :
+            Thread(Thread::NonRTThread),
+            m_source(source),
+            m_worker(worker),
+            m_finishing(false) { }
+
+        void run() override;
+
+        void go() { m_go.release(); }
+        void finish() { m_finishing = true; m_go.release(); }
+
+    protected:
+        AudioCallbackPlaySource &m_source;
+        int m_worker;
+        std::atomic<bool> m_finishing;
+        QSemaphore m_go;
+    };
+
+    // Mix threads are used by the fill thread, with m_mutex held, and
+    // only changed with m_mutex held
+    int m_mixThreadCount;
+    int m_mixWorkerCount;
+    std::vector<MixThread *> m_mixThreads;
+    QSemaphore m_mixDone;
+
+    // Set, with m_mutex held, while an OfflineRenderer is using the
+    // mixing state; the fill thread leaves it alone meanwhile
+    bool m_rendering;
+
+    // Held by the fill thread while it works, and by control
+    // functions that change the playback state. Never taken by the
+    // audio thread, which wakes the fill thread through m_fillSignal
+    // instead.
     QMutex m_mutex;
-    QWaitCondition m_condition;
+    RTSignal m_fillSignal;
     FillThread *m_fillThread;
     breakfastquay::ResamplerWrapper *m_resamplerWrapper;
     TimeStretchWrapper *m_timeStretchWrapper;
@@ -23,11 +23,21 @@
 #include <QDir>
 #include <QTimer>
 #include <QDateTime>
+#include <QThread>
+
+#include <algorithm>
 
 //#define DEBUG_AUDIO_CALLBACK_RECORD_TARGET 1
 
 static const int recordUpdateTimeout = 200; // ms
 
+// The writer thread wakes when this much is waiting in the ring
+// buffers, or after writerTimeout ms, whichever comes first
+static const int writerChunkFrames = 8192;
+static const int writerTimeout = 100; // ms
+
+static const int ringBufferSize = 441000;
+
 AudioCallbackRecordTarget::AudioCallbackRecordTarget(ViewManagerBase *manager,
                                                      QString clientName) :
     m_viewManager(manager),
@@ -36,9 +46,12 @@ AudioCallbackRecordTarget::AudioCallbackRecordTarget(ViewManagerBase *manager,
     m_recordSampleRate(44100),
     m_recordChannelCount(2),
     m_frameCount(0),
+    m_frameCountAtUpdate(0),
     m_model(nullptr),
+    m_updateTimer(new QTimer(this)),
     m_buffers(nullptr),
-    m_bufferCount(0),
+    m_putting(0),
+    m_writerThread(nullptr),
     m_inputLeft(0.f),
     m_inputRight(0.f),
     m_levelsSet(false)
@@ -48,6 +61,9 @@ AudioCallbackRecordTarget::AudioCallbackRecordTarget(ViewManagerBase *manager,
     connect(this, SIGNAL(recordStatusChanged(bool)),
             m_viewManager, SLOT(recordStatusChanged(bool)));
 
+    m_updateTimer->setInterval(recordUpdateTimeout);
+    connect(m_updateTimer, SIGNAL(timeout()), this, SLOT(updateModel()));
+
     recreateBuffers();
 }
 
@@ -59,38 +75,50 @@ AudioCallbackRecordTarget::~AudioCallbackRecordTarget()
     
     m_viewManager->setAudioRecordTarget(nullptr);
 
-    QMutexLocker locker(&m_bufPtrMutex);
-    for (int c = 0; c < m_bufferCount; ++c) {
-        delete m_buffers[c];
+    m_recording = false;
+    while (m_putting > 0) {
+        QThread::usleep(100);
     }
-    delete[] m_buffers;
+    
+    stopWriter();
+
+    delete m_buffers.exchange(nullptr);
+    m_bufferScavenger.scavenge(true);
 }
 
 void
 AudioCallbackRecordTarget::recreateBuffers()
 {
-    static int bufferSize = 441000;
-    
     int count = m_recordChannelCount;
 
-    if (count > m_bufferCount) {
+    RingBufferVector *current = m_buffers;
+    if (current && int(current->size()) >= count) {
+        return;
+    }
 
-        RingBuffer<float> **newBuffers = new RingBuffer<float> *[count];
-        for (int c = 0; c < m_bufferCount; ++c) {
-            newBuffers[c] = m_buffers[c];
-        }
-        for (int c = m_bufferCount; c < count; ++c) {
-            newBuffers[c] = new RingBuffer<float>(bufferSize);
-        }
+    RingBufferVector *newBuffers = new RingBufferVector;
+    for (int c = 0; c < count; ++c) {
+        newBuffers->push_back(new RingBuffer<float>(ringBufferSize));
+    }
 
-        // This is the only place where m_buffers is rewritten and
-        // should be the only possible source of contention against
-        // putSamples for this mutex (as the model-updating code is
-        // supposed to run in the same thread as this)
-        QMutexLocker locker(&m_bufPtrMutex);
-        delete[] m_buffers;
-        m_buffers = newBuffers;
-        m_bufferCount = count;
+    // The writer thread must not be draining the old buffers while
+    // we swap them; the audio thread may still be writing to them,
+    // which is why they go to the scavenger rather than being
+    // deleted here
+    QMutexLocker locker(&m_writerMutex);
+
+    RingBufferVector *old = m_buffers.exchange(newBuffers);
+    if (old) {
+        m_bufferScavenger.claim(old);
+    }
+
+    // Preallocate the writer's buffers for the largest chunk it
+    // drains at once
+    m_drainBuffers.resize(count);
+    m_drainPtrs.resize(count);
+    for (int c = 0; c < count; ++c) {
+        m_drainBuffers[c].resize(writerChunkFrames * 4, 0.f);
+        m_drainPtrs[c] = m_drainBuffers[c].data();
     }
 }    
     
@@ -132,49 +160,100 @@ AudioCallbackRecordTarget::setSystemRecordChannelCount(int c)
 void
 AudioCallbackRecordTarget::putSamples(const float *const *samples, int, int nframes)
 {
-    // This may be called from RT context, and in a different thread
-    // from everything else in this class. It takes a mutex that
-    // should almost never be contended (see recreateBuffers())
-    if (!m_recording) return;
-
-    QMutexLocker locker(&m_bufPtrMutex);
-    if (m_buffers && m_bufferCount >= m_recordChannelCount) {
-        for (int c = 0; c < m_recordChannelCount; ++c) {
-            m_buffers[c]->write(samples[c], nframes);
+    // This is called from RT context, and in a different thread from
+    // everything else in this class. It must not lock or allocate.
+
+    ++m_putting;
+
+    if (m_recording) {
+        RingBufferVector *buffers = m_buffers;
+        int channels = m_recordChannelCount;
+        if (buffers && int(buffers->size()) >= channels) {
+            for (int c = 0; c < channels; ++c) {
+                (*buffers)[c]->write(samples[c], nframes);
+            }
+            if (channels > 0 &&
+                (*buffers)[0]->getReadSpace() >= writerChunkFrames) {
+                m_writerSignal.signal();
+            }
         }
     }
+
+    --m_putting;
 }
 
 void
-AudioCallbackRecordTarget::updateModel()
+AudioCallbackRecordTarget::WriterThread::run()
 {
-#ifdef DEBUG_AUDIO_CALLBACK_RECORD_TARGET
-    cerr << "AudioCallbackRecordTarget::updateModel" << endl;
-#endif
+    while (!m_exiting) {
+        m_target.m_writerSignal.wait(writerTimeout);
+        m_target.drainBuffers();
+    }
+}
+
+void
+AudioCallbackRecordTarget::drainBuffers()
+{
+    // Called from the writer thread, and from the GUI thread once the
+    // writer thread has stopped. The model is only replaced or
+    // cleared while the writer thread is stopped.
     
-    sv_frame_t frameToEmit = 0;
+    QMutexLocker locker(&m_writerMutex);
 
-    int nframes = 0;
-    for (int c = 0; c < m_recordChannelCount; ++c) {
-        if (c == 0 || m_buffers[c]->getReadSpace() < nframes) {
-            nframes = m_buffers[c]->getReadSpace();
-        }
+    if (!m_model) {
+        return;
     }
-
-    if (nframes == 0) {
-#ifdef DEBUG_AUDIO_CALLBACK_RECORD_TARGET
-        cerr << "AudioCallbackRecordTarget::updateModel: no frames available" << endl;
-#endif 
-        if (m_recording) {
-            QTimer::singleShot(recordUpdateTimeout, this, SLOT(updateModel()));
-        }    
+    
+    RingBufferVector *buffers = m_buffers;
+    int channels = m_recordChannelCount;
+    if (!buffers || int(buffers->size()) < channels ||
+        int(m_drainPtrs.size()) < channels) {
         return;
     }
 
+    int chunk = int(m_drainBuffers[0].size());
+    
+    while (true) {
+
+        int nframes = 0;
+        for (int c = 0; c < channels; ++c) {
+            int here = (*buffers)[c]->getReadSpace();
+            if (c == 0 || here < nframes) {
+                nframes = here;
+            }
+        }
+
+        if (nframes == 0) {
+            break;
+        }
+        if (nframes > chunk) {
+            nframes = chunk;
+        }
+        
 #ifdef DEBUG_AUDIO_CALLBACK_RECORD_TARGET
-    cerr << "AudioCallbackRecordTarget::updateModel: have " << nframes << " frames" << endl;
+        cerr << "AudioCallbackRecordTarget::drainBuffers: writing " << nframes << " frames" << endl;
 #endif
 
+        for (int c = 0; c < channels; ++c) {
+            (*buffers)[c]->read(m_drainPtrs[c], nframes);
+        }
+
+        {
+            QMutexLocker modelLocker(&m_modelMutex);
+            m_model->addSamples(m_drainPtrs.data(), nframes);
+        }
+        
+        m_frameCount += nframes;
+    }
+}
+
+void
+AudioCallbackRecordTarget::updateModel()
+{
+    // Called from the GUI thread on a timer while recording, to have
+    // the model and any views catch up with what the writer thread
+    // has written
+    
     if (!m_model) {
 #ifdef DEBUG_AUDIO_CALLBACK_RECORD_TARGET
         cerr << "AudioCallbackRecordTarget::updateModel: have no model to update; I am hoping there is a good reason for this" << endl;
@@ -182,28 +261,22 @@ AudioCallbackRecordTarget::updateModel()
         return;
     }
 
-    float **samples = new float *[m_recordChannelCount];
-    for (int c = 0; c < m_recordChannelCount; ++c) {
-        samples[c] = new float[nframes];
-        m_buffers[c]->read(samples[c], nframes);
+    sv_frame_t frameToEmit = m_frameCount;
+    if (frameToEmit == m_frameCountAtUpdate) {
+        return;
     }
 
-    m_model->addSamples(samples, nframes);
-
-    for (int c = 0; c < m_recordChannelCount; ++c) {
-        delete[] samples[c];
+    {
+        QMutexLocker locker(&m_modelMutex);
+        m_model->updateModel();
     }
-    delete[] samples;
-    
-    m_frameCount += nframes;
-    
-    m_model->updateModel();
-    frameToEmit = m_frameCount;
-    emit recordDurationChanged(frameToEmit, m_recordSampleRate);
 
-    if (m_recording) {
-        QTimer::singleShot(recordUpdateTimeout, this, SLOT(updateModel()));
-    }    
+#ifdef DEBUG_AUDIO_CALLBACK_RECORD_TARGET
+    cerr << "AudioCallbackRecordTarget::updateModel: now have " << frameToEmit << " frames" << endl;
+#endif
+
+    m_frameCountAtUpdate = frameToEmit;
+    emit recordDurationChanged(frameToEmit, m_recordSampleRate);
 }
 
 void
@@ -226,6 +299,16 @@ AudioCallbackRecordTarget::getInputLevels(float &left, float &right)
     return valid;
 }
 
+void
+AudioCallbackRecordTarget::stopWriter()
+{
+    if (!m_writerThread) return;
+    m_writerThread->exit();
+    m_writerThread->wait();
+    delete m_writerThread;
+    m_writerThread = nullptr;
+}
+
 void
 AudioCallbackRecordTarget::modelAboutToBeDeleted()
 {
@@ -233,8 +316,10 @@ AudioCallbackRecordTarget::modelAboutToBeDeleted()
 #ifdef DEBUG_AUDIO_CALLBACK_RECORD_TARGET
         cerr << "AudioCallbackRecordTarget::modelAboutToBeDeleted: taking note" << endl;
 #endif
-        m_model = nullptr;
         m_recording = false;
+        m_updateTimer->stop();
+        stopWriter();
+        m_model = nullptr;
     } else if (m_model) {
         SVCERR << "WARNING: AudioCallbackRecordTarget::modelAboutToBeDeleted: this is not my model!" << endl;
     }
@@ -250,6 +335,7 @@ AudioCallbackRecordTarget::startRecording()
 
     m_model = nullptr;
     m_frameCount = 0;
+    m_frameCountAtUpdate = 0;
 
     QString folder = RecordDirectory::getRecordDirectory();
     if (folder == "") return nullptr;
@@ -285,11 +371,22 @@ AudioCallbackRecordTarget::startRecording()
             this, SLOT(modelAboutToBeDeleted()));
 
     m_model->setObjectName(label);
+
+    // Nothing is writing to the ring buffers while we are not
+    // recording, so anything left from a recording whose model went
+    // away can safely be discarded here
+    if (RingBufferVector *buffers = m_buffers) {
+        for (auto rb: *buffers) rb->reset();
+    }
+    
+    m_writerThread = new WriterThread(*this);
+    m_writerThread->start();
+    
     m_recording = true;
 
     emit recordStatusChanged(true);
 
-    QTimer::singleShot(recordUpdateTimeout, this, SLOT(updateModel()));
+    m_updateTimer->start();
     
     return m_model;
 }
@@ -304,11 +401,20 @@ AudioCallbackRecordTarget::stopRecording()
 
     m_recording = false;
 
-    m_bufPtrMutex.lock();
-    m_bufPtrMutex.unlock();
+    // Wait for any audio callback that had already seen us recording
+    while (m_putting > 0) {
+        QThread::usleep(100);
+    }
+
+    m_updateTimer->stop();
+    stopWriter();
 
-    // buffers should now be up-to-date
-    updateModel();
+    // The buffers are now complete, and nothing else is draining
+    // them
+    drainBuffers();
+    m_model->updateModel();
+    m_frameCountAtUpdate = m_frameCount;
+    emit recordDurationChanged(m_frameCount, m_recordSampleRate);
 
     m_model->writeComplete();
     m_model = nullptr;
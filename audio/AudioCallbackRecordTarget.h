@@ -21,16 +21,36 @@
 
 #include <string>
 #include <atomic>
+#include <vector>
 
 #include <QObject>
 #include <QMutex>
 
 #include "base/BaseTypes.h"
 #include "base/RingBuffer.h"
+#include "base/Scavenger.h"
+#include "base/Thread.h"
+
+#include "RTSignal.h"
 
 class ViewManagerBase;
 class WritableWaveFileModel;
-
+class QTimer;
+
+/**
+ * Record target that streams incoming audio to a
+ * WritableWaveFileModel. The audio thread only writes into ring
+ * buffers, taking no lock and allocating nothing. A writer thread
+ * drains the ring buffers a chunk at a time, through buffers
+ * preallocated for the largest chunk, and passes each chunk to the
+ * model, which writes it to disk. The GUI thread does no disk
+ * writing: at a fixed interval it calls the model's updateModel,
+ * which is when the model's reader, and so its views, learn how many
+ * frames have been written. A lock serialises the two, so that the
+ * reader is never updated part way through a write. If the disk
+ * cannot keep up, the ring buffers fill and further input is
+ * dropped, rather than being held in memory without limit.
+ */
 class AudioCallbackRecordTarget : public QObject,
                                   public AudioRecordTarget,
                                   public breakfastquay::ApplicationRecordTarget
@@ -90,18 +110,71 @@ private:
     std::string m_clientName;
     std::atomic_bool m_recording;
     sv_samplerate_t m_recordSampleRate;
-    int m_recordChannelCount;
-    sv_frame_t m_frameCount;
+    std::atomic<int> m_recordChannelCount;
+    std::atomic<sv_frame_t> m_frameCount;
+    sv_frame_t m_frameCountAtUpdate;
     QString m_audioFileName;
     WritableWaveFileModel *m_model;
-    RingBuffer<float> **m_buffers;
-    QMutex m_bufPtrMutex;
-    int m_bufferCount;
-    float m_inputLeft;
-    float m_inputRight;
-    bool m_levelsSet;
+    QTimer *m_updateTimer;
+
+    class RingBufferVector : public std::vector<RingBuffer<float> *> {
+    public:
+        virtual ~RingBufferVector() {
+            for (auto rb: *this) delete rb;
+        }
+    };
+
+    // Replaced only in recreateBuffers. The audio thread takes one
+    // snapshot of this pointer per callback, and the old vector is
+    // released via m_bufferScavenger once no callback can still be
+    // using it.
+    std::atomic<RingBufferVector *> m_buffers;
+    Scavenger<RingBufferVector> m_bufferScavenger;
+
+    // Count of audio callbacks currently in putSamples, so that
+    // stopRecording can tell when the last of them has finished
+    std::atomic<int> m_putting;
+
+    // Held by the writer thread while draining the ring buffers, and
+    // by the GUI thread when changing m_buffers. Never taken by the
+    // audio thread.
+    QMutex m_writerMutex;
+    std::vector<std::vector<float>> m_drainBuffers;
+    std::vector<float *> m_drainPtrs;
+
+    // Held by the writer thread while passing a chunk to the model,
+    // and by the GUI thread while calling the model's updateModel.
+    // Each hold on the writer thread is one chunk's disk write, so
+    // the GUI thread never waits for long. Taken after m_writerMutex
+    // where both are held.
+    QMutex m_modelMutex;
+
+    class WriterThread : public Thread
+    {
+    public:
+        WriterThread(AudioCallbackRecordTarget &target) :
+            Thread(Thread::NonRTThread),
+            m_target(target),
+            m_exiting(false) { }
+
+        void run() override;
+        void exit() { m_exiting = true; m_target.m_writerSignal.signal(); }
+
+    private:
+        AudioCallbackRecordTarget &m_target;
+        std::atomic<bool> m_exiting;
+    };
+
+    WriterThread *m_writerThread;
+    RTSignal m_writerSignal;
+
+    std::atomic<float> m_inputLeft;
+    std::atomic<float> m_inputRight;
+    std::atomic<bool> m_levelsSet;
 
     void recreateBuffers();
+    void drainBuffers();
+    void stopWriter();
 };
 
 #endif
@@ -30,8 +30,13 @@
 #include "ClipMixer.h"
 #include "ContinuousSynth.h"
 
+#include "bqvec/VectorOps.h"
+
+using breakfastquay::v_add_with_gain;
+
 #include <iostream>
 #include <cmath>
+#include <algorithm>
 
 #include <QDir>
 #include <QFile>
@@ -48,10 +53,7 @@ AudioGenerator::AudioGenerator() :
     m_sourceSampleRate(0),
     m_targetChannelCount(1),
     m_waveType(0),
-    m_soloing(false),
-    m_channelBuffer(nullptr),
-    m_channelBufSiz(0),
-    m_channelBufCount(0)
+    m_soloing(false)
 {
     initialiseSampleDir();
 
@@ -66,11 +68,6 @@ AudioGenerator::~AudioGenerator()
 #ifdef DEBUG_AUDIO_GENERATOR
     cerr << "AudioGenerator::~AudioGenerator" << endl;
 #endif
-
-    for (int i = 0; i < m_channelBufCount; ++i) {
-        delete[] m_channelBuffer[i];
-    }
-    delete[] m_channelBuffer;
 }
 
 void
@@ -116,7 +113,7 @@ AudioGenerator::addModel(ModelId modelId)
     auto model = ModelById::get(modelId);
     if (!model) return false;
     if (!model->canPlay()) return false;
-    
+
     if (m_sourceSampleRate == 0) {
 
         m_sourceSampleRate = model->getSampleRate();
@@ -145,8 +142,14 @@ AudioGenerator::addModel(ModelId modelId)
     if (usesClipMixer(modelId)) {
         ClipMixer *mixer = makeClipMixerFor(modelId);
         if (mixer) {
-            QMutexLocker locker(&m_mutex);
-            m_clipMixerMap[modelId] = mixer;
+            {
+                QWriteLocker locker(&m_lock);
+                m_clipMixerMap[modelId] = mixer;
+                m_noteOffs[modelId] = NoteOffList();
+                m_schedules[modelId] = Schedule();
+            }
+            connectForSchedule(model.get());
+            updateSchedule(modelId, 0, 0);
             return willPlay;
         }
     }
@@ -154,8 +157,13 @@ AudioGenerator::addModel(ModelId modelId)
     if (usesContinuousSynth(modelId)) {
         ContinuousSynth *synth = makeSynthFor(modelId);
         if (synth) {
-            QMutexLocker locker(&m_mutex);
-            m_continuousSynthMap[modelId] = synth;
+            {
+                QWriteLocker locker(&m_lock);
+                m_continuousSynthMap[modelId] = synth;
+                m_schedules[modelId] = Schedule();
+            }
+            connectForSchedule(model.get());
+            updateSchedule(modelId, 0, 0);
             return willPlay;
         }
     }
@@ -163,6 +171,151 @@ AudioGenerator::addModel(ModelId modelId)
     return false;
 }
 
+void
+AudioGenerator::connectForSchedule(Model *model)
+{
+    connect(model, SIGNAL(modelChanged(ModelId)),
+            this, SLOT(modelChanged(ModelId)));
+    connect(model, SIGNAL(modelChangedWithin(ModelId, sv_frame_t, sv_frame_t)),
+            this, SLOT(modelChangedWithin(ModelId, sv_frame_t, sv_frame_t)));
+}
+
+void
+AudioGenerator::modelChanged(ModelId modelId)
+{
+    updateSchedule(modelId, 0, 0);
+}
+
+void
+AudioGenerator::modelChangedWithin(ModelId modelId,
+                                   sv_frame_t startFrame,
+                                   sv_frame_t endFrame)
+{
+    updateSchedule(modelId, startFrame, endFrame);
+}
+
+void
+AudioGenerator::updateSchedule(ModelId modelId,
+                               sv_frame_t startFrame,
+                               sv_frame_t endFrame)
+{
+    bool all = (endFrame <= startFrame);
+
+    // Query the model without the lock held, as this may take a
+    // while, and then splice the results in with it
+
+    std::vector<ScheduledNote> notes;
+    std::vector<ScheduledValue> values;
+
+    if (usesClipMixer(modelId)) {
+        auto exportable = ModelById::getAs<NoteExportable>(modelId);
+        if (!exportable) return;
+        NoteList list = all ?
+            exportable->getNotes() :
+            exportable->getNotesStartingWithin(startFrame,
+                                               endFrame - startFrame);
+        notes.reserve(list.size());
+        for (const auto &n: list) {
+            if (n.duration == 0) {
+                // If we have a note-off and a note-on with the same
+                // time, then the note-off will be assumed (in the
+                // logic in mixClipModel that deals with two-point
+                // note-on/off events) to be switching off an earlier
+                // note before this one begins -- that's necessary in
+                // order to support adjoining notes of equal pitch. But
+                // it does mean we have to explicitly ignore
+                // zero-duration notes, otherwise they'll be played
+                // without end
+                continue;
+            }
+            notes.push_back({ n.start, n.duration, n.getFrequency(),
+                              float(n.velocity) / 127.0f });
+        }
+    } else if (usesContinuousSynth(modelId)) {
+        auto stvm = ModelById::getAs<SparseTimeValueModel>(modelId);
+        if (!stvm) return;
+        EventVector events = all ?
+            stvm->getAllEvents() :
+            stvm->getEventsStartingWithin(startFrame, endFrame - startFrame);
+        values.reserve(events.size());
+        for (const auto &e: events) {
+            values.push_back({ e.getFrame(), e.getValue() });
+        }
+    } else {
+        return;
+    }
+
+    // Resample the clip for any new pitches now, so that the mix
+    // never has to. The mixers are only replaced on this thread, so
+    // the pointer stays valid until we take the lock again
+    
+    ClipMixer *mixer = nullptr;
+    ClipMixer::ResampledClips resampled;
+    if (!notes.empty()) {
+        {
+            QReadLocker locker(&m_lock);
+            auto mi = m_clipMixerMap.find(modelId);
+            if (mi != m_clipMixerMap.end()) mixer = mi->second;
+        }
+        if (mixer) {
+            std::vector<float> frequencies;
+            for (const auto &n: notes) {
+                frequencies.push_back(n.frequency);
+            }
+            std::sort(frequencies.begin(), frequencies.end());
+            frequencies.erase(std::unique(frequencies.begin(),
+                                          frequencies.end()),
+                              frequencies.end());
+            resampled = mixer->resampleFor(frequencies);
+        }
+    }
+    
+    QWriteLocker locker(&m_lock);
+
+    if (!resampled.empty()) {
+        auto mi = m_clipMixerMap.find(modelId);
+        if (mi != m_clipMixerMap.end() && mi->second == mixer) {
+            mixer->addResampledClips(std::move(resampled));
+        }
+    }
+    
+    auto si = m_schedules.find(modelId);
+    if (si == m_schedules.end()) return;
+    Schedule &schedule = si->second;
+
+    if (all) {
+        schedule.notes = notes;
+        schedule.values = values;
+    } else {
+        auto nfrom = std::lower_bound
+            (schedule.notes.begin(), schedule.notes.end(), startFrame,
+             [](const ScheduledNote &n, sv_frame_t f) { return n.start < f; });
+        auto nto = std::lower_bound
+            (nfrom, schedule.notes.end(), endFrame,
+             [](const ScheduledNote &n, sv_frame_t f) { return n.start < f; });
+        nfrom = schedule.notes.erase(nfrom, nto);
+        schedule.notes.insert(nfrom, notes.begin(), notes.end());
+
+        auto vfrom = std::lower_bound
+            (schedule.values.begin(), schedule.values.end(), startFrame,
+             [](const ScheduledValue &v, sv_frame_t f) { return v.frame < f; });
+        auto vto = std::lower_bound
+            (vfrom, schedule.values.end(), endFrame,
+             [](const ScheduledValue &v, sv_frame_t f) { return v.frame < f; });
+        vfrom = schedule.values.erase(vfrom, vto);
+        schedule.values.insert(vfrom, values.begin(), values.end());
+    }
+
+    // force the cursor to be found again
+    schedule.nextFrame = -1;
+
+#ifdef DEBUG_AUDIO_GENERATOR
+    cerr << "AudioGenerator::updateSchedule(" << modelId << "): now have "
+         << schedule.notes.size() << " notes and " << schedule.values.size()
+         << " values" << endl;
+#endif
+}
+
 void
 AudioGenerator::playClipIdChanged(int playableId, QString)
 {
@@ -175,10 +328,14 @@ AudioGenerator::playClipIdChanged(int playableId, QString)
 
     ClipMixer *mixer = makeClipMixerFor(modelId);
     if (mixer) {
-        QMutexLocker locker(&m_mutex);
-        ClipMixer *oldMixer = m_clipMixerMap[modelId];
-        m_clipMixerMap[modelId] = mixer;
-        delete oldMixer;
+        {
+            QWriteLocker locker(&m_lock);
+            ClipMixer *oldMixer = m_clipMixerMap[modelId];
+            m_clipMixerMap[modelId] = mixer;
+            delete oldMixer;
+        }
+        // to resample the new clip for the model's pitches
+        updateSchedule(modelId, 0, 0);
     }
 }
 
@@ -268,33 +425,43 @@ AudioGenerator::makeSynthFor(ModelId)
 void
 AudioGenerator::removeModel(ModelId modelId)
 {
-    QMutexLocker locker(&m_mutex);
+    if (auto model = ModelById::get(modelId)) {
+        disconnect(model.get(), nullptr, this, nullptr);
+    }
+    
+    QWriteLocker locker(&m_lock);
 
+    m_schedules.erase(modelId);
+    
     if (m_clipMixerMap.find(modelId) == m_clipMixerMap.end()) {
         return;
     }
 
     ClipMixer *mixer = m_clipMixerMap[modelId];
     m_clipMixerMap.erase(modelId);
+    m_noteOffs.erase(modelId);
     delete mixer;
 }
 
 void
 AudioGenerator::clearModels()
 {
-    QMutexLocker locker(&m_mutex);
+    QWriteLocker locker(&m_lock);
 
     while (!m_clipMixerMap.empty()) {
         ClipMixer *mixer = m_clipMixerMap.begin()->second;
         m_clipMixerMap.erase(m_clipMixerMap.begin());
         delete mixer;
     }
+
+    m_noteOffs.clear();
+    m_schedules.clear();
 }    
 
 void
 AudioGenerator::reset()
 {
-    QMutexLocker locker(&m_mutex);
+    QWriteLocker locker(&m_lock);
 
 #ifdef DEBUG_AUDIO_GENERATOR
     cerr << "AudioGenerator::reset()" << endl;
@@ -307,7 +474,15 @@ AudioGenerator::reset()
         }
     }
 
-    m_noteOffs.clear();
+    // Clear the pending note-offs but keep an (empty) entry for each
+    // model, so that mixClipModel never needs to insert one
+    for (auto &n: m_noteOffs) {
+        n.second.clear();
+    }
+
+    for (auto &sc: m_schedules) {
+        sc.second.nextFrame = -1;
+    }
 }
 
 void
@@ -317,7 +492,7 @@ AudioGenerator::setTargetChannelCount(int targetChannelCount)
 
 //    SVDEBUG << "AudioGenerator::setTargetChannelCount(" << targetChannelCount << ")" << endl;
 
-    QMutexLocker locker(&m_mutex);
+    QWriteLocker locker(&m_lock);
     m_targetChannelCount = targetChannelCount;
 
     for (ClipMixerMap::iterator i = m_clipMixerMap.begin(); i != m_clipMixerMap.end(); ++i) {
@@ -334,7 +509,7 @@ AudioGenerator::getBlockSize() const
 void
 AudioGenerator::setSoloModelSet(std::set<ModelId> s)
 {
-    QMutexLocker locker(&m_mutex);
+    QWriteLocker locker(&m_lock);
 
     m_soloModelSet = s;
     m_soloing = true;
@@ -343,7 +518,7 @@ AudioGenerator::setSoloModelSet(std::set<ModelId> s)
 void
 AudioGenerator::clearSoloModelSet()
 {
-    QMutexLocker locker(&m_mutex);
+    QWriteLocker locker(&m_lock);
 
     m_soloModelSet.clear();
     m_soloing = false;
@@ -360,7 +535,7 @@ AudioGenerator::mixModel(ModelId modelId,
         return frameCount;
     }
 
-    QMutexLocker locker(&m_mutex);
+    QReadLocker locker(&m_lock);
 
     auto model = ModelById::get(modelId);
     if (!model || !model->canPlay()) return frameCount;
@@ -416,63 +591,22 @@ AudioGenerator::mixDenseTimeValueModel(ModelId modelId,
                                        float **buffer, float gain, float pan,
                                        sv_frame_t fadeIn, sv_frame_t fadeOut)
 {
-    sv_frame_t maxFrames = frames + std::max(fadeIn, fadeOut);
-
     auto dtvm = ModelById::getAs<DenseTimeValueModel>(modelId);
     if (!dtvm) return 0;
     
     int modelChannels = dtvm->getChannelCount();
 
-    if (m_channelBufSiz < maxFrames || m_channelBufCount < modelChannels) {
-
-        for (int c = 0; c < m_channelBufCount; ++c) {
-            delete[] m_channelBuffer[c];
-        }
-
-        delete[] m_channelBuffer;
-        m_channelBuffer = new float *[modelChannels];
+    sv_frame_t readStart, readCount, missing;
+    getFadedReadRegion(startFrame, frames, fadeIn, fadeOut,
+                       readStart, readCount, missing);
 
-        for (int c = 0; c < modelChannels; ++c) {
-            m_channelBuffer[c] = new float[maxFrames];
-        }
-
-        m_channelBufCount = modelChannels;
-        m_channelBufSiz = maxFrames;
+    auto data = dtvm->getMultiChannelData(0, modelChannels - 1,
+                                          readStart, readCount);
+    if (int(data.size()) < modelChannels) {
+        return 0;
     }
 
-    sv_frame_t got = 0;
-
-    if (startFrame >= fadeIn/2) {
-
-        auto data = dtvm->getMultiChannelData(0, modelChannels - 1,
-                                              startFrame - fadeIn/2,
-                                              frames + fadeOut/2 + fadeIn/2);
-
-        for (int c = 0; c < modelChannels; ++c) {
-            copy(data[c].begin(), data[c].end(), m_channelBuffer[c]);
-        }
-
-        got = data[0].size();
-
-    } else {
-        sv_frame_t missing = fadeIn/2 - startFrame;
-
-        if (missing > 0) {
-            cerr << "note: channelBufSiz = " << m_channelBufSiz
-                 << ", frames + fadeOut/2 = " << frames + fadeOut/2 
-                 << ", startFrame = " << startFrame 
-                 << ", missing = " << missing << endl;
-        }
-
-        auto data = dtvm->getMultiChannelData(0, modelChannels - 1,
-                                              startFrame,
-                                              frames + fadeOut/2);
-        for (int c = 0; c < modelChannels; ++c) {
-            copy(data[c].begin(), data[c].end(), m_channelBuffer[c] + missing);
-        }
-
-        got = data[0].size() + missing;
-    }            
+    sv_frame_t got = sv_frame_t(data[0].size()) + missing;
 
     for (int c = 0; c < m_targetChannelCount; ++c) {
 
@@ -489,29 +623,100 @@ AudioGenerator::mixDenseTimeValueModel(ModelId modelId,
             }
         }
 
-        for (sv_frame_t i = 0; i < fadeIn/2; ++i) {
-            float *back = buffer[c];
-            back -= fadeIn/2;
-            back[i] +=
-                (channelGain * m_channelBuffer[sourceChannel][i] * float(i))
-                / float(fadeIn);
-        }
+        mixFadedChannel(data[sourceChannel].data(), missing, got,
+                        buffer[c], channelGain, frames, fadeIn, fadeOut);
+    }
+
+    return got;
+}
+
+void
+AudioGenerator::getFadedReadRegion(sv_frame_t startFrame, sv_frame_t frames,
+                                   sv_frame_t fadeIn, sv_frame_t fadeOut,
+                                   sv_frame_t &readStart,
+                                   sv_frame_t &readCount,
+                                   sv_frame_t &missing)
+{
+    // Read from fadeIn/2 before the start frame, if there is that
+    // much before it, so as to have something to fade in from. We mix
+    // straight from the returned channel data, rather than copying it
+    // into a buffer of our own: element i of the region being mixed
+    // is at index i - missing in the data, and anything outside it is
+    // treated as silence.
+
+    missing = 0;
+    readStart = startFrame - fadeIn/2;
+    readCount = frames + fadeOut/2 + fadeIn/2;
+
+    if (startFrame < fadeIn/2) {
+        missing = fadeIn/2 - startFrame;
+        readStart = startFrame;
+        readCount = frames + fadeOut/2;
+#ifdef DEBUG_AUDIO_GENERATOR
+        cerr << "note: frames + fadeOut/2 = " << frames + fadeOut/2 
+             << ", startFrame = " << startFrame 
+             << ", missing = " << missing << endl;
+#endif
+    }
+}
+
+void
+AudioGenerator::mixFadedChannel(const float *source,
+                                sv_frame_t missing, sv_frame_t got,
+                                float *target, float channelGain,
+                                sv_frame_t frames,
+                                sv_frame_t fadeIn, sv_frame_t fadeOut)
+{
+    auto sample = [&](sv_frame_t i) {
+        return (i >= missing && i < got) ? source[i - missing] : 0.f;
+    };
+        
+    for (sv_frame_t i = 0; i < fadeIn/2; ++i) {
+        float *back = target;
+        back -= fadeIn/2;
+        back[i] +=
+            (channelGain * sample(i) * float(i))
+            / float(fadeIn);
+    }
 
-        for (sv_frame_t i = 0; i < frames + fadeOut/2; ++i) {
+    // The mix is split into a fade-in segment, a steady segment with
+    // constant gain, and a fade-out segment. Only the short fade
+    // segments need the per-sample gain calculation; the steady
+    // segment, which is nearly all of it, is a plain multiply-add
+    // that can be vectorised. Samples outside the data read
+    // contribute nothing, so the steady segment is limited to that.
+        
+    sv_frame_t total = frames + fadeOut/2;
+    sv_frame_t fadeInEnd = std::min(fadeIn/2, total);
+    sv_frame_t fadeOutStart = std::max(fadeInEnd,
+                                       std::min(frames - fadeOut/2 + 1,
+                                                total));
+    sv_frame_t steadyStart = std::max(fadeInEnd, missing);
+    sv_frame_t steadyEnd = std::max(steadyStart,
+                                    std::min(fadeOutStart, got));
+
+    auto mixFaded = [&](sv_frame_t from, sv_frame_t to) {
+        for (sv_frame_t i = from; i < to; ++i) {
             float mult = channelGain;
             if (i < fadeIn/2) {
                 mult = (mult * float(i)) / float(fadeIn);
             }
             if (i > frames - fadeOut/2) {
-                mult = (mult * float((frames + fadeOut/2) - i)) / float(fadeOut);
+                mult = (mult * float(total - i)) / float(fadeOut);
             }
-            float val = m_channelBuffer[sourceChannel][i];
-            if (i >= got) val = 0.f;
-            buffer[c][i] += mult * val;
+            target[i] += mult * sample(i);
         }
-    }
+    };
 
-    return got;
+    mixFaded(0, fadeInEnd);
+        
+    if (steadyEnd > steadyStart) {
+        v_add_with_gain(target + steadyStart,
+                        source + (steadyStart - missing),
+                        channelGain, int(steadyEnd - steadyStart));
+    }
+        
+    mixFaded(fadeOutStart, total);
 }
   
 sv_frame_t
@@ -519,10 +724,15 @@ AudioGenerator::mixClipModel(ModelId modelId,
                              sv_frame_t startFrame, sv_frame_t frames,
                              float **buffer, float gain, float pan)
 {
-    ClipMixer *clipMixer = m_clipMixerMap[modelId];
-    if (!clipMixer) return 0;
+    auto mi = m_clipMixerMap.find(modelId);
+    if (mi == m_clipMixerMap.end() || !mi->second) return 0;
+    ClipMixer *clipMixer = mi->second;
 
-    auto exportable = ModelById::getAs<NoteExportable>(modelId);
+    auto ni = m_noteOffs.find(modelId);
+    if (ni == m_noteOffs.end()) return 0;
+
+    auto si = m_schedules.find(modelId);
+    if (si == m_schedules.end()) return 0;
     
     int blocks = int(frames / m_processingBlockSize);
     
@@ -549,26 +759,35 @@ AudioGenerator::mixClipModel(ModelId modelId,
     ClipMixer::NoteStart on;
     ClipMixer::NoteEnd off;
 
-    NoteOffSet &noteOffs = m_noteOffs[modelId];
+    NoteOffList &noteOffs = ni->second;
+    Schedule &schedule = si->second;
+    const std::vector<ScheduledNote> &notes = schedule.notes;
+
+    schedule.bufferIndexes.resize(m_targetChannelCount);
+    float **bufferIndexes = schedule.bufferIndexes.data();
 
-    float **bufferIndexes = new float *[m_targetChannelCount];
+    std::vector<ClipMixer::NoteStart> &starts = schedule.starts;
+    std::vector<ClipMixer::NoteEnd> &ends = schedule.ends;
 
     //!!! + for first block, prime with notes already active
     
     for (int i = 0; i < blocks; ++i) {
 
         sv_frame_t reqStart = startFrame + i * m_processingBlockSize;
-
-        NoteList notes;
-        if (exportable) {
-            notes = exportable->getNotesStartingWithin(reqStart,
-                                                       m_processingBlockSize);
+        sv_frame_t reqEnd = reqStart + m_processingBlockSize;
+
+        if (reqStart != schedule.nextFrame) {
+            schedule.cursor = std::lower_bound
+                (notes.begin(), notes.end(), reqStart,
+                 [](const ScheduledNote &n, sv_frame_t f) {
+                     return n.start < f;
+                 }) - notes.begin();
         }
 
-        std::vector<ClipMixer::NoteStart> starts;
-        std::vector<ClipMixer::NoteEnd> ends;
+        starts.clear();
+        ends.clear();
 
-        while (noteOffs.begin() != noteOffs.end() &&
+        while (!noteOffs.empty() &&
                noteOffs.begin()->onFrame > reqStart) {
 
             // We must have jumped back in time, as there is a
@@ -585,34 +804,16 @@ AudioGenerator::mixClipModel(ModelId modelId,
             ends.push_back(off);
             noteOffs.erase(noteOffs.begin());
         }
-        
-        for (NoteList::const_iterator ni = notes.begin();
-             ni != notes.end(); ++ni) {
 
-            sv_frame_t noteFrame = ni->start;
-            sv_frame_t noteDuration = ni->duration;
+        while (schedule.cursor < notes.size() &&
+               notes[schedule.cursor].start < reqEnd) {
 
-            if (noteFrame < reqStart ||
-                noteFrame >= reqStart + m_processingBlockSize) {
-                continue;
-            }
-
-            if (noteDuration == 0) {
-                // If we have a note-off and a note-on with the same
-                // time, then the note-off will be assumed (in the
-                // logic below that deals with two-point note-on/off
-                // events) to be switching off an earlier note before
-                // this one begins -- that's necessary in order to
-                // support adjoining notes of equal pitch. But it does
-                // mean we have to explicitly ignore zero-duration
-                // notes, otherwise they'll be played without end
-#ifdef DEBUG_AUDIO_GENERATOR
-                cerr << "mixModel [clip]: zero-duration note found at frame " << noteFrame << ", skipping it" << endl;
-#endif
-                continue;
-            }
+            const ScheduledNote &note = notes[schedule.cursor++];
+            
+            sv_frame_t noteFrame = note.start;
+            sv_frame_t noteDuration = note.duration;
 
-            while (noteOffs.begin() != noteOffs.end() &&
+            while (!noteOffs.empty() &&
                    noteOffs.begin()->offFrame <= noteFrame) {
 
                 sv_frame_t eventFrame = noteOffs.begin()->offFrame;
@@ -630,8 +831,8 @@ AudioGenerator::mixClipModel(ModelId modelId,
             }
 
             on.frameOffset = noteFrame - reqStart;
-            on.frequency = ni->getFrequency();
-            on.level = float(ni->velocity) / 127.0f;
+            on.frequency = note.frequency;
+            on.level = note.level;
             on.pan = pan;
 
 #ifdef DEBUG_AUDIO_GENERATOR
@@ -639,13 +840,15 @@ AudioGenerator::mixClipModel(ModelId modelId,
 #endif
             
             starts.push_back(on);
-            noteOffs.insert
-                (NoteOff(on.frequency, noteFrame + noteDuration, noteFrame));
+
+            NoteOff pending(on.frequency, noteFrame + noteDuration, noteFrame);
+            noteOffs.insert(std::upper_bound(noteOffs.begin(), noteOffs.end(),
+                                             pending, NoteOff::Comparator()),
+                            pending);
         }
 
-        while (noteOffs.begin() != noteOffs.end() &&
-               noteOffs.begin()->offFrame <=
-               reqStart + m_processingBlockSize) {
+        while (!noteOffs.empty() &&
+               noteOffs.begin()->offFrame <= reqEnd) {
 
             sv_frame_t eventFrame = noteOffs.begin()->offFrame;
             if (eventFrame < reqStart) eventFrame = reqStart;
@@ -661,6 +864,8 @@ AudioGenerator::mixClipModel(ModelId modelId,
             noteOffs.erase(noteOffs.begin());
         }
 
+        schedule.nextFrame = reqEnd;
+        
         for (int c = 0; c < m_targetChannelCount; ++c) {
             bufferIndexes[c] = buffer[c] + i * m_processingBlockSize;
         }
@@ -668,8 +873,6 @@ AudioGenerator::mixClipModel(ModelId modelId,
         clipMixer->mix(bufferIndexes, gain, starts, ends);
     }
 
-    delete[] bufferIndexes;
-
     return got;
 }
 
@@ -681,14 +884,20 @@ AudioGenerator::mixContinuousSynthModel(ModelId modelId,
                                         float gain, 
                                         float pan)
 {
-    ContinuousSynth *synth = m_continuousSynthMap[modelId];
-    if (!synth) return 0;
+    auto si = m_continuousSynthMap.find(modelId);
+    if (si == m_continuousSynthMap.end() || !si->second) return 0;
+    ContinuousSynth *synth = si->second;
 
     // only type we support here at the moment
     auto stvm = ModelById::getAs<SparseTimeValueModel>(modelId);
     if (!stvm) return 0;
     if (stvm->getScaleUnits() != "Hz") return 0;
 
+    auto sci = m_schedules.find(modelId);
+    if (sci == m_schedules.end()) return 0;
+    Schedule &schedule = sci->second;
+    const std::vector<ScheduledValue> &values = schedule.values;
+    
     int blocks = int(frames / m_processingBlockSize);
 
     //!!! todo: see comment in mixClipModel
@@ -700,25 +909,40 @@ AudioGenerator::mixContinuousSynthModel(ModelId modelId,
               << ", blocks " << blocks << endl;
 #endif
     
-    float **bufferIndexes = new float *[m_targetChannelCount];
+    schedule.bufferIndexes.resize(m_targetChannelCount);
+    float **bufferIndexes = schedule.bufferIndexes.data();
 
+    sv_frame_t resolution = stvm->getResolution();
+    
     for (int i = 0; i < blocks; ++i) {
 
         sv_frame_t reqStart = startFrame + i * m_processingBlockSize;
+        sv_frame_t reqEnd = reqStart + m_processingBlockSize;
 
         for (int c = 0; c < m_targetChannelCount; ++c) {
             bufferIndexes[c] = buffer[c] + i * m_processingBlockSize;
         }
 
-        EventVector points = 
-            stvm->getEventsStartingWithin(reqStart, m_processingBlockSize);
+        if (reqStart != schedule.nextFrame) {
+            schedule.cursor = std::lower_bound
+                (values.begin(), values.end(), reqStart,
+                 [](const ScheduledValue &v, sv_frame_t f) {
+                     return v.frame < f;
+                 }) - values.begin();
+        }
 
+        // values starting within this block are [cursor, next)
+        size_t next = schedule.cursor;
+        while (next < values.size() && values[next].frame < reqEnd) {
+            ++next;
+        }
+        
         // by default, repeat last frequency
         float f0 = 0.f;
 
         // go straight to the last freq in this range
-        if (!points.empty()) {
-            f0 = points.rbegin()->getValue();
+        if (next > schedule.cursor) {
+            f0 = values[next - 1].value;
         }
 
         // if there is no such frequency and the next point is further
@@ -726,16 +950,15 @@ AudioGenerator::mixContinuousSynthModel(ModelId modelId,
         // criterion TimeValueLayer uses for ending a discrete curve
         // segment)
         if (f0 == 0.f) {
-            Event nextP;
-            if (!stvm->getNearestEventMatching(reqStart + m_processingBlockSize,
-                                               [](Event) { return true; },
-                                               EventSeries::Forward,
-                                               nextP) ||
-                nextP.getFrame() > reqStart + 2 * stvm->getResolution()) {
+            if (next >= values.size() ||
+                values[next].frame > reqStart + 2 * resolution) {
                 f0 = -1.f;
             }
         }
 
+        schedule.cursor = next;
+        schedule.nextFrame = reqEnd;
+
 //        cerr << "f0 = " << f0 << endl;
 
         synth->mix(bufferIndexes,
@@ -744,8 +967,6 @@ AudioGenerator::mixContinuousSynthModel(ModelId modelId,
                    f0);
     }
 
-    delete[] bufferIndexes;
-
     return got;
 }
 
@@ -21,11 +21,10 @@ class FlexiNoteModel;
 class DenseTimeValueModel;
 class SparseOneDimensionalModel;
 class Playable;
-class ClipMixer;
 class ContinuousSynth;
 
 #include <QObject>
-#include <QMutex>
+#include <QReadWriteLock>
 
 #include <set>
 #include <map>
@@ -34,6 +33,8 @@ class ContinuousSynth;
 #include "base/BaseTypes.h"
 #include "data/model/Model.h"
 
+#include "ClipMixer.h"
+
 class AudioGenerator : public QObject
 {
     Q_OBJECT
@@ -80,6 +81,13 @@ public:
 
     /**
      * Mix a single model into an output buffer.
+     *
+     * This may be called concurrently from more than one thread,
+     * provided that no two concurrent calls are for the same model
+     * and that none overlaps a call to any of the other (non-const)
+     * methods. All of the generation state for a model (its clip
+     * mixer or synth, and pending note-offs) is touched only by the
+     * call mixing that model.
      */
     virtual sv_frame_t mixModel(ModelId model,
                                 sv_frame_t startFrame,
@@ -88,6 +96,37 @@ public:
                                 sv_frame_t fadeIn = 0,
                                 sv_frame_t fadeOut = 0);
 
+    /**
+     * Return the region of source data read when mixing frameCount
+     * frames of a wave model from startFrame with the given fades:
+     * readCount frames from readStart, to be placed at index
+     * "missing" onward in the faded region. See mixFadedChannel.
+     */
+    static void getFadedReadRegion(sv_frame_t startFrame,
+                                   sv_frame_t frameCount,
+                                   sv_frame_t fadeIn, sv_frame_t fadeOut,
+                                   sv_frame_t &readStart,
+                                   sv_frame_t &readCount,
+                                   sv_frame_t &missing);
+
+    /**
+     * Mix one channel of source data into a target buffer with the
+     * given gain and fades, as for a wave model in mixModel. Element
+     * i of the faded region is source[i - missing], for missing <= i
+     * < got, and silence elsewhere. The fade-in adds into the fadeIn/2
+     * frames before target, which must be valid.
+     *
+     * Because this is linear in the source, a sum of several models'
+     * samples, each already scaled by its own gain, may be mixed in
+     * one call with unit gain, giving the same result as mixing each
+     * model separately.
+     */
+    static void mixFadedChannel(const float *source,
+                                sv_frame_t missing, sv_frame_t got,
+                                float *target, float gain,
+                                sv_frame_t frameCount,
+                                sv_frame_t fadeIn, sv_frame_t fadeOut);
+
     /**
      * Specify that only the given set of models should be played.
      */
@@ -101,6 +140,8 @@ public:
 
 protected slots:
     void playClipIdChanged(int playableId, QString);
+    void modelChanged(ModelId);
+    void modelChangedWithin(ModelId, sv_frame_t startFrame, sv_frame_t endFrame);
 
 protected:
     sv_samplerate_t m_sourceSampleRate;
@@ -142,18 +183,69 @@ protected:
 
     typedef std::map<ModelId, ClipMixer *> ClipMixerMap;
 
-    typedef std::multiset<NoteOff, NoteOff::Comparator> NoteOffSet;
-    typedef std::map<ModelId, NoteOffSet> NoteOffMap;
+    // Pending note-offs, kept sorted by NoteOff::Comparator
+    typedef std::vector<NoteOff> NoteOffList;
+    typedef std::map<ModelId, NoteOffList> NoteOffMap;
 
     typedef std::map<ModelId, ContinuousSynth *> ContinuousSynthMap;
 
-    QMutex m_mutex;
+    struct ScheduledNote {
+        sv_frame_t start;
+        sv_frame_t duration;
+        float frequency;
+        float level;
+    };
+
+    struct ScheduledValue {
+        sv_frame_t frame;
+        float value;
+    };
+
+    /**
+     * The events to be played from a clip or synth model, copied out
+     * of the model in playback order so that mixing does not need to
+     * query the model. Notes are held for clip models and values for
+     * synth models. The cursor is the index of the first event not
+     * yet reached, and is valid only if the next block to be mixed
+     * starts at nextFrame; otherwise it is found again by bisection,
+     * as after a seek.
+     */
+    struct Schedule {
+        Schedule() : cursor(0), nextFrame(-1) { }
+        std::vector<ScheduledNote> notes;
+        std::vector<ScheduledValue> values;
+        size_t cursor;
+        sv_frame_t nextFrame;
+
+        // Scratch space for mixing, reused between blocks
+        std::vector<float *> bufferIndexes;
+        std::vector<ClipMixer::NoteStart> starts;
+        std::vector<ClipMixer::NoteEnd> ends;
+    };
+
+    typedef std::map<ModelId, Schedule> ScheduleMap;
+
+    // Taken for reading by mixModel, and for writing by anything that
+    // adds or removes models or changes shared state. The maps below
+    // are only modified with the write lock held, so mixModel may
+    // look up entries without further locking.
+    QReadWriteLock m_lock;
 
     ClipMixerMap m_clipMixerMap;
     NoteOffMap m_noteOffs;
     static QString m_sampleDir;
 
     ContinuousSynthMap m_continuousSynthMap;
+    ScheduleMap m_schedules;
+
+    /**
+     * Refresh the schedule for a model from the events starting
+     * within the given range, or from all of its events if the range
+     * is empty. Takes the write lock only to update the schedule.
+     */
+    void updateSchedule(ModelId model, sv_frame_t startFrame,
+                        sv_frame_t endFrame);
+    void connectForSchedule(Model *model);
 
     bool usesClipMixer(ModelId);
     bool wantsQuieterClips(ModelId);
@@ -177,10 +269,6 @@ protected:
      float **buffer, float gain, float pan);
     
     static const sv_frame_t m_processingBlockSize;
-
-    float **m_channelBuffer;
-    sv_frame_t m_channelBufSiz;
-    int m_channelBufCount;
 };
 
 #endif
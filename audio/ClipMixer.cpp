@@ -17,11 +17,22 @@
 
 #include <sndfile.h>
 #include <cmath>
+#include <algorithm>
 
 #include "base/Debug.h"
 
+#include "bqvec/VectorOps.h"
+
+using breakfastquay::v_add_with_gain;
+
 //#define DEBUG_CLIP_MIXER 1
 
+const int
+ClipMixer::m_voiceCapacity = 256;
+
+const sv_frame_t
+ClipMixer::m_resampledLimit = 2 * 1024 * 1024;
+
 ClipMixer::ClipMixer(int channels, sv_samplerate_t sampleRate, sv_frame_t blockSize) :
     m_channels(channels),
     m_sampleRate(sampleRate),
@@ -29,8 +40,13 @@ ClipMixer::ClipMixer(int channels, sv_samplerate_t sampleRate, sv_frame_t blockS
     m_clipData(nullptr),
     m_clipLength(0),
     m_clipF0(0),
-    m_clipRate(0)
+    m_clipRate(0),
+    m_levels(channels, 0.f),
+    m_noteBuffer(blockSize, 0.f),
+    m_resampledTotal(0)
 {
+    m_playing.reserve(m_voiceCapacity);
+    m_endOrder.reserve(m_voiceCapacity);
 }
 
 ClipMixer::~ClipMixer()
@@ -42,6 +58,7 @@ void
 ClipMixer::setChannelCount(int channels)
 {
     m_channels = channels;
+    m_levels.resize(channels, 0.f);
 }
 
 bool
@@ -104,37 +121,165 @@ ClipMixer::reset()
     m_playing.clear();
 }
 
+int
+ClipMixer::getPitchKey(double frequency)
+{
+    return int(lround(1200.0 * log2(frequency / 440.0)));
+}
+
 double
-ClipMixer::getResampleRatioFor(double frequency)
+ClipMixer::getKeyFrequency(int key)
+{
+    return 440.0 * pow(2.0, double(key) / 1200.0);
+}
+
+double
+ClipMixer::getResampleRatioFor(double frequency) const
 {
     if (!m_clipData || !m_clipRate) return 1.0;
-    double pitchRatio = m_clipF0 / frequency;
+    double pitchRatio = m_clipF0 / getKeyFrequency(getPitchKey(frequency));
     double resampleRatio = m_sampleRate / m_clipRate;
     return pitchRatio * resampleRatio;
 }
 
 sv_frame_t
-ClipMixer::getResampledClipDuration(double frequency)
+ClipMixer::getResampledClipDuration(double frequency) const
 {
     return sv_frame_t(ceil(double(m_clipLength) * getResampleRatioFor(frequency)));
 }
 
+void
+ClipMixer::resample(double frequency, sv_frame_t sourceOffset,
+                    sv_frame_t count, float *target) const
+{
+    double step = 1.0 / getResampleRatioFor(frequency);
+    for (sv_frame_t i = 0; i < count; ++i) {
+        double os = double(sourceOffset + i) * step;
+        sv_frame_t osi = sv_frame_t(os);
+        double value = 0.0;
+        if (osi < m_clipLength) {
+            value += m_clipData[osi];
+        }
+        if (osi + 1 < m_clipLength) {
+            value += (m_clipData[osi + 1] - m_clipData[osi]) * (os - double(osi));
+        }
+        target[i] = float(value);
+    }
+}
+
+ClipMixer::ResampledClips
+ClipMixer::resampleFor(const std::vector<float> &frequencies) const
+{
+    ResampledClips clips;
+    if (!m_clipData) return clips;
+
+    sv_frame_t total = m_resampledTotal;
+    
+    for (float frequency: frequencies) {
+        if (!(frequency > 20 && frequency < 5000)) continue;
+        int key = getPitchKey(frequency);
+        if (m_resampled.find(key) != m_resampled.end() ||
+            clips.find(key) != clips.end()) {
+            continue;
+        }
+        sv_frame_t duration = getResampledClipDuration(frequency);
+        if (total + duration > m_resampledLimit) {
+            break;
+        }
+        std::vector<float> &data = clips[key];
+        data.resize(duration);
+        resample(frequency, 0, duration, data.data());
+        total += duration;
+    }
+    
+    return clips;
+}
+
+void
+ClipMixer::addResampledClips(ResampledClips &&clips)
+{
+    for (auto &c: clips) {
+        if (m_resampled.find(c.first) != m_resampled.end()) continue;
+        sv_frame_t duration = sv_frame_t(c.second.size());
+        if (m_resampledTotal + duration > m_resampledLimit) break;
+        m_resampledTotal += duration;
+        m_resampled[c.first] = std::move(c.second);
+    }
+    
+#ifdef DEBUG_CLIP_MIXER
+    cerr << "ClipMixer::addResampledClips: now have " << m_resampled.size()
+         << " totalling " << m_resampledTotal << endl;
+#endif
+}
+
+const std::vector<float> *
+ClipMixer::getResampledClip(float frequency) const
+{
+    auto i = m_resampled.find(getPitchKey(frequency));
+    if (i != m_resampled.end()) {
+        return &i->second;
+    }
+    return nullptr;
+}
+
+int
+ClipMixer::findEnd(const std::vector<NoteEnd> &endingNotes,
+                   const NoteStart &note) const
+{
+    // m_endOrder holds the indices of endingNotes sorted by
+    // frequency, and then by index, so the first match found here is
+    // the first in endingNotes
+
+    auto i = std::lower_bound
+        (m_endOrder.begin(), m_endOrder.end(), note.frequency,
+         [&](int e, float f) { return endingNotes[e].frequency < f; });
+    
+    for ( ; i != m_endOrder.end(); ++i) {
+        const NoteEnd &end = endingNotes[*i];
+        if (end.frequency != note.frequency) {
+            break;
+        }
+        // This is > rather than >= because if we have a note-off and
+        // a note-on at the same time, the note-off must be switching
+        // off an earlier note-on, not the current one (zero-duration
+        // notes are forbidden earlier in the pipeline)
+        if (end.frameOffset > note.frameOffset &&
+            end.frameOffset <= m_blockSize) {
+            return *i;
+        }
+    }
+
+    return -1;
+}
+
 void
 ClipMixer::mix(float **toBuffers, 
                float gain,
-               std::vector<NoteStart> newNotes, 
-               std::vector<NoteEnd> endingNotes)
+               const std::vector<NoteStart> &newNotes, 
+               const std::vector<NoteEnd> &endingNotes)
 {
-    foreach (NoteStart note, newNotes) {
+    for (const NoteStart &note: newNotes) {
         if (note.frequency > 20 && 
             note.frequency < 5000) {
+            if (int(m_playing.size()) >= m_voiceCapacity) {
+                // steal the oldest voice
+                m_playing.erase(m_playing.begin());
+            }
             m_playing.push_back(note);
         }
     }
 
-    std::vector<NoteStart> remaining;
-
-    float *levels = new float[m_channels];
+    m_endOrder.clear();
+    for (int i = 0; i < int(endingNotes.size()); ++i) {
+        m_endOrder.push_back(i);
+    }
+    std::sort(m_endOrder.begin(), m_endOrder.end(),
+              [&](int a, int b) {
+                  if (endingNotes[a].frequency != endingNotes[b].frequency) {
+                      return endingNotes[a].frequency < endingNotes[b].frequency;
+                  }
+                  return a < b;
+              });
 
 #ifdef DEBUG_CLIP_MIXER
     cerr << "ClipMixer::mix: have " << m_playing.size() << " playing note(s)"
@@ -142,8 +287,13 @@ ClipMixer::mix(float **toBuffers,
          << endl;
 #endif
 
-    foreach (NoteStart note, m_playing) {
+    float *levels = m_levels.data();
+    size_t remaining = 0;
 
+    for (size_t n = 0; n < m_playing.size(); ++n) {
+
+        const NoteStart note = m_playing[n];
+        
         for (int c = 0; c < m_channels; ++c) {
             levels[c] = note.level * gain;
         }
@@ -158,20 +308,11 @@ ClipMixer::mix(float **toBuffers,
 
         bool ending = false;
 
-        foreach (NoteEnd end, endingNotes) {
-            if (end.frequency == note.frequency &&
-                // This is > rather than >= because if we have a
-                // note-off and a note-on at the same time, the
-                // note-off must be switching off an earlier note-on,
-                // not the current one (zero-duration notes are
-                // forbidden earlier in the pipeline)
-                end.frameOffset > start &&
-                end.frameOffset <= m_blockSize) {
-                ending = true;
-                durationHere = end.frameOffset;
-                if (start > 0) durationHere = end.frameOffset - start;
-                break;
-            }
+        int e = findEnd(endingNotes, note);
+        if (e >= 0) {
+            ending = true;
+            durationHere = endingNotes[e].frameOffset;
+            if (start > 0) durationHere = endingNotes[e].frameOffset - start;
         }
 
         sv_frame_t clipDuration = getResampledClipDuration(note.frequency);
@@ -193,13 +334,11 @@ ClipMixer::mix(float **toBuffers,
         if (!ending) {
             NoteStart adjusted = note;
             adjusted.frameOffset -= m_blockSize;
-            remaining.push_back(adjusted);
+            m_playing[remaining++] = adjusted;
         }
     }
 
-    delete[] levels;
-
-    m_playing = remaining;
+    m_playing.resize(remaining);
 }
 
 void
@@ -213,41 +352,40 @@ ClipMixer::mixNote(float **toBuffers,
 {
     if (!m_clipData) return;
 
-    double ratio = getResampleRatioFor(frequency);
-    
-    double releaseTime = 0.01;
-    sv_frame_t releaseSampleCount = sv_frame_t(round(releaseTime * m_sampleRate));
-    if (releaseSampleCount > sampleCount) {
-        releaseSampleCount = sampleCount;
+    if (sampleCount > sv_frame_t(m_noteBuffer.size())) {
+        m_noteBuffer.resize(sampleCount);
     }
-    double releaseFraction = 1.0/double(releaseSampleCount);
-
-    for (sv_frame_t i = 0; i < sampleCount; ++i) {
+    float *values = m_noteBuffer.data();
 
-        sv_frame_t s = sourceOffset + i;
+    const std::vector<float> *resampled = getResampledClip(frequency);
 
-        double os = double(s) / ratio;
-        sv_frame_t osi = sv_frame_t(floor(os));
-
-        //!!! just linear interpolation for now (same as SV's sample
-        //!!! player). a small sinc kernel would be better and
-        //!!! probably "good enough"
-        double value = 0.0;
-        if (osi < m_clipLength) {
-            value += m_clipData[osi];
+    if (resampled) {
+        sv_frame_t n = sv_frame_t(resampled->size());
+        for (sv_frame_t i = 0; i < sampleCount; ++i) {
+            sv_frame_t s = sourceOffset + i;
+            values[i] = (s < n ? (*resampled)[s] : 0.f);
         }
-        if (osi + 1 < m_clipLength) {
-            value += (m_clipData[osi + 1] - m_clipData[osi]) * (os - double(osi));
+    } else {
+        // Not prepared, or the cache is full: resample on the fly
+        resample(frequency, sourceOffset, sampleCount, values);
+    }
+
+    if (isEnd) {
+        // linear ramp for release
+        double releaseTime = 0.01;
+        sv_frame_t releaseSampleCount = sv_frame_t(round(releaseTime * m_sampleRate));
+        if (releaseSampleCount > sampleCount) {
+            releaseSampleCount = sampleCount;
         }
-         
-        if (isEnd && i + releaseSampleCount > sampleCount) {
-            value *= releaseFraction * double(sampleCount - i); // linear ramp for release
+        float releaseFraction = 1.f / float(releaseSampleCount);
+        for (sv_frame_t i = sampleCount - releaseSampleCount + 1;
+             i < sampleCount; ++i) {
+            values[i] *= releaseFraction * float(sampleCount - i);
         }
+    }
 
-        for (int c = 0; c < m_channels; ++c) {
-            toBuffers[c][targetOffset + i] += float(levels[c] * value);
-        }
+    for (int c = 0; c < m_channels; ++c) {
+        v_add_with_gain(toBuffers[c] + targetOffset, values,
+                        levels[c], int(sampleCount));
     }
 }
-
-
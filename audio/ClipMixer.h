@@ -18,14 +18,23 @@
 
 #include <QString>
 #include <vector>
+#include <map>
 
 #include "base/BaseTypes.h"
 
 /**
  * Mix in synthetic notes produced by resampling a prerecorded
  * clip. (i.e. this is an implementation of a digital sampler in the
- * musician's sense.) This can mix any number of notes of arbitrary
- * frequency, so long as they all use the same sample clip.
+ * musician's sense.) This can mix notes of arbitrary frequency, so
+ * long as they all use the same sample clip, up to a fixed number of
+ * simultaneous voices; beyond that the oldest notes are stolen.
+ *
+ * The clip can be resampled in advance for the pitches to be played,
+ * each quantised to the nearest cent, up to a limit on the total
+ * cached length, so that those pitches cost only a mix. Notes at any
+ * other pitch are resampled as they play. mix() itself never adds to
+ * the cache, and does no allocation once the block size and channel
+ * count have been seen.
  */
 
 class ClipMixer
@@ -47,6 +56,26 @@ public:
 
     void reset(); // discarding any playing notes
 
+    /**
+     * Resampled copies of the clip, by pitch key (see getPitchKey).
+     */
+    typedef std::map<int, std::vector<float>> ResampledClips;
+
+    /**
+     * Resample the clip for each of the given frequencies that does
+     * not already have a resampled copy, within the cache limit, and
+     * return the results for passing to addResampledClips. May be
+     * called from any thread while mix() runs, so long as no other
+     * thread is calling addResampledClips.
+     */
+    ResampledClips resampleFor(const std::vector<float> &frequencies) const;
+
+    /**
+     * Add resampled clips returned by resampleFor to the cache. Must
+     * not be called at the same time as mix().
+     */
+    void addResampledClips(ResampledClips &&clips);
+
     struct NoteStart {
         sv_frame_t frameOffset; // within current processing block
         float frequency; // Hz
@@ -61,8 +90,8 @@ public:
 
     void mix(float **toBuffers, 
              float gain,
-             std::vector<NoteStart> newNotes, 
-             std::vector<NoteEnd> endingNotes);
+             const std::vector<NoteStart> &newNotes, 
+             const std::vector<NoteEnd> &endingNotes);
 
 private:
     int m_channels;
@@ -76,10 +105,36 @@ private:
     double m_clipF0;
     sv_samplerate_t m_clipRate;
 
+    // Voice pool: reserved to its full capacity on construction, and
+    // compacted in place as notes end
+    static const int m_voiceCapacity;
     std::vector<NoteStart> m_playing;
 
-    double getResampleRatioFor(double frequency);
-    sv_frame_t getResampledClipDuration(double frequency);
+    // Scratch space for mix, sized in advance
+    std::vector<float> m_levels;
+    std::vector<float> m_noteBuffer;
+    std::vector<int> m_endOrder;
+
+    // Clip resampled for each pitch prepared so far, while the total
+    // length is within m_resampledLimit
+    static const sv_frame_t m_resampledLimit;
+    ResampledClips m_resampled;
+    sv_frame_t m_resampledTotal;
+
+    // Pitches are cached to the nearest cent, and played at the
+    // quantised frequency whether cached or not, so that a note
+    // sounds the same either way
+    static int getPitchKey(double frequency);
+    static double getKeyFrequency(int key);
+    
+    double getResampleRatioFor(double frequency) const;
+    sv_frame_t getResampledClipDuration(double frequency) const;
+
+    const std::vector<float> *getResampledClip(float frequency) const;
+    void resample(double frequency, sv_frame_t sourceOffset,
+                  sv_frame_t count, float *target) const;
+    int findEnd(const std::vector<NoteEnd> &endingNotes,
+                const NoteStart &note) const;
 
     void mixNote(float **toBuffers, 
                  float *levels,
@@ -17,7 +17,12 @@
 #include "base/Debug.h"
 #include "system/System.h"
 
+#include "bqvec/VectorOps.h"
+
+using breakfastquay::v_add_with_gain;
+
 #include <cmath>
+#include <algorithm>
 
 ContinuousSynth::ContinuousSynth(int channels, sv_samplerate_t sampleRate, sv_frame_t blockSize, int waveType) :
     m_channels(channels),
@@ -25,20 +30,145 @@ ContinuousSynth::ContinuousSynth(int channels, sv_samplerate_t sampleRate, sv_fr
     m_blockSize(blockSize),
     m_prevF0(-1.0),
     m_phase(0.0),
-    m_wavetype(waveType) // 0: 3 sinusoids, 1: 1 sinusoid, 2: sawtooth, 3: square
+    m_wavetype(waveType), // 0: 3 sinusoids, 1: 1 sinusoid, 2: sawtooth, 3: square
+    m_levels(channels, 0.f),
+    m_buffer(blockSize, 0.f)
 {
+    (void)getWavetables(m_wavetype); // build now rather than in mix
 }
 
 ContinuousSynth::~ContinuousSynth()
 {
 }
 
+void
+ContinuousSynth::setChannelCount(int channels)
+{
+    m_channels = channels;
+    m_levels.resize(channels, 0.f);
+}
+
 void
 ContinuousSynth::reset()
 {
     m_phase = 0;
 }
 
+ContinuousSynth::Wavetable
+ContinuousSynth::makeWavetable(int waveType, int harmonics)
+{
+    // Highest partial number present, which determines the table
+    // size: keep at least 8 points per cycle of it, so that linear
+    // interpolation is accurate enough
+    int top = harmonics;
+    if (waveType == 3) top = harmonics * 2 - 1;
+    
+    int size = 1024;
+    while (size < top * 8) size *= 2;
+    
+    Wavetable table;
+    table.harmonics = harmonics;
+    table.data.resize(size + 1, 0.f);
+
+    for (int i = 0; i < size; ++i) {
+
+        double phase = (2.0 * M_PI * i) / size;
+        double v = 0.0;
+
+        // sin(n * phase) for successive n by the Chebyshev recurrence
+        // sin((n+1)x) = 2 cos(x) sin(nx) - sin((n-1)x), rather than a
+        // call to sin() for every partial of every point
+        double c2 = 2.0 * cos(phase);
+        double prev = 0.0;         // sin(0 * phase)
+        double curr = sin(phase);  // sin(1 * phase)
+        
+        for (int n = 1; n <= top; ++n) {
+            switch (waveType) {
+            case 1: // single sinusoid
+                if (n == 1) v += curr;
+                break;
+            case 2: // sawtooth
+                if (n > 1) v += -(1.0 / M_PI) * curr / n;
+                break;
+            case 3: // square
+                if (n % 2 == 1) v += curr / n;
+                break;
+            default: // 3 sinusoids
+                v += curr / n;
+                break;
+            }
+            double next = c2 * curr - prev;
+            prev = curr;
+            curr = next;
+        }
+
+        if (waveType == 2) v += 0.5;
+
+        table.data[i] = float(v);
+    }
+
+    table.data[size] = table.data[0];
+    return table;
+}
+
+std::vector<ContinuousSynth::Wavetable>
+ContinuousSynth::makeWavetables(int waveType)
+{
+    std::vector<Wavetable> tables;
+
+    switch (waveType) {
+    case 1:
+        tables.push_back(makeWavetable(waveType, 1));
+        break;
+    case 2:
+    case 3:
+        // Half-octave spacing. The richest table is enough for a full
+        // spectrum up to a quarter of the sample rate from around 40Hz
+        // at 44.1kHz; lower notes just lose some of their top end
+        for (int k = 0; ; ++k) {
+            int h = int(pow(2.0, k / 2.0));
+            if (h > maxHarmonics) break;
+            if (!tables.empty() && tables.rbegin()->harmonics == h) {
+                continue;
+            }
+            tables.push_back(makeWavetable(waveType, h));
+        }
+        break;
+    default:
+        tables.push_back(makeWavetable(waveType, 3));
+        break;
+    }
+
+    return tables;
+}
+
+const std::vector<ContinuousSynth::Wavetable> &
+ContinuousSynth::getWavetables(int waveType)
+{
+    // Built on first use of each wave type, and shared by all synths
+    // using it. Initialisation of function-local statics is
+    // thread-safe.
+
+    switch (waveType) {
+    case 1: {
+        static const std::vector<Wavetable> sine = makeWavetables(1);
+        return sine;
+    }
+    case 2: {
+        static const std::vector<Wavetable> sawtooth = makeWavetables(2);
+        return sawtooth;
+    }
+    case 3: {
+        static const std::vector<Wavetable> square = makeWavetables(3);
+        return square;
+    }
+    default: {
+        static const std::vector<Wavetable> sines3 = makeWavetables(0);
+        return sines3;
+    }
+    }
+}
+
 void
 ContinuousSynth::mix(float **toBuffers, float gain, float pan, float f0f)
 {
@@ -55,7 +185,7 @@ ContinuousSynth::mix(float **toBuffers, float gain, float pan, float f0f)
 
     sv_frame_t fadeLength = 100;
 
-    float *levels = new float[m_channels];
+    float *levels = m_levels.data();
     
     for (int c = 0; c < m_channels; ++c) {
         levels[c] = gain * 0.5f; // scale gain otherwise too loud compared to source
@@ -67,6 +197,18 @@ ContinuousSynth::mix(float **toBuffers, float gain, float pan, float f0f)
 
 //    cerr << "ContinuousSynth::mix: f0 = " << f0 << " (from " << m_prevF0 << "), phase = " << m_phase << endl;
 
+    const std::vector<Wavetable> &tables = getWavetables(m_wavetype);
+    bool bandLimited = (m_wavetype == 2 || m_wavetype == 3);
+    const Wavetable *table = &tables[0];
+    int tableHarmonics = -1;
+
+    if (sv_frame_t(m_buffer.size()) < m_blockSize) {
+        m_buffer.resize(m_blockSize);
+    }
+    float *buffer = m_buffer.data();
+    
+    const double twoPi = 2 * M_PI;
+    
     for (sv_frame_t i = 0; i < m_blockSize; ++i) {
 
         double fHere = (nowOn ? f0 : m_prevF0);
@@ -76,74 +218,50 @@ ContinuousSynth::mix(float **toBuffers, float gain, float pan, float f0f)
             fHere = m_prevF0 + ((f0 - m_prevF0) * double(i)) / double(fadeLength);
         }
 
-        double phasor = (fHere * 2 * M_PI) / m_sampleRate;
+        double phasor = (fHere * twoPi) / m_sampleRate;
     
         m_phase = m_phase + phasor;
-
-        int harmonics = int((m_sampleRate / 4) / fHere - 1);
-        if (harmonics < 1) harmonics = 1;
-
-        switch (m_wavetype) {
-        case 1:
-            harmonics = 1;
-            break;
-        case 2:
-            break;
-        case 3:
-            break;
-        default:
-            harmonics = 3;
-            break;
+        if (m_phase >= twoPi) {
+            m_phase = fmod(m_phase, twoPi);
         }
 
-        for (int h = 0; h < harmonics; ++h) {
-
-            double v = 0;
-            double hn = 0;
-            double hp = 0;
-
-            switch (m_wavetype) {
-            case 1: // single sinusoid
-                v = sin(m_phase);
-                break;
-            case 2: // sawtooth
-                if (h != 0) {
-                    hn = h + 1;
-                    hp = m_phase * hn;
-                    v = -(1.0 / M_PI) * sin(hp) / hn;
-                } else {
-                    v = 0.5;
-                }
-                break;
-            case 3: // square
-                hn = h*2 + 1;
-                hp = m_phase * hn;
-                v = sin(hp) / hn;
-                break;
-            default: // 3 sinusoids
-                hn = h + 1;
-                hp = m_phase * hn;
-                v = sin(hp) / hn;
-                break;
+        if (bandLimited) {
+            int harmonics = int((m_sampleRate / 4) / fHere - 1);
+            if (harmonics < 1) harmonics = 1;
+            if (harmonics != tableHarmonics) {
+                // the richest table with no more than this many harmonics
+                auto ti = std::upper_bound
+                    (tables.begin(), tables.end(), harmonics,
+                     [](int h, const Wavetable &t) { return h < t.harmonics; });
+                if (ti != tables.begin()) --ti;
+                table = &*ti;
+                tableHarmonics = harmonics;
             }
+        }
 
-            if (!wasOn && i < fadeLength) {
-                // fade in
-                v = v * (double(i) / double(fadeLength));
-            } else if (!nowOn) {
-                // fade out
-                if (i > fadeLength) v = 0;
-                else v = v * (1.0 - (double(i) / double(fadeLength)));
-            }
+        int size = int(table->data.size()) - 1;
+        double pos = (m_phase / twoPi) * size;
+        int index = int(pos);
+        if (index >= size) index = size - 1;
+        double frac = pos - index;
+        double v = table->data[index] +
+            frac * (table->data[index + 1] - table->data[index]);
 
-            for (int c = 0; c < m_channels; ++c) {
-                toBuffers[c][i] += float(levels[c] * v);
-            }
+        if (!wasOn && i < fadeLength) {
+            // fade in
+            v = v * (double(i) / double(fadeLength));
+        } else if (!nowOn) {
+            // fade out
+            if (i > fadeLength) v = 0;
+            else v = v * (1.0 - (double(i) / double(fadeLength)));
         }
+
+        buffer[i] = float(v);
     }    
 
+    for (int c = 0; c < m_channels; ++c) {
+        v_add_with_gain(toBuffers[c], buffer, levels[c], int(m_blockSize));
+    }
+    
     m_prevF0 = f0;
-
-    delete[] levels;
 }
-
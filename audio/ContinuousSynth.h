@@ -17,10 +17,19 @@
 
 #include "base/BaseTypes.h"
 
+#include <vector>
+
 /**
  * Mix into a target buffer a signal synthesised so as to sound at a
  * specific frequency. The frequency may change with each processing
  * block, or may be switched on or off.
+ *
+ * The signal is read from precomputed single-cycle wavetables, built
+ * on first use of each wave type. For the sawtooth and square wave
+ * types there is a set of tables with increasing numbers of
+ * harmonics, at half-octave spacing up to maxHarmonics, and the
+ * richest one that stays below a quarter of the sample rate at the
+ * current frequency is used.
  */
 
 class ContinuousSynth
@@ -60,6 +69,20 @@ private:
     double m_phase;
 
     int m_wavetype;
+
+    std::vector<float> m_levels;
+    std::vector<float> m_buffer;
+
+    struct Wavetable {
+        int harmonics;
+        std::vector<float> data; // one cycle, plus a guard point
+    };
+
+    static const int maxHarmonics = 256;
+
+    static const std::vector<Wavetable> &getWavetables(int waveType);
+    static std::vector<Wavetable> makeWavetables(int waveType);
+    static Wavetable makeWavetable(int waveType, int harmonics);
 };
 
 #endif
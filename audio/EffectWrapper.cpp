@@ -14,59 +14,123 @@
 
 #include "EffectWrapper.h"
 
-#include <rubberband/RubberBandStretcher.h>
-
 #include "base/Debug.h"
 
+#include "bqvec/VectorOps.h"
+
 //#define DEBUG_EFFECT_WRAPPER 1
 
 using namespace std;
 
+using breakfastquay::v_copy;
+
 static const int DEFAULT_RING_BUFFER_SIZE = 131071;
 
 EffectWrapper::EffectWrapper(ApplicationPlaybackSource *source) :
     m_source(source),
+    m_stats(nullptr),
+    m_chain(nullptr),
+    m_chainScavenger(2),
     m_bypassed(false),
-    m_failed(false),
     m_channelCount(0)
 {
 }
 
 EffectWrapper::~EffectWrapper()
 {
+    delete m_chain.load();
+    m_chainScavenger.scavenge(true);
 }
 
 void
 EffectWrapper::setEffect(weak_ptr<RealTimePluginInstance> effect)
 {
-    lock_guard<mutex> guard(m_mutex);
-
 #ifdef DEBUG_EFFECT_WRAPPER
     SVCERR << "EffectWrapper[" << this
            << "]::setEffect(" << effect.lock() << ")" << endl;
 #endif
+
+    vector<shared_ptr<RealTimePluginInstance>> effects;
+    if (auto e = effect.lock()) {
+        effects.push_back(e);
+    }
+    setEffectChain(effects);
+}
+
+void
+EffectWrapper::setEffectChain(vector<shared_ptr<RealTimePluginInstance>>
+                              effects)
+{
+    Chain *chain = nullptr;
+
+    for (auto e: effects) {
+        if (!e) continue;
+        if (!chain) {
+            chain = new Chain;
+            chain->blockSize = e->getBufferSize();
+        } else if (e->getBufferSize() != chain->blockSize) {
+            SVCERR << "WARNING: EffectWrapper::setEffectChain: effect "
+                   << e.get() << " has buffer size " << e->getBufferSize()
+                   << ", but the chain has " << chain->blockSize
+                   << ": leaving it out" << endl;
+            continue;
+        }
+        chain->latency += e->getLatency();
+        chain->effects.push_back(e);
+    }
+
+#ifdef DEBUG_EFFECT_WRAPPER
+    SVCERR << "EffectWrapper[" << this << "]::setEffectChain: "
+           << (chain ? chain->effects.size() : 0) << " effect(s), latency "
+           << (chain ? chain->latency : 0) << endl;
+#endif
     
-    m_effect = effect;
-    m_failed = false;
+    replaceChain(chain);
+}
+
+void
+EffectWrapper::replaceChain(Chain *chain)
+{
+    lock_guard<mutex> guard(m_chainMutex);
+
+    Chain *old = m_chain.exchange(chain, std::memory_order_acq_rel);
+    if (old) {
+        m_chainScavenger.claim(old);
+    }
+    m_chainScavenger.scavenge();
 }
 
 bool
 EffectWrapper::haveEffect() const
 {
-    return m_effect.lock() != nullptr;
+    Chain *chain = m_chain.load(std::memory_order_acquire);
+    return chain && !chain->effects.empty();
+}
+
+int
+EffectWrapper::getEffectCount() const
+{
+    Chain *chain = m_chain.load(std::memory_order_acquire);
+    return chain ? int(chain->effects.size()) : 0;
 }
 
 void
 EffectWrapper::clearEffect()
 {
-    m_effect = {};
+    replaceChain(nullptr);
+}
+
+sv_frame_t
+EffectWrapper::getLatency() const
+{
+    Chain *chain = m_chain.load(std::memory_order_acquire);
+    if (!chain || m_bypassed || chain->failed) return 0;
+    return chain->latency;
 }
 
 void
 EffectWrapper::setBypassed(bool bypassed)
 {
-    lock_guard<mutex> guard(m_mutex);
-
 #ifdef DEBUG_EFFECT_WRAPPER
     SVCERR << "EffectWrapper[" << this
            << "]::setBypassed(" << bypassed << ")" << endl;
@@ -78,8 +142,6 @@ EffectWrapper::setBypassed(bool bypassed)
 bool
 EffectWrapper::isBypassed() const
 {
-    lock_guard<mutex> guard(m_mutex);
-
     return m_bypassed;
 }
 
@@ -96,23 +158,60 @@ EffectWrapper::reset()
         rb.reset();
     }
 
-    m_failed = false;
+    if (Chain *chain = m_chain.load(std::memory_order_acquire)) {
+        chain->failed = false;
+    }
+}
+
+void
+EffectWrapper::setStatistics(PlaybackStatistics *stats)
+{
+    m_stats = stats;
+}
+
+float **
+EffectWrapper::runChain(Chain *chain, int n)
+{
+    float **out = nullptr;
+
+    for (const auto &effect: chain->effects) {
+        if (out) {
+            // Each plugin owns its port buffers, so the only copy
+            // needed between stages is from one's outputs into the
+            // next one's inputs
+            float **in = effect->getAudioInputBuffers();
+            for (int c = 0; c < m_channelCount; ++c) {
+                v_copy(in[c], out[c], n);
+            }
+        }
+        effect->run(Vamp::RealTime::zeroTime, n);
+        out = effect->getAudioOutputBuffers();
+    }
+
+    return out;
 }
 
 int
 EffectWrapper::getSourceSamples(float *const *samples,
                                 int nchannels, int nframes)
 {
-    lock_guard<mutex> guard(m_mutex);
+    PlaybackStatistics::StageTimer timer
+        (m_stats, PlaybackStatistics::EffectStage);
 
 #ifdef DEBUG_EFFECT_WRAPPER
     SVCERR << "EffectWrapper[" << this << "]::getSourceSamples: " << nframes
            << " frames across " << nchannels << " channels" << endl;
 #endif
+
+    unique_lock<mutex> lock(m_mutex, try_to_lock);
+    if (!lock.owns_lock()) {
+        // channel count changing or reset in progress
+        return m_source->getSourceSamples(samples, nchannels, nframes);
+    }
     
-    auto effect(m_effect.lock());
+    Chain *chain = m_chain.load(std::memory_order_acquire);
     
-    if (!effect) {
+    if (!chain || chain->effects.empty()) {
 #ifdef DEBUG_EFFECT_WRAPPER
         SVCERR << "EffectWrapper::getSourceSamples: "
                << "no effect is set" << endl;
@@ -120,10 +219,10 @@ EffectWrapper::getSourceSamples(float *const *samples,
         return m_source->getSourceSamples(samples, nchannels, nframes);
     }
 
-    if (m_bypassed || m_failed) {
+    if (m_bypassed || chain->failed) {
 #ifdef DEBUG_EFFECT_WRAPPER
         SVCERR << "EffectWrapper::getSourceSamples: "
-               << "effect is bypassed or has failed" << endl;
+               << "effect chain is bypassed or has failed" << endl;
 #endif
         return m_source->getSourceSamples(samples, nchannels, nframes);
     }
@@ -140,38 +239,41 @@ EffectWrapper::getSourceSamples(float *const *samples,
         }
         return 0;
     }
-    
-    if ((int)effect->getAudioInputCount() != m_channelCount) {
-        if (!m_failed) {
+
+    for (const auto &effect: chain->effects) {
+        if ((int)effect->getAudioInputCount() != m_channelCount ||
+            (int)effect->getAudioOutputCount() != m_channelCount) {
             SVCERR << "EffectWrapper::getSourceSamples: "
                    << "Can't run plugin: plugin input count "
-                   << effect->getAudioInputCount() 
-                   << " != our channel count " << m_channelCount
-                   << " (future errors for this plugin will be suppressed)"
-                   << endl;
-            m_failed = true;
-        }
-    }
-    if ((int)effect->getAudioOutputCount() != m_channelCount) {
-        if (!m_failed) {
-            SVCERR << "EffectWrapper::getSourceSamples: "
-                   << "Can't run plugin: plugin output count "
-                   << effect->getAudioOutputCount() 
+                   << effect->getAudioInputCount() << " or output count "
+                   << effect->getAudioOutputCount()
                    << " != our channel count " << m_channelCount
-                   << " (future errors for this plugin will be suppressed)"
+                   << " (future errors for this chain will be suppressed)"
                    << endl;
-            m_failed = true;
+            chain->failed = true;
+            return m_source->getSourceSamples(samples, nchannels, nframes);
         }
     }
 
-    if (m_failed) {
-        return m_source->getSourceSamples(samples, nchannels, nframes);
+    float **ib = chain->effects[0]->getAudioInputBuffers();
+    int blockSize = chain->blockSize;
+
+    if (nframes == blockSize && m_effectOutputBuffers[0].getReadSpace() == 0) {
+
+        // The usual case when the device block size matches the
+        // plugin block size: run straight through without going via
+        // our output buffers
+        
+        int toRun = m_source->getSourceSamples(ib, nchannels, blockSize);
+        if (toRun <= 0) return 0;
+
+        float **ob = runChain(chain, toRun);
+        for (int c = 0; c < nchannels; ++c) {
+            v_copy(samples[c], ob[c], toRun);
+        }
+        return toRun;
     }
     
-    float **ib = effect->getAudioInputBuffers();
-    float **ob = effect->getAudioOutputBuffers();
-    int blockSize = effect->getBufferSize();
-    
     int got = 0;
 
     while (got < nframes) {
@@ -190,10 +292,10 @@ EffectWrapper::getSourceSamples(float *const *samples,
             if (toRun <= 0) break;
 
 #ifdef DEBUG_EFFECT_WRAPPER
-            SVCERR << "EffectWrapper::getSourceSamples: Running effect "
+            SVCERR << "EffectWrapper::getSourceSamples: Running chain "
                    << "for " << toRun << " frames" << endl;
 #endif
-            effect->run(Vamp::RealTime::zeroTime, toRun);
+            float **ob = runChain(chain, toRun);
 
             for (int c = 0; c < nchannels; ++c) {
                 m_effectOutputBuffers[c].write(ob[c], toRun);
@@ -19,16 +19,25 @@
 
 #include "base/BaseTypes.h"
 #include "base/RingBuffer.h"
+#include "base/Scavenger.h"
 
 #include "plugin/RealTimePluginInstance.h"
 
+#include "PlaybackStatistics.h"
+
 #include <vector>
 #include <mutex>
+#include <atomic>
 #include <memory>
 
 /**
  * A breakfastquay::ApplicationPlaybackSource wrapper that applies a
- * real-time effect plugin.
+ * chain of real-time effect plugins in series.
+ *
+ * The chain may be replaced from any non-audio thread without
+ * blocking the audio thread, which picks up the new chain at its
+ * next call. Apart from plugin processing, the audio thread path
+ * takes no lock and performs no allocation.
  */
 class EffectWrapper : public breakfastquay::ApplicationPlaybackSource
 {
@@ -50,20 +59,46 @@ public:
      * Set the effect to apply. The effect instance is shared with the
      * caller: the expectation is that the caller may continue to
      * modify its parameters etc during auditioning. Replaces any
-     * instance previously set.
+     * effect or chain previously set. This is the same as a chain of
+     * one effect.
      */
     void setEffect(std::weak_ptr<RealTimePluginInstance>);
 
+    /**
+     * Set a chain of effects to apply in series, the output of each
+     * feeding the input of the next, replacing any effect or chain
+     * previously set. All must have the same buffer size as the
+     * first; any that do not are left out, with a warning. As with
+     * setEffect, the instances are shared with the caller. The
+     * wrapper keeps them alive until some time after the chain has
+     * been replaced, so that the audio thread never releases them.
+     */
+    void setEffectChain(std::vector<std::shared_ptr<RealTimePluginInstance>>
+                        effects);
+
     /**
      * Return true if an effect is currently set to be applied.
      */
     bool haveEffect() const;
+
+    /**
+     * Return the number of effects in the current chain.
+     */
+    int getEffectCount() const;
     
     /**
-     * Remove any applied effect without setting another one.
+     * Remove any applied effects without setting others.
      */
     void clearEffect();
 
+    /**
+     * Return the total processing latency of the current chain, in
+     * frames at the system playback sample rate, as reported by its
+     * plugins. This is zero if there is no chain or it is bypassed.
+     * May be called from any thread.
+     */
+    sv_frame_t getLatency() const;
+
     /**
      * Bypass or un-bypass the effect.
      */
@@ -102,15 +137,49 @@ public:
     int getSourceSamples(float *const *samples, int nchannels, int nframes)
         override;
 
+    /**
+     * Record the time taken by each getSourceSamples call in the
+     * given statistics object, which must outlive this wrapper. Pass
+     * nullptr to stop recording.
+     */
+    void setStatistics(PlaybackStatistics *stats);
+
 private:
     ApplicationPlaybackSource *m_source;
-    std::weak_ptr<RealTimePluginInstance> m_effect;
-    bool m_bypassed;
-    bool m_failed;
+    std::atomic<PlaybackStatistics *> m_stats;
+
+    struct Chain {
+        Chain() : blockSize(0), latency(0), failed(false) { }
+        std::vector<std::shared_ptr<RealTimePluginInstance>> effects;
+        int blockSize;
+        sv_frame_t latency;
+        std::atomic<bool> failed; // set by the audio thread
+    };
+
+    // Published with release semantics and read once per callback by
+    // the audio thread. Replaced chains are handed to the scavenger,
+    // which deletes them once the audio thread can no longer be
+    // using them
+    std::atomic<Chain *> m_chain;
+    Scavenger<Chain> m_chainScavenger;
+    std::mutex m_chainMutex; // serialises chain changes, never RT
+
+    std::atomic<bool> m_bypassed;
     int m_channelCount;
     std::vector<RingBuffer<float>> m_effectOutputBuffers;
+
+    // Held while changing the channel count or resetting. The audio
+    // thread only ever try-locks this, and passes audio through
+    // unprocessed if it cannot get it
     mutable std::mutex m_mutex;
 
+    void replaceChain(Chain *chain);
+    
+    // Run n frames through the chain, whose first effect's input
+    // buffers have already been filled. Return the last effect's
+    // output buffers
+    float **runChain(Chain *chain, int n);
+
     EffectWrapper(const EffectWrapper &)=delete;
     EffectWrapper &operator=(const EffectWrapper &)=delete;
 };
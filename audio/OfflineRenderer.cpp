@@ -0,0 +1,461 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "OfflineRenderer.h"
+
+#include "AudioCallbackPlaySource.h"
+#include "AudioGenerator.h"
+#include "EffectWrapper.h"
+#include "TimeStretchWrapper.h"
+
+#include "base/ViewManagerBase.h"
+#include "base/Debug.h"
+#include "data/fileio/WavFileWriter.h"
+
+#include "bqaudioio/ApplicationPlaybackSource.h"
+#include "bqvec/VectorOps.h"
+
+#include <QMutexLocker>
+#include <QThread>
+
+#include <algorithm>
+#include <cmath>
+
+using breakfastquay::v_zero;
+using breakfastquay::v_copy;
+
+//#define DEBUG_OFFLINE_RENDERER 1
+
+// Frames mixed per call to mixModels: large, as there is no latency
+// to worry about, but rounded to the generator block size
+static const sv_frame_t MIX_BLOCK_SIZE = 16384;
+
+// Longest effect tail rendered after the end of the mix, in seconds
+static const double MAX_TAIL_DURATION = 10.0;
+
+// Level below which an effect tail is considered to have ended
+static const float TAIL_THRESHOLD = 1.0e-5f;
+
+/**
+ * The head of the wrapper chain: an ApplicationPlaybackSource that
+ * hands out the play source's mix in whatever block sizes the
+ * wrappers ask for, mixing in larger blocks of a multiple of the
+ * generator block size as needed. Each block is mixed with the play
+ * source's mutex held, using the renderer's mix thread count. Once
+ * the mix has ended, silence is returned for as long as it is asked
+ * for, so that the wrappers can be drained.
+ */
+class OfflineRenderer::MixSource : public breakfastquay::ApplicationPlaybackSource
+{
+public:
+    MixSource(AudioCallbackPlaySource *source,
+              sv_frame_t startFrame, sv_frame_t endFrame,
+              int mixThreadCount) :
+        m_source(source),
+        m_channels(source->getTargetChannelCount()),
+        m_frame(startFrame),
+        m_endFrame(endFrame),
+        m_mixThreadCount(mixThreadCount),
+        m_ended(false),
+        m_mixedTotal(0),
+        m_available(0),
+        m_offset(0) {
+
+        sv_frame_t gbs = m_source->m_audioGenerator->getBlockSize();
+        m_blockSize = std::max(gbs, (MIX_BLOCK_SIZE / gbs) * gbs);
+
+        m_buffers.resize(m_channels);
+        m_ptrs.resize(m_channels);
+        for (int c = 0; c < m_channels; ++c) {
+            m_buffers[c].resize(m_blockSize, 0.f);
+            m_ptrs[c] = m_buffers[c].data();
+        }
+    }
+
+    std::string getClientName() const override {
+        return m_source->getClientName();
+    }
+    int getApplicationSampleRate() const override {
+        return int(m_source->getSourceSampleRate());
+    }
+    int getApplicationChannelCount() const override {
+        return m_channels;
+    }
+
+    void setSystemPlaybackBlockSize(int) override { }
+    void setSystemPlaybackSampleRate(int) override { }
+    void setSystemPlaybackChannelCount(int) override { }
+    void setSystemPlaybackLatency(int) override { }
+    void setOutputLevels(float, float) override { }
+    void audioProcessingOverload() override { }
+
+    int getSourceSamples(float *const *samples, int nchannels, int nframes)
+        override {
+
+        int got = 0;
+
+        while (got < nframes) {
+
+            if (m_available == 0) {
+                mixBlock();
+            }
+
+            int n = int(std::min(sv_frame_t(nframes - got), m_available));
+            for (int c = 0; c < nchannels && c < m_channels; ++c) {
+                v_copy(samples[c] + got, m_ptrs[c] + m_offset, n);
+            }
+            for (int c = m_channels; c < nchannels; ++c) {
+                v_zero(samples[c] + got, n);
+            }
+
+            got += n;
+            m_offset += n;
+            m_available -= n;
+        }
+
+        return got;
+    }
+
+    /**
+     * Return true once the mix has ended, and all of it has been
+     * handed out.
+     */
+    bool isEnded() const { return m_ended && m_available == 0; }
+
+    /**
+     * Return the number of frames of mixed audio handed out, not
+     * counting the silence that follows the end.
+     */
+    sv_frame_t getMixedFrames() const { return m_mixedTotal; }
+
+private:
+    AudioCallbackPlaySource *m_source;
+    int m_channels;
+    sv_frame_t m_frame;
+    sv_frame_t m_endFrame; // 0 if playback has its own end
+    int m_mixThreadCount;
+    bool m_ended;
+    sv_frame_t m_mixedTotal;
+    sv_frame_t m_blockSize;
+    sv_frame_t m_available;
+    sv_frame_t m_offset;
+    std::vector<std::vector<float>> m_buffers;
+    std::vector<float *> m_ptrs;
+
+    void mixBlock() {
+
+        for (int c = 0; c < m_channels; ++c) {
+            v_zero(m_ptrs[c], int(m_blockSize));
+        }
+
+        m_offset = 0;
+        
+        if (m_ended) {
+            m_available = m_blockSize;
+            return;
+        }
+
+        sv_frame_t from = m_frame;
+        sv_frame_t mixed = 0;
+
+        {
+            QMutexLocker locker(&m_source->m_mutex);
+            int realTimeMixThreads = m_source->m_mixThreadCount;
+            // We are not the fill thread, so may start any extra mix
+            // threads we want here, and they are stopped at the end
+            m_source->m_mixThreadCount = m_mixThreadCount;
+            m_source->prepareMixThreads();
+            (void) m_source->mixModels(m_frame, m_blockSize, m_ptrs.data(),
+                                       &mixed);
+            m_source->m_mixThreadCount = realTimeMixThreads;
+        }
+
+#ifdef DEBUG_OFFLINE_RENDERER
+        SVCERR << "OfflineRenderer: mixed " << mixed << " from " << from
+               << ", next frame " << m_frame << endl;
+#endif
+
+        if (mixed < m_blockSize) {
+            // the play selection has ended
+            m_ended = true;
+        }
+
+        if (m_endFrame > 0 && from + mixed >= m_endFrame) {
+            // unconstrained playback, which runs on past the end of
+            // the models, has reached their end
+            mixed = std::max(sv_frame_t(0), m_endFrame - from);
+            m_ended = true;
+        }
+
+        m_mixedTotal += mixed;
+        
+        // Whatever follows the end within this block is already
+        // silent, and the silence is handed out as part of the drain
+        m_available = (m_ended ? m_blockSize : mixed);
+        if (m_ended) {
+            for (int c = 0; c < m_channels; ++c) {
+                v_zero(m_ptrs[c] + mixed, int(m_blockSize - mixed));
+            }
+        }
+    }
+};
+
+OfflineRenderer::OfflineRenderer(AudioCallbackPlaySource *source) :
+    m_source(source),
+    m_timeStretch(1.0),
+    m_mixThreadCount(std::max(1, QThread::idealThreadCount()))
+{
+}
+
+OfflineRenderer::~OfflineRenderer()
+{
+}
+
+void
+OfflineRenderer::setEffect(std::weak_ptr<RealTimePluginInstance> effect)
+{
+    m_effect = effect;
+}
+
+void
+OfflineRenderer::setTimeStretch(double factor)
+{
+    m_timeStretch = factor;
+}
+
+void
+OfflineRenderer::setMixThreadCount(int threads)
+{
+    m_mixThreadCount = std::max(1, threads);
+}
+
+sv_frame_t
+OfflineRenderer::render(sv_frame_t startFrame, sv_frame_t maxFrames,
+                        Sink &sink)
+{
+    AudioCallbackPlaySource &s(*m_source);
+    ViewManagerBase *vm = s.m_viewManager;
+
+    if (s.isPlaying()) {
+        m_error = "Cannot render while the play source is playing";
+        return -1;
+    }
+
+    sv_samplerate_t rate = s.getSourceSampleRate();
+    int channels = s.getTargetChannelCount();
+
+    if (!rate || channels < 1 || s.m_models.empty()) {
+        m_error = "Nothing to render";
+        return -1;
+    }
+
+    bool looping = vm->getPlayLoopMode();
+    bool constrained = (vm->getPlaySelectionMode() &&
+                        !vm->getSelections().empty());
+
+    if (looping && maxFrames <= 0) {
+        m_error = "A frame limit is required when rendering in loop mode";
+        return -1;
+    }
+
+    // Start as play() would
+
+    if (constrained) {
+        startFrame = vm->constrainFrameToSelection(startFrame);
+    } else if (startFrame < 0 || startFrame >= s.m_lastModelEndFrame) {
+        startFrame = 0;
+    }
+    startFrame = vm->alignReferenceToPlaybackFrame(startFrame);
+
+    sv_frame_t endFrame = 0;
+    if (!constrained && !looping) {
+        endFrame = s.m_lastModelEndFrame;
+    }
+
+    // Take over the generator state from the fill thread, which
+    // leaves it alone until we have finished. Each block is mixed with
+    // the play source's mutex held, so it is not held for the whole
+    // render
+
+    {
+        QMutexLocker locker(&s.m_mutex);
+        s.m_rendering = true;
+        s.m_audioGenerator->reset();
+    }
+
+    MixSource mixSource(m_source, startFrame, endFrame, m_mixThreadCount);
+
+    EffectWrapper effectWrapper(&mixSource);
+    TimeStretchWrapper stretchWrapper(&effectWrapper);
+
+    // The ratio is fixed for the whole render, so leave the stretcher
+    // out of the chain altogether unless a stretch was asked for
+    breakfastquay::ApplicationPlaybackSource *head = &effectWrapper;
+    bool stretching = (m_timeStretch != 1.0);
+    if (stretching) {
+        stretchWrapper.setTimeStretchRatio(m_timeStretch);
+        head = &stretchWrapper;
+    }
+    
+    head->setSystemPlaybackChannelCount(channels);
+    head->setSystemPlaybackSampleRate(int(rate));
+    bool haveEffect = bool(m_effect.lock());
+    if (haveEffect) {
+        effectWrapper.setEffect(m_effect);
+    }
+    if (stretching) {
+        stretchWrapper.reset();
+    }
+
+    // The output is delayed by the latency of the wrappers. The
+    // effect's latency is in source frames, which the stretcher
+    // lengthens along with everything else
+    sv_frame_t latency = sv_frame_t(round(double(effectWrapper.getLatency())
+                                          * m_timeStretch));
+    if (stretching) {
+        latency += stretchWrapper.getLatency();
+    }
+    
+    std::vector<std::vector<float>> out(channels);
+    std::vector<float *> outPtrs(channels);
+    std::vector<float *> sinkPtrs(channels);
+    for (int c = 0; c < channels; ++c) {
+        out[c].resize(MIX_BLOCK_SIZE, 0.f);
+        outPtrs[c] = out[c].data();
+    }
+
+    sv_frame_t toDrop = latency;
+    sv_frame_t written = 0;
+    sv_frame_t tail = 0;
+    sv_frame_t maxTail = sv_frame_t(round(MAX_TAIL_DURATION * rate));
+
+    while (maxFrames <= 0 || written < maxFrames) {
+
+        sv_frame_t n = MIX_BLOCK_SIZE;
+        if (toDrop > 0) {
+            n = std::min(n, toDrop);
+        } else if (maxFrames > 0) {
+            n = std::min(n, maxFrames - written);
+        }
+
+        int got = head->getSourceSamples(outPtrs.data(), channels, int(n));
+        if (got <= 0) break;
+
+        if (toDrop > 0) {
+            toDrop -= got;
+            continue;
+        }
+
+        // Once the mix has ended, the output runs on for as long as
+        // the wrappers return audio from it: to the end of the
+        // stretched mix, and then to the end of any effect tail
+        
+        if (mixSource.isEnded()) {
+            sv_frame_t mixedLength = sv_frame_t
+                (round(double(mixSource.getMixedFrames()) * m_timeStretch));
+            if (written + got > mixedLength) {
+                if (!haveEffect) {
+                    got = int(std::max(sv_frame_t(0), mixedLength - written));
+                    if (got == 0) break;
+                } else {
+                    bool silent = true;
+                    for (int c = 0; c < channels && silent; ++c) {
+                        for (int i = 0; i < got; ++i) {
+                            if (fabsf(outPtrs[c][i]) > TAIL_THRESHOLD) {
+                                silent = false;
+                                break;
+                            }
+                        }
+                    }
+                    tail += got;
+                    if (silent || tail > maxTail) break;
+                }
+            }
+        }
+
+        if (!sink.write(outPtrs.data(), channels, got)) {
+            SVDEBUG << "OfflineRenderer::render: Abandoned by sink after "
+                    << written + got << " frames" << endl;
+            written += got;
+            break;
+        }
+
+        written += got;
+    }
+
+    // Leave the play source ready to start playing again from scratch
+
+    {
+        QMutexLocker locker(&s.m_mutex);
+        s.m_audioGenerator->reset();
+        if (int(s.m_mixThreads.size()) > s.m_mixThreadCount - 1) {
+            s.stopMixThreads();
+            s.prepareMixThreads();
+        }
+        s.clearRingBuffers(true);
+        s.m_rendering = false;
+    }
+
+    SVDEBUG << "OfflineRenderer::render: Rendered " << written
+            << " frames from " << startFrame << endl;
+
+    m_error = "";
+    return written;
+}
+
+namespace {
+class FileSink : public OfflineRenderer::Sink
+{
+public:
+    FileSink(WavFileWriter &writer) : m_writer(writer) { }
+    bool write(const float *const *samples, int, sv_frame_t count) override {
+        return m_writer.writeSamples(samples, count);
+    }
+private:
+    WavFileWriter &m_writer;
+};
+}
+
+bool
+OfflineRenderer::renderToFile(QString path, sv_frame_t startFrame,
+                              sv_frame_t maxFrames)
+{
+    WavFileWriter writer(path,
+                         m_source->getSourceSampleRate(),
+                         m_source->getTargetChannelCount(),
+                         WavFileWriter::WriteToTemporary);
+    if (!writer.isOK()) {
+        m_error = writer.getError();
+        return false;
+    }
+
+    FileSink sink(writer);
+    sv_frame_t written = render(startFrame, maxFrames, sink);
+
+    if (written < 0) {
+        return false;
+    }
+
+    if (!writer.isOK()) {
+        m_error = writer.getError();
+        return false;
+    }
+
+    if (!writer.close()) {
+        m_error = writer.getError();
+        return false;
+    }
+
+    return true;
+}
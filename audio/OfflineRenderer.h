@@ -0,0 +1,135 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_OFFLINE_RENDERER_H
+#define SV_OFFLINE_RENDERER_H
+
+#include "base/BaseTypes.h"
+
+#include <QString>
+
+#include <memory>
+
+class AudioCallbackPlaySource;
+class RealTimePluginInstance;
+
+/**
+ * Render the mix that an AudioCallbackPlaySource would play, as fast
+ * as it can be computed, without an audio device. The models are
+ * mixed by the play source's own mixing code, so the result honours
+ * the play selection and loop modes, the play parameters of each
+ * model, and solo and mute settings, exactly as playback would. An
+ * auditioning effect and a time-stretch ratio may optionally be
+ * applied through the same wrappers that playback uses.
+ *
+ * Rendering takes over the play source's mixing state for its
+ * duration, so the play source must not be playing, and its fill
+ * thread is paused meanwhile. The play source's mutex is taken only
+ * while each block is mixed. Playback can be started again as usual
+ * once render() has returned.
+ *
+ * The rendered output is aligned with the mix: the latency of the
+ * effect and time stretcher is trimmed from its start, and it runs on
+ * past the end of the mix to include the stretched audio still held
+ * in the stretcher and any tail from the effect, up to ten seconds of
+ * it.
+ */
+class OfflineRenderer
+{
+public:
+    /**
+     * Receiver for rendered audio, in non-interleaved channels at the
+     * play source's sample rate.
+     */
+    class Sink {
+    public:
+        virtual ~Sink() { }
+
+        /**
+         * Accept count frames of each of the given channels. Return
+         * false to abandon the render.
+         */
+        virtual bool write(const float *const *samples, int channels,
+                           sv_frame_t count) = 0;
+    };
+
+    /**
+     * Create a renderer for the given play source, which must outlive
+     * it.
+     */
+    OfflineRenderer(AudioCallbackPlaySource *source);
+    ~OfflineRenderer();
+
+    /**
+     * Apply the given effect to the rendered mix. The effect instance
+     * is shared with the caller, and must be configured for the play
+     * source's sample rate and channel count.
+     */
+    void setEffect(std::weak_ptr<RealTimePluginInstance> effect);
+
+    /**
+     * Time-stretch the rendered mix by the given factor, as for
+     * AudioCallbackPlaySource::setTimeStretch. The default is 1.0,
+     * for no stretching.
+     */
+    void setTimeStretch(double factor);
+
+    /**
+     * Set the number of threads to mix models with. The default is
+     * the number of processor cores available. The play source's own
+     * setting for real-time playback is unaffected.
+     */
+    void setMixThreadCount(int threads);
+
+    /**
+     * Render from the given start frame, which is constrained to the
+     * play selection in the same way as when starting playback. At
+     * most maxFrames output frames are rendered; if maxFrames is zero,
+     * rendering continues until the end of the selection or of the
+     * models, plus any effect tail. A limit is required if the play
+     * source's view manager is in loop mode, as the playback would
+     * not otherwise end.
+     *
+     * Return the number of frames passed to the sink, or a negative
+     * value if rendering could not be started.
+     */
+    sv_frame_t render(sv_frame_t startFrame, sv_frame_t maxFrames,
+                      Sink &sink);
+
+    /**
+     * Render as for render(), writing the result to a WAV file at the
+     * given path. Return false on failure.
+     */
+    bool renderToFile(QString path, sv_frame_t startFrame,
+                      sv_frame_t maxFrames);
+
+    /**
+     * Return the error message for the last failure, if any.
+     */
+    QString getError() const { return m_error; }
+
+private:
+    AudioCallbackPlaySource *m_source;
+    std::weak_ptr<RealTimePluginInstance> m_effect;
+    double m_timeStretch;
+    int m_mixThreadCount;
+    QString m_error;
+
+    class MixSource;
+
+    OfflineRenderer(const OfflineRenderer &) =delete;
+    OfflineRenderer &operator=(const OfflineRenderer &) =delete;
+};
+
+#endif
@@ -0,0 +1,319 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "PlaybackStatistics.h"
+
+#include <QMutexLocker>
+#include <QStringList>
+
+#include <chrono>
+#include <climits>
+#include <sstream>
+
+using std::memory_order_relaxed;
+
+PlaybackStatistics::AtomicTiming::AtomicTiming()
+{
+    clear();
+}
+
+void
+PlaybackStatistics::AtomicTiming::record(double seconds)
+{
+    if (seconds < 0.0) seconds = 0.0;
+    int64_t ns = int64_t(seconds * 1.0e9);
+
+    count.fetch_add(1, memory_order_relaxed);
+    totalNs.fetch_add(ns, memory_order_relaxed);
+
+    int64_t prev = maxNs.load(memory_order_relaxed);
+    while (ns > prev &&
+           !maxNs.compare_exchange_weak(prev, ns, memory_order_relaxed)) {
+    }
+
+    int64_t us = ns / 1000;
+    int bucket = 0;
+    while (us > 0 && bucket < BucketCount - 1) {
+        us >>= 1;
+        ++bucket;
+    }
+    buckets[bucket].fetch_add(1, memory_order_relaxed);
+}
+
+void
+PlaybackStatistics::AtomicTiming::clear()
+{
+    count = 0;
+    totalNs = 0;
+    maxNs = 0;
+    for (int i = 0; i < BucketCount; ++i) {
+        buckets[i] = 0;
+    }
+}
+
+PlaybackStatistics::Timing
+PlaybackStatistics::AtomicTiming::snapshot() const
+{
+    Timing t;
+    t.count = count.load(memory_order_relaxed);
+    t.total = double(totalNs.load(memory_order_relaxed)) / 1.0e9;
+    t.max = double(maxNs.load(memory_order_relaxed)) / 1.0e9;
+    for (int i = 0; i < BucketCount; ++i) {
+        t.buckets[i] = buckets[i].load(memory_order_relaxed);
+    }
+    return t;
+}
+
+void
+PlaybackStatistics::AtomicModelTiming::clear()
+{
+    calls = 0;
+    frames = 0;
+    totalNs = 0;
+    maxNs = 0;
+}
+
+PlaybackStatistics::ModelTiming
+PlaybackStatistics::AtomicModelTiming::snapshot() const
+{
+    ModelTiming t;
+    t.calls = calls.load(memory_order_relaxed);
+    t.frames = sv_frame_t(frames.load(memory_order_relaxed));
+    t.total = double(totalNs.load(memory_order_relaxed)) / 1.0e9;
+    t.max = double(maxNs.load(memory_order_relaxed)) / 1.0e9;
+    return t;
+}
+
+PlaybackStatistics::PlaybackStatistics()
+{
+    reset();
+}
+
+double
+PlaybackStatistics::now()
+{
+    return std::chrono::duration<double>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void
+PlaybackStatistics::recordStageTime(Stage stage, double seconds)
+{
+    if (stage < 0 || stage >= StageCount) return;
+    m_stages[stage].record(seconds);
+}
+
+void
+PlaybackStatistics::recordReadSpace(int channel, int frames)
+{
+    if (channel < 0 || channel >= MaxChannels) return;
+    std::atomic<int> &m(m_minReadSpace[channel]);
+    int prev = m.load(memory_order_relaxed);
+    while (frames < prev &&
+           !m.compare_exchange_weak(prev, frames, memory_order_relaxed)) {
+    }
+}
+
+void
+PlaybackStatistics::recordUnderrun(int framesRequested, int framesAvailable)
+{
+    m_underruns.fetch_add(1, memory_order_relaxed);
+    if (framesRequested > framesAvailable) {
+        m_underrunFrames.fetch_add(framesRequested - framesAvailable,
+                                   memory_order_relaxed);
+    }
+}
+
+void
+PlaybackStatistics::recordOverload()
+{
+    m_overloads.fetch_add(1, memory_order_relaxed);
+}
+
+void
+PlaybackStatistics::recordFillLag(double seconds)
+{
+    m_fillLag.record(seconds);
+}
+
+void
+PlaybackStatistics::addModel(ModelId model)
+{
+    QMutexLocker locker(&m_modelMutex);
+    if (m_models.find(model) == m_models.end()) {
+        m_models[model].reset(new AtomicModelTiming);
+    }
+}
+
+void
+PlaybackStatistics::recordModelMixTime(ModelId model, sv_frame_t frames,
+                                       double seconds)
+{
+    auto itr = m_models.find(model);
+    if (itr == m_models.end()) return;
+    AtomicModelTiming &t = *itr->second;
+
+    if (seconds < 0.0) seconds = 0.0;
+    int64_t ns = int64_t(seconds * 1.0e9);
+    
+    t.calls.fetch_add(1, memory_order_relaxed);
+    t.frames.fetch_add(int64_t(frames), memory_order_relaxed);
+    t.totalNs.fetch_add(ns, memory_order_relaxed);
+
+    int64_t prev = t.maxNs.load(memory_order_relaxed);
+    while (ns > prev &&
+           !t.maxNs.compare_exchange_weak(prev, ns, memory_order_relaxed)) {
+    }
+}
+
+void
+PlaybackStatistics::removeModel(ModelId model)
+{
+    QMutexLocker locker(&m_modelMutex);
+    m_models.erase(model);
+}
+
+void
+PlaybackStatistics::reset()
+{
+    for (int i = 0; i < StageCount; ++i) {
+        m_stages[i].clear();
+    }
+    m_fillLag.clear();
+    for (int i = 0; i < MaxChannels; ++i) {
+        m_minReadSpace[i] = INT_MAX;
+    }
+    m_underruns = 0;
+    m_underrunFrames = 0;
+    m_overloads = 0;
+
+    QMutexLocker locker(&m_modelMutex);
+    for (auto &m: m_models) {
+        m.second->clear();
+    }
+}
+
+PlaybackStatistics::Report
+PlaybackStatistics::getReport() const
+{
+    Report r;
+
+    for (int i = 0; i < StageCount; ++i) {
+        r.stages[i] = m_stages[i].snapshot();
+    }
+
+    // Every call at each stage is timed, including pass-through
+    // calls, so each stage's total includes the totals of all the
+    // stages nested within it, which are the ones with lower indices
+    for (int i = 0; i < StageCount; ++i) {
+        double own = r.stages[i].total;
+        if (i > 0) own -= r.stages[i-1].total;
+        if (own < 0.0 || r.stages[i].count == 0) own = 0.0;
+        r.ownMean[i] = (r.stages[i].count > 0 ? own / r.stages[i].count : 0.0);
+    }
+
+    r.fillLag = m_fillLag.snapshot();
+
+    for (int i = 0; i < MaxChannels; ++i) {
+        int m = m_minReadSpace[i].load(memory_order_relaxed);
+        if (m == INT_MAX) break;
+        r.minReadSpace.push_back(m);
+    }
+
+    r.underruns = m_underruns.load(memory_order_relaxed);
+    r.underrunFrames = m_underrunFrames.load(memory_order_relaxed);
+    r.overloads = m_overloads.load(memory_order_relaxed);
+
+    QMutexLocker locker(&m_modelMutex);
+    for (const auto &m: m_models) {
+        r.models[m.first] = m.second->snapshot();
+    }
+
+    return r;
+}
+
+const char *
+PlaybackStatistics::getStageName(Stage stage)
+{
+    switch (stage) {
+    case SourceStage: return "source";
+    case EffectStage: return "effect";
+    case TimeStretchStage: return "timestretch";
+    case StageCount: break;
+    }
+    return "unknown";
+}
+
+static QString
+formatTiming(QString name, const PlaybackStatistics::Timing &t)
+{
+    QStringList buckets;
+    for (int i = 0; i < int(t.buckets.size()); ++i) {
+        buckets << QString::number(t.buckets[i]);
+    }
+    return QString("%1: calls %2 mean %3us max %4us histogram-log2us [%5]")
+        .arg(name)
+        .arg(t.count)
+        .arg(t.getMean() * 1.0e6, 0, 'f', 1)
+        .arg(t.max * 1.0e6, 0, 'f', 1)
+        .arg(buckets.join(" "));
+}
+
+QString
+PlaybackStatistics::formatReport(const Report &r)
+{
+    QStringList lines;
+
+    for (int i = 0; i < StageCount; ++i) {
+        lines << formatTiming(QString("stage %1").arg
+                              (getStageName(Stage(i))), r.stages[i])
+            + QString(" own-mean %1us").arg(r.ownMean[i] * 1.0e6, 0, 'f', 1);
+    }
+
+    lines << formatTiming("fill-lag", r.fillLag);
+
+    QStringList spaces;
+    for (int s: r.minReadSpace) {
+        spaces << QString::number(s);
+    }
+    lines << QString("min-read-space: [%1]").arg(spaces.join(" "));
+
+    lines << QString("underruns: %1 (%2 frames short)")
+        .arg(r.underruns).arg(r.underrunFrames);
+    lines << QString("overloads: %1").arg(r.overloads);
+
+    for (const auto &m: r.models) {
+        std::ostringstream id;
+        id << m.first;
+        QString name;
+        if (auto model = ModelById::get(m.first)) {
+            name = QString(" %1 \"%2\"")
+                .arg(model->getTypeName())
+                .arg(model->objectName());
+        }
+        const ModelTiming &t = m.second;
+        lines << QString("model %1%2: calls %3 frames %4 total %5ms "
+                         "per-frame %6ns max %7us")
+            .arg(id.str().c_str())
+            .arg(name)
+            .arg(t.calls)
+            .arg(t.frames)
+            .arg(t.total * 1.0e3, 0, 'f', 2)
+            .arg(t.frames > 0 ? t.total * 1.0e9 / double(t.frames) : 0.0,
+                 0, 'f', 1)
+            .arg(t.max * 1.0e6, 0, 'f', 1);
+    }
+
+    return lines.join("\n") + "\n";
+}
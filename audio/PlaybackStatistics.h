@@ -0,0 +1,233 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_PLAYBACK_STATISTICS_H
+#define SV_PLAYBACK_STATISTICS_H
+
+#include "base/BaseTypes.h"
+#include "data/model/Model.h"
+
+#include <QMutex>
+#include <QString>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+/**
+ * Always-on timing and fault counters for the playback chain, cheap
+ * enough to record from the audio callback. Recording functions
+ * marked real-time safe use only relaxed atomic operations; the
+ * others take a mutex and are for the fill and mix threads.
+ *
+ * The processing stages nest: the time-stretch wrapper calls the
+ * effect wrapper, which calls the resampler and then the play
+ * source. Each stage's recorded time includes that of the stages
+ * it calls, and the report subtracts them to give each stage's own
+ * share. (The resampler is not separately instrumented, so its
+ * time is counted in the effect stage.)
+ */
+class PlaybackStatistics
+{
+public:
+    enum Stage {
+        SourceStage,       // AudioCallbackPlaySource::getSourceSamples
+        EffectStage,       // EffectWrapper::getSourceSamples
+        TimeStretchStage,  // TimeStretchWrapper::getSourceSamples
+        StageCount
+    };
+
+    /**
+     * Durations are histogrammed in buckets by powers of two of
+     * microseconds: bucket 0 holds durations under 1us, bucket b
+     * those in [2^(b-1), 2^b) us, and the last bucket everything
+     * longer.
+     */
+    static const int BucketCount = 20;
+
+    /**
+     * Read space minimums are tracked for this many channels.
+     */
+    static const int MaxChannels = 16;
+
+    PlaybackStatistics();
+
+    /**
+     * Return a monotonic time in seconds, for use in timing the
+     * intervals passed to the record functions. Real-time safe.
+     */
+    static double now();
+
+    /**
+     * Record the time taken by one call at the given stage of the
+     * playback chain. Real-time safe.
+     */
+    void recordStageTime(Stage stage, double seconds);
+
+    /**
+     * Record the time from construction to destruction of this object
+     * against a stage, for stages with several return paths. Does
+     * nothing if constructed with a null statistics object.
+     */
+    class StageTimer {
+    public:
+        StageTimer(PlaybackStatistics *stats, Stage stage) :
+            m_stats(stats), m_stage(stage),
+            m_start(stats ? now() : 0.0) { }
+        ~StageTimer() {
+            if (m_stats) m_stats->recordStageTime(m_stage, now() - m_start);
+        }
+    private:
+        PlaybackStatistics *m_stats;
+        Stage m_stage;
+        double m_start;
+    };
+
+    /**
+     * Record the read space found on a ring buffer channel at the
+     * start of a callback. Real-time safe.
+     */
+    void recordReadSpace(int channel, int frames);
+
+    /**
+     * Record a short read, in which the ring buffers held fewer
+     * frames than requested while playing. Real-time safe.
+     */
+    void recordUnderrun(int framesRequested, int framesAvailable);
+
+    /**
+     * Record a processing overload reported by the audio driver.
+     */
+    void recordOverload();
+
+    /**
+     * Record the delay between the audio callback waking the fill
+     * thread and the fill thread starting work.
+     */
+    void recordFillLag(double seconds);
+
+    /**
+     * Allocate the counters for a model about to be played. Must not
+     * be called at the same time as recordModelMixTime, which the
+     * play source ensures by calling both with its mutex held.
+     */
+    void addModel(ModelId model);
+
+    /**
+     * Record the time taken to mix the given number of frames from
+     * one model, which must have been added with addModel (others
+     * are ignored). Takes no lock, and may be called from several mix
+     * threads at once.
+     */
+    void recordModelMixTime(ModelId model, sv_frame_t frames,
+                            double seconds);
+
+    /**
+     * Forget a model that is no longer being played. The same
+     * restriction applies as for addModel.
+     */
+    void removeModel(ModelId model);
+
+    /**
+     * Clear all counts and histograms.
+     */
+    void reset();
+
+    struct Timing {
+        Timing() : count(0), total(0.0), max(0.0),
+                   buckets(BucketCount, 0) { }
+        long count;
+        double total;  // seconds
+        double max;    // seconds
+        std::vector<long> buckets;
+        double getMean() const { return count > 0 ? total / count : 0.0; }
+    };
+
+    struct ModelTiming {
+        ModelTiming() : calls(0), frames(0), total(0.0), max(0.0) { }
+        long calls;
+        sv_frame_t frames;
+        double total;  // seconds
+        double max;    // seconds, for a single call
+    };
+
+    struct Report {
+        Timing stages[StageCount];
+        double ownMean[StageCount]; // mean seconds per call, excluding
+                                    // time spent in nested stages
+        Timing fillLag;
+        std::vector<int> minReadSpace; // per channel seen so far
+        long underruns;
+        long underrunFrames;
+        long overloads;
+        std::map<ModelId, ModelTiming> models;
+    };
+
+    /**
+     * Return a snapshot of everything recorded since construction or
+     * the last reset().
+     */
+    Report getReport() const;
+
+    /**
+     * Format a report as human-readable text, one item per line.
+     */
+    static QString formatReport(const Report &report);
+
+    static const char *getStageName(Stage stage);
+
+private:
+    // Nanosecond totals are 64-bit, as long is only 32 bits on some
+    // platforms and would overflow after two seconds
+    struct AtomicTiming {
+        AtomicTiming();
+        std::atomic<long> count;
+        std::atomic<int64_t> totalNs;
+        std::atomic<int64_t> maxNs;
+        std::atomic<long> buckets[BucketCount];
+        void record(double seconds);
+        void clear();
+        Timing snapshot() const;
+    };
+
+    AtomicTiming m_stages[StageCount];
+    AtomicTiming m_fillLag;
+    std::atomic<int> m_minReadSpace[MaxChannels];
+    std::atomic<long> m_underruns;
+    std::atomic<long> m_underrunFrames;
+    std::atomic<long> m_overloads;
+
+    struct AtomicModelTiming {
+        AtomicModelTiming() { clear(); }
+        std::atomic<long> calls;
+        std::atomic<int64_t> frames;
+        std::atomic<int64_t> totalNs;
+        std::atomic<int64_t> maxNs;
+        void clear();
+        ModelTiming snapshot() const;
+    };
+
+    // The map is changed only by addModel and removeModel, with
+    // m_modelMutex held; recordModelMixTime only looks up and updates
+    // the counters in an existing slot
+    mutable QMutex m_modelMutex;
+    std::map<ModelId, std::unique_ptr<AtomicModelTiming>> m_models;
+
+    PlaybackStatistics(const PlaybackStatistics &) =delete;
+    PlaybackStatistics &operator=(const PlaybackStatistics &) =delete;
+};
+
+#endif
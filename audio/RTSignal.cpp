@@ -0,0 +1,125 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "RTSignal.h"
+
+#include "base/Debug.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <climits>
+#elif defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#endif
+
+class RTSignal::D
+{
+public:
+#if defined(_WIN32)
+    D() : m_sem(CreateSemaphore(NULL, 0, LONG_MAX, NULL)) {
+        if (!m_sem) {
+            SVCERR << "ERROR: RTSignal: Failed to create semaphore" << endl;
+        }
+    }
+    ~D() {
+        if (m_sem) CloseHandle(m_sem);
+    }
+    void post() {
+        if (m_sem) ReleaseSemaphore(m_sem, 1, NULL);
+    }
+    bool wait(int ms) {
+        if (!m_sem) return false;
+        return WaitForSingleObject(m_sem, DWORD(ms)) == WAIT_OBJECT_0;
+    }
+private:
+    HANDLE m_sem;
+#elif defined(__APPLE__)
+    // Unnamed POSIX semaphores are not supported on macOS
+    D() : m_sem(dispatch_semaphore_create(0)) { }
+    ~D() {
+        dispatch_release(m_sem);
+    }
+    void post() {
+        dispatch_semaphore_signal(m_sem);
+    }
+    bool wait(int ms) {
+        dispatch_time_t t = dispatch_time(DISPATCH_TIME_NOW,
+                                          int64_t(ms) * NSEC_PER_MSEC);
+        return dispatch_semaphore_wait(m_sem, t) == 0;
+    }
+private:
+    dispatch_semaphore_t m_sem;
+#else
+    D() : m_ok(sem_init(&m_sem, 0, 0) == 0) {
+        if (!m_ok) {
+            SVCERR << "ERROR: RTSignal: Failed to initialise semaphore" << endl;
+        }
+    }
+    ~D() {
+        if (m_ok) sem_destroy(&m_sem);
+    }
+    void post() {
+        if (m_ok) sem_post(&m_sem);
+    }
+    bool wait(int ms) {
+        if (!m_ok) return false;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += long(ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec += 1;
+            ts.tv_nsec -= 1000000000L;
+        }
+        while (sem_timedwait(&m_sem, &ts) != 0) {
+            if (errno != EINTR) return false;
+        }
+        return true;
+    }
+private:
+    sem_t m_sem;
+    bool m_ok;
+#endif
+};
+
+RTSignal::RTSignal() :
+    m_pending(false),
+    m_d(new D)
+{
+}
+
+RTSignal::~RTSignal()
+{
+    delete m_d;
+}
+
+void
+RTSignal::signal()
+{
+    if (!m_pending.exchange(true)) {
+        m_d->post();
+    }
+}
+
+bool
+RTSignal::wait(int timeoutMs)
+{
+    bool signalled = m_d->wait(timeoutMs);
+    m_pending = false;
+    return signalled;
+}
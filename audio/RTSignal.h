@@ -0,0 +1,61 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_RT_SIGNAL_H
+#define SV_RT_SIGNAL_H
+
+#include <atomic>
+
+/**
+ * A wakeup signal that may be raised from a real-time thread and
+ * waited for from a non-real-time one. Raising the signal never takes
+ * a lock or blocks: it sets an atomic flag and, only if the flag was
+ * not already set, posts an operating-system semaphore, which is
+ * itself safe to post from a real-time thread. Signals raised while
+ * the waiting thread is already awake are coalesced into a single
+ * wakeup.
+ *
+ * Only one thread should wait on an RTSignal.
+ */
+class RTSignal
+{
+public:
+    RTSignal();
+    ~RTSignal();
+
+    /**
+     * Wake the waiting thread, or make its next wait return
+     * immediately if it is not waiting. Real-time safe.
+     */
+    void signal();
+
+    /**
+     * Wait until signal() is called or the given timeout in
+     * milliseconds expires. Return true if signalled. The signal is
+     * consumed on return, so that any signal() occurring after this
+     * returns will wake the next call.
+     */
+    bool wait(int timeoutMs);
+
+private:
+    RTSignal(const RTSignal &) =delete;
+    RTSignal &operator=(const RTSignal &) =delete;
+
+    std::atomic<bool> m_pending;
+    
+    class D;
+    D *m_d;
+};
+
+#endif
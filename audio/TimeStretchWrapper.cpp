@@ -16,38 +16,56 @@
 
 #include <rubberband/RubberBandStretcher.h>
 
+#include <cmath>
+#include <thread>
+
+#include "PlaySpeedRangeMapper.h"
+
 #include "base/Debug.h"
 
+#include "bqvec/VectorOps.h"
+
 using namespace RubberBand;
 using namespace std;
 
+using breakfastquay::v_zero;
+
 TimeStretchWrapper::TimeStretchWrapper(ApplicationPlaybackSource *source) :
     m_source(source),
-    m_stretcher(nullptr),
+    m_stats(nullptr),
     m_timeRatio(1.0),
+    m_appliedRatio(1.0),
+    m_latency(0),
+    m_inputCount(0),
     m_stretcherInputSize(16384),
     m_channelCount(0),
-    m_sampleRate(0)
+    m_sampleRate(0),
+    m_multithreaded(false),
+    m_pass(0),
+    m_pending(0)
 {
 }
 
 TimeStretchWrapper::~TimeStretchWrapper()
 {
-    delete m_stretcher;
+    lock_guard<mutex> guard(m_mutex);
+    clear();
 }
 
 void
 TimeStretchWrapper::setTimeStretchRatio(double ratio)
 {
-    lock_guard<mutex> guard(m_mutex);
-
     SVDEBUG << "TimeStretchWrapper::setTimeStretchRatio: setting ratio to "
-            << ratio << " (was " << m_timeRatio << ")" << endl;
+            << ratio << " (was " << m_timeRatio.load() << ")" << endl;
+
+    // Picked up by the audio thread on its next call to
+    // getSourceSamples(). Rubber Band's real-time mode permits the
+    // ratio to be changed between process calls, including to and
+    // from 1.0, and our stretchers were constructed at the most
+    // extreme ratio in the play speed range, so their buffers never
+    // need to grow
     
     m_timeRatio = ratio;
-
-    // Stretcher will be updated by checkStretcher() from next call to
-    // getSourceSamples()
 }
 
 void
@@ -55,18 +73,58 @@ TimeStretchWrapper::reset()
 {
     lock_guard<mutex> guard(m_mutex);
 
-    if (m_stretcher) {
-        m_stretcher->reset();
+    // A pass abandoned by the audio thread may still be running on
+    // the channel threads
+    while (m_pending > 0) {
+        std::this_thread::yield();
+    }
+    
+    for (auto s: m_stretchers) {
+        s->reset();
+        s->setTimeRatio(m_timeRatio);
     }
+    m_appliedRatio = m_timeRatio;
+
+    m_latency = (m_stretchers.empty() ? 0 :
+                 int(m_stretchers[0]->getLatency()));
+}
+
+void
+TimeStretchWrapper::setMultithreaded(bool multithreaded)
+{
+    lock_guard<mutex> guard(m_mutex);
+
+    if (multithreaded == m_multithreaded) return;
+    m_multithreaded = multithreaded;
+    rebuild();
+}
+
+int
+TimeStretchWrapper::getLatency() const
+{
+    return m_latency;
+}
+
+void
+TimeStretchWrapper::setStatistics(PlaybackStatistics *stats)
+{
+    m_stats = stats;
 }
 
 int
 TimeStretchWrapper::getSourceSamples(float *const *samples,
                                      int nchannels, int nframes)
 {
-    checkStretcher();
-
-    lock_guard<mutex> guard(m_mutex);
+    PlaybackStatistics::StageTimer timer
+        (m_stats, PlaybackStatistics::TimeStretchStage);
+
+    // This is only contended by changes of channel count or sample
+    // rate, which rebuild the stretchers, and by reset(). Rather than
+    // wait for those, play the source unstretched for this block
+    unique_lock<mutex> guard(m_mutex, try_to_lock);
+    if (!guard.owns_lock()) {
+        return m_source->getSourceSamples(samples, nchannels, nframes);
+    }
 
     static int warnings = 0;
     if (nchannels != m_channelCount) {
@@ -81,77 +139,292 @@ TimeStretchWrapper::getSourceSamples(float *const *samples,
         return 0;
     }
     
-    if (!m_stretcher) {
+    if (m_stretchers.empty()) {
+        // format not yet known
         return m_source->getSourceSamples(samples, nchannels, nframes);
     }
 
-    vector<float *> inputPtrs(m_channelCount, nullptr);
-    for (int i = 0; i < m_channelCount; ++i) {
-        inputPtrs[i] = m_inputs[i].data();
+    // The stretcher keeps running at 1.0 rather than being bypassed,
+    // as switching between stretched and unstretched audio would
+    // either drop what the stretcher holds or insert its start-up
+    // latency as silence
+    
+    double ratio = m_timeRatio;
+    if (ratio != m_appliedRatio) {
+        for (auto s: m_stretchers) {
+            s->setTimeRatio(ratio);
+        }
+        m_appliedRatio = ratio;
+        m_latency = int(m_stretchers[0]->getLatency());
+    }
+
+    // If the channel threads have not finished a pass left over from
+    // the last call, play silence rather than hold up the callback
+    
+    if (!waitForPass(nframes)) {
+        for (int c = 0; c < nchannels; ++c) {
+            v_zero(samples[c], nframes);
+        }
+        if (auto stats = m_stats.load()) stats->recordUnderrun(nframes, 0);
+        return nframes;
     }
     
     // The input block for a given output is approx output / ratio,
     // but we can't predict it exactly, for an adaptive timestretcher.
 
-    sv_frame_t available;
+    int available;
 
-    while ((available = m_stretcher->available()) < nframes) {
+    while ((available = getAvailable()) < nframes) {
         
-        int reqd = int(ceil(double(nframes - available) / m_timeRatio));
-        reqd = std::max(reqd, int(m_stretcher->getSamplesRequired()));
+        int reqd = int(ceil(double(nframes - available) / m_appliedRatio));
+        reqd = std::max(reqd, getSamplesRequired());
         reqd = std::min(reqd, m_stretcherInputSize);
         if (reqd == 0) reqd = 1;
         
         int got = m_source->getSourceSamples
-            (inputPtrs.data(), nchannels, reqd);
+            (m_inputPtrs.data(), nchannels, reqd);
 
         if (got <= 0) {
             SVCERR << "WARNING: Failed to obtain any source samples at all"
                    << endl;
             return 0;
         }
-            
-        m_stretcher->process
-            (inputPtrs.data(), size_t(got), false);
+
+        m_inputCount = got;
+        if (!process(nframes)) {
+            for (int c = 0; c < nchannels; ++c) {
+                v_zero(samples[c], nframes);
+            }
+            if (auto stats = m_stats.load()) stats->recordUnderrun(nframes, 0);
+            return nframes;
+        }
     }
 
-    return int(m_stretcher->retrieve(samples, nframes));
+    int got = nframes;
+    if (m_stretchers.size() == 1) {
+        got = int(m_stretchers[0]->retrieve(samples, nframes));
+    } else {
+        // Per-channel stretchers: all have at least nframes available
+        for (int c = 0; c < m_channelCount; ++c) {
+            float *out = samples[c];
+            got = std::min(got,
+                           int(m_stretchers[c]->retrieve(&out, nframes)));
+        }
+    }
+
+    return got;
 }
 
-void
-TimeStretchWrapper::checkStretcher()
+int
+TimeStretchWrapper::getAvailable() const
 {
-    lock_guard<mutex> guard(m_mutex);
+    int available = 0;
+    for (int i = 0; i < int(m_stretchers.size()); ++i) {
+        int a = m_stretchers[i]->available();
+        if (i == 0 || a < available) available = a;
+    }
+    return available;
+}
 
-    if (m_timeRatio == 1.0 || !m_channelCount || !m_sampleRate) {
-        if (m_stretcher) {
-            SVDEBUG << "TimeStretchWrapper::checkStretcher: m_timeRatio = "
-                    << m_timeRatio << ", m_channelCount = " << m_channelCount
-                    << ", m_sampleRate = " << m_sampleRate
-                    << ", deleting existing stretcher" << endl;
-            delete m_stretcher;
-            m_stretcher = nullptr;
+int
+TimeStretchWrapper::getSamplesRequired() const
+{
+    int required = 0;
+    for (auto s: m_stretchers) {
+        required = std::max(required, int(s->getSamplesRequired()));
+    }
+    return required;
+}
+
+bool
+TimeStretchWrapper::process(int nframes)
+{
+    if (m_stretchers.size() == 1) {
+        m_stretchers[0]->process(m_inputPtrs.data(), size_t(m_inputCount),
+                                 false);
+        return true;
+    }
+
+    if (m_threads.empty()) {
+        for (int c = 0; c < m_channelCount; ++c) {
+            float *in = m_inputPtrs[c];
+            m_stretchers[c]->process(&in, size_t(m_inputCount), false);
         }
+        return true;
+    }
+
+    // Audio thread takes worker 0's share of the channels and the
+    // channel threads the rest. Each channel is claimed before it is
+    // processed, so once done with its own share the audio thread
+    // takes any that a channel thread has not yet got to, and then
+    // waits only for those already under way. The wait is by spinning
+    // rather than blocking, as it must not involve a system call, and
+    // it is bounded: see waitForPass
+    
+    int pass = m_pass.load(std::memory_order_relaxed) + 1;
+    m_pending.store(m_channelCount, std::memory_order_relaxed);
+    m_pass.store(pass, std::memory_order_release);
+    for (auto t: m_threads) {
+        t->go();
+    }
+
+    processChannels(0);
+    stealChannels();
+
+    return waitForPass(nframes);
+}
+
+bool
+TimeStretchWrapper::waitForPass(int nframes)
+{
+    if (m_pending.load(std::memory_order_acquire) == 0) {
+        return true;
+    }
+
+    // Wait for no longer than half the duration of the audio
+    // requested, leaving the rest for everything else in the callback
+    double limit = PlaybackStatistics::now() +
+        0.5 * double(nframes) / double(m_sampleRate);
+    
+    while (m_pending.load(std::memory_order_acquire) > 0) {
+        if (PlaybackStatistics::now() > limit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void
+TimeStretchWrapper::processChannels(int worker)
+{
+    int pass = m_pass.load(std::memory_order_acquire);
+    int workers = int(m_threads.size()) + 1;
+    for (int c = worker; c < m_channelCount; c += workers) {
+        processChannel(c, pass);
+    }
+}
+
+void
+TimeStretchWrapper::stealChannels()
+{
+    int pass = m_pass.load(std::memory_order_relaxed);
+    for (int c = 0; c < m_channelCount; ++c) {
+        processChannel(c, pass);
+    }
+}
+
+void
+TimeStretchWrapper::processChannel(int c, int pass)
+{
+    // Every channel is claimed once in every pass, so at the start of
+    // a pass each holds the previous pass number. A channel thread
+    // that wakes late, with a pass number already finished, fails to
+    // claim anything
+    int previous = pass - 1;
+    if (!m_claims[c].compare_exchange_strong(previous, pass,
+                                             std::memory_order_acq_rel)) {
         return;
     }
+    float *in = m_inputPtrs[c];
+    m_stretchers[c]->process(&in, size_t(m_inputCount), false);
+    m_pending.fetch_sub(1, std::memory_order_release);
+}
+
+void
+TimeStretchWrapper::ChannelThread::run()
+{
+    while (true) {
+        m_go.wait(1000);
+        if (m_finishing) return;
+        int pass = m_wrapper.m_pass.load(std::memory_order_acquire);
+        if (pass == m_lastPass) {
+            continue; // timed out, or a stale wakeup
+        }
+        m_lastPass = pass;
+        m_wrapper.processChannels(m_worker);
+    }
+}
+
+void
+TimeStretchWrapper::clear()
+{
+    for (auto t: m_threads) {
+        t->finish();
+    }
+    for (auto t: m_threads) {
+        t->wait();
+        delete t;
+    }
+    m_threads.clear();
+
+    for (auto s: m_stretchers) {
+        delete s;
+    }
+    m_stretchers.clear();
+    m_claims.reset();
+    m_pending = 0;
+    m_latency = 0;
+}
+
+void
+TimeStretchWrapper::rebuild()
+{
+    clear();
     
-    if (m_stretcher) {
-        SVDEBUG << "TimeStretchWrapper::checkStretcher: setting stretcher ratio to " << m_timeRatio << endl;
-        m_stretcher->setTimeRatio(m_timeRatio);
+    if (!m_channelCount || !m_sampleRate) {
         return;
     }
 
-    SVDEBUG << "TimeStretchWrapper::checkStretcher: creating stretcher with ratio " << m_timeRatio << endl;
+    // Construct the stretchers at the most extreme ratio in the play
+    // speed range, so that they allocate the largest buffers they
+    // will ever need, then switch to the actual ratio. Rubber Band
+    // only reallocates when a ratio change requires larger buffers
     
-    m_stretcher = new RubberBandStretcher
-        (size_t(round(m_sampleRate)),
-         m_channelCount,
-         RubberBandStretcher::OptionProcessRealTime,
-         m_timeRatio);
+    PlaySpeedRangeMapper mapper;
+    double slowest = mapper.getFactorForPosition(mapper.getMinPosition());
+    double fastest = mapper.getFactorForPosition(mapper.getMaxPosition());
+    double extreme = std::max(1.0 / slowest, fastest);
+
+    bool perChannel = (m_multithreaded && m_channelCount > 1);
+    int stretchers = (perChannel ? m_channelCount : 1);
+    
+    SVDEBUG << "TimeStretchWrapper::rebuild: creating " << stretchers
+            << " stretcher(s) for " << m_channelCount << " channel(s) at "
+            << m_sampleRate << "Hz" << endl;
+
+    for (int i = 0; i < stretchers; ++i) {
+        RubberBandStretcher *s = new RubberBandStretcher
+            (size_t(round(m_sampleRate)),
+             perChannel ? 1 : m_channelCount,
+             RubberBandStretcher::OptionProcessRealTime,
+             extreme);
+        s->setMaxProcessSize(m_stretcherInputSize);
+        s->setTimeRatio(m_timeRatio);
+        m_stretchers.push_back(s);
+    }
+
+    m_appliedRatio = m_timeRatio;
+    m_latency = int(m_stretchers[0]->getLatency());
+
+    m_claims.reset(new std::atomic<int>[m_channelCount]);
+    for (int c = 0; c < m_channelCount; ++c) {
+        m_claims[c] = m_pass.load();
+    }
 
     m_inputs.resize(m_channelCount);
-    for (auto &v: m_inputs) {
-        v.resize(m_stretcherInputSize);
+    m_inputPtrs.resize(m_channelCount);
+    for (int c = 0; c < m_channelCount; ++c) {
+        m_inputs[c].resize(m_stretcherInputSize);
+        m_inputPtrs[c] = m_inputs[c].data();
+    }
+
+    if (perChannel) {
+        int workers = std::min(m_channelCount, int(MaxThreads));
+        for (int w = 1; w < workers; ++w) {
+            ChannelThread *t = new ChannelThread(*this, w);
+            t->start();
+            m_threads.push_back(t);
+        }
     }
 }
 
@@ -161,10 +434,9 @@ TimeStretchWrapper::setSystemPlaybackChannelCount(int count)
     {
         lock_guard<mutex> guard(m_mutex);
         if (m_channelCount != count) {
-            delete m_stretcher;
-            m_stretcher = nullptr;
+            m_channelCount = count;
+            rebuild();
         }
-        m_channelCount = count;
     }
     m_source->setSystemPlaybackChannelCount(count);
 }
@@ -175,10 +447,9 @@ TimeStretchWrapper::setSystemPlaybackSampleRate(int rate)
     {
         lock_guard<mutex> guard(m_mutex);
         if (m_sampleRate != rate) {
-            delete m_stretcher;
-            m_stretcher = nullptr;
+            m_sampleRate = rate;
+            rebuild();
         }
-        m_sampleRate = rate;
     }
     m_source->setSystemPlaybackSampleRate(rate);
 }
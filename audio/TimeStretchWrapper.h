@@ -18,9 +18,15 @@
 #include "bqaudioio/ApplicationPlaybackSource.h"
 
 #include "base/BaseTypes.h"
+#include "base/Thread.h"
+
+#include "PlaybackStatistics.h"
+#include "RTSignal.h"
 
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <memory>
 
 namespace RubberBand {
     class RubberBandStretcher;
@@ -28,14 +34,18 @@ namespace RubberBand {
 
 /**
  * A breakfastquay::ApplicationPlaybackSource wrapper that implements
- * time-stretching using Rubber Band. Note that the stretcher is
- * bypassed entirely when a ratio of 1.0 is set; this means it's
- * (almost) free to use one of these wrappers normally, but it also
- * means you can't switch from 1.0 to another ratio (or back again)
- * without some audible artifacts.
+ * time-stretching using Rubber Band.
+ *
+ * The stretcher is created, with its buffers sized for the full range
+ * of PlaySpeedRangeMapper, when the channel count and sample rate are
+ * set, and then runs at every ratio including 1.0, so that a change
+ * of ratio in either direction is continuous. No ratio change
+ * allocates on the audio thread, and the audio thread never blocks:
+ * if the stretchers are being rebuilt when it calls, the source is
+ * passed through unstretched.
  *
- * This is real-time safe while the ratio is fixed, and may perform
- * reallocations when the ratio changes.
+ * Optionally, each channel of a multichannel source may be stretched
+ * by its own stretcher on its own thread (see setMultithreaded).
  */
 class TimeStretchWrapper : public breakfastquay::ApplicationPlaybackSource
 {
@@ -60,10 +70,33 @@ public:
     void setTimeStretchRatio(double ratio);
 
     /**
-     * Clear stretcher buffers.
+     * Clear stretcher buffers, as for the start of playback. The
+     * current ratio is applied straight away, and getLatency() is
+     * correct for it as soon as this returns.
      */
     void reset();
 
+    /**
+     * Stretch each channel of a multichannel source independently,
+     * with the channels shared among up to MaxThreads threads (the
+     * first of which is the audio thread itself). This uses more
+     * processing power in total, but spreads it across cores. The
+     * stretchers are rebuilt if this changes; do not call from the
+     * audio thread. Default is false.
+     */
+    void setMultithreaded(bool multithreaded);
+
+    /**
+     * Return the number of frames, at the system playback sample
+     * rate, by which the stretcher delays the audio passing through
+     * it. This is audio that has been taken from the wrapped source
+     * but not yet returned, and is zero until the format is known.
+     * May be called from any thread.
+     */
+    int getLatency() const;
+
+    static const int MaxThreads = 8;
+
     // These functions are passed through to the wrapped
     // ApplicationPlaybackSource
     
@@ -87,17 +120,82 @@ public:
     int getSourceSamples(float *const *samples, int nchannels, int nframes)
         override;
 
+    /**
+     * Record the time taken by each getSourceSamples call in the
+     * given statistics object, which must outlive this wrapper. Pass
+     * nullptr to stop recording.
+     */
+    void setStatistics(PlaybackStatistics *stats);
+
 private:
     ApplicationPlaybackSource *m_source;
-    RubberBand::RubberBandStretcher *m_stretcher;
-    double m_timeRatio;
+    std::atomic<PlaybackStatistics *> m_stats;
+
+    // Either a single stretcher for all channels, or one mono
+    // stretcher per channel when multithreaded. Changed only with
+    // m_mutex held, off the audio thread
+    std::vector<RubberBand::RubberBandStretcher *> m_stretchers;
+
+    std::atomic<double> m_timeRatio;
+    double m_appliedRatio; // audio thread only, or with m_mutex held
+    std::atomic<int> m_latency;
     std::vector<std::vector<float>> m_inputs;
+    std::vector<float *> m_inputPtrs;
+    int m_inputCount; // frames in m_inputs for the current pass
+
+    // Held by anything that rebuilds or resets the stretchers. The
+    // audio thread only ever tries it, and bypasses the stretcher if
+    // it is held elsewhere
     std::mutex m_mutex;
     int m_stretcherInputSize;
     int m_channelCount;
     sv_samplerate_t m_sampleRate;
-
-    void checkStretcher(); // call without m_mutex held
+    bool m_multithreaded;
+
+    class ChannelThread : public Thread
+    {
+    public:
+        ChannelThread(TimeStretchWrapper &wrapper, int worker) :
+            Thread(Thread::RTThread),
+            m_wrapper(wrapper),
+            m_worker(worker),
+            m_lastPass(wrapper.m_pass),
+            m_finishing(false) { }
+
+        void run() override;
+
+        void go() { m_go.signal(); }
+        void finish() { m_finishing = true; m_go.signal(); }
+
+    private:
+        TimeStretchWrapper &m_wrapper;
+        int m_worker;
+        int m_lastPass;
+        std::atomic<bool> m_finishing;
+        RTSignal m_go;
+    };
+
+    std::vector<ChannelThread *> m_threads;
+    std::atomic<int> m_pass; // incremented at the start of each pass
+    std::atomic<int> m_pending; // channels yet to finish the current pass
+
+    // Per channel, the last pass in which that channel was claimed
+    // for processing, by a worker or by the audio thread
+    std::unique_ptr<std::atomic<int>[]> m_claims;
+
+    void rebuild(); // call with m_mutex held, not on the audio thread
+    void clear(); // likewise
+    int getAvailable() const;
+    int getSamplesRequired() const;
+
+    // Process m_inputCount frames from m_inputs. Return false if the
+    // channel threads did not finish within the time available for
+    // nframes of output, in which case the pass is left outstanding
+    bool process(int nframes);
+    bool waitForPass(int nframes); // false if the pass is still outstanding
+    void processChannels(int worker); // those channels assigned to worker
+    void stealChannels(); // any channels not yet claimed, on audio thread
+    void processChannel(int c, int pass); // if not claimed already
     
     TimeStretchWrapper(const TimeStretchWrapper &)=delete;
     TimeStretchWrapper &operator=(const TimeStretchWrapper &)=delete;
@@ -0,0 +1,487 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+/*
+    Benchmark for the playback mixing code. A set of dense (audio
+    file), clip (instants played with ClipMixer) and synth (time
+    values played with ContinuousSynth) models is generated and added
+    to an AudioCallbackPlaySource, and the mix is then rendered with
+    OfflineRenderer, as fast as it can be computed, in each of the
+    play modes and time-stretch ratios asked for. OfflineRenderer
+    drives the play source's own mixModels, with its mix threads and
+    through the same effect and time-stretch wrappers as playback, so
+    this measures the real mixing path except for the ring buffers
+    and the audio device.
+
+    For each render, the rate in frames mixed per second, that rate
+    as a multiple of real time, and the number of heap allocations
+    per generator block are reported, followed by the mixing cost of
+    each model as recorded in the play source's PlaybackStatistics.
+    Each model type is then also mixed directly through
+    AudioGenerator::mixModel in generator-sized blocks, to give its
+    cost in isolation. All output is CSV, one section per kind of
+    result, each with its own header line.
+
+    This must be built within the Sonic Visualiser source tree, next
+    to the svcore, svgui and svapp libraries that it links against.
+
+    Usage: playback-benchmark [--dense N] [--clips N] [--synths N]
+                              [--channels N] [--duration SECONDS]
+                              [--threads N] [--modes LIST]
+                              [--stretches LIST]
+
+    LIST is comma-separated. The modes are "plain", "selection",
+    "loop" and "loop-selection", all of them by default; the default
+    stretches are "1,1.5".
+*/
+
+#include "audio/AudioCallbackPlaySource.h"
+#include "audio/AudioGenerator.h"
+#include "audio/OfflineRenderer.h"
+#include "audio/PlaybackStatistics.h"
+
+#include "data/model/ReadOnlyWaveFileModel.h"
+#include "data/model/SparseOneDimensionalModel.h"
+#include "data/model/SparseTimeValueModel.h"
+#include "data/fileio/WavFileWriter.h"
+#include "data/fileio/FileSource.h"
+#include "base/PlayParameterRepository.h"
+#include "base/PlayParameters.h"
+#include "base/TempDirectory.h"
+#include "base/Selection.h"
+#include "view/ViewManager.h"
+
+#include <QApplication>
+#include <QEventLoop>
+#include <QTemporaryDir>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QDir>
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <random>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cmath>
+
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+static const sv_samplerate_t sampleRate = 44100;
+
+static const QString clipId = "playback-benchmark-click";
+
+// Every heap allocation in the process, from any thread, is counted
+// here, so that allocations made by the mixing code can be reported
+
+static std::atomic<long> allocations { 0 };
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+struct Options {
+    int dense = 4;
+    int clips = 2;
+    int synths = 2;
+    int channels = 2;
+    double duration = 30.0;
+    int threads = 1;
+    QStringList modes { "plain", "selection", "loop", "loop-selection" };
+    vector<double> stretches { 1.0, 1.5 };
+};
+
+static bool
+parseOptions(const QStringList &args, Options &options)
+{
+    for (int i = 1; i + 1 < args.size(); i += 2) {
+        QString name = args[i];
+        QString value = args[i+1];
+        if (name == "--dense") {
+            options.dense = value.toInt();
+        } else if (name == "--clips") {
+            options.clips = value.toInt();
+        } else if (name == "--synths") {
+            options.synths = value.toInt();
+        } else if (name == "--channels") {
+            options.channels = std::max(1, value.toInt());
+        } else if (name == "--duration") {
+            options.duration = value.toDouble();
+        } else if (name == "--threads") {
+            options.threads = std::max(1, value.toInt());
+        } else if (name == "--modes") {
+            options.modes = value.split(",", QString::SkipEmptyParts);
+        } else if (name == "--stretches") {
+            options.stretches.clear();
+            for (auto s: value.split(",", QString::SkipEmptyParts)) {
+                options.stretches.push_back(s.toDouble());
+            }
+        } else {
+            cerr << "ERROR: Unknown option " << name << endl;
+            return false;
+        }
+    }
+    if (args.size() % 2 == 0) {
+        cerr << "ERROR: Option " << args.back() << " has no value" << endl;
+        return false;
+    }
+    if (options.duration <= 0.0 ||
+        options.dense + options.clips + options.synths < 1) {
+        cerr << "ERROR: Nothing to play" << endl;
+        return false;
+    }
+    return true;
+}
+
+static bool
+writeWav(QString path, const vector<vector<float>> &channels)
+{
+    WavFileWriter writer(path, sampleRate, int(channels.size()),
+                         WavFileWriter::WriteToTarget);
+    if (!writer.isOK()) {
+        cerr << "ERROR: Failed to open " << path << " for writing: "
+             << writer.getError() << endl;
+        return false;
+    }
+    vector<const float *> ptrs;
+    for (const auto &c: channels) ptrs.push_back(c.data());
+    writer.writeSamples(ptrs.data(), sv_frame_t(channels[0].size()));
+    writer.close();
+    return writer.isOK();
+}
+
+/**
+ * Write the clip that the clip models are played with into the
+ * directory that AudioGenerator loads its clips from.
+ */
+static bool
+writeClip()
+{
+    QString dir = TempDirectory::getInstance()->getSubDirectoryPath("samples");
+    sv_frame_t n = sv_frame_t(0.1 * sampleRate);
+    vector<vector<float>> clip(1, vector<float>(n));
+    for (sv_frame_t i = 0; i < n; ++i) {
+        double env = exp(-30.0 * double(i) / double(n));
+        clip[0][i] = float(0.5 * env * sin(2.0 * M_PI * 261.63 * double(i) /
+                                          sampleRate));
+    }
+    return writeWav(QDir(dir).filePath(clipId + ".wav"), clip);
+}
+
+static ModelId
+makeDenseModel(QString dir, int index, const Options &options)
+{
+    std::mt19937 random { unsigned(index + 1) };
+    std::uniform_real_distribution<double> noise(-0.05, 0.05);
+    
+    sv_frame_t n = sv_frame_t(options.duration * sampleRate);
+    double w = 2.0 * M_PI * (110.0 * (index + 1)) / sampleRate;
+    vector<vector<float>> channels(options.channels, vector<float>(n));
+    for (int c = 0; c < options.channels; ++c) {
+        for (sv_frame_t i = 0; i < n; ++i) {
+            channels[c][i] = float(0.2 * sin(w * double(i) + c) +
+                                   noise(random));
+        }
+    }
+
+    QString path = QString("%1/dense-%2.wav").arg(dir).arg(index);
+    if (!writeWav(path, channels)) return {};
+
+    auto model = std::make_shared<ReadOnlyWaveFileModel>(FileSource(path));
+    if (!model->isOK()) {
+        cerr << "ERROR: Failed to load " << path << endl;
+        return {};
+    }
+    while (!model->isReady()) {
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 50);
+    }
+    return ModelById::add(model);
+}
+
+static ModelId
+makeClipModel(int index, const Options &options)
+{
+    auto model = std::make_shared<SparseOneDimensionalModel>(sampleRate, 1);
+    model->setObjectName(QString("clip-%1").arg(index));
+
+    // An onset every 100-300ms
+    std::mt19937 random { unsigned(100 + index) };
+    std::uniform_real_distribution<double> gap(0.1, 0.3);
+    for (double t = 0.0; t < options.duration; t += gap(random)) {
+        model->add(Event(sv_frame_t(t * sampleRate)));
+    }
+    return ModelById::add(model);
+}
+
+static ModelId
+makeSynthModel(int index, const Options &options)
+{
+    auto model = std::make_shared<SparseTimeValueModel>(sampleRate, 512);
+    model->setObjectName(QString("synth-%1").arg(index));
+
+    // A frequency contour, with a value every 512 frames
+    double step = 512.0 / sampleRate;
+    for (double t = 0.0; t < options.duration; t += step) {
+        double f = 220.0 * (index + 1) * (1.0 + 0.1 * sin(t * 2.0));
+        model->add(Event(sv_frame_t(t * sampleRate), float(f), QString()));
+    }
+    return ModelById::add(model);
+}
+
+static void
+preparePlayParameters(ModelId modelId, bool clip)
+{
+    // Models register themselves as playables on construction
+    auto parameters = PlayParameterRepository::getInstance()->
+        getPlayParameters(modelId.untyped);
+    if (!parameters) {
+        cerr << "WARNING: No play parameters for model " << modelId << endl;
+        return;
+    }
+    parameters->setPlayMuted(false);
+    if (clip) parameters->setPlayClipId(clipId);
+}
+
+/**
+ * A sink that keeps nothing but a running peak, so that the mix can
+ * not be optimised away.
+ */
+class PeakSink : public OfflineRenderer::Sink
+{
+public:
+    PeakSink() : m_peak(0.f) { }
+    bool write(const float *const *samples, int channels,
+               sv_frame_t count) override {
+        for (int c = 0; c < channels; ++c) {
+            for (sv_frame_t i = 0; i < count; ++i) {
+                m_peak = std::max(m_peak, fabsf(samples[c][i]));
+            }
+        }
+        return true;
+    }
+    float getPeak() const { return m_peak; }
+private:
+    float m_peak;
+};
+
+struct Benchmarked {
+    ModelId id;
+    QString kind;
+    int index;
+};
+
+static void
+runRender(AudioCallbackPlaySource &source, ViewManager &vm,
+          const vector<Benchmarked> &models, QString mode, double stretch,
+          sv_frame_t durationFrames, sv_frame_t blockSize,
+          const Options &options,
+          vector<QString> &modelRows)
+{
+    bool loop = mode.startsWith("loop");
+    bool selection = mode.endsWith("selection");
+
+    vm.setPlayLoopMode(loop);
+    vm.setPlaySelectionMode(selection);
+    vm.clearSelections();
+    if (selection) {
+        vm.setSelection(Selection(durationFrames / 4, durationFrames * 3 / 4));
+    }
+
+    // Looping never ends by itself, so render the same length as
+    // without it
+    sv_frame_t maxFrames = 0;
+    if (loop) maxFrames = sv_frame_t(durationFrames * stretch);
+
+    OfflineRenderer renderer(&source);
+    renderer.setTimeStretch(stretch);
+    renderer.setMixThreadCount(options.threads);
+
+    source.resetPlaybackStatistics();
+
+    PeakSink sink;
+    long allocationsBefore = allocations.load();
+    QElapsedTimer timer;
+    timer.start();
+    sv_frame_t frames = renderer.render(0, maxFrames, sink);
+    qint64 ns = timer.nsecsElapsed();
+    long allocated = allocations.load() - allocationsBefore;
+
+    QString config = QString("%1,%2,%3,%4,%5,%6")
+        .arg(mode).arg(stretch).arg(source.getTargetChannelCount())
+        .arg(options.dense).arg(options.clips).arg(options.synths);
+    
+    if (frames < 0) {
+        cout << config << ",,,,,,failed: " << renderer.getError() << endl;
+        return;
+    }
+
+    double sec = double(ns) / 1.0e9;
+    double rate = (sec > 0.0 ? double(frames) / sec : 0.0);
+    double blocks = double(frames) / double(blockSize);
+    
+    cout << config << "," << frames << "," << sec << "," << rate << ","
+         << rate / sampleRate << "," << allocated << ","
+         << (blocks > 0 ? double(allocated) / blocks : 0.0) << ",ok"
+         << endl;
+
+    PlaybackStatistics::Report report = source.getPlaybackStatistics();
+    for (const auto &m: models) {
+        auto itr = report.models.find(m.id);
+        if (itr == report.models.end()) continue;
+        const auto &t = itr->second;
+        modelRows.push_back
+            (QString("%1,%2,%3,%4,%5,%6,%7,%8")
+             .arg(mode).arg(stretch).arg(m.kind).arg(m.index)
+             .arg(t.calls).arg(t.frames).arg(t.total * 1.0e3)
+             .arg(t.frames > 0 ? t.total * 1.0e9 / double(t.frames) : 0.0));
+    }
+}
+
+static void
+runGenerator(const Benchmarked &m, sv_frame_t durationFrames,
+             const Options &options)
+{
+    AudioGenerator generator;
+    generator.setTargetChannelCount(std::max(2, options.channels));
+    if (!generator.addModel(m.id)) {
+        cout << m.kind << "," << m.index << ",,,,,unplayable" << endl;
+        return;
+    }
+
+    sv_frame_t blockSize = generator.getBlockSize();
+    int channels = std::max(2, options.channels);
+    vector<vector<float>> buffers(channels, vector<float>(blockSize, 0.f));
+    vector<float *> ptrs;
+    for (auto &b: buffers) ptrs.push_back(b.data());
+
+    long blocks = 0;
+    long allocationsBefore = allocations.load();
+    QElapsedTimer timer;
+    timer.start();
+    for (sv_frame_t f = 0; f < durationFrames; f += blockSize) {
+        (void)generator.mixModel(m.id, f, blockSize, ptrs.data());
+        ++blocks;
+    }
+    qint64 ns = timer.nsecsElapsed();
+    long allocated = allocations.load() - allocationsBefore;
+
+    double sec = double(ns) / 1.0e9;
+    double frames = double(blocks) * double(blockSize);
+    cout << m.kind << "," << m.index << "," << blockSize << ","
+         << (sec > 0.0 ? frames / sec : 0.0) << ","
+         << (blocks > 0 ? double(ns) / double(blocks) : 0.0) << ","
+         << (blocks > 0 ? double(allocated) / double(blocks) : 0.0)
+         << ",ok" << endl;
+}
+
+int main(int argc, char **argv)
+{
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    
+    QApplication app(argc, argv);
+    QApplication::setOrganizationName("sv-playback-benchmark");
+    QApplication::setApplicationName("playback-benchmark");
+
+    Options options;
+    if (!parseOptions(app.arguments(), options)) {
+        return 2;
+    }
+
+    QTemporaryDir dir;
+    if (!dir.isValid() || !writeClip()) {
+        return 1;
+    }
+
+    vector<Benchmarked> models;
+    for (int i = 0; i < options.dense; ++i) {
+        models.push_back({ makeDenseModel(dir.path(), i, options),
+                           "dense", i });
+    }
+    for (int i = 0; i < options.clips; ++i) {
+        models.push_back({ makeClipModel(i, options), "clip", i });
+    }
+    for (int i = 0; i < options.synths; ++i) {
+        models.push_back({ makeSynthModel(i, options), "synth", i });
+    }
+    for (const auto &m: models) {
+        if (m.id.isNone()) return 1;
+        preparePlayParameters(m.id, m.kind == "clip");
+    }
+
+    sv_frame_t durationFrames = sv_frame_t(options.duration * sampleRate);
+    vector<QString> modelRows;
+
+    {
+        ViewManager vm;
+        AudioCallbackPlaySource source(&vm, "playback-benchmark");
+        source.setSystemPlaybackSampleRate(int(sampleRate));
+        source.setSystemPlaybackChannelCount(options.channels);
+        for (const auto &m: models) {
+            source.addModel(m.id);
+        }
+
+        sv_frame_t blockSize = AudioGenerator().getBlockSize();
+
+        cout << "mode,stretch,channels,dense,clips,synths,frames,seconds,"
+             << "frames-per-sec,realtime-factor,allocations,"
+             << "allocations-per-block,status" << endl;
+
+        for (QString mode: options.modes) {
+            for (double stretch: options.stretches) {
+                runRender(source, vm, models, mode, stretch,
+                          durationFrames, blockSize, options, modelRows);
+            }
+        }
+    }
+    
+    cout << endl
+         << "mode,stretch,kind,index,calls,frames,total-ms,ns-per-frame"
+         << endl;
+    for (const auto &row: modelRows) {
+        cout << row << endl;
+    }
+    
+    cout << endl
+         << "kind,index,block-size,frames-per-sec,ns-per-block,"
+         << "allocations-per-block,status" << endl;
+    for (const auto &m: models) {
+        runGenerator(m, durationFrames, options);
+    }
+
+    for (const auto &m: models) {
+        ModelById::release(m.id);
+    }
+    TempDirectory::getInstance()->cleanup();
+    
+    return 0;
+}
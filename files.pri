@@ -2,6 +2,11 @@
 SVAPP_HEADERS += \
            align/Align.h \
            align/Aligner.h \
+           align/AlignmentCache.h \
+           align/AlignmentWindowModel.h \
+           align/CachedAligner.h \
+           align/ChunkedMATCHAligner.h \
+           align/DTWScheduler.h \
            align/ExternalProgramAligner.h \
            align/LinearAligner.h \
            align/MATCHAligner.h \
@@ -12,17 +17,31 @@ SVAPP_HEADERS += \
            audio/ClipMixer.h \
            audio/ContinuousSynth.h \
            audio/EffectWrapper.h \
+           audio/OfflineRenderer.h \
+           audio/PlaybackStatistics.h \
            audio/PlaySpeedRangeMapper.h \
+           audio/RTSignal.h \
            audio/TimeStretchWrapper.h \
+           framework/BatchProcessor.h \
+           framework/DerivedModelCache.h \
 	   framework/Document.h \
+           framework/LayerExporter.h \
+           framework/LayerExportTask.h \
            framework/MainWindowBase.h \
+           framework/ModelDataLoader.h \
            framework/OSCScript.h \
            framework/SVFileReader.h \
+           framework/SessionStatistics.h \
            framework/TransformUserConfigurator.h \
            framework/VersionTester.h
 
 SVAPP_SOURCES += \
 	   align/Align.cpp \
+           align/AlignmentCache.cpp \
+           align/AlignmentWindowModel.cpp \
+           align/CachedAligner.cpp \
+           align/ChunkedMATCHAligner.cpp \
+           align/DTWScheduler.cpp \
            align/ExternalProgramAligner.cpp \
            align/LinearAligner.cpp \
            align/MATCHAligner.cpp \
@@ -33,10 +52,20 @@ SVAPP_SOURCES += \
            audio/ClipMixer.cpp \
            audio/ContinuousSynth.cpp \
            audio/EffectWrapper.cpp \
+           audio/OfflineRenderer.cpp \
+           audio/PlaybackStatistics.cpp \
            audio/PlaySpeedRangeMapper.cpp \
+           audio/RTSignal.cpp \
            audio/TimeStretchWrapper.cpp \
+           framework/BatchProcessor.cpp \
+           framework/DerivedModelCache.cpp \
 	   framework/Document.cpp \
+           framework/LayerExporter.cpp \
+           framework/LayerExportTask.cpp \
            framework/MainWindowBase.cpp \
+           framework/ModelDataLoader.cpp \
+           framework/OSCScript.cpp \
            framework/SVFileReader.cpp \
+           framework/SessionStatistics.cpp \
            framework/TransformUserConfigurator.cpp \
            framework/VersionTester.cpp
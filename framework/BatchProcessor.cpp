@@ -0,0 +1,449 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "BatchProcessor.h"
+
+#include "Document.h"
+#include "LayerExporter.h"
+#include "SVFileReader.h"
+#include "ModelDataLoader.h"
+
+#include "base/Debug.h"
+#include "data/fileio/BZipFileDevice.h"
+#include "data/fileio/FileSource.h"
+#include "data/model/ReadOnlyWaveFileModel.h"
+#include "data/model/WaveFileModel.h"
+#include "layer/Layer.h"
+#include "layer/LayerFactory.h"
+
+#include <QDir>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QSettings>
+#include <QThread>
+#include <QTimer>
+#include <QXmlInputSource>
+
+#include <algorithm>
+
+//#define DEBUG_BATCH_PROCESSOR 1
+
+// Interval at which a job waiting for its models wakes to check on
+// them, if no event has woken it sooner
+static const int readyCheckInterval = 100; // ms
+
+namespace {
+class NoPaneCallback : public SVFileReaderPaneCallback
+{
+public:
+    Pane *addPane() override { return nullptr; }
+    void setWindowSize(int, int) override { }
+    void addSelection(sv_frame_t, sv_frame_t) override { }
+};
+}
+
+BatchProcessor::BatchProcessor() :
+    m_nextId(1),
+    m_running(0),
+    m_exiting(false),
+    m_generation(0)
+{
+    QSettings settings;
+    settings.beginGroup("BatchProcessor");
+    m_threadCount = std::max
+        (1, settings.value("job-threads",
+                           QThread::idealThreadCount()).toInt());
+    m_jobTimeout = std::max(0, settings.value("job-timeout", 0).toInt());
+    settings.endGroup();
+}
+
+BatchProcessor::~BatchProcessor()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_jobs.empty() || m_running > 0) {
+            SVDEBUG << "BatchProcessor: Abandoning " << m_jobs.size()
+                    << " queued and " << m_running << " running job(s)"
+                    << endl;
+        }
+        m_jobs.clear();
+        ++m_generation;
+        m_exiting = true;
+        m_condition.wakeAll();
+    }
+
+    for (auto t: m_threads) {
+        t->wait();
+        delete t;
+    }
+}
+
+void
+BatchProcessor::setJobThreadCount(int threads)
+{
+    QMutexLocker locker(&m_mutex);
+    m_threadCount = std::max(1, threads);
+}
+
+int
+BatchProcessor::addJob(Job job)
+{
+    QMutexLocker locker(&m_mutex);
+
+    int id = m_nextId++;
+    m_results[id] = Result();
+    m_jobs.push_back({ id, std::move(job) });
+
+    // Start another thread if the ones we have are all busy
+    if (int(m_threads.size()) < m_threadCount &&
+        m_running + int(m_jobs.size()) > int(m_threads.size())) {
+        JobThread *t = new JobThread(*this);
+        m_threads.push_back(t);
+        t->start();
+    }
+
+    m_condition.wakeAll();
+    return id;
+}
+
+bool
+BatchProcessor::isProcessing() const
+{
+    QMutexLocker locker(&m_mutex);
+    return !m_jobs.empty() || m_running > 0;
+}
+
+void
+BatchProcessor::waitForAll() const
+{
+    QMutexLocker locker(&m_mutex);
+    while (!m_jobs.empty() || m_running > 0) {
+        m_condition.wait(&m_mutex);
+    }
+}
+
+void
+BatchProcessor::cancel()
+{
+    QMutexLocker locker(&m_mutex);
+    for (const auto &j: m_jobs) {
+        Result &r = m_results[j.first];
+        r.finished = true;
+        r.error = tr("Cancelled");
+    }
+    m_jobs.clear();
+    ++m_generation;
+    m_condition.wakeAll();
+}
+
+BatchProcessor::Result
+BatchProcessor::getResult(int jobId) const
+{
+    QMutexLocker locker(&m_mutex);
+    auto itr = m_results.find(jobId);
+    if (itr == m_results.end()) return {};
+    return itr->second;
+}
+
+void
+BatchProcessor::runJobs()
+{
+    QMutexLocker locker(&m_mutex);
+
+    while (!m_exiting) {
+
+        if (m_jobs.empty()) {
+            m_condition.wait(&m_mutex);
+            continue;
+        }
+
+        auto job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        ++m_running;
+        int generation = m_generation;
+        locker.unlock();
+
+        SVDEBUG << "BatchProcessor: Starting job " << job.first << " for \""
+                << job.second.input << "\"" << endl;
+        
+        Result result;
+        runJob(job.second, generation, result);
+        result.finished = true;
+
+        SVDEBUG << "BatchProcessor: Job " << job.first << " "
+                << (result.ok ? "succeeded" : "failed: ") << result.error
+                << endl;
+        
+        locker.relock();
+        m_results[job.first] = result;
+        --m_running;
+        m_condition.wakeAll();
+        locker.unlock();
+
+        emit jobFinished(job.first, result.ok);
+
+        locker.relock();
+    }
+}
+
+void
+BatchProcessor::runJob(const Job &job, int generation, Result &result)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // The document is created in this thread and so are all of the
+    // models and layers it makes, which means the signals they
+    // receive from transform and alignment threads are queued for
+    // this thread, and are delivered while waitForDocument runs
+    // this thread's event loop
+    
+    Document document;
+    document.setUsingCommandHistory(false);
+    
+    if (!openInput(document, job, result.error)) {
+        return;
+    }
+
+    // The layers to export, with the name each is exported under.
+    // Layers read from a session come first and are named after the
+    // layer, those we create are named after their transform. Layers
+    // that show audio, or nothing, are not exported
+    
+    std::vector<std::pair<Layer *, QString>> layers;
+    for (auto layer: document.getLayers()) {
+        ModelId modelId = layer->getModel();
+        if (modelId.isNone() || ModelById::isa<WaveFileModel>(modelId)) {
+            continue;
+        }
+        layers.push_back({ layer, layer->objectName() });
+    }
+
+    if (!job.transforms.empty()) {
+
+        ModelId mainModel = document.getMainModel();
+        if (mainModel.isNone()) {
+            result.error = tr("No audio to run transforms on");
+            return;
+        }
+        
+        QString message;
+        std::vector<ModelId> models = document.addDerivedModels
+            (job.transforms, ModelTransformer::Input(mainModel),
+             message, nullptr);
+
+        if (models.empty()) {
+            result.error = tr("Failed to run transforms: %1").arg(message);
+            return;
+        }
+
+        for (int i = 0; in_range_for(models, i); ++i) {
+
+            QString name = job.transforms[i].getIdentifier();
+            
+            if (models[i].isNone()) {
+                result.error = tr("Transform %1 failed: %2")
+                    .arg(name).arg(message);
+                return;
+            }
+
+            LayerFactory::LayerTypeSet types =
+                LayerFactory::getInstance()->getValidLayerTypes(models[i]);
+            if (types.empty()) {
+                result.error = tr("No layer type can export the output of transform %1").arg(name);
+                return;
+            }
+
+            Layer *layer = document.createLayer(*types.begin());
+            document.setModel(layer, models[i]);
+            layers.push_back({ layer, name });
+        }
+    }
+
+    if (!waitForDocument(document, generation, timer, result.error)) {
+        return;
+    }
+
+    if (!QDir().mkpath(job.outputDirectory)) {
+        result.error = tr("Failed to create output directory %1")
+            .arg(job.outputDirectory);
+        return;
+    }
+
+    for (const auto &l: layers) {
+        QString path = makeOutputPath(job, l.second);
+        QString error;
+        if (!LayerExporter::exportLayerTo(l.first, nullptr, nullptr, nullptr,
+                                          path, error)) {
+            result.error = tr("Failed to export %1: %2").arg(l.second)
+                .arg(error);
+            return;
+        }
+        result.outputs.push_back(path);
+    }
+
+    result.ok = true;
+}
+
+bool
+BatchProcessor::openInput(Document &document, const Job &job, QString &error)
+{
+    QString suffix = QFileInfo(job.input).suffix().toLower();
+
+    if (suffix == "sv" ||
+        (suffix == "xml" &&
+         SVFileReader::identifyXmlFile(job.input) ==
+         SVFileReader::SVSessionFile)) {
+        return openSession(document, job.input, error);
+    }
+
+    FileSource source(job.input);
+    if (!source.isAvailable()) {
+        error = tr("File %1 not found").arg(job.input);
+        return false;
+    }
+    source.waitForData();
+
+    auto model = std::make_shared<ReadOnlyWaveFileModel>
+        (source, job.sampleRate);
+    if (!model->isOK()) {
+        error = tr("Failed to open audio file %1").arg(job.input);
+        return false;
+    }
+
+    document.setMainModel(ModelById::add(model));
+    return true;
+}
+
+bool
+BatchProcessor::openSession(Document &document, QString path, QString &error)
+{
+    QFile *rawFile = nullptr;
+    BZipFileDevice *bzFile = nullptr;
+    QXmlInputSource *inputSource = nullptr;
+    
+    if (QFileInfo(path).suffix().toLower() == "sv") {
+        bzFile = new BZipFileDevice(path);
+        if (!bzFile->open(QIODevice::ReadOnly)) {
+            delete bzFile;
+            error = tr("Failed to open session file %1").arg(path);
+            return false;
+        }
+        inputSource = new QXmlInputSource(bzFile);
+    } else {
+        rawFile = new QFile(path);
+        inputSource = new QXmlInputSource(rawFile);
+    }
+
+    NoPaneCallback callback;
+    SVFileReader reader(&document, callback, path);
+    reader.setInteractive(false);
+    reader.parse(*inputSource);
+
+    if (!reader.isOK()) {
+        error = tr("SV XML file read error:\n%1").arg(reader.getErrorString());
+    } else if (document.isIncomplete()) {
+        error = tr("Some of the audio files in session %1 could not be found")
+            .arg(path);
+    }
+    
+    if (bzFile) bzFile->close();
+
+    delete inputSource;
+    delete bzFile;
+    delete rawFile;
+
+    return (error == "");
+}
+
+bool
+BatchProcessor::waitForDocument(Document &document, int generation,
+                                const QElapsedTimer &timer, QString &error)
+{
+    QEventLoop loop;
+    QTimer ticker;
+    ticker.start(readyCheckInterval);
+    
+    while (!isDocumentReady(document)) {
+
+        if (m_exiting || m_generation != generation) {
+            error = tr("Cancelled");
+            return false;
+        }
+
+        int timeout = m_jobTimeout;
+        if (timeout > 0 && timer.elapsed() > qint64(timeout) * 1000) {
+            error = tr("Timed out after %1 seconds").arg(timeout);
+            return false;
+        }
+
+        // Sleep until something happens, at most until the ticker
+        // fires
+        loop.processEvents(QEventLoop::WaitForMoreEvents);
+    }
+
+    return true;
+}
+
+bool
+BatchProcessor::isDocumentReady(Document &document)
+{
+    if (document.getDataLoader()->isLoading()) {
+        return false;
+    }
+
+    for (auto modelId: document.getTransformInputModels()) {
+        auto model = ModelById::get(modelId);
+        if (!model || !model->isOK()) continue;
+        if (!model->isReady() || model->getAlignmentCompletion() < 100) {
+            return false;
+        }
+    }
+
+    for (auto layer: document.getLayers()) {
+        auto model = ModelById::get(layer->getModel());
+        if (!model || !model->isOK()) continue;
+        if (!model->isReady()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+QString
+BatchProcessor::makeOutputPath(const Job &job, QString name)
+{
+    // e.g. input.wav with transform vamp:qm-vamp-plugins:qm-onsetdetector:onsets
+    // gives input_vamp_qm-vamp-plugins_qm-onsetdetector_onsets.csv
+    
+    QString base = QFileInfo(job.input).completeBaseName();
+    
+    QString safe;
+    for (QChar c: name) {
+        if (c.isLetterOrNumber() || c == '-' || c == '.') {
+            safe += c;
+        } else {
+            safe += '_';
+        }
+    }
+
+    QString extension = job.outputExtension;
+    if (extension == "") extension = "csv";
+    
+    return QDir(job.outputDirectory).filePath
+        (QString("%1_%2.%3").arg(base).arg(safe).arg(extension));
+}
@@ -0,0 +1,195 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_BATCH_PROCESSOR_H
+#define SV_BATCH_PROCESSOR_H
+
+#include "base/BaseTypes.h"
+#include "base/Thread.h"
+#include "transform/Transform.h"
+
+#include <QObject>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QString>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <vector>
+
+class Document;
+class QElapsedTimer;
+
+/**
+ * Run batch jobs, each of which opens an audio or session file, runs
+ * transforms on it, and exports the resulting layers to files, with
+ * no main window and no widgets. Jobs are independent and run
+ * concurrently on a pool of threads, each job with its own Document.
+ *
+ * An audio file is opened as the main model of a new document and
+ * the job's transforms are run on it. A session file is read with
+ * SVFileReader, so that its derived models and alignments are
+ * regenerated as they would be in the GUI; the job's transforms, if
+ * any, are then run on its main model, and every layer in the
+ * session is exported along with their outputs. A job finishes when
+ * all of its models are complete, or fails if that takes longer than
+ * the job timeout.
+ *
+ * Each exported file is named after the input file and the transform
+ * or layer it came from, and written in the format given by the
+ * job's output extension as for LayerExporter::exportLayerTo.
+ *
+ * This is intended for applications without a GUI. It must not be
+ * used in an application that has registered an interactive
+ * FileFinder or otherwise expects its documents to be used from the
+ * GUI thread only.
+ */
+class BatchProcessor : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Job {
+        Job() : sampleRate(0) { }
+
+        /// Audio file or Sonic Visualiser session file to read
+        QString input;
+
+        /// Transforms to run on the main audio model
+        Transforms transforms;
+
+        /// Directory to write exported layers to
+        QString outputDirectory;
+
+        /// Extension giving the export format, e.g. "csv" or "svl"
+        QString outputExtension;
+
+        /// Rate to resample audio input to, or 0 for the file's rate
+        sv_samplerate_t sampleRate;
+    };
+
+    struct Result {
+        Result() : finished(false), ok(false) { }
+        bool finished;
+        bool ok;
+        QString error;
+        std::vector<QString> outputs; // paths of files written
+    };
+
+    /**
+     * Create a processor. The number of jobs to run at once and the
+     * job timeout are initialised from the "job-threads" and
+     * "job-timeout" settings in the BatchProcessor settings group,
+     * defaulting to the number of processor cores and to no timeout.
+     */
+    BatchProcessor();
+
+    /**
+     * Cancel any jobs not yet started, abandon those in progress, and
+     * wait for the job threads to exit.
+     */
+    virtual ~BatchProcessor();
+
+    /**
+     * Set the number of jobs to run concurrently. Each job may use
+     * further threads of its own for its transforms. Takes effect for
+     * job threads not yet started.
+     */
+    void setJobThreadCount(int threads);
+    int getJobThreadCount() const { return m_threadCount; }
+
+    /**
+     * Set the time in seconds after which a job that has not
+     * finished is abandoned and reported as failed. Zero means no
+     * limit.
+     */
+    void setJobTimeout(int seconds) { m_jobTimeout = seconds; }
+    int getJobTimeout() const { return m_jobTimeout; }
+
+    /**
+     * Queue a job, starting it as soon as a job thread is free.
+     * Return an id for the job, for use with getResult and in the
+     * jobFinished signal.
+     */
+    int addJob(Job job);
+
+    /**
+     * Return true if any jobs are queued or running.
+     */
+    bool isProcessing() const;
+
+    /**
+     * Wait until all queued jobs have finished. This blocks the
+     * calling thread and delivers no events to it, so the caller
+     * should use the jobFinished signal instead if it needs its own
+     * event loop to keep running.
+     */
+    void waitForAll() const;
+
+    /**
+     * Drop any jobs not yet started, and abandon those in progress,
+     * which then finish as failed.
+     */
+    void cancel();
+
+    /**
+     * Return the result of the given job. Its finished flag is false
+     * if the job is still queued or running.
+     */
+    Result getResult(int jobId) const;
+
+signals:
+    /**
+     * Emitted, from the job's thread, when a job has finished.
+     */
+    void jobFinished(int jobId, bool ok);
+
+private:
+    class JobThread : public Thread
+    {
+    public:
+        JobThread(BatchProcessor &processor) :
+            Thread(Thread::NonRTThread), m_processor(processor) { }
+        void run() override { m_processor.runJobs(); }
+    private:
+        BatchProcessor &m_processor;
+    };
+
+    mutable QMutex m_mutex;
+    mutable QWaitCondition m_condition;
+    std::deque<std::pair<int, Job>> m_jobs;
+    std::map<int, Result> m_results;
+    std::vector<JobThread *> m_threads;
+    int m_nextId;
+    int m_running;
+    int m_threadCount;
+    std::atomic<int> m_jobTimeout;
+    std::atomic<bool> m_exiting;
+    std::atomic<int> m_generation; // incremented on cancel
+
+    void runJobs();
+    void runJob(const Job &job, int generation, Result &result);
+    bool openInput(Document &document, const Job &job, QString &error);
+    bool openSession(Document &document, QString path, QString &error);
+    bool waitForDocument(Document &document, int generation,
+                         const QElapsedTimer &timer, QString &error);
+    static bool isDocumentReady(Document &document);
+    static QString makeOutputPath(const Job &job, QString name);
+
+    BatchProcessor(const BatchProcessor &) =delete;
+    BatchProcessor &operator=(const BatchProcessor &) =delete;
+};
+
+#endif
@@ -0,0 +1,206 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "DerivedModelCache.h"
+
+#include "SVFileReader.h"
+#include "Document.h"
+
+#include "align/AlignmentCache.h"
+
+#include "base/Debug.h"
+
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QSettings>
+#include <QXmlInputSource>
+#include <QMutexLocker>
+
+//#define DEBUG_DERIVED_MODEL_CACHE 1
+
+static const int cacheFormatVersion = 1;
+
+DerivedModelCache *
+DerivedModelCache::getInstance()
+{
+    static DerivedModelCache instance;
+    return &instance;
+}
+
+DerivedModelCache::DerivedModelCache()
+{
+    QDir dir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
+    if (dir.mkpath("derived")) {
+        m_directory = dir.filePath("derived");
+    } else {
+        SVCERR << "WARNING: DerivedModelCache: Failed to create cache "
+               << "directory in " << dir.path()
+               << ", transform outputs will not be cached" << endl;
+    }
+}
+
+bool
+DerivedModelCache::isEnabled()
+{
+    QSettings settings;
+    settings.beginGroup("Transformer");
+    return settings.value("derived-model-cache", true).toBool();
+}
+
+void
+DerivedModelCache::setEnabled(bool enabled)
+{
+    QSettings settings;
+    settings.beginGroup("Transformer");
+    settings.setValue("derived-model-cache", enabled);
+    settings.endGroup();
+}
+
+QString
+DerivedModelCache::getKey(const Transform &transform,
+                          const ModelTransformer::Input &input)
+{
+    if (m_directory == "") return "";
+
+    QString inputHash =
+        AlignmentCache::getInstance()->getContentHash(input.getModel());
+    if (inputHash == "") return "";
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(QString("%1").arg(cacheFormatVersion).toLatin1());
+    hash.addData(inputHash.toLatin1());
+    hash.addData(QString("%1").arg(input.getChannel()).toLatin1());
+    hash.addData(transform.toXmlString().toUtf8());
+    return QString::fromLatin1(hash.result().toHex());
+}
+
+QString
+DerivedModelCache::getFilePath(QString key) const
+{
+    return QDir(m_directory).filePath(key + ".svl");
+}
+
+namespace {
+class NoPaneCallback : public SVFileReaderPaneCallback
+{
+public:
+    Pane *addPane() override { return nullptr; }
+    void setWindowSize(int, int) override { }
+    void addSelection(sv_frame_t, sv_frame_t) override { }
+};
+}
+
+ModelId
+DerivedModelCache::lookup(QString key, Document *document)
+{
+    if (key == "" || m_directory == "") return {};
+
+    QFile file(getFilePath(key));
+    if (!file.exists() || !file.open(QFile::ReadOnly)) return {};
+
+    NoPaneCallback callback;
+    SVFileReader reader(document, callback);
+    reader.setAddModelsToDocument(false);
+
+    QXmlInputSource source(&file);
+    reader.parse(source);
+
+    std::vector<ModelId> models = reader.getUnaddedModels();
+
+    if (!reader.isOK() || models.size() != 1) {
+        SVCERR << "WARNING: DerivedModelCache: Ignoring invalid cache file "
+               << file.fileName() << endl;
+        for (auto m: models) {
+            ModelById::release(m);
+        }
+        file.close();
+        QFile::remove(file.fileName());
+        return {};
+    }
+
+#ifdef DEBUG_DERIVED_MODEL_CACHE
+    SVCERR << "DerivedModelCache::lookup: Found cached output for key "
+           << key << endl;
+#endif
+    
+    return models[0];
+}
+
+void
+DerivedModelCache::store(QString key, QByteArray xml)
+{
+    if (key == "" || m_directory == "") return;
+
+    QMutexLocker locker(&m_mutex);
+
+    // Write to a temporary file and rename, so that a concurrent
+    // reader never sees a partial file
+    QString filePath = getFilePath(key);
+    QString tmpPath = filePath + ".tmp";
+    
+    QFile file(tmpPath);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate) ||
+        file.write(xml) != xml.size()) {
+        SVCERR << "WARNING: DerivedModelCache: Failed to write " << tmpPath
+               << endl;
+        file.close();
+        QFile::remove(tmpPath);
+        return;
+    }
+    file.close();
+
+    QFile::remove(filePath);
+    if (!QFile::rename(tmpPath, filePath)) {
+        SVCERR << "WARNING: DerivedModelCache: Failed to rename " << tmpPath
+               << " to " << filePath << endl;
+        QFile::remove(tmpPath);
+        return;
+    }
+
+#ifdef DEBUG_DERIVED_MODEL_CACHE
+    SVCERR << "DerivedModelCache::store: Stored " << xml.size()
+           << " bytes for key " << key << endl;
+#endif
+
+    trim();
+}
+
+void
+DerivedModelCache::trim()
+{
+    QSettings settings;
+    settings.beginGroup("Transformer");
+    qint64 limit = qint64(settings.value("derived-model-cache-size-mb", 1024)
+                          .toInt()) * 1024 * 1024;
+    settings.endGroup();
+
+    QDir dir(m_directory);
+    QFileInfoList files = dir.entryInfoList
+        (QStringList() << "*.svl", QDir::Files, QDir::Time); // newest first
+
+    qint64 total = 0;
+    for (const auto &info: files) {
+        total += info.size();
+        if (total > limit) {
+#ifdef DEBUG_DERIVED_MODEL_CACHE
+            SVCERR << "DerivedModelCache::trim: Removing " << info.fileName()
+                   << endl;
+#endif
+            QFile::remove(info.filePath());
+        }
+    }
+}
@@ -0,0 +1,84 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_DERIVED_MODEL_CACHE_H
+#define SV_DERIVED_MODEL_CACHE_H
+
+#include "data/model/Model.h"
+#include "transform/Transform.h"
+#include "transform/ModelTransformer.h"
+
+#include <QString>
+#include <QByteArray>
+#include <QMutex>
+
+class Document;
+
+/**
+ * Persistent on-disk cache of the outputs of transforms. Entries are
+ * keyed by a hash of the transform description, including its plugin
+ * version and parameters, together with the audio content of the
+ * input model and the input channel, so a cached output is reused
+ * only if the same plugin would be run on the same audio in the same
+ * way again.
+ *
+ * Only transforms whose input is backed by a local audio file can be
+ * cached; see AlignmentCache::getContentHash. Outputs are stored in
+ * SV layer XML, and the cache is trimmed to a size limit, oldest
+ * entries first, whenever something is stored.
+ */
+class DerivedModelCache
+{
+public:
+    static DerivedModelCache *getInstance();
+
+    /**
+     * Return true if the cache is enabled in the settings. It is
+     * enabled by default.
+     */
+    static bool isEnabled();
+    static void setEnabled(bool enabled);
+
+    /**
+     * Return the cache key for the output of the given transform,
+     * which should have its plugin version set, or an empty string
+     * if the input cannot be identified by content.
+     */
+    QString getKey(const Transform &transform,
+                   const ModelTransformer::Input &input);
+
+    /**
+     * Read the cached output for the given key, if there is one, and
+     * return its model, which has been added to ModelById but not to
+     * the document. The document is used to load the model's data in
+     * the background. Return a null id if there is no usable entry.
+     */
+    ModelId lookup(QString key, Document *document);
+
+    /**
+     * Store the given layer XML under the given key.
+     */
+    void store(QString key, QByteArray xml);
+
+private:
+    DerivedModelCache();
+
+    QString getFilePath(QString key) const;
+    void trim();
+
+    QString m_directory;
+    QMutex m_mutex;
+};
+
+#endif
@@ -18,8 +18,11 @@
 #include "data/model/WaveFileModel.h"
 #include "data/model/WritableWaveFileModel.h"
 #include "data/model/DenseThreeDimensionalModel.h"
+#include "data/model/EditableDenseThreeDimensionalModel.h"
 #include "data/model/DenseTimeValueModel.h"
 #include "data/model/AggregateWaveModel.h"
+#include "data/model/RangeSummarisableTimeValueModel.h"
+#include "data/model/TabularModel.h"
 
 #include "layer/Layer.h"
 #include "widgets/CommandHistory.h"
@@ -27,28 +30,67 @@
 #include "view/View.h"
 #include "base/PlayParameterRepository.h"
 #include "base/PlayParameters.h"
+#include "base/Thread.h"
 #include "transform/TransformFactory.h"
 #include "transform/ModelTransformerFactory.h"
 #include "transform/FeatureExtractionModelTransformer.h"
 #include <QApplication>
 #include <QTextStream>
 #include <QSettings>
+#include <QByteArray>
+#include <QtEndian>
+#include <QTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
 #include <iostream>
 #include <typeinfo>
+#include <cstring>
+#include <algorithm>
+#include <deque>
 
 #include "data/model/AlignmentModel.h"
 #include "align/Align.h"
+#include "ModelDataLoader.h"
+#include "DerivedModelCache.h"
+#include "SessionStatistics.h"
 
 using std::vector;
 
 //#define DEBUG_DOCUMENT 1
 
+// Models whose XML is shorter than this are quick enough to write
+// that there is no point in keeping their text between saves
+static const int MODEL_XML_CACHE_MIN_LENGTH = 65536;
+
+// Limit on the total text kept in the model XML cache
+static const size_t MODEL_XML_CACHE_MAX_BYTES = 64 * 1024 * 1024;
+
+// Rough sizes for memory accounting: the fixed cost of any model, and
+// the cost of each event in a sparse model, including its label
+static const size_t MODEL_BASE_BYTES = 1024;
+static const size_t SPARSE_EVENT_BYTES = 128;
+
+// Frames per range summary entry for audio models, as kept in memory
+// by the wave file models
+static const sv_frame_t AUDIO_SUMMARY_BLOCK = 256;
+
+// How often to check the memory budget, while one is set
+static const int MEMORY_BUDGET_CHECK_INTERVAL = 2000; // ms
+
 //!!! still need to handle command history, documentRestored/documentModified
 
 Document::Document() :
     m_autoAlignment(false),
     m_align(new Align()),
-    m_isIncomplete(false)
+    m_dataLoader(new ModelDataLoader()),
+    m_isIncomplete(false),
+    m_usingCommandHistory(true),
+    m_datasetEncoding(TextDatasets),
+    m_memoryBudget(0),
+    m_memoryBudgetTimer(nullptr),
+    m_statisticsOperation(-1),
+    m_derivedModelWriter(nullptr)
 {
     connect(ModelTransformerFactory::getInstance(),
             SIGNAL(transformFailed(QString, QString)),
@@ -58,8 +100,16 @@ Document::Document() :
     connect(m_align, SIGNAL(alignmentComplete(ModelId)),
             this, SIGNAL(alignmentComplete(ModelId)));
 
+    connect(m_dataLoader, SIGNAL(allLoadsComplete()),
+            this, SIGNAL(dataLoadingComplete()));
+
     connect(m_align, SIGNAL(alignmentFailed(ModelId, QString)),
             this, SIGNAL(alignmentFailed(ModelId, QString)));
+
+    connect(m_align, SIGNAL(alignmentComplete(ModelId)),
+            this, SLOT(alignmentSucceeded(ModelId)));
+    connect(m_align, SIGNAL(alignmentFailed(ModelId, QString)),
+            this, SLOT(alignmentNotSucceeded(ModelId)));
 }
 
 Document::~Document()
@@ -73,7 +123,18 @@ Document::~Document()
 #ifdef DEBUG_DOCUMENT
     SVDEBUG << "\n\nDocument::~Document: about to clear command history" << endl;
 #endif
-    CommandHistory::getInstance()->clear();
+    if (m_usingCommandHistory) {
+        CommandHistory::getInstance()->clear();
+    }
+
+    // Stop filling models before we start releasing them
+    delete m_dataLoader;
+    m_dataLoader = nullptr;
+
+    // And stop writing them to the cache, abandoning any not yet
+    // started
+    delete m_derivedModelWriter;
+    m_derivedModelWriter = nullptr;
     
 #ifdef DEBUG_DOCUMENT
     SVCERR << "Document::~Document: about to delete layers" << endl;
@@ -124,6 +185,9 @@ Document::createLayer(LayerFactory::LayerType type)
 
     newLayer->setObjectName(getUniqueLayerName(newLayer->objectName()));
 
+    connect(newLayer, SIGNAL(layerParametersChanged()),
+            this, SLOT(layerParametersChanged()));
+
     m_layers.push_back(newLayer);
 
 #ifdef DEBUG_DOCUMENT
@@ -174,6 +238,9 @@ Document::createImportedLayer(ModelId modelId)
     //!!! and all channels
     setChannel(newLayer, -1);
 
+    connect(newLayer, SIGNAL(layerParametersChanged()),
+            this, SLOT(layerParametersChanged()));
+
     m_layers.push_back(newLayer);
 
 #ifdef DEBUG_DOCUMENT
@@ -376,6 +443,10 @@ Document::createLayersForDerivedModels(vector<ModelId> newModels,
     for (int i = 0; in_range_for(newModels, i); ++i) {
 
         ModelId newModelId = newModels[i];
+        if (newModelId.isNone()) {
+            // transform failed, reported by addDerivedModels
+            continue;
+        }
 
         LayerFactory::LayerTypeSet types =
             LayerFactory::getInstance()->getValidLayerTypes(newModelId);
@@ -735,14 +806,11 @@ Document::addDerivedModel(const Transform &transform,
                           QString &message)
 {
     Profiler profiler("Document::addDerivedModel");
-    
-    for (auto &rec : m_models) {
-        if (rec.second.transform == transform &&
-            rec.second.source == input.getModel() && 
-            rec.second.channel == input.getChannel()) {
-            SVDEBUG << "derived model taken from map " << endl;
-            return rec.first;
-        }
+
+    ModelId existing = findDerivedModel(transform, input);
+    if (!existing.isNone()) {
+        SVDEBUG << "derived model taken from map " << endl;
+        return existing;
     }
 
     Transforms tt;
@@ -752,51 +820,284 @@ Document::addDerivedModel(const Transform &transform,
     else return mm[0];
 }
 
+ModelId
+Document::findDerivedModel(const Transform &transform,
+                           const ModelTransformer::Input &input) const
+{
+    for (auto &rec : m_models) {
+        if (rec.second.transform == transform &&
+            rec.second.source == input.getModel() && 
+            rec.second.channel == input.getChannel()) {
+            return rec.first;
+        }
+    }
+    return {};
+}
+
 vector<ModelId>
 Document::addDerivedModels(const Transforms &transforms,
                            const ModelTransformer::Input &input,
                            QString &message,
-                           AdditionalModelConverter *amc)
+                           AdditionalModelConverter *amc,
+                           vector<QString> *transformMessages)
 {
     Profiler profiler("Document::addDerivedModels");
-    
-    vector<ModelId> mm = 
-        ModelTransformerFactory::getInstance()->transformMultiple
-        (transforms, input, message, amc);
 
+    // The transforms we actually use are presumably identical to the
+    // ones asked for, except that the version of the plugin may
+    // differ.  It's possible that the returned message contains a
+    // warning about this; that doesn't concern us here, but we do
+    // need to ensure that the transform we remember, and look up in
+    // the cache, is correct for what is actually applied, with the
+    // current plugin version.
+
+    Transforms applied = transforms;
+    for (auto &t: applied) {
+        //!!! would be nice to short-circuit this -- the version is
+        //!!! static data, shouldn't have to construct a plugin for it
+        //!!! (which may be expensive in Piper-world)
+        t.setPluginVersion
+            (TransformFactory::getInstance()->
+             getDefaultTransformFor(t.getIdentifier(), t.getSampleRate())
+             .getPluginVersion());
+    }
+
+    vector<ModelId> mm(transforms.size());
+    vector<QString> keys(transforms.size());
+    vector<bool> storable(transforms.size(), false);
+
+    if (transformMessages) {
+        transformMessages->assign(transforms.size(), QString());
+    }
+
+    // An additional model handler expects to hear from exactly one
+    // transformer, so in that case run everything together as asked.
+    // Otherwise take what we can from the cache, and run the rest in
+    // groups that differ only in plugin output, as those can share a
+    // single pass through the input.
+
+    vector<vector<int>> groups;
+
+    if (amc) {
+        groups.push_back({});
+        for (int j = 0; in_range_for(transforms, j); ++j) {
+            groups[0].push_back(j);
+        }
+    } else {
+        bool useCache = DerivedModelCache::isEnabled();
+        for (int j = 0; in_range_for(transforms, j); ++j) {
+            if (useCache) {
+                SessionStatistics::PhaseTimer timer
+                    ("derived-model-cache", m_statisticsOperation);
+                keys[j] = DerivedModelCache::getInstance()->getKey
+                    (applied[j], input);
+                mm[j] = DerivedModelCache::getInstance()->lookup
+                    (keys[j], this);
+                if (!mm[j].isNone()) {
+                    SVDEBUG << "Document::addDerivedModels: Using cached output for transform " << applied[j].getIdentifier() << endl;
+                    SessionStatistics::getInstance()->modelStarted
+                        (m_statisticsOperation, mm[j], "cached-derivation",
+                         applied[j].getIdentifier());
+                    keys[j] = "";
+                    continue;
+                }
+                storable[j] = true;
+            }
+            Transform t = applied[j];
+            t.setOutput("");
+            bool grouped = false;
+            for (auto &g: groups) {
+                Transform other = applied[g[0]];
+                other.setOutput("");
+                if (other == t) {
+                    g.push_back(j);
+                    grouped = true;
+                    break;
+                }
+            }
+            if (!grouped) {
+                groups.push_back({ j });
+            }
+        }
+    }
+
+    for (const auto &g: groups) {
+
+        Transforms tt;
+        for (int j: g) tt.push_back(transforms[j]);
+
+        QString groupMessage;
+        vector<ModelId> gm = 
+            ModelTransformerFactory::getInstance()->transformMultiple
+            (tt, input, groupMessage, amc);
+
+        if (groupMessage != "") {
+            if (message != "") message += "\n";
+            message += groupMessage;
+            if (transformMessages) {
+                for (int j: g) (*transformMessages)[j] = groupMessage;
+            }
+        }
+
+        for (int i = 0; in_range_for(gm, i) && in_range_for(g, i); ++i) {
+            mm[g[i]] = gm[i];
+            if (!gm[i].isNone()) {
+                SessionStatistics::getInstance()->modelStarted
+                    (m_statisticsOperation, gm[i], "derivation", applied[g[i]].getIdentifier());
+            }
+        }
+    }
+
+    bool any = false;
+    
     for (int j = 0; in_range_for(mm, j); ++j) {
 
         ModelId modelId = mm[j];
-        Transform applied = transforms[j];
 
         if (modelId.isNone()) {
-            SVCERR << "WARNING: Document::addDerivedModel: no output model for transform " << applied.getIdentifier() << endl;
+            SVCERR << "WARNING: Document::addDerivedModel: no output model for transform " << applied[j].getIdentifier() << endl;
             continue;
         }
 
-        // The transform we actually used was presumably identical to
-        // the one asked for, except that the version of the plugin
-        // may differ.  It's possible that the returned message
-        // contains a warning about this; that doesn't concern us
-        // here, but we do need to ensure that the transform we
-        // remember is correct for what was actually applied, with the
-        // current plugin version.
+        any = true;
+        addAlreadyDerivedModel(applied[j], input, modelId);
 
-        //!!! would be nice to short-circuit this -- the version is
-        //!!! static data, shouldn't have to construct a plugin for it
-        //!!! (which may be expensive in Piper-world)
-        applied.setPluginVersion
-            (TransformFactory::getInstance()->
-             getDefaultTransformFor(applied.getIdentifier(),
-                                    applied.getSampleRate())
-             .getPluginVersion());
+        if (storable[j]) {
+            storeInCacheWhenReady(modelId, keys[j]);
+        }
+    }
 
-        addAlreadyDerivedModel(applied, input, modelId);
+    if (!any) {
+        return {};
     }
-        
+    
     return mm;
 }
 
+void
+Document::storeInCacheWhenReady(ModelId modelId, QString key)
+{
+    auto model = ModelById::get(modelId);
+    if (!model) return;
+
+    m_derivedCacheKeys[modelId] = key;
+
+    if (model->isReady()) {
+        derivedModelReady(modelId);
+    } else {
+        connect(model.get(), SIGNAL(ready(ModelId)),
+                this, SLOT(derivedModelReady(ModelId)));
+    }
+}
+
+class Document::DerivedModelWriter : public Thread
+{
+public:
+    DerivedModelWriter() :
+        Thread(Thread::NonRTThread),
+        m_exiting(false) { }
+
+    ~DerivedModelWriter() {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_exiting = true;
+            m_condition.wakeAll();
+        }
+        wait();
+    }
+
+    // The model is held until it has been written, so that it
+    // outlives its release from the document if need be
+    void add(QString key, std::shared_ptr<Model> model) {
+        QMutexLocker locker(&m_mutex);
+        m_jobs.push_back({ key, model });
+        m_condition.wakeAll();
+    }
+
+    void run() override {
+        QMutexLocker locker(&m_mutex);
+        while (!m_exiting) {
+            if (m_jobs.empty()) {
+                m_condition.wait(&m_mutex);
+                continue;
+            }
+            Job job = m_jobs.front();
+            m_jobs.pop_front();
+            locker.unlock();
+            write(job);
+            job.model.reset();
+            locker.relock();
+        }
+    }
+
+private:
+    struct Job {
+        QString key;
+        std::shared_ptr<Model> model;
+    };
+
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+    std::deque<Job> m_jobs;
+    bool m_exiting;
+
+    static void write(const Job &job) {
+
+        // As a layer file, which SVFileReader can read back in. The
+        // models' own locking makes it safe to read them here while
+        // the GUI thread may be using them
+        QString xml;
+        {
+            QTextStream out(&xml);
+            out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                << "<!DOCTYPE sonic-visualiser>\n"
+                << "<sv>\n"
+                << "  <data>\n";
+            if (std::dynamic_pointer_cast<EditableDenseThreeDimensionalModel>
+                (job.model)) {
+                writeBinaryDenseThreeDimensionalModel
+                    (out, "    ", job.model->getId(), true);
+            } else {
+                job.model->toXml(out, "    ");
+            }
+            out << "  </data>\n"
+                << "</sv>\n";
+        }
+
+        DerivedModelCache::getInstance()->store(job.key, xml.toUtf8());
+    }
+};
+
+void
+Document::derivedModelReady(ModelId modelId)
+{
+    auto itr = m_derivedCacheKeys.find(modelId);
+    if (itr == m_derivedCacheKeys.end()) return;
+    QString key = itr->second;
+    m_derivedCacheKeys.erase(itr);
+
+    auto model = ModelById::get(modelId);
+    if (!model || model->getCompletion() < 100) return;
+
+    if (key == "") {
+        // The input's content hash was not ready when the derivation
+        // started, but may be by now
+        auto ritr = m_models.find(modelId);
+        if (ritr == m_models.end()) return;
+        const ModelRecord &rec = ritr->second;
+        key = DerivedModelCache::getInstance()->getKey
+            (rec.transform,
+             ModelTransformer::Input(rec.source, rec.channel));
+        if (key == "") return;
+    }
+
+    if (!m_derivedModelWriter) {
+        m_derivedModelWriter = new DerivedModelWriter;
+        m_derivedModelWriter->start();
+    }
+    m_derivedModelWriter->add(key, model);
+}
+
 void
 Document::releaseModel(ModelId modelId)
 {
@@ -882,6 +1183,9 @@ Document::releaseModel(ModelId modelId)
     }
 
     m_models.erase(modelId);
+    m_modelXmlCache.erase(modelId);
+    m_derivedCacheKeys.erase(modelId);
+    m_evictedModels.erase(modelId);
     ModelById::release(modelId);
 }
 
@@ -1036,7 +1340,13 @@ Document::addToLayerViewMap(Layer *layer, View *view)
 
     m_layerViewMap[layer].insert(view);
 
-    if (firstView) emit layerInAView(layer, true);
+    if (firstView) {
+        ModelId modelId = layer->getModel();
+        if (m_evictedModels.find(modelId) != m_evictedModels.end()) {
+            restoreEvictedModel(modelId);
+        }
+        emit layerInAView(layer, true);
+    }
 }
     
 void
@@ -1187,9 +1497,27 @@ Document::alignModel(ModelId modelId, bool forceRecalculate)
                 << endl;
     }
 
+    SessionStatistics::getInstance()->modelStarted
+        (m_statisticsOperation, modelId, "alignment", "");
     m_align->scheduleAlignment(this, m_mainModel, modelId);
 }
 
+void
+Document::alignmentSucceeded(ModelId alignmentModelId)
+{
+    if (auto am = ModelById::getAs<AlignmentModel>(alignmentModelId)) {
+        SessionStatistics::getInstance()->modelFinished
+            (am->getAlignedModel(), "alignment", true);
+    }
+}
+
+void
+Document::alignmentNotSucceeded(ModelId toAlign)
+{
+    SessionStatistics::getInstance()->modelFinished
+        (toAlign, "alignment", false);
+}
+
 void
 Document::performDeferredAlignment(ModelId modelId)
 {
@@ -1200,6 +1528,9 @@ Document::performDeferredAlignment(ModelId modelId)
 void
 Document::alignModels()
 {
+    SessionStatistics::PhaseTimer timer
+        ("schedule-alignments", m_statisticsOperation);
+    
     for (auto rec: m_models) {
         alignModel(rec.first);
     }
@@ -1215,6 +1546,344 @@ Document::realignModels()
     alignModel(m_mainModel);
 }
 
+void
+Document::prioritiseAlignment(ModelId modelId)
+{
+    m_align->prioritiseAlignment(modelId);
+}
+
+static size_t
+estimateModelMemory(ModelId modelId)
+{
+    auto model = ModelById::get(modelId);
+    if (!model) return 0;
+
+    size_t bytes = MODEL_BASE_BYTES;
+    
+    if (auto dense =
+        ModelById::getAs<EditableDenseThreeDimensionalModel>(modelId)) {
+        bytes += size_t(dense->getWidth()) * size_t(dense->getHeight()) *
+            sizeof(float);
+
+    } else if (ModelById::isa<AggregateWaveModel>(modelId)) {
+        // reads from its components, holding nothing itself
+        
+    } else if (auto wave =
+               ModelById::getAs<RangeSummarisableTimeValueModel>(modelId)) {
+        // Samples are read from file as needed, but a min/max/mean
+        // summary of each block is kept in memory
+        sv_frame_t frames = wave->getEndFrame() - wave->getStartFrame();
+        bytes += size_t(frames / AUDIO_SUMMARY_BLOCK + 1) *
+            size_t(wave->getChannelCount()) * 3 * sizeof(float);
+
+    } else if (auto tabular = std::dynamic_pointer_cast<TabularModel>(model)) {
+        bytes += size_t(std::max(0, tabular->getRowCount())) *
+            SPARSE_EVENT_BYTES;
+    }
+
+    return bytes;
+}
+
+vector<Document::ModelMemoryUsage>
+Document::getModelMemoryUsage() const
+{
+    vector<ModelMemoryUsage> usage;
+
+    auto add = [&](ModelId modelId, QString kind, bool evictable) {
+        auto model = ModelById::get(modelId);
+        if (!model) return;
+        usage.push_back({ modelId, model->objectName(), kind,
+                          estimateModelMemory(modelId), evictable });
+    };
+
+    if (!m_mainModel.isNone()) {
+        add(m_mainModel, "main", false);
+    }
+    
+    for (const auto &rec: m_models) {
+        ModelId modelId = rec.first;
+        if (m_evictedModels.find(modelId) != m_evictedModels.end()) {
+            add(modelId, "evicted", false);
+        } else if (!rec.second.source.isNone() &&
+                   rec.second.transform.getIdentifier() != "") {
+            add(modelId, "derived", isEvictable(modelId));
+        } else {
+            add(modelId, "imported", false);
+        }
+    }
+
+    // An aggregate model reads from its components and holds almost
+    // nothing itself, so releasing one would not bring usage down
+    for (auto modelId: m_aggregateModels) {
+        add(modelId, "aggregate", false);
+    }
+
+    for (auto modelId: m_alignmentModels) {
+        add(modelId, "alignment", false);
+    }
+
+    std::stable_sort(usage.begin(), usage.end(),
+                     [](const ModelMemoryUsage &a, const ModelMemoryUsage &b) {
+                         return a.bytes > b.bytes;
+                     });
+    
+    return usage;
+}
+
+size_t
+Document::getMemoryUsage() const
+{
+    size_t total = 0;
+
+    for (const auto &u: getModelMemoryUsage()) {
+        total += u.bytes;
+    }
+    for (const auto &x: m_modelXmlCache) {
+        total += size_t(x.second.xml.size());
+    }
+    for (auto cache: m_evictableCaches) {
+        total += cache->getCacheMemoryUsage();
+    }
+
+    return total;
+}
+
+void
+Document::addEvictableCache(EvictableCache *cache)
+{
+    if (std::find(m_evictableCaches.begin(), m_evictableCaches.end(), cache)
+        == m_evictableCaches.end()) {
+        m_evictableCaches.push_back(cache);
+    }
+}
+
+void
+Document::removeEvictableCache(EvictableCache *cache)
+{
+    m_evictableCaches.erase(std::remove(m_evictableCaches.begin(),
+                                        m_evictableCaches.end(), cache),
+                            m_evictableCaches.end());
+}
+
+void
+Document::setMemoryBudget(size_t bytes)
+{
+    m_memoryBudget = bytes;
+
+    if (m_memoryBudget == 0) {
+        if (m_memoryBudgetTimer) m_memoryBudgetTimer->stop();
+        return;
+    }
+
+    // Created here rather than in the constructor, so that a document
+    // without a budget, perhaps in a thread with no event loop, has
+    // no timer
+    if (!m_memoryBudgetTimer) {
+        m_memoryBudgetTimer = new QTimer(this);
+        connect(m_memoryBudgetTimer, SIGNAL(timeout()),
+                this, SLOT(checkMemoryBudget()));
+    }
+    m_memoryBudgetTimer->start(MEMORY_BUDGET_CHECK_INTERVAL);
+}
+
+void
+Document::checkMemoryBudget()
+{
+    (void)enforceMemoryBudget();
+}
+
+bool
+Document::isEvictable(ModelId modelId) const
+{
+    if (m_evictedModels.find(modelId) != m_evictedModels.end()) {
+        return false;
+    }
+
+    auto itr = m_models.find(modelId);
+    if (itr == m_models.end()) return false;
+
+    // Only a model that was generated by a transform, and has not
+    // been modified since, can be generated again. Additional models
+    // would come back alongside a second copy of the primary one.
+    const ModelRecord &rec = itr->second;
+    if (rec.source.isNone() || rec.transform.getIdentifier() == "" ||
+        rec.additional) {
+        return false;
+    }
+
+    // Dense 3-D models are both the largest derived models and the
+    // ones that toXml never writes out, so a placeholder for one
+    // saves exactly as the model itself would
+    auto model = ModelById::getAs<EditableDenseThreeDimensionalModel>(modelId);
+    if (!model || !model->isReady()) return false;
+
+    for (const auto &m: m_models) {
+        if (m.second.source == modelId) return false;
+    }
+
+    for (auto layer: m_layers) {
+        if (layer->getModel() != modelId) continue;
+        auto vitr = m_layerViewMap.find(layer);
+        if (vitr != m_layerViewMap.end() && !vitr->second.empty()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+Document::evictDerivedModel(ModelId modelId)
+{
+    auto model = ModelById::getAs<EditableDenseThreeDimensionalModel>(modelId);
+    if (!model) return;
+
+    SVDEBUG << "Document::evictDerivedModel: evicting " << modelId
+            << " (\"" << model->objectName() << "\", "
+            << estimateModelMemory(modelId) << " bytes)" << endl;
+
+    // The placeholder describes the same grid, so that a layer set
+    // to it is undisturbed, but has no columns
+    auto placeholder = std::make_shared<EditableDenseThreeDimensionalModel>
+        (model->getSampleRate(), model->getResolution(), model->getHeight());
+    placeholder->setObjectName(model->objectName());
+    placeholder->setMinimumLevel(model->getMinimumLevel());
+    placeholder->setMaximumLevel(model->getMaximumLevel());
+    for (int i = 0; i < model->getHeight(); ++i) {
+        QString name = model->getBinName(i);
+        if (name != "") placeholder->setBinName(i, name);
+    }
+    
+    ModelId placeholderId = ModelById::add(placeholder);
+    m_models[placeholderId] = m_models[modelId];
+    m_evictedModels.insert(placeholderId);
+
+    for (auto layer: m_layers) {
+        if (layer->getModel() == modelId) {
+            LayerFactory::getInstance()->setModel(layer, placeholderId);
+        }
+    }
+
+    releaseModel(modelId);
+}
+
+void
+Document::restoreEvictedModel(ModelId placeholderId)
+{
+    auto itr = m_models.find(placeholderId);
+    if (itr == m_models.end()) return;
+
+    // Remove the placeholder's record first, or addDerivedModel would
+    // find it and hand back the placeholder itself
+    ModelRecord rec = itr->second;
+    m_models.erase(itr);
+    m_evictedModels.erase(placeholderId);
+
+    SVDEBUG << "Document::restoreEvictedModel: regenerating model for "
+            << "placeholder " << placeholderId << endl;
+    
+    QString message;
+    ModelId replacement = addDerivedModel
+        (rec.transform, ModelTransformer::Input(rec.source, rec.channel),
+         message);
+
+    QString transformId = rec.transform.getIdentifier();
+    
+    if (replacement.isNone()) {
+        SVCERR << "WARNING: Document::restoreEvictedModel: Failed to "
+               << "regenerate model for transform \"" << transformId
+               << "\"" << endl;
+        // Leave the layers with the empty placeholder, which is now
+        // the best we have
+        m_models[placeholderId] = rec;
+        for (auto layer: m_layers) {
+            if (layer->getModel() == placeholderId) {
+                emit modelRegenerationFailed(layer->objectName(),
+                                             transformId, message);
+                break;
+            }
+        }
+        return;
+    }
+
+    for (auto layer: m_layers) {
+        if (layer->getModel() == placeholderId) {
+            if (message != "") {
+                emit modelRegenerationWarning(layer->objectName(),
+                                              transformId, message);
+                message = "";
+            }
+            LayerFactory::getInstance()->setModel(layer, replacement);
+        }
+    }
+
+    ModelById::release(placeholderId);
+}
+
+size_t
+Document::enforceMemoryBudget()
+{
+    if (m_memoryBudget == 0) return 0;
+    
+    size_t before = getMemoryUsage();
+    if (before <= m_memoryBudget) return 0;
+
+    SVDEBUG << "Document::enforceMemoryBudget: estimated usage " << before
+            << " exceeds budget of " << m_memoryBudget << endl;
+
+    size_t usage = before;
+    auto freed = [&](size_t bytes) {
+        usage -= std::min(usage, bytes);
+    };
+    
+    if (!m_modelXmlCache.empty()) {
+        for (const auto &x: m_modelXmlCache) {
+            freed(size_t(x.second.xml.size()));
+        }
+        m_modelXmlCache.clear();
+    }
+
+    for (auto cache: m_evictableCaches) {
+        if (usage <= m_memoryBudget) break;
+        size_t bytes = cache->getCacheMemoryUsage();
+        if (bytes > 0 && cache->evictCache()) {
+            SVDEBUG << "Document::enforceMemoryBudget: evicted "
+                    << cache->getCacheName() << " (" << bytes << " bytes)"
+                    << endl;
+            freed(bytes);
+        }
+    }
+
+    if (usage > m_memoryBudget) {
+
+        vector<std::pair<size_t, ModelId>> candidates;
+        for (const auto &rec: m_models) {
+            if (isEvictable(rec.first)) {
+                candidates.push_back({ estimateModelMemory(rec.first),
+                                       rec.first });
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const std::pair<size_t, ModelId> &a,
+                     const std::pair<size_t, ModelId> &b) {
+                      return a.first > b.first;
+                  });
+
+        for (const auto &c: candidates) {
+            if (usage <= m_memoryBudget) break;
+            evictDerivedModel(c.second);
+            freed(c.first - std::min(c.first, MODEL_BASE_BYTES));
+        }
+    }
+
+    size_t after = getMemoryUsage();
+    
+    SVDEBUG << "Document::enforceMemoryBudget: estimated usage now "
+            << after << endl;
+
+    return before > after ? before - after : 0;
+}
+
 Document::AddLayerCommand::AddLayerCommand(Document *d,
                                            View *view,
                                            Layer *layer) :
@@ -1341,6 +2010,12 @@ Document::RemoveLayerCommand::unexecute()
     m_added = true;
 }
 
+bool
+Document::isLoadingData() const
+{
+    return m_dataLoader->isLoading();
+}
+
 void
 Document::toXml(QTextStream &out, QString indent, QString extraAttributes) const
 {
@@ -1357,6 +2032,13 @@ void
 Document::toXml(QTextStream &out, QString indent, QString extraAttributes,
                 bool asTemplate) const
 {
+    // Callers are expected to wait for dataLoadingComplete rather
+    // than have us block here
+    if (m_dataLoader->isLoading()) {
+        SVCERR << "WARNING: Document::toXml: Models are still being loaded, "
+               << "writing them as far as they have got" << endl;
+    }
+    
     out << indent + QString("<data%1%2>\n")
         .arg(extraAttributes == "" ? "" : " ").arg(extraAttributes);
 
@@ -1508,7 +2190,7 @@ Document::toXml(QTextStream &out, QString indent, QString extraAttributes,
             }
             
             if (writeModel) {
-                model->toXml(out, indent + "  ");
+                writeModelXml(out, indent + "  ", modelId);
                 written.insert(modelId);
             }
             
@@ -1564,6 +2246,177 @@ Document::writePlaceholderMainModel(QTextStream &out, QString indent) const
         .arg(mainModel->getSampleRate());
 }
 
+void
+Document::writeModelXml(QTextStream &out, QString indent,
+                        ModelId modelId) const
+{
+    auto model = ModelById::get(modelId);
+    if (!model) return;
+
+    auto itr = m_modelXmlCache.find(modelId);
+    if (itr != m_modelXmlCache.end()) {
+        if (itr->second.indent == indent &&
+            itr->second.encoding == m_datasetEncoding) {
+#ifdef DEBUG_DOCUMENT
+            SVDEBUG << "Document::writeModelXml: reusing text for unchanged model " << modelId << endl;
+#endif
+            out << QString::fromUtf8(itr->second.xml);
+            return;
+        }
+        m_modelXmlCache.erase(itr);
+    }
+
+    QString xml;
+    {
+        QTextStream str(&xml);
+        if (m_datasetEncoding != TextDatasets &&
+            ModelById::isa<EditableDenseThreeDimensionalModel>(modelId)) {
+            writeBinaryDenseThreeDimensionalModel
+                (str, indent, modelId,
+                 m_datasetEncoding == CompressedBinaryDatasets);
+        } else {
+            model->toXml(str, indent);
+        }
+    }
+
+    out << xml;
+
+    // Keep the text of large, complete models, to be written again
+    // as it is if the model does not change before the next save
+    if (xml.length() < MODEL_XML_CACHE_MIN_LENGTH ||
+        model->getCompletion() < 100) {
+        return;
+    }
+
+    CachedModelXml cached;
+    cached.indent = indent;
+    cached.encoding = m_datasetEncoding;
+    cached.xml = xml.toUtf8();
+
+    size_t total = size_t(cached.xml.size());
+    for (const auto &x: m_modelXmlCache) {
+        total += size_t(x.second.xml.size());
+    }
+    if (total > MODEL_XML_CACHE_MAX_BYTES) {
+        // Serialising this model again next time is cheaper than
+        // holding on to any more text
+        return;
+    }
+    
+    m_modelXmlCache[modelId] = cached;
+
+    connect(model.get(), SIGNAL(modelChanged(ModelId)),
+            this, SLOT(modelXmlInvalidated(ModelId)), Qt::UniqueConnection);
+    connect(model.get(), SIGNAL(modelChangedWithin(ModelId, sv_frame_t, sv_frame_t)),
+            this, SLOT(modelXmlInvalidated(ModelId)), Qt::UniqueConnection);
+    connect(model.get(), SIGNAL(completionChanged(ModelId)),
+            this, SLOT(modelXmlInvalidated(ModelId)), Qt::UniqueConnection);
+    connect(model.get(), SIGNAL(objectNameChanged(const QString &)),
+            this, SLOT(modelNameChanged()), Qt::UniqueConnection);
+}
+
+void
+Document::modelXmlInvalidated(ModelId modelId)
+{
+    m_modelXmlCache.erase(modelId);
+}
+
+void
+Document::modelNameChanged()
+{
+    if (Model *model = qobject_cast<Model *>(sender())) {
+        m_modelXmlCache.erase(model->getId());
+    }
+}
+
+void
+Document::layerParametersChanged()
+{
+    // Some layer properties, such as units, are stored in the model
+    // without the model signalling a change
+    if (Layer *layer = qobject_cast<Layer *>(sender())) {
+        m_modelXmlCache.erase(layer->getModel());
+    }
+}
+
+void
+Document::writeBinaryDenseThreeDimensionalModel(QTextStream &out,
+                                                QString indent,
+                                                ModelId modelId,
+                                                bool compress)
+{
+    // As EditableDenseThreeDimensionalModel::toXml, except that each
+    // row is written as a single base64 block of little-endian
+    // float32 values rather than as separated text, optionally
+    // compressed. SVFileReader identifies the encoding from the
+    // dataset's attributes.
+    //
+    // The model element and bin names must match those written by
+    // the model's own toXml, and should be changed with it: that
+    // function writes its rows as text in the same pass, so there is
+    // no way to have it write only the rest. If the model gains a way
+    // to write its datasets in other encodings, this should go.
+
+    auto model = ModelById::getAs<EditableDenseThreeDimensionalModel>(modelId);
+    if (!model) return;
+
+    int dataset = model->getExportId();
+
+    model->Model::toXml
+        (out, indent,
+         QString("type=\"dense\" dimensions=\"3\" windowSize=\"%1\" yBinCount=\"%2\" minimum=\"%3\" maximum=\"%4\" dataset=\"%5\" startFrame=\"%6\"")
+         .arg(model->getResolution())
+         .arg(model->getHeight())
+         .arg(model->getMinimumLevel())
+         .arg(model->getMaximumLevel())
+         .arg(dataset)
+         .arg(model->getStartFrame()));
+
+    out << indent;
+    out << QString("<dataset id=\"%1\" dimensions=\"3\" encoding=\"base64-float32\"%2>\n")
+        .arg(dataset)
+        .arg(compress ? " compression=\"zlib\"" : "");
+
+    int height = model->getHeight();
+    for (int i = 0; i < height; ++i) {
+        QString name = model->getBinName(i);
+        if (name != "") {
+            out << indent + "  ";
+            out << QString("<bin number=\"%1\" name=\"%2\"/>\n")
+                .arg(i)
+                .arg(XmlExportable::encodeEntities(name));
+        }
+    }
+
+    QByteArray bytes;
+    int width = model->getWidth();
+
+    for (int i = 0; i < width; ++i) {
+
+        DenseThreeDimensionalModel::Column column = model->getColumn(i);
+        int n = int(column.size());
+
+        bytes.resize(n * 4);
+        uchar *ptr = reinterpret_cast<uchar *>(bytes.data());
+        for (int j = 0; j < n; ++j) {
+            quint32 bits;
+            memcpy(&bits, &column[j], 4);
+            qToLittleEndian<quint32>(bits, ptr + j * 4);
+        }
+
+        out << indent + "  ";
+        out << QString("<row n=\"%1\">").arg(i);
+        if (compress) {
+            out << qCompress(bytes).toBase64();
+        } else {
+            out << bytes.toBase64();
+        }
+        out << "</row>\n";
+    }
+
+    out << indent + "</dataset>\n";
+}
+
 void
 Document::writeBackwardCompatibleDerivation(QTextStream &out, QString indent,
                                             ModelId targetModelId,
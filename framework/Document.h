@@ -22,8 +22,11 @@
 #include "transform/FeatureExtractionModelTransformer.h"
 #include "base/Command.h"
 
+#include <QByteArray>
+
 #include <map>
 #include <set>
+#include <vector>
 
 class Model;
 class Layer;
@@ -34,6 +37,8 @@ class AggregateWaveModel;
 class AdditionalModelConverter;
 
 class Align;
+class ModelDataLoader;
+class QTimer;
 
 /**
  * A Sonic Visualiser document consists of a set of data models, and
@@ -212,16 +217,40 @@ public:
                             const ModelTransformer::Input &input,
                             QString &returnedMessage);
 
+    /**
+     * Return the model in the document that was derived using the
+     * given transform from the given input, if there is one, so that
+     * an identical derivation can reuse it. Return a null id if there
+     * is none.
+     */
+    ModelId findDerivedModel(const Transform &transform,
+                             const ModelTransformer::Input &input) const;
+
     /**
      * Add derived models associated with the given set of related
      * transforms, running the transforms and returning the resulting
      * models.  The models are added to ModelById before returning.
+     *
+     * Unless an AdditionalModelConverter is given, outputs found in
+     * the DerivedModelCache are taken from there instead of being
+     * recalculated, and transforms that differ only in plugin output
+     * are run together so as to share a single pass through the
+     * input. The returned models correspond to the transforms, with
+     * a null id for any that failed; if all failed, the returned
+     * vector is empty.
+     *
+     * The returned message combines the messages from all the
+     * transformers run. If transformMessages is given, it receives
+     * for each transform the message from the transformer that ran
+     * it, or an empty string if it was taken from the cache.
      */
     friend class AdditionalModelConverter;
     std::vector<ModelId> addDerivedModels(const Transforms &transforms,
                                           const ModelTransformer::Input &input,
                                           QString &returnedMessage,
-                                          AdditionalModelConverter *);
+                                          AdditionalModelConverter *,
+                                          std::vector<QString> *
+                                          transformMessages = nullptr);
 
     /**
      * Add a derived model associated with the given transform.  This
@@ -299,6 +328,13 @@ public:
      */
     void realignModels();
 
+    /**
+     * If the given model is waiting for its alignment to begin, move
+     * it to the front of the queue. Used to align the models that the
+     * user can see first.
+     */
+    void prioritiseAlignment(ModelId);
+
     /**
      * Return true if any external files (most obviously audio) failed
      * to be found on load, so that the document is incomplete
@@ -308,6 +344,146 @@ public:
 
     void setIncomplete(bool i) { m_isIncomplete = i; }
 
+    /**
+     * Return all of the layers in the document, whether or not they
+     * are in any view.
+     */
+    std::vector<Layer *> getLayers() const { return m_layers; }
+
+    /**
+     * Set whether the document uses the application's CommandHistory,
+     * clearing it when the document is deleted. This is true by
+     * default. A document used without a GUI, for example from a
+     * batch-processing thread, should set it false, and must then not
+     * add layers to views.
+     */
+    void setUsingCommandHistory(bool u) { m_usingCommandHistory = u; }
+
+    /**
+     * Return the loader used to fill this document's models in the
+     * background, for example with datasets read from a session
+     * file.
+     */
+    ModelDataLoader *getDataLoader() { return m_dataLoader; }
+
+    /**
+     * Return true if any model is still being filled in by the data
+     * loader. While this is so, toXml would write those models
+     * incomplete, so callers should defer writing the document until
+     * dataLoadingComplete has been emitted.
+     */
+    bool isLoadingData() const;
+
+    /**
+     * Set the SessionStatistics operation to which background work
+     * started by this document (derivations, alignments) is to be
+     * attributed, or -1 for none, which is the default.
+     */
+    void setStatisticsOperation(int operation) {
+        m_statisticsOperation = operation;
+    }
+    int getStatisticsOperation() const { return m_statisticsOperation; }
+
+    /**
+     * Encodings for the row data of dense 3-D model datasets in
+     * session files. TextDatasets writes each value as text, as all
+     * versions of the reader understand. BinaryDatasets writes each
+     * row as a base64 block of little-endian 32-bit floats, and
+     * CompressedBinaryDatasets additionally zlib-compresses each
+     * block before encoding it. The binary encodings are much faster
+     * to write and read back, and smaller, but can only be read by
+     * readers that know about them.
+     */
+    enum DatasetEncoding {
+        TextDatasets,
+        BinaryDatasets,
+        CompressedBinaryDatasets
+    };
+
+    /**
+     * Set the encoding used for dense 3-D model datasets by toXml.
+     * The default is TextDatasets.
+     */
+    void setDatasetEncoding(DatasetEncoding e) { m_datasetEncoding = e; }
+    DatasetEncoding getDatasetEncoding() const { return m_datasetEncoding; }
+
+    /**
+     * The estimated memory held by one model in the document, as
+     * returned by getModelMemoryUsage.
+     */
+    struct ModelMemoryUsage {
+        ModelId model;
+        QString name;
+        QString kind;   // "main", "derived", "imported", "aggregate",
+                        // "alignment" or "evicted"
+        size_t bytes;
+        bool evictable; // could be discarded now and regenerated later
+    };
+
+    /**
+     * Return an estimate of the memory used by each of the models in
+     * the document, largest first. The estimates count the bulk data
+     * of each model (the grid of a dense 3-D model, the events of a
+     * sparse one, and the range summaries of an audio model whose
+     * samples are read from file) rather than every allocation.
+     */
+    std::vector<ModelMemoryUsage> getModelMemoryUsage() const;
+
+    /**
+     * Return the estimated total of the memory used by the models,
+     * the cached session XML, and any registered evictable caches.
+     */
+    size_t getMemoryUsage() const;
+
+    /**
+     * Regenerable data held outside the document, such as the play
+     * source's loop cache, that may be discarded when the document is
+     * over its memory budget.
+     */
+    class EvictableCache {
+    public:
+        virtual ~EvictableCache() { }
+        virtual QString getCacheName() const = 0;
+        virtual size_t getCacheMemoryUsage() = 0;
+
+        /**
+         * Discard the cached data, returning false if it cannot be
+         * discarded at the moment.
+         */
+        virtual bool evictCache() = 0;
+    };
+
+    /**
+     * Register a cache to be counted in getMemoryUsage and evicted if
+     * need be. The document does not take ownership, and the cache
+     * must be removed before it is deleted.
+     */
+    void addEvictableCache(EvictableCache *);
+    void removeEvictableCache(EvictableCache *);
+
+    /**
+     * Set the memory budget for the document, in bytes. Zero, the
+     * default, means no budget. While the estimated usage is over
+     * budget, regenerable data is discarded, in this order: the
+     * cached session XML, the registered caches, and then derived
+     * dense 3-D models whose layers are not in any view, largest
+     * first. An evicted model is replaced by an empty
+     * placeholder, and calculated again (or taken from the derived
+     * model cache) when one of its layers is next added to a view.
+     * Session files are unaffected, as such models are saved as
+     * their derivations only.
+     */
+    void setMemoryBudget(size_t bytes);
+    size_t getMemoryBudget() const { return m_memoryBudget; }
+
+    /**
+     * Discard regenerable data, as described for setMemoryBudget,
+     * until the estimated usage is within budget or there is nothing
+     * more to discard. Return the estimated number of bytes freed.
+     * This is called periodically while a budget is set.
+     */
+    size_t enforceMemoryBudget();
+
     void toXml(QTextStream &, QString indent, QString extraAttributes) const override;
     void toXmlAsTemplate(QTextStream &, QString indent, QString extraAttributes) const;
 
@@ -335,8 +511,21 @@ signals:
 
     void activity(QString);
 
+    /**
+     * Emitted when the data loader has finished filling in models,
+     * so that isLoadingData() has become false.
+     */
+    void dataLoadingComplete();
+
 protected slots:
     void performDeferredAlignment(ModelId);
+    void modelXmlInvalidated(ModelId);
+    void modelNameChanged();
+    void layerParametersChanged();
+    void derivedModelReady(ModelId);
+    void alignmentSucceeded(ModelId);
+    void alignmentNotSucceeded(ModelId);
+    void checkMemoryBudget();
     
 protected:
     void releaseModel(ModelId model);
@@ -443,6 +632,26 @@ protected:
 
     void toXml(QTextStream &, QString, QString, bool asTemplate) const;
     void writePlaceholderMainModel(QTextStream &, QString) const;
+    void writeModelXml(QTextStream &, QString, ModelId) const;
+    static void writeBinaryDenseThreeDimensionalModel(QTextStream &, QString,
+                                                      ModelId, bool compress);
+
+    /**
+     * Derived models whose output is to be stored in the derived
+     * model cache once they are complete, with their cache keys. A
+     * key is empty if the input's content hash was not ready when
+     * the derivation started, and is then made on completion.
+     */
+    std::map<ModelId, QString> m_derivedCacheKeys;
+    void storeInCacheWhenReady(ModelId, QString key);
+
+    /**
+     * Thread that serialises completed derived models and writes them
+     * to the derived model cache, so that neither happens on the GUI
+     * thread. Created when first needed.
+     */
+    class DerivedModelWriter;
+    DerivedModelWriter *m_derivedModelWriter;
 
     std::vector<Layer *> createLayersForDerivedModels(std::vector<ModelId>,
                                                       QStringList names);
@@ -456,8 +665,40 @@ protected:
 
     bool m_autoAlignment;
     Align *m_align;
+    ModelDataLoader *m_dataLoader;
 
     bool m_isIncomplete;
+    bool m_usingCommandHistory;
+    DatasetEncoding m_datasetEncoding;
+
+    /**
+     * The text written by toXml for large models, kept so that it can
+     * be written again without re-serialising the model if the model
+     * has not changed by the next time. An entry is removed when its
+     * model signals any change. The total kept is bounded, and the
+     * whole cache is dropped if the memory budget is exceeded.
+     */
+    struct CachedModelXml {
+        QString indent;
+        DatasetEncoding encoding;
+        QByteArray xml; // UTF-8
+    };
+    mutable std::map<ModelId, CachedModelXml> m_modelXmlCache;
+
+    size_t m_memoryBudget;
+    QTimer *m_memoryBudgetTimer;
+    int m_statisticsOperation;
+    std::vector<EvictableCache *> m_evictableCaches;
+
+    /**
+     * Placeholder models standing in for evicted derived models. Each
+     * has the ModelRecord of the model it replaced.
+     */
+    std::set<ModelId> m_evictedModels;
+
+    bool isEvictable(ModelId) const;
+    void evictDerivedModel(ModelId);
+    void restoreEvictedModel(ModelId placeholder);
 };
 
 #endif
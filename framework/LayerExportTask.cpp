@@ -0,0 +1,199 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "LayerExportTask.h"
+#include "LayerExporter.h"
+
+#include "base/Debug.h"
+#include "base/ProgressReporter.h"
+#include "layer/Layer.h"
+
+#include <QFileInfo>
+#include <QTextStream>
+
+/**
+ * Progress reporter passed to the exporters on the worker thread,
+ * forwarding progress to the task's signal and cancellation from it.
+ */
+class LayerExportTask::Reporter : public ProgressReporter
+{
+public:
+    Reporter(LayerExportTask &task) : m_task(task), m_definite(true) { }
+    
+    bool isDefinite() const override { return m_definite; }
+    void setDefinite(bool definite) override { m_definite = definite; }
+    bool wasCancelled() const override { return m_task.m_cancelled; }
+    void setMessage(QString) override { }
+    void setProgress(int percentage) override {
+        m_task.setProgress(percentage);
+    }
+
+private:
+    LayerExportTask &m_task;
+    std::atomic<bool> m_definite;
+};
+
+LayerExportTask::Format
+LayerExportTask::getFormatForPath(QString path)
+{
+    QString suffix = QFileInfo(path).suffix().toLower();
+
+    if (suffix == "xml" || suffix == "svl") {
+        return SVLFormat;
+    } else if (suffix == "mid" || suffix == "midi") {
+        return MIDIFormat;
+    } else if (suffix == "ttl" || suffix == "n3") {
+        return RDFFormat;
+    } else {
+        return CSVFormat;
+    }
+}
+
+LayerExportTask::LayerExportTask(Layer *layer,
+                                 LayerGeometryProvider *provider,
+                                 MultiSelection *selectionsToWrite,
+                                 Format format,
+                                 QString path) :
+    m_format(format),
+    m_path(path),
+    m_haveSelections(selectionsToWrite != nullptr),
+    m_options(DataExportDefaults),
+    m_reporter(nullptr),
+    m_thread(nullptr),
+    m_cancelled(false),
+    m_finished(false)
+{
+    if (QFileInfo(m_path).suffix() == "") {
+        switch (m_format) {
+        case SVLFormat: m_path += ".svl"; break;
+        case MIDIFormat: m_path += ".mid"; break;
+        case RDFFormat: m_path += ".ttl"; break;
+        case CSVFormat: m_path += ".csv"; break;
+        }
+    }
+    
+    m_delimiter =
+        (QFileInfo(m_path).suffix().toLower() == "csv" ? "," : "\t");
+    
+    if (selectionsToWrite) {
+        m_selections = *selectionsToWrite;
+    }
+
+    ModelId modelId;
+    if (m_format == MIDIFormat) {
+        if (ModelById::get(layer->getExportModel(nullptr))) {
+            modelId = layer->getModel();
+        }
+    } else if (m_format == CSVFormat) {
+        modelId = layer->getExportModel(provider);
+    } else {
+        modelId = layer->getExportModel(nullptr);
+    }
+    m_model = ModelById::get(modelId);
+
+    // Emitted on the worker thread, so queued to this one, where the
+    // model may safely be destroyed if the task held the last
+    // reference to it
+    connect(this, SIGNAL(finished(bool)), this, SLOT(releaseModel()));
+
+    if (m_format == SVLFormat) {
+        QTextStream out(&m_layerXml);
+        layer->toXml(out, "    ");
+    }
+}
+
+LayerExportTask::~LayerExportTask()
+{
+    if (m_thread) {
+        m_cancelled = true;
+        m_thread->wait();
+        delete m_thread;
+    }
+    delete m_reporter;
+}
+
+void
+LayerExportTask::setCSVFormat(QString delimiter, DataExportOptions options)
+{
+    m_delimiter = delimiter;
+    m_options = options;
+}
+
+void
+LayerExportTask::start()
+{
+    if (m_thread) {
+        SVCERR << "WARNING: LayerExportTask::start: Already started" << endl;
+        return;
+    }
+    m_reporter = new Reporter(*this);
+    m_thread = new ExportThread(*this);
+    m_thread->start();
+}
+
+void
+LayerExportTask::cancel()
+{
+    m_cancelled = true;
+}
+
+void
+LayerExportTask::releaseModel()
+{
+    m_model.reset();
+}
+
+void
+LayerExportTask::setProgress(int percentage)
+{
+    emit progress(percentage);
+}
+
+void
+LayerExportTask::run()
+{
+    QString error;
+    const MultiSelection *selections =
+        (m_haveSelections ? &m_selections : nullptr);
+    
+    if (m_cancelled) {
+        error = tr("Export cancelled");
+    } else {
+        switch (m_format) {
+        case SVLFormat:
+            LayerExporter::exportModelToSVL
+                (m_model, m_layerXml, m_path, error);
+            break;
+        case MIDIFormat:
+            LayerExporter::exportModelToMIDI
+                (m_model, selections, m_path, error);
+            break;
+        case RDFFormat:
+            LayerExporter::exportModelToRDF(m_model, m_path, error);
+            break;
+        case CSVFormat:
+            LayerExporter::exportModelToCSV
+                (m_model, selections, m_delimiter, m_options,
+                 m_reporter, m_path, error);
+            break;
+        }
+    }
+
+    SVDEBUG << "LayerExportTask: Export to \"" << m_path << "\" "
+            << (error == "" ? "succeeded" : "failed: ") << error << endl;
+    
+    m_error = error;
+    m_finished = true;
+    emit finished(error == "");
+}
@@ -0,0 +1,151 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_LAYER_EXPORT_TASK_H
+#define SV_LAYER_EXPORT_TASK_H
+
+#include "base/DataExportOptions.h"
+#include "base/Selection.h"
+#include "base/Thread.h"
+#include "data/model/Model.h"
+
+#include <QObject>
+#include <QString>
+
+#include <atomic>
+#include <memory>
+
+class Layer;
+class LayerGeometryProvider;
+
+/**
+ * Export a layer to a file on a worker thread, reporting progress and
+ * allowing the export to be cancelled, using the same formats and
+ * code as LayerExporter.
+ *
+ * Everything needed from the layer and view is taken when the task
+ * is constructed, on the GUI thread; the worker thread then uses only
+ * the exported model, which the task keeps alive until it finishes
+ * and releases on the GUI thread. The layer may therefore continue
+ * to be used, or even deleted, while the export runs. CSV output is
+ * written a block at a time and can be cancelled between blocks; the
+ * other formats can only be cancelled before they start.
+ */
+class LayerExportTask : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Format {
+        SVLFormat,
+        MIDIFormat,
+        RDFFormat,
+        CSVFormat
+    };
+
+    /**
+     * Return the format that LayerExporter::exportLayerTo would use
+     * for the given path.
+     */
+    static Format getFormatForPath(QString path);
+
+    /**
+     * Prepare to export the given layer in the given format. For CSV,
+     * the delimiter is a comma if the path ends in .csv and a tab
+     * otherwise, and the default export options are used, unless
+     * changed with setCSVFormat. The selections, if not null, are
+     * copied.
+     */
+    LayerExportTask(Layer *layer,
+                    LayerGeometryProvider *provider, // or null
+                    MultiSelection *selectionsToWrite, // or null
+                    Format format,
+                    QString toPath);
+
+    /**
+     * Cancel the export if it is still running, and wait for it.
+     */
+    virtual ~LayerExportTask();
+
+    void setCSVFormat(QString delimiter, DataExportOptions options);
+
+    /**
+     * Start the export. The finished signal is emitted when it ends.
+     */
+    void start();
+
+    bool isFinished() const { return m_finished; }
+    bool isOK() const { return m_finished && m_error == ""; }
+
+    /**
+     * Return the error message from a failed export. Only valid once
+     * the task has finished.
+     */
+    QString getError() const { return m_error; }
+
+    QString getPath() const { return m_path; }
+
+signals:
+    /**
+     * Emitted, from the worker thread, as progress is made.
+     */
+    void progress(int percentage);
+
+    /**
+     * Emitted, from the worker thread, when the export has finished,
+     * successfully or not.
+     */
+    void finished(bool ok);
+
+public slots:
+    void cancel();
+
+private slots:
+    void releaseModel();
+
+private:
+    class ExportThread : public Thread
+    {
+    public:
+        ExportThread(LayerExportTask &task) :
+            Thread(Thread::NonRTThread), m_task(task) { }
+        void run() override { m_task.run(); }
+    private:
+        LayerExportTask &m_task;
+    };
+
+    class Reporter;
+    
+    Format m_format;
+    QString m_path;
+    std::shared_ptr<Model> m_model; // held until the export has finished
+    QString m_layerXml;
+    MultiSelection m_selections;
+    bool m_haveSelections;
+    QString m_delimiter;
+    DataExportOptions m_options;
+    Reporter *m_reporter;
+    ExportThread *m_thread;
+    std::atomic<bool> m_cancelled;
+    std::atomic<bool> m_finished;
+    QString m_error;
+
+    void run();
+    void setProgress(int percentage);
+
+    LayerExportTask(const LayerExportTask &) =delete;
+    LayerExportTask &operator=(const LayerExportTask &) =delete;
+};
+
+#endif
@@ -0,0 +1,250 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "LayerExporter.h"
+
+#include "layer/Layer.h"
+#include "data/model/Model.h"
+#include "data/model/NoteModel.h"
+#include "data/fileio/MIDIFileWriter.h"
+#include "data/fileio/CSVFileWriter.h"
+#include "rdf/RDFExporter.h"
+#include "base/Selection.h"
+#include "base/ProgressReporter.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QTextCodec>
+
+bool
+LayerExporter::exportLayerToSVL(Layer *layer,
+                                QString path, QString &error)
+{
+    QString layerXml;
+    {
+        QTextStream out(&layerXml);
+        layer->toXml(out, "    ");
+    }
+    return exportModelToSVL(ModelById::get(layer->getExportModel(nullptr)),
+                            layerXml, path, error);
+}
+
+bool
+LayerExporter::exportLayerToMIDI(Layer *layer,
+                                 MultiSelection *selectionsToWrite,
+                                 QString path, QString &error)
+{
+    if (!ModelById::get(layer->getExportModel(nullptr))) {
+        error = tr("Internal error: unknown model");
+        return false;
+    }
+    return exportModelToMIDI(ModelById::get(layer->getModel()),
+                             selectionsToWrite, path, error);
+}
+
+bool
+LayerExporter::exportLayerToRDF(Layer *layer, 
+                                QString path, QString &error)
+{
+    return exportModelToRDF(ModelById::get(layer->getExportModel(nullptr)),
+                            path, error);
+}
+
+bool
+LayerExporter::exportLayerToCSV(Layer *layer, LayerGeometryProvider *provider,
+                                MultiSelection *selectionsToWrite,
+                                QString delimiter,
+                                DataExportOptions options,
+                                ProgressReporter *reporter,
+                                QString path, QString &error)
+{
+    return exportModelToCSV(ModelById::get(layer->getExportModel(provider)),
+                            selectionsToWrite, delimiter, options,
+                            reporter, path, error);
+}
+
+bool
+LayerExporter::exportModelToSVL(std::shared_ptr<Model> model,
+                                QString layerXml,
+                                QString path, QString &error)
+{
+    if (QFileInfo(path).suffix() == "") path += ".svl";
+
+    if (!model) {
+        error = tr("Internal error: unknown model");
+        return false;
+    }
+
+    // The model is written straight to the file through the stream's
+    // own buffer, so nothing like the whole output is held in memory
+    
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        error = tr("Failed to open file %1 for writing").arg(path);
+    } else {
+        QTextStream out(&file);
+        out.setCodec(QTextCodec::codecForName("UTF-8"));
+        out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            << "<!DOCTYPE sonic-visualiser>\n"
+            << "<sv>\n"
+            << "  <data>\n";
+        
+        model->toXml(out, "    ");
+        
+        out << "  </data>\n"
+            << "  <display>\n";
+        
+        out << layerXml;
+        
+        out << "  </display>\n"
+            << "</sv>\n";
+
+        out.flush();
+        if (file.error() != QFile::NoError) {
+            error = tr("Failed to write file %1: %2")
+                .arg(path).arg(file.errorString());
+        }
+    }
+
+    return (error == "");
+}
+
+bool
+LayerExporter::exportModelToMIDI(std::shared_ptr<Model> model,
+                                 const MultiSelection *selectionsToWrite,
+                                 QString path, QString &error)
+{
+    if (QFileInfo(path).suffix() == "") path += ".mid";
+
+    auto nm = std::dynamic_pointer_cast<NoteModel>(model);
+        
+    if (!nm) {
+        error = tr("Can't export non-note layers to MIDI");
+    } else if (!selectionsToWrite) {
+        MIDIFileWriter writer(path, nm.get(), nm->getSampleRate());
+        writer.write();
+        if (!writer.isOK()) {
+            error = writer.getError();
+        }
+    } else {
+        NoteModel temporary(nm->getSampleRate(),
+                            nm->getResolution(),
+                            nm->getValueMinimum(),
+                            nm->getValueMaximum(),
+                            false);
+        temporary.setScaleUnits(nm->getScaleUnits());
+        for (const auto &s: selectionsToWrite->getSelections()) {
+            EventVector ev(nm->getEventsStartingWithin
+                           (s.getStartFrame(), s.getDuration()));
+            for (const auto &e: ev) {
+                temporary.add(e);
+            }
+        }
+        MIDIFileWriter writer(path, &temporary, temporary.getSampleRate());
+        writer.write();
+        if (!writer.isOK()) {
+            error = writer.getError();
+        }
+    }
+    
+    return (error == "");
+}
+
+bool
+LayerExporter::exportModelToRDF(std::shared_ptr<Model> model,
+                                QString path, QString &error)
+{
+    if (QFileInfo(path).suffix() == "") path += ".ttl";
+
+    if (!model) {
+        error = tr("Internal error: unknown model");
+        return false;
+    }
+    
+    if (!RDFExporter::canExportModel(model.get())) {
+        error = tr("Sorry, cannot export this layer type to RDF (supported types are: region, note, text, time instants, time values)");
+    } else {
+        RDFExporter exporter(path, model.get());
+        exporter.write();
+        if (!exporter.isOK()) {
+            error = exporter.getError();
+        }
+    }
+
+    return (error == "");
+}
+
+bool
+LayerExporter::exportModelToCSV(std::shared_ptr<Model> model,
+                                const MultiSelection *selectionsToWrite,
+                                QString delimiter,
+                                DataExportOptions options,
+                                ProgressReporter *reporter,
+                                QString path, QString &error)
+{
+    if (QFileInfo(path).suffix() == "") path += ".csv";
+
+    if (!model) {
+        error = tr("Internal error: unknown model");
+        return false;
+    }
+
+    // CSVFileWriter writes a block of frames at a time to a temporary
+    // file, which replaces the target only once complete, checking
+    // for cancellation between blocks
+    
+    CSVFileWriter writer(path, model.get(), reporter, delimiter, options);
+
+    if (selectionsToWrite) {
+        writer.writeSelection(*selectionsToWrite);
+    } else {
+        writer.write();
+    }
+
+    if (!writer.isOK()) {
+        error = writer.getError();
+        if (error == "") {
+            if (reporter && reporter->wasCancelled()) {
+                error = tr("Export cancelled");
+            } else {
+                error = tr("Failed to export layer for an unknown reason");
+            }
+        }
+    }
+
+    return (error == "");
+}
+
+bool
+LayerExporter::exportLayerTo(Layer *layer, LayerGeometryProvider *provider,
+                             MultiSelection *selectionsToWrite,
+                             ProgressReporter *reporter,
+                             QString path, QString &error)
+{
+    if (QFileInfo(path).suffix() == "") path += ".csv";
+    QString suffix = QFileInfo(path).suffix().toLower();
+
+    if (suffix == "xml" || suffix == "svl") {
+        return exportLayerToSVL(layer, path, error);
+    } else if (suffix == "mid" || suffix == "midi") {
+        return exportLayerToMIDI(layer, selectionsToWrite, path, error);
+    } else if (suffix == "ttl" || suffix == "n3") {
+        return exportLayerToRDF(layer, path, error);
+    } else {
+        return exportLayerToCSV(layer, provider, selectionsToWrite,
+                                (suffix == "csv" ? "," : "\t"),
+                                DataExportDefaults, reporter, path, error);
+    }
+}
@@ -0,0 +1,113 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_LAYER_EXPORTER_H
+#define SV_LAYER_EXPORTER_H
+
+#include "base/DataExportOptions.h"
+#include "data/model/Model.h"
+
+#include <QCoreApplication>
+#include <QString>
+
+#include <memory>
+
+class Layer;
+class LayerGeometryProvider;
+class MultiSelection;
+class ProgressReporter;
+
+/**
+ * Write the contents of layers to files, in the formats supported by
+ * the layer export functions of MainWindowBase. These functions do
+ * not use any widgets and may be called from any thread, including
+ * from batch-processing code with no main window at all.
+ *
+ * Each function returns true on success, or false with an error
+ * message in error.
+ */
+class LayerExporter
+{
+    Q_DECLARE_TR_FUNCTIONS(LayerExporter)
+
+public:
+    /**
+     * Export to Sonic Visualiser layer XML, containing both the
+     * layer's model and the layer itself.
+     */
+    static bool exportLayerToSVL(Layer *layer,
+                                 QString toPath, QString &error);
+
+    /**
+     * Export a note layer to a MIDI file.
+     */
+    static bool exportLayerToMIDI(Layer *layer,
+                                  MultiSelection *selectionsToWrite, // or null
+                                  QString toPath, QString &error);
+
+    /**
+     * Export to RDF, for the layer types that RDFExporter supports.
+     */
+    static bool exportLayerToRDF(Layer *layer,
+                                 QString toPath, QString &error);
+
+    /**
+     * Export to delimited text. The reporter, if given, is updated
+     * with progress and may be used to cancel the export.
+     */
+    static bool exportLayerToCSV(Layer *layer, LayerGeometryProvider *provider,
+                                 MultiSelection *selectionsToWrite, // or null
+                                 QString delimiter,
+                                 DataExportOptions options,
+                                 ProgressReporter *reporter, // or null
+                                 QString toPath, QString &error);
+
+    /**
+     * Delegate to one of the above depending on the extension of the
+     * path, using the default export options. A path with no
+     * extension is exported as CSV.
+     */
+    static bool exportLayerTo(Layer *layer, LayerGeometryProvider *provider,
+                              MultiSelection *selectionsToWrite, // or null
+                              ProgressReporter *reporter, // or null
+                              QString toPath, QString &error);
+
+    /**
+     * The following do the work for the layer functions above, given
+     * the model to export (the layer's export model, or its note
+     * model for MIDI) and, for SVL, the layer's own XML. They use no
+     * layer or view, and do not look the model up by id, so may be
+     * called from a worker thread, with a model held by the caller,
+     * while the layer remains in use in the GUI; see LayerExportTask.
+     */
+    static bool exportModelToSVL(std::shared_ptr<Model> model,
+                                 QString layerXml,
+                                 QString toPath, QString &error);
+
+    static bool exportModelToMIDI(std::shared_ptr<Model> noteModel,
+                                  const MultiSelection *selectionsToWrite,
+                                  QString toPath, QString &error);
+
+    static bool exportModelToRDF(std::shared_ptr<Model> model,
+                                 QString toPath, QString &error);
+
+    static bool exportModelToCSV(std::shared_ptr<Model> model,
+                                 const MultiSelection *selectionsToWrite,
+                                 QString delimiter,
+                                 DataExportOptions options,
+                                 ProgressReporter *reporter, // or null
+                                 QString toPath, QString &error);
+};
+
+#endif
@@ -15,6 +15,8 @@
 
 #include "MainWindowBase.h"
 #include "Document.h"
+#include "LayerExportTask.h"
+#include "SessionStatistics.h"
 
 #include "view/Pane.h"
 #include "view/PaneStack.h"
@@ -72,9 +74,11 @@
 #include "base/Preferences.h"
 #include "base/TempWriteFile.h"
 #include "base/Exceptions.h"
+#include "base/Thread.h"
 #include "base/ResourceFinder.h"
 
 #include "data/osc/OSCQueue.h"
+#include "data/osc/OSCMessage.h"
 #include "data/midi/MIDIInput.h"
 #include "OSCScript.h"
 
@@ -103,15 +107,23 @@
 #include <QShortcut>
 #include <QSettings>
 #include <QDateTime>
+#include <QTimer>
+#include <QLockFile>
+#include <QCryptographicHash>
+#include <QEventLoop>
+#include <QStandardPaths>
+#include <QCoreApplication>
 #include <QProcess>
 #include <QCheckBox>
 #include <QRegExp>
 #include <QScrollArea>
 #include <QScreen>
+#include <QWindow>
 #include <QSignalMapper>
 
 #include <iostream>
 #include <cstdio>
+#include <cmath>
 #include <errno.h>
 
 using std::vector;
@@ -140,6 +152,32 @@ static int handle_x11_error(Display *dpy, XErrorEvent *err)
 #undef Window
 #endif
 
+/**
+ * Present the play source's loop cache to the document as regenerable
+ * data. The cache is not evicted while playing, as the play source
+ * would only build it again straight away.
+ */
+class MainWindowBase::PlaySourceCache : public Document::EvictableCache
+{
+public:
+    PlaySourceCache(AudioCallbackPlaySource *source) : m_source(source) { }
+
+    QString getCacheName() const override {
+        return "loop-cache";
+    }
+    size_t getCacheMemoryUsage() override {
+        return m_source ? m_source->getLoopCacheMemoryUsage() : 0;
+    }
+    bool evictCache() override {
+        if (!m_source || m_source->isPlaying()) return false;
+        m_source->discardLoopCache();
+        return true;
+    }
+
+private:
+    QPointer<AudioCallbackPlaySource> m_source;
+};
+
 MainWindowBase::MainWindowBase(AudioMode audioMode,
                                MIDIMode midiMode,
                                PaneStack::Options paneStackOptions) :
@@ -155,6 +193,7 @@ MainWindowBase::MainWindowBase(AudioMode audioMode,
     m_audioIO(nullptr),
     m_oscQueue(nullptr),
     m_oscQueueStarter(nullptr),
+    m_oscRetryTimer(nullptr),
     m_oscScript(nullptr),
     m_midiInput(nullptr),
     m_recentFiles("RecentFiles", 20),
@@ -164,12 +203,24 @@ MainWindowBase::MainWindowBase(AudioMode audioMode,
     m_handlingOSC(false),
     m_labeller(nullptr),
     m_lastPlayStatusSec(0),
+    m_playheadTimer(nullptr),
+    m_playheadUpdateRate(0.0),
+    m_playStatusUpdateRate(4.0),
+    m_pendingPlaybackFrame(0),
+    m_displayedPlaybackFrame(-1),
+    m_visibleRangePending(false),
     m_initialDarkBackground(false),
     m_defaultFfwdRwdStep(2, 0),
     m_audioRecordMode(RecordCreateAdditionalModel),
     m_statusLabel(nullptr),
     m_iconsVisibleInMenus(true),
-    m_menuShortcutMapper(nullptr)
+    m_menuShortcutMapper(nullptr),
+    m_playSourceCache(nullptr),
+    m_sessionWriter(nullptr),
+    m_sessionWriterIsAutosave(false),
+    m_autosaveTimer(nullptr),
+    m_autosaveLock(nullptr),
+    m_pendingAutosaveLock(nullptr)
 {
     Profiler profiler("MainWindowBase::MainWindowBase");
 
@@ -266,6 +317,22 @@ MainWindowBase::MainWindowBase(AudioMode audioMode,
     m_playSource = new AudioCallbackPlaySource
         (m_viewManager, QApplication::applicationName());
 
+    {
+        QSettings settings;
+        settings.beginGroup("Playback");
+        m_playSource->setMixThreadCount
+            (settings.value("mix-threads", 1).toInt());
+        m_playSource->setLowLatencyMode
+            (settings.value("low-latency", false).toBool());
+        m_playSource->setTimeStretchMultithreaded
+            (settings.value("multithreaded-stretch", false).toBool());
+        m_playSource->setLoopCacheEnabled
+            (settings.value("loop-cache", false).toBool());
+        settings.endGroup();
+    }
+
+    m_playSourceCache = new PlaySourceCache(m_playSource);
+
     if (m_audioMode == AUDIO_PLAYBACK_NOW_RECORD_LATER ||
         m_audioMode == AUDIO_PLAYBACK_AND_RECORD) {
         SVDEBUG << "MainWindowBase: Creating record target" << endl;
@@ -287,6 +354,21 @@ MainWindowBase::MainWindowBase(AudioMode audioMode,
     connect(m_viewManager, SIGNAL(monitoringLevelsChanged(float, float)),
             this, SLOT(monitoringLevelsChanged(float, float)));
 
+    {
+        QSettings settings;
+        settings.beginGroup("MainWindow");
+        m_playheadUpdateRate =
+            settings.value("playhead-update-rate", 0.0).toDouble();
+        m_playStatusUpdateRate =
+            settings.value("play-status-update-rate", 4.0).toDouble();
+        settings.endGroup();
+    }
+
+    m_playheadTimer = new QTimer(this);
+    m_playheadTimer->setSingleShot(true);
+    connect(m_playheadTimer, SIGNAL(timeout()),
+            this, SLOT(updatePlayheadDisplays()));
+    
     connect(m_viewManager, SIGNAL(playbackFrameChanged(sv_frame_t)),
             this, SLOT(playbackFrameChanged(sv_frame_t)));
 
@@ -312,6 +394,7 @@ MainWindowBase::MainWindowBase(AudioMode audioMode,
     labellerType = (Labeller::ValueType)
         settings.value("labellertype", (int)labellerType).toInt();
     int cycle = settings.value("labellercycle", 4).toInt();
+    int autosaveInterval = settings.value("autosave-interval", 0).toInt();
 
     settings.endGroup();
 
@@ -323,6 +406,14 @@ MainWindowBase::MainWindowBase(AudioMode audioMode,
         m_midiInput = new MIDIInput(QApplication::applicationName(), this);
     }
 
+    m_autosaveTimer = new QTimer(this);
+    connect(m_autosaveTimer, SIGNAL(timeout()), this, SLOT(autosave()));
+    setAutosaveInterval(autosaveInterval);
+    QTimer::singleShot(0, this, SLOT(offerAutosaveRecovery()));
+
+    connect(SessionStatistics::getInstance(), SIGNAL(reportComplete(QString)),
+            this, SLOT(sessionReportComplete(QString)));
+
     QTimer::singleShot(1500, this, SIGNAL(hideSplash()));
 
     SVDEBUG << "MainWindowBase: Constructor done" << endl;
@@ -332,6 +423,13 @@ MainWindowBase::~MainWindowBase()
 {
     SVDEBUG << "MainWindowBase::~MainWindowBase" << endl;
 
+    // Let any save finish; the session is complete when we are
+    // closed normally, so there is then no need for an autosave
+    m_autosaveTimer->stop();
+    waitForSessionSave();
+    removeAutosave();
+    delete m_pendingAutosaveLock;
+
     // We have to delete the breakfastquay::SystemPlaybackTarget or
     // breakfastquay::SystemAudioIO object (whichever we have -- it
     // depends on whether we handle recording or not) before we delete
@@ -368,6 +466,8 @@ MainWindowBase::~MainWindowBase()
         delete m_oscQueueStarter;
         delete m_oscQueue;
     }
+
+    delete m_playSourceCache;
     
     Profiles::getInstance()->dump();
 }
@@ -543,6 +643,12 @@ MainWindowBase::oscReady()
 {
     if (m_oscQueue && m_oscQueue->isOK()) {
         connect(m_oscQueue, SIGNAL(messagesAvailable()), this, SLOT(pollOSC()));
+
+        m_oscRetryTimer = new QTimer(this);
+        m_oscRetryTimer->setSingleShot(true);
+        m_oscRetryTimer->setInterval(100);
+        connect(m_oscRetryTimer, SIGNAL(timeout()), this, SLOT(pollOSC()));
+        
         QTimer *oscTimer = new QTimer(this);
         connect(oscTimer, SIGNAL(timeout()), this, SLOT(pollOSC()));
         oscTimer->start(2000);
@@ -884,6 +990,12 @@ MainWindowBase::currentPaneChanged(Pane *p)
 
     if (!p) return;
 
+    if (m_document) {
+        for (ModelId modelId: p->getModels()) {
+            m_document->prioritiseAlignment(modelId);
+        }
+    }
+
     if (!(m_viewManager &&
           m_playSource &&
           m_viewManager->getPlaySoloMode())) {
@@ -1583,6 +1695,28 @@ MainWindowBase::openAudio(FileSource source,
 
     source.waitForData();
 
+    sv_samplerate_t rate = getRateForOpenedAudio(mode);
+    
+    auto newModel = std::make_shared<ReadOnlyWaveFileModel>(source, rate);
+    if (!newModel->isOK()) {
+        m_openingAudioFile = false;
+        if (source.wasCancelled()) {
+            return FileOpenCancelled;
+        } else { 
+            return FileOpenFailed;
+        }
+    }
+
+    auto newModelId = ModelById::add(newModel);
+    auto status = addOpenedAudioModel
+        (source, newModelId, mode, templateName, true);
+    m_openingAudioFile = false;
+    return status;
+}
+
+sv_samplerate_t
+MainWindowBase::getRateForOpenedAudio(AudioFileOpenMode mode)
+{
     sv_samplerate_t rate = 0;
 
     SVDEBUG << "Checking whether to preserve incoming audio file's sample rate"
@@ -1605,22 +1739,8 @@ MainWindowBase::openAudio(FileSource source,
     if (rate == 0) {
         SVDEBUG << "Yes, preserving incoming file rate" << endl;
     }
-    
-    auto newModel = std::make_shared<ReadOnlyWaveFileModel>(source, rate);
-    if (!newModel->isOK()) {
-        m_openingAudioFile = false;
-        if (source.wasCancelled()) {
-            return FileOpenCancelled;
-        } else { 
-            return FileOpenFailed;
-        }
-    }
 
-    auto newModelId = ModelById::add(newModel);
-    auto status = addOpenedAudioModel
-        (source, newModelId, mode, templateName, true);
-    m_openingAudioFile = false;
-    return status;
+    return rate;
 }
 
 MainWindowBase::FileOpenStatus
@@ -1875,262 +1995,99 @@ MainWindowBase::openPlaylist(FileSource source, AudioFileOpenMode mode)
 
     PlaylistFileReader::Playlist playlist = reader.load();
 
-    bool someSuccess = false;
+    ProgressDialog dialog(tr("Opening playlist..."), true, 2000, this);
+    connect(&dialog, SIGNAL(showing()), this, SIGNAL(hideSplash()));
 
+    std::vector<FileSource> sources;
     for (PlaylistFileReader::Playlist::const_iterator i = playlist.begin();
          i != playlist.end(); ++i) {
-
-        ProgressDialog dialog(tr("Opening playlist..."), true, 2000, this);
-        connect(&dialog, SIGNAL(showing()), this, SIGNAL(hideSplash()));
-        FileOpenStatus status = openAudio(FileSource(*i, &dialog), mode);
-
-        if (status == FileOpenCancelled) {
-            return FileOpenCancelled;
-        }
-
-        if (status == FileOpenSucceeded) {
-            someSuccess = true;
-            mode = CreateAdditionalModel;
-        }
+        sources.push_back(FileSource(*i, &dialog));
     }
 
-    if (someSuccess) return FileOpenSucceeded;
-    else return FileOpenFailed;
+    return openMultipleAudio(sources, mode);
 }
 
 MainWindowBase::FileOpenStatus
-MainWindowBase::openLayer(FileSource source)
+MainWindowBase::openDirOfAudio(QString dirPath)
 {
-    SVDEBUG << "MainWindowBase::openLayer(" << source.getLocation() << ")" << endl;
-
-    Pane *pane = m_paneStack->getCurrentPane();
-    
-    if (!pane) {
-        // shouldn't happen, as the menu action should have been disabled
-        cerr << "WARNING: MainWindowBase::openLayer: no current pane" << endl;
-        return FileOpenWrongMode;
-    }
-
-    if (!getMainModel()) {
-        // shouldn't happen, as the menu action should have been disabled
-        cerr << "WARNING: MainWindowBase::openLayer: No main model -- hence no default sample rate available" << endl;
-        return FileOpenWrongMode;
-    }
-
-    if (!source.isAvailable()) return FileOpenFailed;
-    source.waitForData();
-
-    QString path = source.getLocalFilename();
-
-    RDFImporter::RDFDocumentType rdfType = 
-        RDFImporter::identifyDocumentType(QUrl::fromLocalFile(path));
-
-//    cerr << "RDF type:  (in layer) " << (int) rdfType << endl;
-
-    if (rdfType != RDFImporter::NotRDF) {
-
-        return openLayersFromRDF(source);
-
-    } else if (source.getExtension().toLower() == "svl" ||
-               (source.getExtension().toLower() == "xml" &&
-                (SVFileReader::identifyXmlFile(source.getLocalFilename())
-                 == SVFileReader::SVLayerFile))) {
-
-        PaneCallback callback(this);
-        QFile file(path);
-        
-        if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-            cerr << "ERROR: MainWindowBase::openLayer("
-                      << source.getLocation()
-                      << "): Failed to open file for reading" << endl;
-            return FileOpenFailed;
-        }
-        
-        SVFileReader reader(m_document, callback, source.getLocation());
-        connect
-            (&reader, SIGNAL(modelRegenerationFailed(QString, QString, QString)),
-             this, SLOT(modelRegenerationFailed(QString, QString, QString)));
-        connect
-            (&reader, SIGNAL(modelRegenerationWarning(QString, QString, QString)),
-             this, SLOT(modelRegenerationWarning(QString, QString, QString)));
-        reader.setCurrentPane(pane);
-        
-        QXmlInputSource inputSource(&file);
-        reader.parse(inputSource);
-        
-        if (!reader.isOK()) {
-            cerr << "ERROR: MainWindowBase::openLayer("
-                      << source.getLocation()
-                      << "): Failed to read XML file: "
-                      << reader.getErrorString() << endl;
-            return FileOpenFailed;
-        }
+    QDir dir(dirPath);
+    QStringList files = dir.entryList(QDir::Files | QDir::Readable);
+    files.sort();
 
-        emit activity(tr("Import layer XML file \"%1\"").arg(source.getLocation()));
+    std::vector<FileSource> sources;
 
-        m_recentFiles.addFile(source.getLocation());
+    foreach (QString file, files) {
 
-        if (!source.isRemote()) {
-            registerLastOpenedFilePath(FileFinder::LayerFile, path); // for file dialog
+        FileSource source(dir.filePath(file));
+        if (!source.isAvailable()) {
+            continue;
         }
 
-        return FileOpenSucceeded;
-
-    } else {
-        
-        try {
-
-            MIDIFileImportDialog midiDlg(this);
-
-            Model *newModelPtr = DataFileReaderFactory::loadNonCSV
-                (path, &midiDlg, getMainModel()->getSampleRate());
-        
-            if (!newModelPtr) {
-                CSVFormatDialog *dialog =
-                    new CSVFormatDialog(this,
-                                        path,
-                                        getMainModel()->getSampleRate(),
-                                        5);
-                if (dialog->exec() == QDialog::Accepted) {
-                    newModelPtr = DataFileReaderFactory::loadCSV
-                        (path, dialog->getFormat(),
-                         getMainModel()->getSampleRate());
-                }
-                delete dialog;
-            }
-
-            if (newModelPtr) {
-
-                SVDEBUG << "MainWindowBase::openLayer: Have model" << endl;
-
-                emit activity(tr("Import MIDI file \"%1\"").arg(source.getLocation()));
-
-                ModelId modelId = 
-                    ModelById::add(std::shared_ptr<Model>(newModelPtr));
-                
-                Layer *newLayer = m_document->createImportedLayer(modelId);
-
-                if (newLayer) {
-
-                    m_document->addLayerToView(pane, newLayer);
-                    m_paneStack->setCurrentLayer(pane, newLayer);
-
-                    m_recentFiles.addFile(source.getLocation());
-                    
-                    if (!source.isRemote()) {
-                        registerLastOpenedFilePath
-                            (FileFinder::LayerFile,
-                             path); // for file dialog
-                    }
-
-                    return FileOpenSucceeded;
-                }
-            }
-        } catch (DataFileReaderFactory::Exception e) {
-            if (e == DataFileReaderFactory::ImportCancelled) {
-                return FileOpenCancelled;
-            }
+        if (AudioFileReaderFactory::getKnownExtensions().contains
+            (source.getExtension().toLower())) {
+            sources.push_back(source);
         }
     }
-    
-    return FileOpenFailed;
+
+    return openMultipleAudio(sources, ReplaceSession);
 }
 
 MainWindowBase::FileOpenStatus
-MainWindowBase::openImage(FileSource source)
+MainWindowBase::openMultipleAudio(std::vector<FileSource> sources,
+                                  AudioFileOpenMode mode)
 {
-    SVDEBUG << "MainWindowBase::openImage(" << source.getLocation() << ")" << endl;
+    // Open the first file that can be opened in the usual way, as it
+    // may start a new session and determines the rate for the rest
 
-    Pane *pane = m_paneStack->getCurrentPane();
+    size_t first = 0;
+    bool haveReference = false;
     
-    if (!pane) {
-        // shouldn't happen, as the menu action should have been disabled
-        cerr << "WARNING: MainWindowBase::openImage: no current pane" << endl;
-        return FileOpenWrongMode;
-    }
-
-    if (!getMainModel()) {
-        return FileOpenWrongMode;
-    }
-
-    bool newLayer = false;
-
-    ImageLayer *il = dynamic_cast<ImageLayer *>(pane->getSelectedLayer());
-    if (!il) {
-        for (int i = pane->getLayerCount()-1; i >= 0; --i) {
-            il = dynamic_cast<ImageLayer *>(pane->getLayer(i));
-            if (il) break;
+    for ( ; first < sources.size(); ++first) {
+        switch (openAudio(sources[first], mode)) {
+        case FileOpenSucceeded:
+            haveReference = true;
+            break;
+        case FileOpenCancelled:
+            return FileOpenCancelled;
+        case FileOpenFailed:
+        case FileOpenWrongMode:
+            break;
         }
+        if (haveReference) break;
     }
-    if (!il) {
-        il = dynamic_cast<ImageLayer *>
-            (m_document->createEmptyLayer(LayerFactory::Image));
-        if (!il) return FileOpenFailed;
-        newLayer = true;
-    }
-
-    // We don't put the image file in Recent Files
 
-    SVCERR << "openImage: trying location \"" << source.getLocation() << "\" in image layer" << endl;
-
-    if (!il->addImage(m_viewManager->getGlobalCentreFrame(), source.getLocation())) {
-        if (newLayer) {
-            m_document->deleteLayer(il); // also releases its model
-        }
+    if (!haveReference) {
         return FileOpenFailed;
-    } else {
-        if (newLayer) {
-            m_document->addLayerToView(pane, il);
-        }
-        m_paneStack->setCurrentLayer(pane, il);
     }
 
-    return FileOpenSucceeded;
-}
-
-MainWindowBase::FileOpenStatus
-MainWindowBase::openDirOfAudio(QString dirPath)
-{
-    QDir dir(dirPath);
-    QStringList files = dir.entryList(QDir::Files | QDir::Readable);
-    files.sort();
+    if (first + 1 >= sources.size()) {
+        return FileOpenSucceeded;
+    }
 
-    FileOpenStatus status = FileOpenFailed;
-    bool first = true;
-    bool cancelled = false;
+    // The rest are opened one at a time; each model decodes its file
+    // on a thread of its own, so there is nothing to be gained from
+    // constructing them in parallel. Align once everything is in,
+    // rather than each model as it is added
 
-    foreach (QString file, files) {
+    m_document->setAutoAlignment(false);
 
-        FileSource source(dir.filePath(file));
-        if (!source.isAvailable()) {
-            continue;
+    for (size_t i = first + 1; i < sources.size(); ++i) {
+        FileOpenStatus status = openAudio(sources[i], CreateAdditionalModel);
+        if (status == FileOpenCancelled) {
+            break;
         }
-
-        if (AudioFileReaderFactory::getKnownExtensions().contains
-            (source.getExtension().toLower())) {
-            
-            AudioFileOpenMode mode = CreateAdditionalModel;
-            if (first) mode = ReplaceSession;
-            
-            switch (openAudio(source, mode)) {
-            case FileOpenSucceeded:
-                status = FileOpenSucceeded;
-                first = false;
-                break;
-            case FileOpenFailed:
-                break;
-            case FileOpenCancelled:
-                cancelled = true;
-                break;
-            case FileOpenWrongMode:
-                break;
-            }
+        if (status != FileOpenSucceeded) {
+            SVCERR << "MainWindowBase::openMultipleAudio: Failed to open \""
+                   << sources[i].getLocation() << "\"" << endl;
         }
+    }
 
-        if (cancelled) break;
+    m_document->setAutoAlignment(m_viewManager->getAlignMode());
+    if (m_viewManager->getAlignMode()) {
+        m_document->alignModels();
     }
 
-    return status;
+    return FileOpenSucceeded;
 }
 
 MainWindowBase::FileOpenStatus
@@ -2210,9 +2167,16 @@ MainWindowBase::openSession(FileSource source)
         return FileOpenCancelled;
     }
 
+    int operation = SessionStatistics::getInstance()->beginOperation
+        ("open-session", source.getLocation());
+    
     QString error;
-    closeSession();
-    createDocument();
+    {
+        SessionStatistics::PhaseTimer timer("close-previous");
+        closeSession();
+        createDocument();
+    }
+    m_document->setStatisticsOperation(operation);
 
     PaneCallback callback(this);
     m_viewManager->clearSelections();
@@ -2282,6 +2246,11 @@ MainWindowBase::openSession(FileSource source)
 
         updateWindowTitle();
     }
+
+    // Work started from here on is the user's own, not the session's
+    m_document->setStatisticsOperation(-1);
+    
+    SessionStatistics::getInstance()->endOperation(operation, ok);
     
     return ok ? FileOpenSucceeded : FileOpenFailed;
 }
@@ -2720,6 +2689,16 @@ MainWindowBase::createDocument()
 {
     m_document = new Document;
 
+    if (m_deferredSavePath != "") {
+        SVCERR << "WARNING: MainWindowBase::createDocument: Abandoning save "
+               << "of previous document to \"" << m_deferredSavePath
+               << "\", which had not finished loading" << endl;
+        m_deferredSavePath = "";
+    }
+
+    m_untitledSessionName = QString("untitled-%1")
+        .arg(QDateTime::currentDateTime().toString("yyyyMMdd-HHmmss-zzz"));
+
     connect(m_document, SIGNAL(layerAdded(Layer *)),
             this, SLOT(layerAdded(Layer *)));
     connect(m_document, SIGNAL(layerRemoved(Layer *)),
@@ -2745,12 +2724,37 @@ MainWindowBase::createDocument()
 
     m_document->setAutoAlignment(m_viewManager->getAlignMode());
 
+    // "text", "binary" or "compressed": see Document::DatasetEncoding
+    QSettings settings;
+    settings.beginGroup("MainWindow");
+    QString encoding = settings.value("session-dataset-encoding", "text")
+        .toString();
+    settings.endGroup();
+    if (encoding == "binary") {
+        m_document->setDatasetEncoding(Document::BinaryDatasets);
+    } else if (encoding == "compressed") {
+        m_document->setDatasetEncoding(Document::CompressedBinaryDatasets);
+    }
+
+    // 0 for no budget: see Document::setMemoryBudget
+    settings.beginGroup("MainWindow");
+    int budgetMB = settings.value("memory-budget-mb", 0).toInt();
+    settings.endGroup();
+    m_document->addEvictableCache(m_playSourceCache);
+    if (budgetMB > 0) {
+        m_document->setMemoryBudget(size_t(budgetMB) * 1024 * 1024);
+    }
+
     emit replacedDocument();
 }
 
+namespace {
 bool
-MainWindowBase::saveSessionFile(QString path)
+writeSessionData(QString path, const QByteArray &xml, QString &error,
+                 int operation)
 {
+    SessionStatistics::PhaseTimer timer("write", operation);
+    
     try {
 
         TempWriteFile temp(path);
@@ -2761,22 +2765,14 @@ MainWindowBase::saveSessionFile(QString path)
                       << temp.getTemporaryFilename()
                       << "\" for writing: "
                       << bzFile.errorString() << endl;
+            error = bzFile.errorString();
             return false;
         }
 
-        QApplication::setOverrideCursor(QCursor(Qt::WaitCursor));
-
-        QTextStream out(&bzFile);
-        out.setCodec(QTextCodec::codecForName("UTF-8"));
-        toXml(out, false);
-        out.flush();
-
-        QApplication::restoreOverrideCursor();
+        bzFile.write(xml);
 
         if (!bzFile.isOK()) {
-            QMessageBox::critical(this, tr("Failed to write file"),
-                                  tr("<b>Save failed</b><p>Failed to write to file \"%1\": %2")
-                                  .arg(path).arg(bzFile.errorString()));
+            error = bzFile.errorString();
             bzFile.close();
             return false;
         }
@@ -2786,210 +2782,522 @@ MainWindowBase::saveSessionFile(QString path)
         return true;
 
     } catch (FileOperationFailed &f) {
-        
-        QMessageBox::critical(this, tr("Failed to write file"),
-                              tr("<b>Save failed</b><p>Failed to write to file \"%1\": %2")
-                              .arg(path).arg(f.what()));
+        error = f.what();
         return false;
     }
 }
+}
 
-bool
-MainWindowBase::saveSessionTemplate(QString path)
+/**
+ * Compresses and writes a captured session to file, so that the GUI
+ * thread does not have to wait for it.
+ */
+class MainWindowBase::SessionWriter : public Thread
 {
-    try {
+public:
+    SessionWriter(QString path, QByteArray xml, int operation) :
+        Thread(Thread::NonRTThread),
+        m_path(path),
+        m_xml(xml),
+        m_operation(operation),
+        m_ok(false) { }
+
+    void run() override {
+        m_ok = writeSessionData(m_path, m_xml, m_error, m_operation);
+        m_xml.clear();
+    }
+
+    QString getPath() const { return m_path; }
+    int getOperation() const { return m_operation; }
+    bool isOK() const { return m_ok; }
+    QString getError() const { return m_error; }
+
+private:
+    QString m_path;
+    QByteArray m_xml;
+    int m_operation;
+    bool m_ok;
+    QString m_error;
+};
 
-        TempWriteFile temp(path);
+QByteArray
+MainWindowBase::makeSessionSnapshot(bool asTemplate)
+{
+    Profiler profiler("MainWindowBase::makeSessionSnapshot");
+    SessionStatistics::PhaseTimer timer("snapshot");
+    
+    QByteArray xml;
+    QTextStream out(&xml, QIODevice::WriteOnly);
+    out.setCodec(QTextCodec::codecForName("UTF-8"));
+    toXml(out, asTemplate);
+    out.flush();
+    return xml;
+}
 
-        QFile file(temp.getTemporaryFilename());
-        if (!file.open(QIODevice::WriteOnly)) {
-            cerr << "Failed to open session template file \""
-                      << temp.getTemporaryFilename()
-                      << "\" for writing: "
-                      << file.errorString() << endl;
-            return false;
-        }
-        
-        QApplication::setOverrideCursor(QCursor(Qt::WaitCursor));
+bool
+MainWindowBase::saveSessionFile(QString path)
+{
+    // Don't race a background save that may be writing the same file
+    waitForSessionSave();
 
-        QTextStream out(&file);
-        out.setCodec(QTextCodec::codecForName("UTF-8"));
-        toXml(out, true);
-        out.flush();
+    if (!waitForDocumentData()) {
+        return false;
+    }
+    
+    QApplication::setOverrideCursor(QCursor(Qt::WaitCursor));
 
-        QApplication::restoreOverrideCursor();
+    int operation = SessionStatistics::getInstance()->beginOperation
+        ("save-session", path);
+    QByteArray xml = makeSessionSnapshot(false);
+    QString error;
+    bool ok = writeSessionData(path, xml, error, operation);
+    SessionStatistics::getInstance()->endOperation(operation, ok);
 
-        file.close();
-        temp.moveToTarget();
-        return true;
+    QApplication::restoreOverrideCursor();
 
-    } catch (FileOperationFailed &f) {
-        
+    if (!ok) {
         QMessageBox::critical(this, tr("Failed to write file"),
                               tr("<b>Save failed</b><p>Failed to write to file \"%1\": %2")
-                              .arg(path).arg(f.what()));
+                              .arg(path).arg(error));
         return false;
     }
-}
 
-//!!! should we pull out the whole export logic into another
-// class?  then we can more reasonably query it for things like
-// "can we export this layer type to this file format? can we
-// export selections, or only the whole layer?"
+    removeAutosave();
+    return true;
+}
 
 bool
-MainWindowBase::exportLayerToSVL(Layer *layer,
-                                 QString path, QString &error)
+MainWindowBase::saveSessionFileInBackground(QString path)
 {
-    if (QFileInfo(path).suffix() == "") path += ".svl";
+    return startSessionWriter(path, false);
+}
 
-    QString suffix = QFileInfo(path).suffix().toLower();
+bool
+MainWindowBase::startSessionWriter(QString path, bool isAutosave)
+{
+    waitForSessionSave();
+
+    if (!isAutosave && m_document->isLoadingData()) {
+        // Start once the models are all there, rather than blocking
+        // until they are
+        SVDEBUG << "MainWindowBase::startSessionWriter: Document is still "
+                << "loading, deferring save to \"" << path << "\"" << endl;
+        m_deferredSavePath = path;
+        connect(m_document, SIGNAL(dataLoadingComplete()),
+                this, SLOT(startDeferredSave()), Qt::UniqueConnection);
+        return true;
+    }
 
-    auto model = ModelById::get(layer->getExportModel(nullptr));
-    if (!model) {
-        error = tr("Internal error: unknown model");
-        return false;
+    int operation = SessionStatistics::getInstance()->beginOperation
+        (isAutosave ? "autosave-session" : "save-session", path);
+    
+    QByteArray xml;
+    {
+        QApplication::setOverrideCursor(QCursor(Qt::WaitCursor));
+        xml = makeSessionSnapshot(false);
+        QApplication::restoreOverrideCursor();
     }
 
-    QFile file(path);
-    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
-        error = tr("Failed to open file %1 for writing").arg(path);
-    } else {
-        QTextStream out(&file);
-        out.setCodec(QTextCodec::codecForName("UTF-8"));
-        out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-            << "<!DOCTYPE sonic-visualiser>\n"
-            << "<sv>\n"
-            << "  <data>\n";
-        
-        model->toXml(out, "    ");
-        
-        out << "  </data>\n"
-            << "  <display>\n";
-        
-        layer->toXml(out, "    ");
-        
-        out << "  </display>\n"
-            << "</sv>\n";
+    SVDEBUG << "MainWindowBase::startSessionWriter: Captured " << xml.size()
+            << " bytes of session for " << (isAutosave ? "autosave" : "save")
+            << " to \"" << path << "\"" << endl;
+
+    m_sessionWriter = new SessionWriter(path, xml, operation);
+    m_sessionWriterIsAutosave = isAutosave;
+    connect(m_sessionWriter, SIGNAL(finished()),
+            this, SLOT(sessionWriteFinished()));
+    m_sessionWriter->start();
+    return true;
+}
+
+bool
+MainWindowBase::isSavingSession() const
+{
+    return m_sessionWriter != nullptr || m_deferredSavePath != "";
+}
+
+void
+MainWindowBase::waitForSessionSave()
+{
+    if (m_deferredSavePath != "") {
+        if (waitForDocumentData()) {
+            startDeferredSave();
+        } else {
+            SVCERR << "WARNING: MainWindowBase::waitForSessionSave: "
+                   << "Abandoning save to \"" << m_deferredSavePath
+                   << "\" while the document is still loading" << endl;
+            m_deferredSavePath = "";
+        }
     }
+    
+    if (!m_sessionWriter) return;
+    m_sessionWriter->wait();
+    sessionWriteFinished();
+}
 
-    return (error == "");
+void
+MainWindowBase::startDeferredSave()
+{
+    // Called when the document has finished loading, or from
+    // waitForSessionSave once it has
+    if (m_deferredSavePath == "" || m_document->isLoadingData()) {
+        return;
+    }
+    QString path = m_deferredSavePath;
+    m_deferredSavePath = "";
+    startSessionWriter(path, false);
 }
 
 bool
-MainWindowBase::exportLayerToMIDI(Layer *layer,
-                                  MultiSelection *selectionsToWrite,
-                                  QString path, QString &error)
+MainWindowBase::waitForDocumentData()
 {
-    if (QFileInfo(path).suffix() == "") path += ".mid";
+    // Wait with events processed, and the option to cancel, for any
+    // models still being filled in from a session file. Return false
+    // if cancelled
+    
+    if (!m_document || !m_document->isLoadingData()) {
+        return true;
+    }
 
-    QString suffix = QFileInfo(path).suffix().toLower();
+    ProgressDialog dialog(tr("Waiting for session data to load..."),
+                          true, 500, this);
+    
+    QEventLoop loop;
+    connect(m_document, SIGNAL(dataLoadingComplete()), &loop, SLOT(quit()));
+    connect(&dialog, SIGNAL(cancelled()), &loop, SLOT(quit()));
 
-    auto model = ModelById::get(layer->getExportModel(nullptr));
-    if (!model) {
-        error = tr("Internal error: unknown model");
-        return false;
+    // Check again, as the last load may have finished before we
+    // connected to its signal
+    if (m_document->isLoadingData()) {
+        loop.exec();
     }
 
-    auto nm = ModelById::getAs<NoteModel>(layer->getModel());
-        
-    if (!nm) {
-        error = tr("Can't export non-note layers to MIDI");
-    } else if (!selectionsToWrite) {
-        MIDIFileWriter writer(path, nm.get(), nm->getSampleRate());
-        writer.write();
-        if (!writer.isOK()) {
-            error = writer.getError();
-        }
-    } else {
-        NoteModel temporary(nm->getSampleRate(),
-                            nm->getResolution(),
-                            nm->getValueMinimum(),
-                            nm->getValueMaximum(),
-                            false);
-        temporary.setScaleUnits(nm->getScaleUnits());
-        for (const auto &s: selectionsToWrite->getSelections()) {
-            EventVector ev(nm->getEventsStartingWithin
-                           (s.getStartFrame(), s.getDuration()));
-            for (const auto &e: ev) {
-                temporary.add(e);
+    return !m_document->isLoadingData();
+}
+
+void
+MainWindowBase::sessionWriteFinished()
+{
+    // Called either through the writer's finished signal, or from
+    // waitForSessionSave if we wanted the result sooner; in the
+    // latter case the queued signal arrives to find nothing to do
+    if (!m_sessionWriter || !m_sessionWriter->isFinished()) return;
+
+    SessionWriter *writer = m_sessionWriter;
+    m_sessionWriter = nullptr;
+    
+    QString path = writer->getPath();
+    bool ok = writer->isOK();
+    QString error = writer->getError();
+    SessionStatistics::getInstance()->endOperation(writer->getOperation(), ok);
+    delete writer;
+
+    if (m_sessionWriterIsAutosave) {
+        if (ok) {
+            SVDEBUG << "MainWindowBase: Autosaved to \"" << path << "\""
+                    << endl;
+            if (m_pendingAutosaveLock) {
+                // The session has a new autosave name, for example
+                // because it has been given a file since the last one
+                removeAutosave();
+                m_autosaveLock = m_pendingAutosaveLock;
+                m_pendingAutosaveLock = nullptr;
             }
+            m_autosavedPath = path;
+        } else {
+            SVCERR << "WARNING: MainWindowBase: Autosave to \"" << path
+                   << "\" failed: " << error << endl;
+            delete m_pendingAutosaveLock;
+            m_pendingAutosaveLock = nullptr;
         }
-        MIDIFileWriter writer(path, &temporary, temporary.getSampleRate());
-        writer.write();
-        if (!writer.isOK()) {
-            error = writer.getError();
+        return;
+    }
+
+    if (ok) {
+        removeAutosave();
+    } else {
+        QMessageBox::critical(this, tr("Failed to write file"),
+                              tr("<b>Save failed</b><p>Failed to write to file \"%1\": %2")
+                              .arg(path).arg(error));
+    }
+
+    emit sessionSaved(path, ok);
+}
+
+void
+MainWindowBase::setAutosaveInterval(int seconds)
+{
+    if (seconds > 0) {
+        m_autosaveTimer->start(seconds * 1000);
+    } else {
+        m_autosaveTimer->stop();
+    }
+}
+
+QString
+MainWindowBase::getAutosaveDirectory()
+{
+    return QStandardPaths::writableLocation
+        (QStandardPaths::AppDataLocation) + "/autosave";
+}
+
+QString
+MainWindowBase::getAutosavePath() const
+{
+    QString name;
+    if (m_sessionFile != "") {
+        QByteArray hash = QCryptographicHash::hash
+            (QFileInfo(m_sessionFile).absoluteFilePath().toUtf8(),
+             QCryptographicHash::Sha1).toHex();
+        name = QString("%1-%2")
+            .arg(QFileInfo(m_sessionFile).completeBaseName())
+            .arg(QString::fromLatin1(hash.left(12)));
+    } else {
+        name = m_untitledSessionName;
+    }
+    return QString("%1/autosave-%2.sv").arg(getAutosaveDirectory()).arg(name);
+}
+
+void
+MainWindowBase::removeAutosave()
+{
+    if (m_autosavedPath != "") {
+        QFile::remove(m_autosavedPath);
+        m_autosavedPath = "";
+    }
+    delete m_autosaveLock;
+    m_autosaveLock = nullptr;
+}
+
+void
+MainWindowBase::autosave()
+{
+    // Only the models that have changed since the last save or
+    // autosave are serialised again, so this is cheap for a large
+    // session with small edits
+    if (!m_documentModified || !getMainModel() || isSavingSession() ||
+        m_document->isLoadingData()) {
+        return;
+    }
+
+    QString path = getAutosavePath();
+    if (!QDir().mkpath(QFileInfo(path).absolutePath())) {
+        SVCERR << "WARNING: MainWindowBase::autosave: Failed to create directory for \"" << path << "\"" << endl;
+        return;
+    }
+
+    if (path != m_autosavedPath) {
+        // Claim the new name before writing to it; if another
+        // instance has the same session open and is autosaving it,
+        // leave that one's autosave alone
+        QLockFile *lock = new QLockFile(path + ".lock");
+        if (!lock->tryLock(0)) {
+            SVCERR << "WARNING: MainWindowBase::autosave: Autosave file \""
+                   << path << "\" is in use by another instance, not autosaving"
+                   << endl;
+            delete lock;
+            return;
         }
+        delete m_pendingAutosaveLock;
+        m_pendingAutosaveLock = lock;
     }
-    
-    return (error == "");
+
+    startSessionWriter(path, true);
 }
 
-bool
-MainWindowBase::exportLayerToRDF(Layer *layer, 
-                                 QString path, QString &error)
+void
+MainWindowBase::offerAutosaveRecovery()
 {
-    if (QFileInfo(path).suffix() == "") path += ".ttl";
+    QDir dir(getAutosaveDirectory());
+    if (!dir.exists()) return;
 
-    QString suffix = QFileInfo(path).suffix().toLower();
+    // An autosave whose lock can be taken was left by an instance
+    // that has gone without removing it
 
-    auto model = ModelById::get(layer->getExportModel(nullptr));
-    if (!model) {
-        error = tr("Internal error: unknown model");
-        return false;
+    struct Orphan {
+        QString path;
+        QDateTime modified;
+    };
+    std::vector<Orphan> orphans;
+    
+    for (QFileInfo info: dir.entryInfoList({ "autosave-*.sv" }, QDir::Files,
+                                           QDir::Time)) {
+        QString path = info.absoluteFilePath();
+        if (path == m_autosavedPath) continue;
+        QLockFile lock(path + ".lock");
+        if (!lock.tryLock(0)) continue;
+        lock.unlock();
+        orphans.push_back({ path, info.lastModified() });
     }
+
+    if (orphans.empty()) return;
+
+    SVDEBUG << "MainWindowBase::offerAutosaveRecovery: Found "
+            << orphans.size() << " autosave(s) from earlier sessions" << endl;
     
-    if (!RDFExporter::canExportModel(model.get())) {
-        error = tr("Sorry, cannot export this layer type to RDF (supported types are: region, note, text, time instants, time values)");
-    } else {
-        RDFExporter exporter(path, model.get());
-        exporter.write();
-        if (!exporter.isOK()) {
-            error = exporter.getError();
+    emit hideSplash();
+    
+    // Newest first
+    const Orphan &latest = orphans[0];
+    
+    QMessageBox::StandardButton button = QMessageBox::question
+        (this,
+         tr("Recover autosaved session?"),
+         tr("<b>Recover autosaved session?</b><p>A session autosaved at %1 was not saved before %2 last closed.<p>Do you want to recover it now? If you choose not to recover it, %3 autosaved session(s) from earlier will be discarded. Cancel to leave them for next time.")
+         .arg(latest.modified.toString())
+         .arg(QApplication::applicationName())
+         .arg(orphans.size()),
+         QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel,
+         QMessageBox::Yes);
+
+    if (button == QMessageBox::Cancel) {
+        return;
+    }
+
+    if (button == QMessageBox::Yes) {
+
+        if (openSessionPath(latest.path) != FileOpenSucceeded) {
+            QMessageBox::critical
+                (this, tr("Failed to recover session"),
+                 tr("<b>Recovery failed</b><p>The autosaved session could not be opened. It has been left in \"%1\".")
+                 .arg(latest.path));
+            return;
+        }
+
+        // The recovered session has yet to be saved anywhere by the
+        // user, and should not be saved back over the autosave
+        m_sessionFile = "";
+        m_documentModified = true;
+        updateWindowTitle();
+        updateMenuStates();
+
+        // Keep the recovered file until this session next autosaves
+        // or saves, in case we go the same way
+        m_autosavedPath = latest.path;
+        m_autosaveLock = new QLockFile(latest.path + ".lock");
+        if (!m_autosaveLock->tryLock(0)) {
+            delete m_autosaveLock;
+            m_autosaveLock = nullptr;
+            m_autosavedPath = "";
         }
     }
 
-    return (error == "");
+    for (const Orphan &orphan: orphans) {
+        if (orphan.path == m_autosavedPath) continue;
+        SVDEBUG << "MainWindowBase::offerAutosaveRecovery: Discarding \""
+                << orphan.path << "\"" << endl;
+        QFile::remove(orphan.path);
+    }
 }
 
 bool
-MainWindowBase::exportLayerToCSV(Layer *layer, LayerGeometryProvider *provider,
-                                 MultiSelection *selectionsToWrite,
-                                 QString delimiter,
-                                 DataExportOptions options,
-                                 QString path, QString &error)
+MainWindowBase::saveSessionTemplate(QString path)
 {
-    if (QFileInfo(path).suffix() == "") path += ".csv";
+    if (!waitForDocumentData()) {
+        return false;
+    }
+    
+    try {
 
-    QString suffix = QFileInfo(path).suffix().toLower();
+        TempWriteFile temp(path);
+
+        QFile file(temp.getTemporaryFilename());
+        if (!file.open(QIODevice::WriteOnly)) {
+            cerr << "Failed to open session template file \""
+                      << temp.getTemporaryFilename()
+                      << "\" for writing: "
+                      << file.errorString() << endl;
+            return false;
+        }
+        
+        QApplication::setOverrideCursor(QCursor(Qt::WaitCursor));
+
+        QTextStream out(&file);
+        out.setCodec(QTextCodec::codecForName("UTF-8"));
+        toXml(out, true);
+        out.flush();
+
+        QApplication::restoreOverrideCursor();
+
+        file.close();
+        temp.moveToTarget();
+        return true;
 
-    auto model = ModelById::get(layer->getExportModel(provider));
-    if (!model) {
-        error = tr("Internal error: unknown model");
+    } catch (FileOperationFailed &f) {
+        
+        QMessageBox::critical(this, tr("Failed to write file"),
+                              tr("<b>Save failed</b><p>Failed to write to file \"%1\": %2")
+                              .arg(path).arg(f.what()));
         return false;
     }
+}
 
+// The export logic itself is in LayerExporter, which can also be used
+// without a main window. Here it is run on a worker thread through
+// LayerExportTask, so that the window stays responsive and the export
+// can be cancelled
+
+bool
+MainWindowBase::runLayerExport(LayerExportTask &task, QString &error)
+{
     ProgressDialog dialog {
         QObject::tr("Exporting layer..."), true, 500, this,
         Qt::ApplicationModal
     };
-            
-    CSVFileWriter writer(path, model.get(), &dialog, delimiter, options);
 
-    if (selectionsToWrite) {
-        writer.writeSelection(*selectionsToWrite);
-    } else {
-        writer.write();
-    }
+    connect(&task, SIGNAL(progress(int)), &dialog, SLOT(setProgress(int)));
+    connect(&dialog, SIGNAL(cancelled()), &task, SLOT(cancel()));
 
-    if (!writer.isOK()) {
-        error = writer.getError();
-        if (error == "") {
-            error = tr("Failed to export layer for an unknown reason");
-        }
-    }
+    // The dialog is modal, so this accepts no input other than a
+    // click on its cancel button while the export runs
+    QEventLoop loop;
+    connect(&task, SIGNAL(finished(bool)), &loop, SLOT(quit()));
+    task.start();
+    loop.exec();
+
+    error = task.getError();
+    return task.isOK();
+}
+
+bool
+MainWindowBase::exportLayerToSVL(Layer *layer,
+                                 QString path, QString &error)
+{
+    LayerExportTask task(layer, nullptr, nullptr,
+                         LayerExportTask::SVLFormat, path);
+    return runLayerExport(task, error);
+}
+
+bool
+MainWindowBase::exportLayerToMIDI(Layer *layer,
+                                  MultiSelection *selectionsToWrite,
+                                  QString path, QString &error)
+{
+    LayerExportTask task(layer, nullptr, selectionsToWrite,
+                         LayerExportTask::MIDIFormat, path);
+    return runLayerExport(task, error);
+}
+
+bool
+MainWindowBase::exportLayerToRDF(Layer *layer, 
+                                 QString path, QString &error)
+{
+    LayerExportTask task(layer, nullptr, nullptr,
+                         LayerExportTask::RDFFormat, path);
+    return runLayerExport(task, error);
+}
 
-    return (error == "");
+bool
+MainWindowBase::exportLayerToCSV(Layer *layer, LayerGeometryProvider *provider,
+                                 MultiSelection *selectionsToWrite,
+                                 QString delimiter,
+                                 DataExportOptions options,
+                                 QString path, QString &error)
+{
+    LayerExportTask task(layer, provider, selectionsToWrite,
+                         LayerExportTask::CSVFormat, path);
+    task.setCSVFormat(delimiter, options);
+    return runLayerExport(task, error);
 }
 
 bool
@@ -3769,6 +4077,7 @@ MainWindowBase::stop()
     if (!m_playSource) return;
     
     m_playSource->stop();
+    m_playSource->setPrefetchFrame(m_viewManager->getPlaybackFrame());
 
     SVDEBUG << "MainWindowBase::stop: suspending" << endl;
     
@@ -3952,8 +4261,8 @@ MainWindowBase::connectLayerEditDialog(ModelDataTableDialog *dialog)
             dialog,
             SLOT(userScrolledToFrame(sv_frame_t)));
 
-    connect(m_viewManager,
-            SIGNAL(playbackFrameChanged(sv_frame_t)),
+    connect(this,
+            SIGNAL(playbackFrameDisplayed(sv_frame_t)),
             dialog,
             SLOT(playbackScrolledToFrame(sv_frame_t)));
 
@@ -4077,10 +4386,107 @@ MainWindowBase::nextLayer()
 void
 MainWindowBase::playbackFrameChanged(sv_frame_t frame)
 {
-    if (!(m_playSource && m_playSource->isPlaying()) || !getMainModel()) return;
+    if (m_playSource && !m_playSource->isPlaying()) {
+        // Have audio ready for when playback is started from here
+        m_playSource->setPrefetchFrame(frame);
+    }
+
+    // Everything else waits for the next display update, so that the
+    // view manager's notifications during playback cost us little
+    m_pendingPlaybackFrame = frame;
+    schedulePlayheadUpdate();
+}
+
+int
+MainWindowBase::getPlayheadUpdateInterval() const
+{
+    double rate = m_playheadUpdateRate;
+
+    if (rate <= 0.0) {
+        QScreen *screen = nullptr;
+        if (windowHandle()) screen = windowHandle()->screen();
+        if (!screen) screen = QGuiApplication::primaryScreen();
+        if (screen) rate = screen->refreshRate();
+        if (rate <= 0.0) rate = 60.0;
+    }
+
+    return std::max(1, int(round(1000.0 / rate)));
+}
+
+void
+MainWindowBase::schedulePlayheadUpdate()
+{
+    if (m_playheadTimer->isActive()) return;
+
+    // Act at once if we have been idle for a display interval, so
+    // that isolated changes are not delayed; otherwise wait until
+    // the interval is up
+    
+    qint64 interval = getPlayheadUpdateInterval();
+    qint64 since = (m_playheadClock.isValid() ?
+                    m_playheadClock.elapsed() : interval);
+
+    if (since >= interval) {
+        updatePlayheadDisplays();
+    } else {
+        m_playheadTimer->start(int(interval - since));
+    }
+}
+
+void
+MainWindowBase::updatePlayheadDisplays()
+{
+    m_playheadClock.start();
+
+    if (!m_pendingViewCentreFrames.empty()) {
+        // Take a copy, as a dialog may scroll a view in response
+        auto pending = m_pendingViewCentreFrames;
+        m_pendingViewCentreFrames.clear();
+        for (const auto &p: pending) {
+            // The view may have gone since; we only look it up
+            auto itr = m_viewDataDialogMap.find(p.first);
+            if (itr == m_viewDataDialogMap.end()) continue;
+            for (auto dialog: itr->second) {
+                if (dialog) dialog->userScrolledToFrame(p.second);
+            }
+        }
+    }
+
+    bool playing = (m_playSource && m_playSource->isPlaying());
+    
+    if (m_visibleRangePending) {
+        m_visibleRangePending = false;
+        Pane *p = nullptr;
+        if (!playing && getMainModel() &&
+            m_paneStack && (p = m_paneStack->getCurrentPane())) {
+            updateVisibleRangeDisplay(p);
+        }
+    }
+
+    sv_frame_t frame = m_pendingPlaybackFrame;
+    if (frame == m_displayedPlaybackFrame) return;
+    m_displayedPlaybackFrame = frame;
+
+    emit playbackFrameDisplayed(frame);
+    
+    if (!playing || !getMainModel()) return;
 
     updatePositionStatusDisplays();
 
+    // The status text changes more slowly than the playhead, and
+    // is the costliest thing to redraw, so it has a lower rate still
+    if (m_playStatusUpdateRate > 0.0 && m_playStatusClock.isValid() &&
+        m_playStatusClock.elapsed() < 1000.0 / m_playStatusUpdateRate) {
+        return;
+    }
+    m_playStatusClock.start();
+    
+    updatePlayStatusText(frame);
+}
+
+void
+MainWindowBase::updatePlayStatusText(sv_frame_t frame)
+{
     RealTime now = RealTime::frame2RealTime
         (frame, getMainModel()->getSampleRate());
 
@@ -4104,9 +4510,12 @@ MainWindowBase::playbackFrameChanged(sv_frame_t frame)
         remainingStr = (then - now).toText(true).c_str();
     }        
 
-    m_myStatusMessage = tr("Playing: %1 of %2 (%3 remaining)")
+    QString message = tr("Playing: %1 of %2 (%3 remaining)")
         .arg(nowStr).arg(thenStr).arg(remainingStr);
 
+    if (message == m_myStatusMessage) return;
+    m_myStatusMessage = message;
+
     getStatusLabel()->setText(m_myStatusMessage);
 }
 
@@ -4128,7 +4537,8 @@ MainWindowBase::globalCentreFrameChanged(sv_frame_t )
     Pane *p = nullptr;
     if (!m_paneStack || !(p = m_paneStack->getCurrentPane())) return;
     if (!p->getFollowGlobalPan()) return;
-    updateVisibleRangeDisplay(p);
+    m_visibleRangePending = true;
+    schedulePlayheadUpdate();
 }
 
 void
@@ -4137,15 +4547,16 @@ MainWindowBase::viewCentreFrameChanged(View *v, sv_frame_t frame)
 //    SVDEBUG << "MainWindowBase::viewCentreFrameChanged(" << v << "," << frame << ")" << endl;
 
     if (m_viewDataDialogMap.find(v) != m_viewDataDialogMap.end()) {
-        for (DataDialogSet::iterator i = m_viewDataDialogMap[v].begin();
-             i != m_viewDataDialogMap[v].end(); ++i) {
-            (*i)->userScrolledToFrame(frame);
-        }
+        m_pendingViewCentreFrames[v] = frame;
+        schedulePlayheadUpdate();
     }
     if ((m_playSource && m_playSource->isPlaying()) || !getMainModel()) return;
     Pane *p = nullptr;
     if (!m_paneStack || !(p = m_paneStack->getCurrentPane())) return;
-    if (v == p) updateVisibleRangeDisplay(p);
+    if (v == p) {
+        m_visibleRangePending = true;
+        schedulePlayheadUpdate();
+    }
 }
 
 void
@@ -4301,6 +4712,89 @@ MainWindowBase::alignmentComplete(ModelId alignmentModelId)
     cerr << "MainWindowBase::alignmentComplete(" << alignmentModelId << ")" << endl;
 }
 
+void
+MainWindowBase::sessionReportComplete(QString report)
+{
+    SVDEBUG << "MainWindowBase: Session report: " << report << endl;
+
+    // One JSON object per line, appended to the file named in the
+    // "session-report-file" setting (if any) in the MainWindow group
+    QSettings settings;
+    settings.beginGroup("MainWindow");
+    QString path = settings.value("session-report-file", "").toString();
+    settings.endGroup();
+    if (path == "") return;
+
+    QFile file(path);
+    if (!file.open(QFile::WriteOnly | QFile::Append | QFile::Text)) {
+        SVCERR << "WARNING: MainWindowBase: Failed to open \"" << path
+               << "\" for writing session report" << endl;
+        return;
+    }
+    QTextStream out(&file);
+    out << report << "\n";
+}
+
+bool
+MainWindowBase::handleFrameworkOSCMessage(const OSCMessage &message)
+{
+    if (message.getMethod() == "sessionstats") {
+        QString report = SessionStatistics::getInstance()->getLastReport();
+        if (message.getArgCount() == 0) {
+            SVCERR << "Session statistics:\n" << report << endl;
+            return true;
+        }
+        QString arg = message.getArg(0).toString();
+        QFile file(arg);
+        if (!file.open(QFile::WriteOnly | QFile::Text)) {
+            SVCERR << "MainWindowBase: Failed to open \"" << arg
+                   << "\" for writing session statistics" << endl;
+            return true;
+        }
+        QTextStream out(&file);
+        out << report << "\n";
+        return true;
+    }
+    
+    if (message.getMethod() != "playbackstats") {
+        return false;
+    }
+
+    if (!m_playSource) {
+        SVCERR << "MainWindowBase: No play source for playbackstats" << endl;
+        return true;
+    }
+    
+    QString arg;
+    if (message.getArgCount() > 0) {
+        arg = message.getArg(0).toString();
+    }
+
+    if (arg == "reset") {
+        m_playSource->resetPlaybackStatistics();
+        SVDEBUG << "MainWindowBase: Playback statistics reset" << endl;
+        return true;
+    }
+
+    QString report = PlaybackStatistics::formatReport
+        (m_playSource->getPlaybackStatistics());
+
+    if (arg == "") {
+        SVCERR << "Playback statistics:\n" << report;
+        return true;
+    }
+
+    QFile file(arg);
+    if (!file.open(QFile::WriteOnly | QFile::Text)) {
+        SVCERR << "MainWindowBase: Failed to open \"" << arg
+               << "\" for writing playback statistics" << endl;
+        return true;
+    }
+    QTextStream out(&file);
+    out << report;
+    return true;
+}
+
 void
 MainWindowBase::pollOSC()
 {
@@ -4322,6 +4816,7 @@ MainWindowBase::pollOSC()
                     << "waiting for audio to finish loading"
                     << endl;
             m_handlingOSC = false;
+            retryOSCLater();
             return;
         }
 
@@ -4330,6 +4825,7 @@ MainWindowBase::pollOSC()
                     << "waiting for running transforms to complete"
                     << endl;
             m_handlingOSC = false;
+            retryOSCLater();
             return;
         }
 
@@ -4346,7 +4842,15 @@ MainWindowBase::pollOSC()
             continue;
         }
 
-        handleOSCMessage(message);
+        double handlingStarted = OSCScript::now();
+
+        if (!handleFrameworkOSCMessage(message)) {
+            handleOSCMessage(message);
+        }
+
+        if (m_oscScript) {
+            m_oscScript->messageHandled(message, handlingStarted);
+        }
 
         disconnect(m_oscQueue, SIGNAL(messagesAvailable()),
                    this, SLOT(pollOSC()));
@@ -4361,6 +4865,16 @@ MainWindowBase::pollOSC()
             this, SLOT(pollOSC()));
 }
 
+void
+MainWindowBase::retryOSCLater()
+{
+    // Every message arriving while we wait calls pollOSC again, so
+    // share a single retry rather than starting one per deferral
+    if (m_oscRetryTimer && !m_oscRetryTimer->isActive()) {
+        m_oscRetryTimer->start();
+    }
+}
+
 void
 MainWindowBase::inProgressSelectionChanged()
 {
@@ -22,6 +22,8 @@
 #include <QMainWindow>
 #include <QPointer>
 #include <QThread>
+#include <QByteArray>
+#include <QElapsedTimer>
 
 #include "base/Command.h"
 #include "view/ViewManager.h"
@@ -39,6 +41,7 @@
 #include "data/model/Model.h"
 
 #include <map>
+#include <vector>
 
 class Document;
 class PaneStack;
@@ -72,6 +75,9 @@ class QSignalMapper;
 class QShortcut;
 class AlignmentModel;
 class LayerGeometryProvider;
+class QTimer;
+class QLockFile;
+class LayerExportTask;
 
 namespace breakfastquay {
     class SystemPlaybackTarget;
@@ -157,6 +163,18 @@ public:
     virtual FileOpenStatus openImage(FileSource source);
 
     virtual FileOpenStatus openDirOfAudio(QString dirPath);
+
+    /**
+     * Open a series of audio files. The first that can be opened is
+     * opened using the given mode, as by openAudio, and becomes the
+     * reference for the rest. The rest are then added to the session
+     * as additional models, in order. If alignment is enabled, they
+     * are aligned together once all have been added, rather than one
+     * at a time as each is opened. Used by openDirOfAudio and
+     * openPlaylist.
+     */
+    virtual FileOpenStatus openMultipleAudio(std::vector<FileSource> sources,
+                                             AudioFileOpenMode mode);
     
     virtual FileOpenStatus openSession(FileSource source);
     virtual FileOpenStatus openSessionPath(QString fileOrUrl);
@@ -166,6 +184,56 @@ public:
     virtual bool saveSessionFile(QString path);
     virtual bool saveSessionTemplate(QString path);
 
+    /**
+     * Save the session to the given path as saveSessionFile does,
+     * but return as soon as the session has been captured, leaving
+     * the compression and writing to a background thread. The
+     * session is captured in full before this returns, so later
+     * changes do not affect what is saved. Models left unchanged
+     * since the last save are not serialised again. Emit
+     * sessionSaved when the file is complete or writing has
+     * failed. Return false if the save could not be started.
+     */
+    virtual bool saveSessionFileInBackground(QString path);
+
+    /**
+     * Return true if a background save or autosave is in progress,
+     * or a background save is waiting for the document's models to
+     * finish loading before it can start.
+     */
+    bool isSavingSession() const;
+
+    /**
+     * Wait for any background save or autosave to finish. If a save
+     * is waiting for the document to finish loading, events are
+     * processed while it does so.
+     */
+    void waitForSessionSave();
+
+    /**
+     * Autosave the session, if it has been modified, in the
+     * background every interval seconds. Zero disables autosave. The
+     * initial interval is taken from the "autosave-interval" setting
+     * in the MainWindow settings group, and is zero by default.
+     */
+    void setAutosaveInterval(int seconds);
+
+    /**
+     * Return the path that autosaves of the current session are
+     * written to. The name is stable for the session: it is derived
+     * from the session file path if the session has one, so that a
+     * later run autosaves the same session to the same file, or
+     * otherwise from the time the session was created. The file is
+     * removed when the session is next saved, or on a normal exit.
+     */
+    QString getAutosavePath() const;
+
+    /**
+     * Export a layer to a file. The export runs on a worker thread,
+     * with a modal progress dialog from which it can be cancelled;
+     * these functions return once it has finished. To export without
+     * waiting, use a LayerExportTask directly.
+     */
     virtual bool exportLayerToSVL(Layer *layer,
                                   QString toPath, QString &error);
 
@@ -251,6 +319,15 @@ signals:
     void audioFileLoaded();
     void replacedDocument();
     void activity(QString);
+    void sessionSaved(QString path, bool succeeded);
+
+    /**
+     * Emitted with the latest playback frame at no more than the
+     * playhead display rate, in place of the view manager's own
+     * playbackFrameChanged, for displays that need not follow every
+     * change.
+     */
+    void playbackFrameDisplayed(sv_frame_t);
 
 public slots:
     virtual void preferenceChanged(PropertyContainer::PropertyName);
@@ -314,6 +391,7 @@ protected slots:
     virtual void viewZoomLevelChanged(View *, ZoomLevel, bool);
     virtual void monitoringLevelsChanged(float, float) = 0;
     virtual void recordDurationChanged(sv_frame_t, sv_samplerate_t);
+    virtual void updatePlayheadDisplays();
 
     virtual void currentPaneChanged(Pane *);
     virtual void currentLayerChanged(Pane *, Layer *);
@@ -343,6 +421,20 @@ protected slots:
     virtual void documentModified();
     virtual void documentRestored();
 
+    virtual void autosave();
+    virtual void sessionWriteFinished();
+    virtual void startDeferredSave();
+
+    /**
+     * Look for autosaved sessions left behind by an instance that
+     * did not exit normally, and offer to recover the most recent
+     * one, or to discard them. Autosaves belonging to an instance
+     * that is still running are left alone. This is called once the
+     * event loop has started after construction.
+     */
+    virtual void offerAutosaveRecovery();
+    virtual void sessionReportComplete(QString report);
+
     virtual void layerAdded(Layer *);
     virtual void layerRemoved(Layer *);
     virtual void layerAboutToBeDeleted(Layer *);
@@ -436,12 +528,27 @@ protected:
 
     OSCQueue                *m_oscQueue;
     OSCQueueStarter         *m_oscQueueStarter;
+    QTimer                  *m_oscRetryTimer; // single-shot, for deferred messages
     OSCScript               *m_oscScript;
     QString                  m_oscScriptFile;
 
     void startOSCQueue(bool withNetworkPort);
+    void retryOSCLater();
     void startOSCScript();
 
+    /**
+     * Handle an OSC message that is answered by this class rather
+     * than passed to handleOSCMessage. Return true if handled.
+     *
+     * /playbackstats [<filename>] writes the playback statistics
+     * report to the given file, or to the log if no file is given.
+     * /playbackstats reset clears the statistics.
+     *
+     * /sessionstats [<filename>] writes the report from the last
+     * session open or save to the given file, or to the log.
+     */
+    bool handleFrameworkOSCMessage(const OSCMessage &message);
+
     MIDIInput               *m_midiInput;
 
     RecentFiles              m_recentFiles;
@@ -456,6 +563,22 @@ protected:
     int                      m_lastPlayStatusSec;
     mutable QString          m_myStatusMessage;
 
+    // Playhead and scroll notifications are coalesced, and acted on
+    // by updatePlayheadDisplays at no more than the display rate
+    QTimer                  *m_playheadTimer;
+    QElapsedTimer            m_playheadClock;   // since the last update
+    QElapsedTimer            m_playStatusClock; // since the last status text
+    double                   m_playheadUpdateRate; // Hz, 0 for screen rate
+    double                   m_playStatusUpdateRate; // Hz
+    sv_frame_t               m_pendingPlaybackFrame;
+    sv_frame_t               m_displayedPlaybackFrame;
+    bool                     m_visibleRangePending;
+    std::map<View *, sv_frame_t> m_pendingViewCentreFrames;
+
+    void schedulePlayheadUpdate();
+    int getPlayheadUpdateInterval() const;
+    void updatePlayStatusText(sv_frame_t frame);
+
     bool                     m_initialDarkBackground;
 
     RealTime                 m_defaultFfwdRwdStep;
@@ -575,6 +698,41 @@ protected:
     QSignalMapper *m_menuShortcutMapper;
     QList<QShortcut *> m_appShortcuts;
 
+    sv_samplerate_t getRateForOpenedAudio(AudioFileOpenMode mode);
+
+    bool runLayerExport(LayerExportTask &task, QString &error);
+
+    class PlaySourceCache;
+    PlaySourceCache *m_playSourceCache; // play source's loop cache, as
+                                        // registered with the document
+
+    class SessionWriter;
+    SessionWriter *m_sessionWriter; // background save in progress, if any
+    bool m_sessionWriterIsAutosave;
+    QTimer *m_autosaveTimer;
+
+    // Set in createDocument, to name autosaves of a session that has
+    // no file yet
+    QString m_untitledSessionName;
+
+    // The autosave file last written, and a lock file held next to
+    // it to show that it belongs to a running instance. The pending
+    // lock is for an autosave in progress to a different path, and
+    // replaces the other once that autosave has succeeded
+    QString m_autosavedPath;
+    QLockFile *m_autosaveLock;
+    QLockFile *m_pendingAutosaveLock;
+
+    // Path of a background save waiting for the document to finish
+    // loading, if any
+    QString m_deferredSavePath;
+
+    QByteArray makeSessionSnapshot(bool asTemplate);
+    bool startSessionWriter(QString path, bool isAutosave);
+    bool waitForDocumentData();
+    void removeAutosave();
+    static QString getAutosaveDirectory();
+
     virtual bool shouldCreateNewSessionForRDFAudio(bool *) { return true; }
 
     virtual void connectLayerEditDialog(ModelDataTableDialog *dialog);
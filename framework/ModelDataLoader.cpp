@@ -0,0 +1,239 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ModelDataLoader.h"
+
+#include "base/Debug.h"
+
+#include "data/model/EventCommands.h"
+#include "data/model/SparseOneDimensionalModel.h"
+#include "data/model/SparseTimeValueModel.h"
+#include "data/model/NoteModel.h"
+#include "data/model/RegionModel.h"
+#include "data/model/TextModel.h"
+#include "data/model/ImageModel.h"
+#include "data/model/BoxModel.h"
+#include "data/model/EditableDenseThreeDimensionalModel.h"
+
+#include <algorithm>
+
+//#define DEBUG_MODEL_DATA_LOADER 1
+
+// Items added to a model between checks for exiting and updates of
+// its completion
+static const size_t batchSize = 10000;
+
+ModelDataLoader::ModelDataLoader() :
+    m_exiting(false),
+    m_thread(nullptr)
+{
+    m_thread = new LoaderThread(*this);
+    m_thread->start();
+}
+
+ModelDataLoader::~ModelDataLoader()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_jobs.empty()) {
+            SVDEBUG << "ModelDataLoader: Abandoning " << m_jobs.size()
+                    << " load(s) still queued or in progress" << endl;
+        }
+        m_exiting = true;
+        m_condition.wakeAll();
+    }
+
+    m_thread->wait();
+    delete m_thread;
+}
+
+void
+ModelDataLoader::addEvents(ModelId model, EventVector events)
+{
+    if (events.empty()) return;
+    Job job;
+    job.model = model;
+    job.events = std::move(events);
+    job.done = 0;
+    enqueue(std::move(job));
+}
+
+void
+ModelDataLoader::addColumns(ModelId model, ColumnVector columns)
+{
+    if (columns.empty()) return;
+    Job job;
+    job.model = model;
+    job.columns = std::move(columns);
+    job.done = 0;
+    enqueue(std::move(job));
+}
+
+void
+ModelDataLoader::enqueue(Job job)
+{
+#ifdef DEBUG_MODEL_DATA_LOADER
+    SVDEBUG << "ModelDataLoader::enqueue: " << job.getSize()
+            << " item(s) for model " << job.model << endl;
+#endif
+
+    // Mark the model as incomplete straight away, so that anything
+    // looking at it before the loader thread gets to it knows to wait
+    setCompletion(job.model, 0);
+
+    QMutexLocker locker(&m_mutex);
+    m_jobs.push_back(std::move(job));
+    m_condition.wakeAll();
+}
+
+bool
+ModelDataLoader::isLoading() const
+{
+    QMutexLocker locker(&m_mutex);
+    return !m_jobs.empty();
+}
+
+bool
+ModelDataLoader::isLoading(ModelId model) const
+{
+    QMutexLocker locker(&m_mutex);
+    for (const auto &job: m_jobs) {
+        if (job.model == model) return true;
+    }
+    return false;
+}
+
+void
+ModelDataLoader::waitForAll() const
+{
+    QMutexLocker locker(&m_mutex);
+    while (!m_jobs.empty() && !m_exiting) {
+        m_condition.wait(&m_mutex);
+    }
+}
+
+void
+ModelDataLoader::runJobs()
+{
+    QMutexLocker locker(&m_mutex);
+
+    while (!m_exiting) {
+
+        if (m_jobs.empty()) {
+            m_condition.wait(&m_mutex);
+            continue;
+        }
+
+        // Only this thread removes jobs, and adding to the end of a
+        // deque leaves references to existing elements valid, so the
+        // job can be worked on without holding the mutex
+        Job &job = m_jobs.front();
+
+        locker.unlock();
+        bool more = processBatch(job);
+        locker.relock();
+
+        if (!more) {
+            ModelId model = job.model;
+            m_jobs.pop_front();
+            bool all = m_jobs.empty();
+            m_condition.wakeAll();
+            locker.unlock();
+            emit loadComplete(model);
+            if (all) {
+                emit allLoadsComplete();
+            }
+            locker.relock();
+        }
+    }
+}
+
+bool
+ModelDataLoader::processBatch(Job &job)
+{
+    // Hold on to the model for the duration of the batch, but no
+    // longer, so that it can still be released while loading
+    auto model = ModelById::get(job.model);
+    if (!model) {
+#ifdef DEBUG_MODEL_DATA_LOADER
+        SVDEBUG << "ModelDataLoader: Model " << job.model
+                << " has gone away, abandoning its load" << endl;
+#endif
+        return false;
+    }
+
+    size_t total = job.getSize();
+    size_t end = std::min(total, job.done + batchSize);
+
+    if (!job.events.empty()) {
+        auto editable = std::dynamic_pointer_cast<EventEditable>(model);
+        if (!editable) {
+            SVCERR << "WARNING: ModelDataLoader: Model " << job.model
+                   << " cannot take events" << endl;
+            return false;
+        }
+        for (; job.done < end; ++job.done) {
+            editable->add(job.events[job.done]);
+        }
+    } else {
+        auto dtdm = std::dynamic_pointer_cast
+            <EditableDenseThreeDimensionalModel>(model);
+        if (!dtdm) {
+            SVCERR << "WARNING: ModelDataLoader: Model " << job.model
+                   << " cannot take columns" << endl;
+            return false;
+        }
+        for (; job.done < end; ++job.done) {
+            const auto &column = job.columns[job.done];
+            dtdm->setColumn(column.first, column.second);
+        }
+    }
+
+    if (job.done < total) {
+        int completion = int((job.done * 100) / total);
+        setCompletion(job.model, std::max(1, std::min(99, completion)));
+        return true;
+    }
+
+    setCompletion(job.model, 100);
+    return false;
+}
+
+namespace {
+template <typename T>
+bool
+setCompletionAs(ModelId model, int completion)
+{
+    if (auto m = ModelById::getAs<T>(model)) {
+        m->setCompletion(completion);
+        return true;
+    }
+    return false;
+}
+}
+
+void
+ModelDataLoader::setCompletion(ModelId model, int completion)
+{
+    // There is no common base class with a setCompletion method
+    (void)(setCompletionAs<SparseTimeValueModel>(model, completion) ||
+           setCompletionAs<NoteModel>(model, completion) ||
+           setCompletionAs<RegionModel>(model, completion) ||
+           setCompletionAs<SparseOneDimensionalModel>(model, completion) ||
+           setCompletionAs<TextModel>(model, completion) ||
+           setCompletionAs<BoxModel>(model, completion) ||
+           setCompletionAs<ImageModel>(model, completion) ||
+           setCompletionAs<EditableDenseThreeDimensionalModel>
+           (model, completion));
+}
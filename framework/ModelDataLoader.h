@@ -0,0 +1,138 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_MODEL_DATA_LOADER_H
+#define SV_MODEL_DATA_LOADER_H
+
+#include "base/Event.h"
+#include "base/Thread.h"
+#include "data/model/Model.h"
+#include "data/model/DenseThreeDimensionalModel.h"
+
+#include <QObject>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <deque>
+#include <utility>
+#include <vector>
+
+/**
+ * Fill models with data that has already been read, for example from
+ * a session file, on a background thread. This lets the reader finish
+ * building the document (its views, layers and empty models) without
+ * waiting for every point of a large dataset to be added.
+ *
+ * Each model's completion is held below 100 while its data is still
+ * to be added, so views show it as loading in the same way as a model
+ * that is being generated by a transform. Models are referred to by
+ * id throughout, so a model that is released while loading is simply
+ * abandoned.
+ */
+class ModelDataLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    typedef std::vector<std::pair<int, DenseThreeDimensionalModel::Column>>
+        ColumnVector;
+
+    ModelDataLoader();
+
+    /**
+     * Abandon any loads still queued or in progress and stop the
+     * loader thread.
+     */
+    virtual ~ModelDataLoader();
+
+    /**
+     * Queue the given events to be added to the given model, which
+     * must be editable with an event-based type such as
+     * SparseTimeValueModel or NoteModel.
+     */
+    void addEvents(ModelId model, EventVector events);
+
+    /**
+     * Queue the given columns, indexed by column number, to be set on
+     * the given EditableDenseThreeDimensionalModel.
+     */
+    void addColumns(ModelId model, ColumnVector columns);
+
+    /**
+     * Return true if any loads are queued or in progress.
+     */
+    bool isLoading() const;
+
+    /**
+     * Return true if a load is queued or in progress for the given
+     * model.
+     */
+    bool isLoading(ModelId model) const;
+
+    /**
+     * Wait until all queued loads have completed. This blocks the
+     * calling thread; callers on the GUI thread should instead check
+     * isLoading() and wait for allLoadsComplete.
+     */
+    void waitForAll() const;
+
+signals:
+    /**
+     * Emitted, from the loader thread, when all the data queued for
+     * a model has been added to it.
+     */
+    void loadComplete(ModelId model);
+
+    /**
+     * Emitted, from the loader thread, when the last queued load has
+     * completed and nothing remains to be loaded.
+     */
+    void allLoadsComplete();
+
+private:
+    struct Job {
+        ModelId model;
+        EventVector events;
+        ColumnVector columns;
+        size_t done;
+        size_t getSize() const { return events.size() + columns.size(); }
+    };
+
+    class LoaderThread : public Thread
+    {
+    public:
+        LoaderThread(ModelDataLoader &loader) :
+            Thread(Thread::NonRTThread), m_loader(loader) { }
+        void run() override { m_loader.runJobs(); }
+    private:
+        ModelDataLoader &m_loader;
+    };
+
+    mutable QMutex m_mutex;
+    mutable QWaitCondition m_condition;
+    std::deque<Job> m_jobs; // the first is the one in progress, if any
+    std::atomic<bool> m_exiting;
+    LoaderThread *m_thread;
+
+    void enqueue(Job job);
+    void runJobs();
+    bool processBatch(Job &job);
+    static void setCompletion(ModelId model, int completion);
+
+    ModelDataLoader(const ModelDataLoader &) =delete;
+    ModelDataLoader &operator=(const ModelDataLoader &) =delete;
+};
+
+#endif
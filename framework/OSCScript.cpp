@@ -0,0 +1,351 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "OSCScript.h"
+
+#include "base/Debug.h"
+#include "base/StringBits.h"
+
+#include <QFile>
+#include <QMutexLocker>
+#include <QStringList>
+#include <QTextStream>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+
+// Longest single sleep while waiting for a scheduled time, so that an
+// abandoned script notices promptly
+static const double maxSleep = 0.1; // sec
+
+// Most messages remembered as posted but not yet reported handled
+static const size_t maxUnhandled = 100000;
+
+// How long to wait at the end of the script for the last messages to
+// be handled, if the receiver is reporting handled messages at all
+static const double finalDeliveryTimeout = 60.0; // sec
+
+OSCScript::OSCScript(QString filename, OSCQueue *queue) :
+    m_filename(filename),
+    m_queue(queue),
+    m_abandoning(false),
+    m_scheduled(false),
+    m_verbose(true),
+    m_receiverReports(false),
+    m_postedCount(0)
+{
+}
+
+double
+OSCScript::now()
+{
+    return std::chrono::duration<double>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void
+OSCScript::run()
+{
+    if (!m_queue) {
+        SVCERR << "OSCScript: No OSC queue available" << endl;
+        throw std::runtime_error("OSC queue not running");
+    }
+
+    QFile f;
+    QString reportedFilename;
+
+    if (m_filename == "-") {
+        f.open(stdin, QFile::ReadOnly | QFile::Text);
+        reportedFilename = "<stdin>";
+    } else {
+        f.setFileName(m_filename);
+        if (!f.open(QFile::ReadOnly | QFile::Text)) {
+            SVCERR << "OSCScript: Failed to open script file \""
+                   << m_filename << "\" for reading" << endl;
+            throw std::runtime_error("OSC script file not found");
+        }
+        reportedFilename = m_filename;
+    }
+        
+    QTextStream str(&f);
+    int lineno = 0;
+
+    double start = now();
+    double due = start; // when the next message is to be posted
+
+    bool inBundle = false;
+    std::vector<OSCMessage> bundle;
+    QString bundleWhere;
+    
+    while (!str.atEnd() && !m_abandoning) {
+
+        ++lineno;
+
+        QString line = str.readLine().trimmed();
+        if (line == QString()) continue;
+
+        QString where = QString("%1:%2").arg(reportedFilename).arg(lineno);
+
+        if (line.startsWith("#!")) {
+            QStringList parts = StringBits::splitQuoted(line.mid(2), ' ');
+            QString directive = (parts.empty() ? QString() : parts[0]);
+            if (directive == "scheduled") {
+                m_scheduled = true;
+            } else if (directive == "quiet") {
+                m_verbose = false;
+            } else if (directive == "report" && parts.size() > 1) {
+                m_reportFile = parts[1];
+            } else {
+                SVCERR << "OSCScript: " << where
+                       << ": warning: unknown directive, ignoring" << endl;
+            }
+            continue;
+            
+        } else if (line[0] == '#') {
+            continue;
+
+        } else if (line[0].isDigit() || line[0] == '@') {
+
+            bool absolute = (line[0] == '@');
+            bool ok = false;
+            double t = (absolute ? line.mid(1) : line).toDouble(&ok);
+            if (!ok) {
+                SVCERR << "OSCScript: " << where
+                       << ": warning: failed to parse sleep time, ignoring"
+                       << endl;
+                continue;
+            }
+            if (inBundle) {
+                SVCERR << "OSCScript: " << where
+                       << ": warning: pause within bundle, ignoring" << endl;
+                continue;
+            }
+            
+            if (absolute) {
+                due = start + t;
+            } else if (m_scheduled) {
+                due = due + t;
+            } else {
+                due = now() + t;
+            }
+            
+            if (m_verbose) {
+                SVCERR << "OSCScript: " << where << ": pausing until "
+                       << due - start << " sec" << endl;
+            }
+            if (!waitUntil(due)) break;
+            continue;
+
+        } else if (line == "{") {
+            if (inBundle) {
+                SVCERR << "OSCScript: " << where
+                       << ": warning: bundle already started" << endl;
+            } else {
+                inBundle = true;
+                bundleWhere = where;
+            }
+
+        } else if (line == "}") {
+            if (!inBundle) {
+                SVCERR << "OSCScript: " << where
+                       << ": warning: no bundle to end, ignoring" << endl;
+            } else {
+                post(bundle, due, bundleWhere);
+                bundle.clear();
+                inBundle = false;
+            }
+
+        } else if (line[0] == '/' && line.size() > 1) {
+            QStringList parts = StringBits::splitQuoted(line, ' ');
+            if (parts.empty()) {
+                SVCERR << "OSCScript: " << where
+                       << ": warning: empty command spec, ignoring"
+                       << endl;
+                continue;
+            }
+            OSCMessage message;
+            message.setMethod(parts[0].mid(1));
+            for (int i = 1; i < parts.size(); ++i) {
+                message.addArg(parts[i]);
+            }
+            if (inBundle) {
+                bundle.push_back(message);
+            } else {
+                post({ message }, due, where);
+            }
+
+        } else {
+            SVCERR << "OSCScript: " << where
+                   << ": warning: message expected, ignoring" << endl;
+        }
+    }
+
+    if (inBundle && !m_abandoning) {
+        SVCERR << "OSCScript: " << bundleWhere
+               << ": warning: bundle not ended, posting it anyway" << endl;
+        post(bundle, due, bundleWhere);
+    }
+
+    // Give the receiver a chance to handle what we have posted, so
+    // that their latencies can be included in the report
+    double deadline = now() + finalDeliveryTimeout;
+    while (!m_abandoning && now() < deadline) {
+        {
+            QMutexLocker locker(&m_mutex);
+            if (!m_receiverReports || m_unhandled.empty()) break;
+        }
+        msleep(10);
+    }
+
+    QString report = getTimingReport();
+    
+    SVCERR << "OSCScript: " << reportedFilename << ": finished after "
+           << now() - start << " sec\n" << report;
+
+    if (m_reportFile != "") {
+        QFile rf(m_reportFile);
+        if (!rf.open(QFile::WriteOnly | QFile::Text)) {
+            SVCERR << "OSCScript: Failed to open \"" << m_reportFile
+                   << "\" for writing timing report" << endl;
+        } else {
+            QTextStream out(&rf);
+            out << report;
+        }
+    }
+}
+
+bool
+OSCScript::waitUntil(double t)
+{
+    while (!m_abandoning) {
+        double remaining = t - now();
+        if (remaining <= 0.0) return true;
+        usleep((unsigned long)(std::min(remaining, maxSleep) * 1.0e6));
+    }
+    return false;
+}
+
+void
+OSCScript::post(const std::vector<OSCMessage> &messages, double due,
+                QString where)
+{
+    for (const auto &message: messages) {
+
+        QString text = message.toString();
+        double t = now();
+        {
+            QMutexLocker locker(&m_mutex);
+            long sequence = m_postedCount++;
+            m_lateness.add(std::max(0.0, t - due));
+            m_unhandled[sequence] = { text, t };
+            m_unhandledByText[text].push_back(sequence);
+            if (m_unhandled.size() > maxUnhandled) {
+                // The oldest unhandled message is also the first of
+                // those with its text
+                auto oldest = m_unhandled.begin();
+                auto itr = m_unhandledByText.find(oldest->second.text);
+                if (itr != m_unhandledByText.end()) {
+                    itr->pop_front();
+                    if (itr->empty()) m_unhandledByText.erase(itr);
+                }
+                m_unhandled.erase(oldest);
+            }
+        }
+        
+        m_queue->postMessage(message);
+
+        if (m_verbose) {
+            SVCERR << "OSCScript: " << where << ": posting " << text << endl;
+        }
+    }
+}
+
+void
+OSCScript::messageHandled(const OSCMessage &message, double handlingStarted)
+{
+    double t = now();
+    QString text = message.toString();
+
+    QMutexLocker locker(&m_mutex);
+    m_receiverReports = true;
+
+    auto itr = m_unhandledByText.find(text);
+    if (itr == m_unhandledByText.end()) {
+        return;
+    }
+
+    long sequence = itr->front();
+    itr->pop_front();
+    if (itr->empty()) m_unhandledByText.erase(itr);
+
+    auto pitr = m_unhandled.find(sequence);
+    if (pitr == m_unhandled.end()) {
+        return;
+    }
+    m_latency.add(std::max(0.0, handlingStarted - pitr->second.posted));
+    m_handling.add(t - handlingStarted);
+    m_unhandled.erase(pitr);
+}
+
+void
+OSCScript::Timing::add(double t)
+{
+    ++count;
+    total += t;
+    if (t > max) max = t;
+    samples.push_back(t);
+}
+
+QString
+OSCScript::Timing::format(QString name) const
+{
+    if (count == 0) {
+        return QString("%1: count 0\n").arg(name);
+    }
+    
+    std::vector<double> sorted(samples);
+    std::sort(sorted.begin(), sorted.end());
+    auto percentile = [&](double p) {
+        size_t i = size_t(std::floor(p * double(sorted.size() - 1)));
+        return sorted[i] * 1.0e3;
+    };
+
+    return QString("%1: count %2 mean %3ms median %4ms p95 %5ms "
+                   "p99 %6ms max %7ms\n")
+        .arg(name)
+        .arg(count)
+        .arg(total * 1.0e3 / double(count), 0, 'f', 3)
+        .arg(percentile(0.5), 0, 'f', 3)
+        .arg(percentile(0.95), 0, 'f', 3)
+        .arg(percentile(0.99), 0, 'f', 3)
+        .arg(max * 1.0e3, 0, 'f', 3);
+}
+
+QString
+OSCScript::getTimingReport() const
+{
+    QMutexLocker locker(&m_mutex);
+
+    QString report;
+    report += QString("messages-posted: %1\n").arg(m_postedCount);
+    report += m_lateness.format("post-lateness");
+    report += m_latency.format("delivery-latency");
+    report += m_handling.format("handling-time");
+    if (m_receiverReports) {
+        report += QString("unhandled: %1\n").arg(m_unhandled.size());
+    }
+    return report;
+}
@@ -16,116 +16,122 @@
 #define SV_OSC_SCRIPT_H
 
 #include <QThread>
-#include <QFile>
-#include <QTextStream>
+#include <QMutex>
+#include <QString>
+#include <QHash>
 
-#include "base/Debug.h"
-#include "base/StringBits.h"
 #include "data/osc/OSCQueue.h"
 #include "data/osc/OSCMessage.h"
 
-#include <stdexcept>
-
+#include <atomic>
+#include <deque>
+#include <map>
+#include <vector>
+
+/**
+ * Run a script of OSC messages, posting them to an OSCQueue as if
+ * they had arrived from the network.
+ *
+ * Each line of the script is one of:
+ *
+ *  - "/method arg1 arg2 ..." - post a message;
+ *  - a number - pause for that many seconds;
+ *  - "@" followed by a number - wait until that many seconds after
+ *    the start of the script;
+ *  - "{" and "}" - begin and end a bundle of messages, which are all
+ *    posted together at the same time;
+ *  - "#" - a comment, or one of the directives below.
+ *
+ * By default a pause starts once the preceding message has been
+ * posted, so the timing of a long script drifts with the cost of
+ * posting (and logging) each message. The "#!scheduled" directive
+ * switches to scheduled timing, in which each pause is measured from
+ * the time the preceding pause was due to end instead, so that every
+ * message is posted at an absolute time from the start of the script
+ * regardless of how long the others took.
+ *
+ * "#!quiet" stops each line being logged as it is run, and
+ * "#!report <filename>" writes a summary of the timing of the script
+ * to the given file when it finishes, as well as to the log.
+ *
+ * The timing summary covers, for every message posted, its lateness
+ * (how long after its scheduled time it was posted) and, if the
+ * receiver calls messageHandled for it, its delivery latency (from
+ * posting to the receiver starting to handle it) and handling time.
+ * These make a script usable as a performance test.
+ */
 class OSCScript : public QThread
 {
     Q_OBJECT
 
 public:
-    OSCScript(QString filename, OSCQueue *queue) :
-        m_filename(filename),
-        m_queue(queue),
-        m_abandoning(false) {
-    }
+    OSCScript(QString filename, OSCQueue *queue);
 
-    void run() override {
-            
-        if (!m_queue) {
-            SVCERR << "OSCScript: No OSC queue available" << endl;
-            throw std::runtime_error("OSC queue not running");
-        }
-
-        QFile f;
-        QString reportedFilename;
-
-        if (m_filename == "-") {
-            f.open(stdin, QFile::ReadOnly | QFile::Text);
-            reportedFilename = "<stdin>";
-        } else {
-            f.setFileName(m_filename);
-            if (!f.open(QFile::ReadOnly | QFile::Text)) {
-                SVCERR << "OSCScript: Failed to open script file \""
-                       << m_filename << "\" for reading" << endl;
-                throw std::runtime_error("OSC script file not found");
-            }
-            reportedFilename = m_filename;
-        }
-        
-        QTextStream str(&f);
-        int lineno = 0;
-
-        while (!str.atEnd() && !m_abandoning) {
-
-            ++lineno;
-
-            QString line = str.readLine().trimmed();
-            if (line == QString()) continue;
-
-            if (line[0] == '#') {
-                continue;
-
-            } else if (line[0].isDigit()) {
-                bool ok = false;
-                float pause = line.toFloat(&ok);
-                if (ok) {
-                    SVCERR << "OSCScript: "
-                           << reportedFilename << ":" << lineno
-                           << ": pausing for " << pause << " sec" << endl;
-                    msleep(unsigned(round(pause * 1000.0f)));
-                    continue;
-                } else {
-                    SVCERR << "OSCScript: "
-                           << reportedFilename << ":" << lineno
-                           << ": warning: failed to parse sleep time, ignoring"
-                           << endl;
-                    continue;
-                }
-
-            } else if (line[0] == '/' && line.size() > 1) {
-                QStringList parts = StringBits::splitQuoted(line, ' ');
-                if (parts.empty()) {
-                    SVCERR << "OSCScript: "
-                           << reportedFilename << ":" << lineno
-                           << ": warning: empty command spec, ignoring"
-                           << endl;
-                    continue;
-                }
-                OSCMessage message;
-                message.setMethod(parts[0].mid(1));
-                for (int i = 1; i < parts.size(); ++i) {
-                    message.addArg(parts[i]);
-                }
-                SVCERR << "OSCScript: " << reportedFilename << ":" << lineno
-                       << ": posting " << message.toString() << endl;
-                m_queue->postMessage(message);
-
-            } else {
-                SVCERR << "OSCScript: " << reportedFilename << ":" << lineno
-                       << ": warning: message expected, ignoring" << endl;
-            }
-        }
-
-        SVCERR << "OSCScript: " << reportedFilename << ": finished" << endl;
-    }
+    void run() override;
 
     void abandon() {
         m_abandoning = true;
     }
+
+    /**
+     * Return a monotonic time in seconds, on the clock used for
+     * timing the script and its messages.
+     */
+    static double now();
+
+    /**
+     * Note that a message has been handled by the receiver, which
+     * began handling it at the given time (from now()) and has just
+     * finished. Messages not posted by this script are ignored. May
+     * be called from any thread.
+     */
+    void messageHandled(const OSCMessage &message, double handlingStarted);
+
+    /**
+     * Return the timing summary for the messages posted so far, as
+     * text with one "name: value" item per line.
+     */
+    QString getTimingReport() const;
     
 private:
     QString m_filename;
     OSCQueue *m_queue; // I do not own this
-    bool m_abandoning;
+    std::atomic<bool> m_abandoning;
+    bool m_scheduled;
+    bool m_verbose;
+    QString m_reportFile;
+    bool m_receiverReports; // true once messageHandled has been called
+
+    struct Posted {
+        QString text;
+        double posted;
+    };
+
+    struct Timing {
+        Timing() : count(0), total(0.0), max(0.0) { }
+        long count;
+        double total;
+        double max;
+        std::vector<double> samples;
+        void add(double t);
+        QString format(QString name) const;
+    };
+    
+    // Messages posted but not yet reported handled, by posting
+    // sequence number, and the sequence numbers of those with each
+    // text in posting order, so that a handled message can be matched
+    // to the earliest posted one with the same text without a search
+    mutable QMutex m_mutex;
+    std::map<long, Posted> m_unhandled;
+    QHash<QString, std::deque<long>> m_unhandledByText;
+    long m_postedCount;
+    Timing m_lateness;
+    Timing m_latency;
+    Timing m_handling;
+
+    void post(const std::vector<OSCMessage> &messages, double due,
+              QString where);
+    bool waitUntil(double t);
 };
 
 #endif
-
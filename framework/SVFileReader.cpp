@@ -45,12 +45,20 @@
 #include "widgets/ProgressDialog.h"
 
 #include "Document.h"
+#include "ModelDataLoader.h"
+#include "SessionStatistics.h"
 
 #include <QString>
+#include <QByteArray>
+#include <QtEndian>
 #include <QMessageBox>
 #include <QFileDialog>
+#include <QFileInfo>
+#include <QDir>
 
 #include <iostream>
+#include <cstring>
+#include <memory>
 
 SVFileReader::SVFileReader(Document *document,
                            SVFileReaderPaneCallback &callback,
@@ -59,12 +67,16 @@ SVFileReader::SVFileReader(Document *document,
     m_paneCallback(callback),
     m_location(location),
     m_currentPane(nullptr),
+    m_addModelsToDocument(true),
+    m_interactive(true),
     m_currentDataset(XmlExportable::NO_ID),
     m_currentLayer(nullptr),
     m_pendingDerivedModel(XmlExportable::NO_ID),
     m_currentTransformChannel(0),
     m_currentTransformIsNewStyle(true),
     m_datasetSeparator(" "),
+    m_datasetBinary(false),
+    m_datasetCompressed(false),
     m_inRow(false),
     m_inLayer(false),
     m_inView(false),
@@ -86,6 +98,7 @@ SVFileReader::parse(const QString &xmlData)
 void
 SVFileReader::parse(QXmlInputSource &inputSource)
 {
+    SessionStatistics::PhaseTimer timer("parse");
     QXmlSimpleReader reader;
     reader.setContentHandler(this);
     reader.setErrorHandler(this);
@@ -262,13 +275,10 @@ SVFileReader::startElement(const QString &, const QString &,
 bool
 SVFileReader::characters(const QString &text)
 {
-    bool ok = false;
-
+    // The parser may deliver the content of a row in more than one
+    // piece, so gather it up and read it when the row ends
     if (m_inRow) {
-        ok = readRowData(text);
-        if (!ok) {
-            SVCERR << "WARNING: SV-XML: Failed to read row data content for row " << m_rowNumber << endl;
-        }
+        m_rowText += text;
     }
 
     return true;
@@ -297,8 +307,21 @@ SVFileReader::endElement(const QString &, const QString &,
             if (!foundInAwaiting) {
                 SVCERR << "WARNING: SV-XML: Dataset precedes model, or no model uses dataset" << endl;
             }
+
+            // The model is already in the document, empty; its data
+            // is filled in on the loader thread while we carry on
+            // with the rest of the file
+            if (haveModel(m_currentDataset)) {
+                ModelId modelId = m_models[m_currentDataset];
+                ModelDataLoader *loader = m_document->getDataLoader();
+                loader->addEvents(modelId, std::move(m_datasetEvents));
+                loader->addColumns(modelId, std::move(m_datasetColumns));
+            }
         }
 
+        m_datasetEvents.clear();
+        m_datasetColumns.clear();
+
         m_currentDataset = XmlExportable::NO_ID;
 
     } else if (name == "data") {
@@ -317,22 +340,10 @@ SVFileReader::endElement(const QString &, const QString &,
                        << m_pendingDerivedModel
                        << " as target, not regenerating" << endl;
             } else {
-                QString message;
-                m_currentDerivedModel = m_models[m_pendingDerivedModel] =
-                    m_document->addDerivedModel
-                    (m_currentTransform,
-                     ModelTransformer::Input(m_currentTransformSource,
-                                             m_currentTransformChannel),
-                     message);
-                if (m_currentDerivedModel.isNone()) {
-                    emit modelRegenerationFailed(tr("(derived model in SV-XML)"),
-                                                 m_currentTransform.getIdentifier(),
-                                                 message);
-                } else if (message != "") {
-                    emit modelRegenerationWarning(tr("(derived model in SV-XML)"),
-                                                  m_currentTransform.getIdentifier(),
-                                                  message);
-                }                    
+                // regenerated in addPendingDerivations
+                m_pendingDerivations.push_back
+                    ({ m_pendingDerivedModel, m_currentTransform,
+                       m_currentTransformSource, m_currentTransformChannel });
             }
         } else {
             m_document->addAlreadyDerivedModel
@@ -350,6 +361,13 @@ SVFileReader::endElement(const QString &, const QString &,
         m_currentTransformChannel = -1;
 
     } else if (name == "row") {
+        if (m_inRow) {
+            bool ok = readRowData(m_rowText);
+            if (!ok) {
+                SVCERR << "WARNING: SV-XML: Failed to read row data content for row " << m_rowNumber << endl;
+            }
+        }
+        m_rowText = QString();
         m_inRow = false;
     } else if (name == "layer") {
         m_inLayer = false;
@@ -409,6 +427,10 @@ SVFileReader::readWindow(const QXmlAttributes &)
 void
 SVFileReader::makeAggregateModels()
 {
+    if (m_pendingAggregates.empty()) return;
+    
+    SessionStatistics::PhaseTimer timer("aggregate-models");
+    
     std::map<ExportId, PendingAggregateRec> stillPending;
     
     for (auto p: m_pendingAggregates) {
@@ -463,9 +485,105 @@ SVFileReader::makeAggregateModels()
     m_pendingAggregates = stillPending;
 }
 
+bool
+SVFileReader::isPendingDerivation(ExportId id) const
+{
+    for (const auto &p: m_pendingDerivations) {
+        if (p.model == id) return true;
+    }
+    return false;
+}
+
+void
+SVFileReader::addPendingDerivations()
+{
+    // Run the derivations that share an input together, in the order
+    // in which the inputs were first seen. Document groups them
+    // further into transforms that can share a single pass, and
+    // fetches any it can from the derived model cache.
+
+    if (m_pendingDerivations.empty()) return;
+
+    SessionStatistics::PhaseTimer timer("derivations");
+    
+    while (!m_pendingDerivations.empty()) {
+
+        ModelId source = m_pendingDerivations[0].source;
+        int channel = m_pendingDerivations[0].channel;
+
+        ModelTransformer::Input input(source, channel);
+
+        // Reuse any identical derivation the document already has,
+        // as addDerivedModel would, and run identical transforms
+        // within this batch only once
+        
+        Transforms transforms;
+        std::vector<std::vector<ExportId>> ids;
+        std::vector<PendingDerivation> remaining;
+        
+        for (const auto &p: m_pendingDerivations) {
+            if (p.source != source || p.channel != channel) {
+                remaining.push_back(p);
+                continue;
+            }
+            ModelId existing = m_document->findDerivedModel(p.transform, input);
+            if (!existing.isNone()) {
+                SVDEBUG << "SVFileReader::addPendingDerivations: reusing existing derivation for transform " << p.transform.getIdentifier() << endl;
+                m_models[p.model] = existing;
+                m_addedModels.insert(existing);
+                continue;
+            }
+            bool duplicate = false;
+            for (int i = 0; in_range_for(transforms, i); ++i) {
+                if (transforms[i] == p.transform) {
+                    ids[i].push_back(p.model);
+                    duplicate = true;
+                    break;
+                }
+            }
+            if (!duplicate) {
+                transforms.push_back(p.transform);
+                ids.push_back({ p.model });
+            }
+        }
+
+        m_pendingDerivations = remaining;
+
+        if (transforms.empty()) continue;
+
+        QString message;
+        std::vector<QString> messages;
+        std::vector<ModelId> models = m_document->addDerivedModels
+            (transforms, input, message, nullptr, &messages);
+
+        for (int i = 0; in_range_for(transforms, i); ++i) {
+            ModelId modelId;
+            if (in_range_for(models, i)) modelId = models[i];
+            QString transformMessage;
+            if (in_range_for(messages, i)) transformMessage = messages[i];
+            for (ExportId id: ids[i]) {
+                m_models[id] = modelId;
+            }
+            if (modelId.isNone()) {
+                emit modelRegenerationFailed(tr("(derived model in SV-XML)"),
+                                             transforms[i].getIdentifier(),
+                                             transformMessage);
+            } else {
+                m_addedModels.insert(modelId);
+                if (transformMessage != "") {
+                    emit modelRegenerationWarning(tr("(derived model in SV-XML)"),
+                                                  transforms[i].getIdentifier(),
+                                                  transformMessage);
+                }
+            }
+        }
+    }
+}
+
 void
 SVFileReader::addUnaddedModels()
 {
+    addPendingDerivations();
     makeAggregateModels();
 
     for (auto i: m_models) {
@@ -477,10 +595,15 @@ SVFileReader::addUnaddedModels()
             continue;
         }
 
-        m_document->addNonDerivedModel(modelId);
+        if (m_addModelsToDocument) {
+            m_document->addNonDerivedModel(modelId);
+        } else {
+            m_unaddedModels.push_back(modelId);
+        }
         
         // make a note of all models that have been added to the
-        // document, so they don't get released by our own destructor
+        // document or handed to our caller, so they don't get
+        // released by our own destructor
         m_addedModels.insert(modelId);
     }
 }
@@ -508,18 +631,31 @@ SVFileReader::readModel(const QXmlAttributes &attributes)
     bool isMainModel = (attributes.value("mainModel").trimmed() == "true");
 
     if (type == "wavefile") {
+
+        SessionStatistics::PhaseTimer timer("open-audio");
         
         WaveFileModel *model = nullptr;
-        FileFinder *ff = FileFinder::getInstance();
         QString originalPath = attributes.value("file");
-        QString path = ff->find(FileFinder::AudioFile,
-                                originalPath, m_location);
+        QString path = originalPath;
+        FileFinder *ff = (m_interactive ? FileFinder::getInstance() : nullptr);
+        if (ff) {
+            path = ff->find(FileFinder::AudioFile, originalPath, m_location);
+        } else if (QFileInfo(path).isRelative() && !QFileInfo(path).exists()) {
+            QString local = QFileInfo(m_location).dir().filePath(path);
+            if (QFileInfo(local).exists()) {
+                path = local;
+            }
+        }
 
         SVDEBUG << "Wave file originalPath = " << originalPath << ", path = "
                   << path << endl;
 
-        ProgressDialog dialog(tr("Opening file or URL..."), true, 2000);
-        FileSource file(path, &dialog);
+        std::unique_ptr<ProgressDialog> dialog;
+        if (m_interactive) {
+            dialog.reset(new ProgressDialog
+                         (tr("Opening file or URL..."), true, 2000));
+        }
+        FileSource file(path, dialog.get());
         file.waitForStatus();
 
         if (!file.isOK()) {
@@ -558,6 +694,10 @@ SVFileReader::readModel(const QXmlAttributes &attributes)
 
         ModelId modelId = ModelById::add(std::shared_ptr<Model>(model));
         m_models[id] = modelId;
+
+        SessionStatistics::getInstance()->modelStarted
+            (m_document->getStatisticsOperation(),
+             modelId, "audio-decode", path);
         
         if (isMainModel) {
             m_document->setMainModel(modelId);
@@ -1054,6 +1194,9 @@ SVFileReader::readDatasetStart(const QXmlAttributes &attributes)
 
     bool good = false;
 
+    m_datasetBinary = false;
+    m_datasetCompressed = false;
+
     switch (dimensions) {
     case 1:
         good =
@@ -1073,6 +1216,22 @@ SVFileReader::readDatasetStart(const QXmlAttributes &attributes)
         if (ModelById::isa<EditableDenseThreeDimensionalModel>(modelId)) {
             good = true;
             m_datasetSeparator = attributes.value("separator");
+            QString encoding = attributes.value("encoding");
+            QString compression = attributes.value("compression");
+            if (encoding == "base64-float32") {
+                m_datasetBinary = true;
+            } else if (encoding != "" && encoding != "text") {
+                SVCERR << "WARNING: SV-XML: Unsupported encoding \""
+                       << encoding << "\" for 3-D dataset " << id << endl;
+                good = false;
+            }
+            if (compression == "zlib") {
+                m_datasetCompressed = true;
+            } else if (compression != "") {
+                SVCERR << "WARNING: SV-XML: Unsupported compression \""
+                       << compression << "\" for 3-D dataset " << id << endl;
+                good = false;
+            }
         } else {
             good =
                 (ModelById::isa<NoteModel>(modelId) ||
@@ -1115,14 +1274,14 @@ SVFileReader::addPointToDataset(const QXmlAttributes &attributes)
 
     if (auto sodm = ModelById::getAs<SparseOneDimensionalModel>(modelId)) {
         QString label = attributes.value("label");
-        sodm->add(Event(frame, label));
+        m_datasetEvents.push_back(Event(frame, label));
         return true;
     }
 
     if (auto stvm = ModelById::getAs<SparseTimeValueModel>(modelId)) {
         float value = attributes.value("value").trimmed().toFloat(&ok);
         QString label = attributes.value("label");
-        stvm->add(Event(frame, value, label));
+        m_datasetEvents.push_back(Event(frame, value, label));
         return ok;
     }
         
@@ -1135,7 +1294,7 @@ SVFileReader::addPointToDataset(const QXmlAttributes &attributes)
             level = 1.f;
             ok = true;
         }
-        nm->add(Event(frame, value, duration, level, label));
+        m_datasetEvents.push_back(Event(frame, value, duration, level, label));
         return ok;
     }
 
@@ -1143,14 +1302,14 @@ SVFileReader::addPointToDataset(const QXmlAttributes &attributes)
         float value = attributes.value("value").trimmed().toFloat(&ok);
         int duration = attributes.value("duration").trimmed().toInt(&ok);
         QString label = attributes.value("label");
-        rm->add(Event(frame, value, duration, label));
+        m_datasetEvents.push_back(Event(frame, value, duration, label));
         return ok;
     }
 
     if (auto tm = ModelById::getAs<TextModel>(modelId)) {
         float height = attributes.value("height").trimmed().toFloat(&ok);
         QString label = attributes.value("label");
-        tm->add(Event(frame, height, label));
+        m_datasetEvents.push_back(Event(frame, height, label));
         return ok;
     }
 
@@ -1165,14 +1324,14 @@ SVFileReader::addPointToDataset(const QXmlAttributes &attributes)
         float extent = attributes.value("extent").trimmed().toFloat(&ok);
         int duration = attributes.value("duration").trimmed().toInt(&ok);
         QString label = attributes.value("label");
-        bm->add(Event(frame, value, duration, extent, label));
+        m_datasetEvents.push_back(Event(frame, value, duration, extent, label));
         return ok;
     }
 
     if (auto im = ModelById::getAs<ImageModel>(modelId)) {
         QString image = attributes.value("image");
         QString label = attributes.value("label");
-        im->add(Event(frame).withURI(image).withLabel(label));
+        m_datasetEvents.push_back(Event(frame).withURI(image).withLabel(label));
         return ok;
     }
 
@@ -1220,6 +1379,7 @@ bool
 SVFileReader::addRowToDataset(const QXmlAttributes &attributes)
 {
     m_inRow = false;
+    m_rowText = QString();
 
     bool ok = false;
     m_rowNumber = attributes.value("n").trimmed().toInt(&ok);
@@ -1247,6 +1407,10 @@ SVFileReader::readRowData(const QString &text)
     ModelId modelId = m_models[m_currentDataset];        
     bool warned = false;
 
+    if (m_datasetBinary) {
+        return readBinaryRowData(text);
+    }
+
     if (auto dtdm = ModelById::getAs<EditableDenseThreeDimensionalModel>
         (modelId)) {
 
@@ -1275,7 +1439,7 @@ SVFileReader::readRowData(const QString &text)
             }
         }
 
-        dtdm->setColumn(m_rowNumber, values);
+        m_datasetColumns.push_back({ m_rowNumber, values });
         return true;
     }
 
@@ -1283,6 +1447,54 @@ SVFileReader::readRowData(const QString &text)
     return false;
 }
 
+bool
+SVFileReader::readBinaryRowData(const QString &text)
+{
+    // The row is a base64 block of little-endian float32 values,
+    // possibly zlib-compressed (in qCompress format) before encoding,
+    // as written by Document with a binary dataset encoding
+
+    auto dtdm = ModelById::getAs<EditableDenseThreeDimensionalModel>
+        (m_models[m_currentDataset]);
+    if (!dtdm) {
+        SVCERR << "WARNING: SV-XML: Binary row data found in non-row dataset"
+               << endl;
+        return false;
+    }
+
+    QByteArray bytes = QByteArray::fromBase64(text.trimmed().toLatin1());
+    if (m_datasetCompressed) {
+        bytes = qUncompress(bytes);
+        if (bytes.isEmpty()) {
+            SVCERR << "WARNING: SV-XML: Failed to uncompress data for row "
+                   << m_rowNumber << endl;
+            return false;
+        }
+    }
+
+    if (bytes.size() % 4 != 0) {
+        SVCERR << "WARNING: SV-XML: Binary data for row " << m_rowNumber
+               << " is not a whole number of values" << endl;
+        return false;
+    }
+
+    int n = bytes.size() / 4;
+    if (n > dtdm->getHeight()) {
+        SVCERR << "WARNING: SV-XML: Too many y-bins in 3-D dataset row "
+               << m_rowNumber << endl;
+    }
+
+    DenseThreeDimensionalModel::Column values(n);
+    const uchar *ptr = reinterpret_cast<const uchar *>(bytes.constData());
+    for (int i = 0; i < n; ++i) {
+        quint32 bits = qFromLittleEndian<quint32>(ptr + i * 4);
+        memcpy(&values[i], &bits, 4);
+    }
+
+    m_datasetColumns.push_back({ m_rowNumber, std::move(values) });
+    return true;
+}
+
 bool
 SVFileReader::readDerivation(const QXmlAttributes &attributes)
 {
@@ -1308,6 +1520,10 @@ SVFileReader::readDerivation(const QXmlAttributes &attributes)
     bool sourceOk = false;
     sourceId = attributes.value("source").trimmed().toInt(&sourceOk);
 
+    if (sourceOk && isPendingDerivation(sourceId)) {
+        addPendingDerivations();
+    }
+
     if (sourceOk && haveModel(sourceId)) {
         m_currentTransformSource = m_models[sourceId];
     } else {
@@ -1390,6 +1606,10 @@ SVFileReader::readPlayParameters(const QXmlAttributes &attributes)
         return false;
     }
 
+    if (isPendingDerivation(modelExportId)) {
+        addPendingDerivations();
+    }
+
     if (haveModel(modelExportId)) {
 
         bool ok = false;
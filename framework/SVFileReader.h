@@ -18,10 +18,13 @@
 
 #include "layer/LayerFactory.h"
 #include "transform/Transform.h"
+#include "base/Event.h"
+#include "data/model/DenseThreeDimensionalModel.h"
 
 #include <QXmlDefaultHandler>
 
 #include <map>
+#include <vector>
 
 class Pane;
 class Model;
@@ -181,6 +184,33 @@ public:
 
     // For loading a single layer onto an existing pane
     void setCurrentPane(Pane *pane) { m_currentPane = pane; }
+
+    /**
+     * Specify whether the models read should be added to the
+     * document, as they are by default. If not, they are instead
+     * left for the caller to retrieve using getUnaddedModels after
+     * parsing, and it becomes responsible for releasing them. Their
+     * datasets are still loaded through the document's data loader.
+     */
+    void setAddModelsToDocument(bool add) { m_addModelsToDocument = add; }
+
+    /**
+     * Return the models read but not added to the document, in the
+     * order of their ids in the file, if setAddModelsToDocument(false)
+     * was called before parsing.
+     */
+    std::vector<ModelId> getUnaddedModels() const { return m_unaddedModels; }
+
+    /**
+     * Specify whether the reader may interact with the user, as it
+     * does by default, showing progress while retrieving audio files
+     * and asking the application's FileFinder to locate any that have
+     * moved. A reader used without a GUI, or away from the GUI
+     * thread, must set this false; audio files are then looked for
+     * only at the path recorded in the file, or relative to the
+     * location of the file being read.
+     */
+    void setInteractive(bool interactive) { m_interactive = interactive; }
     
     bool startElement(const QString &namespaceURI,
                       const QString &localName,
@@ -221,6 +251,7 @@ protected:
     bool addPointToDataset(const QXmlAttributes &);
     bool addRowToDataset(const QXmlAttributes &);
     bool readRowData(const QString &);
+    bool readBinaryRowData(const QString &);
     bool readDerivation(const QXmlAttributes &);
     bool readPlayParameters(const QXmlAttributes &);
     bool readPlugin(const QXmlAttributes &);
@@ -233,6 +264,7 @@ protected:
 
     void makeAggregateModels();
     void addUnaddedModels();
+    void addPendingDerivations();
 
     // We use the term "pending" of things that have been referred to
     // but not yet constructed because their definitions are
@@ -264,6 +296,21 @@ protected:
     std::map<ExportId, ModelId> m_models;
     std::map<ExportId, Path *> m_paths;
     std::set<ModelId> m_addedModels; // i.e. added to Document, not just ById
+    bool m_addModelsToDocument;
+    std::vector<ModelId> m_unaddedModels;
+    bool m_interactive;
+
+    // Derivations found in the file that need their models to be
+    // regenerated. These are run together when the models are next
+    // needed, so that transforms on the same input can be batched.
+    struct PendingDerivation {
+        ExportId model;
+        Transform transform;
+        ModelId source;
+        int channel;
+    };
+    std::vector<PendingDerivation> m_pendingDerivations;
+    bool isPendingDerivation(ExportId id) const;
     std::map<ExportId, PendingAggregateRec> m_pendingAggregates;
 
     // A model element often contains a dataset id, and the dataset
@@ -288,6 +335,12 @@ protected:
     int m_currentTransformChannel;
     bool m_currentTransformIsNewStyle;
     QString m_datasetSeparator;
+    bool m_datasetBinary;
+    bool m_datasetCompressed;
+    QString m_rowText;
+    EventVector m_datasetEvents;
+    std::vector<std::pair<int, DenseThreeDimensionalModel::Column>>
+        m_datasetColumns;
     bool m_inRow;
     bool m_inLayer;
     bool m_inView;
@@ -0,0 +1,396 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "SessionStatistics.h"
+
+#include "base/Debug.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutexLocker>
+#include <QTimer>
+
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+#ifdef Q_OS_MAC
+#include <mach/mach.h>
+#endif
+
+#include <sstream>
+
+// Interval between checks for the models of an operation becoming
+// ready, while there are any
+static const int pendingModelCheckInterval = 250; // ms
+
+SessionStatistics *
+SessionStatistics::getInstance()
+{
+    static SessionStatistics *instance = nullptr;
+    static QMutex instanceMutex;
+    QMutexLocker locker(&instanceMutex);
+    if (!instance) {
+        instance = new SessionStatistics();
+        // Wherever we were first asked for, our polling timer needs
+        // to run in the main thread
+        if (QCoreApplication::instance()) {
+            instance->moveToThread(QCoreApplication::instance()->thread());
+        }
+    }
+    return instance;
+}
+
+SessionStatistics::SessionStatistics() :
+    m_nextId(1),
+    m_current(-1),
+    m_polling(false)
+{
+}
+
+qint64
+SessionStatistics::now()
+{
+    static QElapsedTimer timer;
+    static QMutex timerMutex;
+    QMutexLocker locker(&timerMutex);
+    if (!timer.isValid()) timer.start();
+    return timer.nsecsElapsed();
+}
+
+long
+SessionStatistics::getResidentMemoryKB()
+{
+#if defined(Q_OS_LINUX)
+    QFile statm("/proc/self/statm");
+    if (!statm.open(QFile::ReadOnly)) return -1;
+    QList<QByteArray> fields = statm.readAll().split(' ');
+    if (fields.size() < 2) return -1;
+    long pages = fields[1].toLong();
+    return long(pages * (sysconf(_SC_PAGESIZE) / 1024));
+#elif defined(Q_OS_MAC)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                  (task_info_t)&info, &count) != KERN_SUCCESS) {
+        return -1;
+    }
+    return long(info.resident_size / 1024);
+#else
+    return -1;
+#endif
+}
+
+int
+SessionStatistics::beginOperation(QString kind, QString path)
+{
+    long kb = getResidentMemoryKB();
+    
+    QMutexLocker locker(&m_mutex);
+    int id = m_nextId++;
+    Operation &op = m_operations[id];
+    op.kind = kind;
+    op.path = path;
+    op.started = QDateTime::currentDateTime();
+    op.startNs = now();
+    op.startKB = kb;
+    op.peakKB = kb;
+    m_current = id;
+    return id;
+}
+
+void
+SessionStatistics::endOperation(int operation, bool ok)
+{
+    long kb = getResidentMemoryKB();
+    QString report;
+    {
+        QMutexLocker locker(&m_mutex);
+        auto itr = m_operations.find(operation);
+        if (itr == m_operations.end()) return;
+        Operation &op = itr->second;
+        op.ended = true;
+        op.ok = ok;
+        op.endNs = now();
+        sampleMemory(op, kb);
+        if (m_current == operation) {
+            m_current = -1;
+        }
+        report = takeReportIfComplete(operation);
+    }
+    if (report != "") {
+        emit reportComplete(report);
+    }
+}
+
+SessionStatistics::PhaseTimer::PhaseTimer(QString phase, int operation) :
+    m_phase(phase),
+    m_operation(operation),
+    m_startNs(now()),
+    m_startKB(getResidentMemoryKB())
+{
+    if (m_operation < 0) {
+        SessionStatistics *s = getInstance();
+        QMutexLocker locker(&s->m_mutex);
+        m_operation = s->m_current;
+    }
+}
+
+SessionStatistics::PhaseTimer::~PhaseTimer()
+{
+    if (m_operation < 0) return;
+    getInstance()->recordPhase(m_operation, m_phase, now() - m_startNs,
+                               m_startKB, getResidentMemoryKB());
+}
+
+void
+SessionStatistics::recordPhase(int operation, QString phase, qint64 ns,
+                               long startKB, long endKB)
+{
+    QMutexLocker locker(&m_mutex);
+    auto itr = m_operations.find(operation);
+    if (itr == m_operations.end()) return;
+    Operation &op = itr->second;
+
+    if (op.phases.find(phase) == op.phases.end()) {
+        op.phaseOrder.push_back(phase);
+    }
+    Phase &p = op.phases[phase];
+    ++p.count;
+    p.totalNs += ns;
+    if (ns > p.maxNs) p.maxNs = ns;
+    if (startKB >= 0 && endKB >= 0) {
+        p.memoryDeltaKB += endKB - startKB;
+    }
+    sampleMemory(op, endKB);
+}
+
+void
+SessionStatistics::sampleMemory(Operation &op, long kb)
+{
+    if (kb < 0) return;
+    op.endKB = kb;
+    if (kb > op.peakKB) op.peakKB = kb;
+}
+
+void
+SessionStatistics::modelStarted(int operation, ModelId modelId,
+                                QString kind, QString detail)
+{
+    if (operation < 0) return;
+    
+    QString type, name;
+    if (auto model = ModelById::get(modelId)) {
+        type = model->getTypeName();
+        name = model->objectName();
+    }
+    
+    {
+        QMutexLocker locker(&m_mutex);
+
+        auto itr = m_operations.find(operation);
+        if (itr == m_operations.end()) return;
+        Operation &op = itr->second;
+
+        ModelWork work;
+        work.model = modelId;
+        work.kind = kind;
+        work.detail = detail;
+        work.type = type;
+        work.name = name;
+        work.startNs = now();
+        op.models.push_back(work);
+
+        if (m_polling) return;
+        m_polling = true;
+    }
+
+    QMetaObject::invokeMethod(this, "checkPendingModels",
+                              Qt::QueuedConnection);
+}
+
+void
+SessionStatistics::modelFinished(ModelId modelId, QString kind, bool ok)
+{
+    std::vector<QString> reports;
+    {
+        QMutexLocker locker(&m_mutex);
+        std::vector<int> ids;
+        for (auto &op: m_operations) {
+            for (auto &work: op.second.models) {
+                if (work.model == modelId && work.kind == kind &&
+                    !work.finished) {
+                    work.finished = true;
+                    work.ok = ok;
+                    work.endNs = now();
+                    ids.push_back(op.first);
+                }
+            }
+        }
+        for (int id: ids) {
+            QString report = takeReportIfComplete(id);
+            if (report != "") reports.push_back(report);
+        }
+    }
+    for (auto r: reports) {
+        emit reportComplete(r);
+    }
+}
+
+void
+SessionStatistics::checkPendingModels()
+{
+    std::vector<QString> reports;
+    bool pending = false;
+    long kb = getResidentMemoryKB();
+    
+    {
+        QMutexLocker locker(&m_mutex);
+        std::vector<int> ids;
+
+        for (auto &op: m_operations) {
+            for (auto &work: op.second.models) {
+                if (work.finished) {
+                    continue;
+                }
+                bool ready = false, ok = false;
+                {
+                    auto model = ModelById::get(work.model);
+                    if (!model) {
+                        ready = true; // released
+                    } else if (work.kind == "alignment") {
+                        // finished only through modelFinished, as an
+                        // aligned model is ready long before its
+                        // alignment is
+                    } else if (model->isReady()) {
+                        ready = true;
+                        ok = model->isOK();
+                    }
+                }
+                if (ready) {
+                    work.finished = true;
+                    work.ok = ok;
+                    work.endNs = now();
+                    sampleMemory(op.second, kb);
+                } else {
+                    pending = true;
+                }
+            }
+            ids.push_back(op.first);
+        }
+
+        for (int id: ids) {
+            QString report = takeReportIfComplete(id);
+            if (report != "") reports.push_back(report);
+        }
+
+        m_polling = pending;
+    }
+
+    for (auto r: reports) {
+        emit reportComplete(r);
+    }
+    
+    if (pending) {
+        QTimer::singleShot(pendingModelCheckInterval,
+                           this, SLOT(checkPendingModels()));
+    }
+}
+
+QString
+SessionStatistics::getLastReport() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_lastReport;
+}
+
+QString
+SessionStatistics::takeReportIfComplete(int operation)
+{
+    auto itr = m_operations.find(operation);
+    if (itr == m_operations.end()) return {};
+    const Operation &op = itr->second;
+    
+    if (!op.ended) return {};
+    for (const auto &work: op.models) {
+        if (!work.finished) return {};
+    }
+
+    QString report = makeReport(op);
+    m_operations.erase(itr);
+    m_lastReport = report;
+    return report;
+}
+
+QString
+SessionStatistics::makeReport(const Operation &op)
+{
+    auto ms = [](qint64 ns) { return double(ns) / 1.0e6; };
+
+    qint64 endNs = op.endNs;
+    for (const auto &work: op.models) {
+        if (work.endNs > endNs) endNs = work.endNs;
+    }
+    
+    QJsonObject obj;
+    obj["operation"] = op.kind;
+    obj["path"] = op.path;
+    obj["started"] = op.started.toString(Qt::ISODateWithMs);
+    obj["ok"] = op.ok;
+    obj["synchronous-ms"] = ms(op.endNs - op.startNs);
+    obj["total-ms"] = ms(endNs - op.startNs);
+    if (op.startKB >= 0) {
+        obj["rss-start-kb"] = double(op.startKB);
+        obj["rss-end-kb"] = double(op.endKB);
+        obj["rss-peak-kb"] = double(op.peakKB);
+    }
+
+    QJsonArray phases;
+    for (const auto &name: op.phaseOrder) {
+        const Phase &p = op.phases.at(name);
+        QJsonObject po;
+        po["phase"] = name;
+        po["count"] = p.count;
+        po["total-ms"] = ms(p.totalNs);
+        po["max-ms"] = ms(p.maxNs);
+        if (op.startKB >= 0) {
+            po["rss-delta-kb"] = double(p.memoryDeltaKB);
+        }
+        phases.append(po);
+    }
+    obj["phases"] = phases;
+
+    QJsonArray models;
+    for (const auto &work: op.models) {
+        std::ostringstream id;
+        id << work.model;
+        QJsonObject mo;
+        mo["model"] = QString::fromStdString(id.str());
+        mo["kind"] = work.kind;
+        if (work.detail != "") mo["detail"] = work.detail;
+        if (work.type != "") mo["type"] = work.type;
+        if (work.name != "") mo["name"] = work.name;
+        mo["ok"] = work.ok;
+        mo["start-ms"] = ms(work.startNs - op.startNs);
+        mo["duration-ms"] = ms(work.endNs - work.startNs);
+        models.append(mo);
+    }
+    obj["models"] = models;
+
+    return QString::fromUtf8
+        (QJsonDocument(obj).toJson(QJsonDocument::Compact));
+}
@@ -0,0 +1,184 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_SESSION_STATISTICS_H
+#define SV_SESSION_STATISTICS_H
+
+#include "data/model/Model.h"
+
+#include <QObject>
+#include <QMutex>
+#include <QString>
+#include <QDateTime>
+
+#include <map>
+#include <vector>
+
+/**
+ * Timing and memory figures for session opening and saving, broken
+ * down by phase and by model, cheap enough to be always on.
+ *
+ * An operation, such as opening or saving a session, is begun with
+ * beginOperation and its synchronous part ended with endOperation.
+ * Phases of the work within it (XML parsing, opening audio files,
+ * building aggregate models, starting derivations and alignments,
+ * serialising and writing) are timed with PhaseTimer, and repeated
+ * phases are accumulated under the same name. Phases may nest, and
+ * the time of each includes that of any within it, so that "parse"
+ * for example includes "open-audio" and "derivations". Work that
+ * carries on in the background with one model each (decoding audio,
+ * running a transform, aligning) is recorded with modelStarted, and
+ * counts as finished once the model is ready or modelFinished is
+ * called.
+ *
+ * When an operation has ended and all of its models have finished,
+ * its report is complete: a single JSON object, which is emitted
+ * through reportComplete and is afterwards available from
+ * getLastReport. Memory figures are the resident size of the whole
+ * process, sampled at the start and end of each phase and operation,
+ * and are absent on platforms where it cannot be read cheaply.
+ *
+ * All functions may be called from any thread.
+ */
+class SessionStatistics : public QObject
+{
+    Q_OBJECT
+
+public:
+    static SessionStatistics *getInstance();
+
+    /**
+     * Begin an operation of the given kind (e.g. "open-session"),
+     * concerning the given file. Return an id for the operation. It
+     * becomes the current operation, to which phases are attributed
+     * unless another is given.
+     */
+    int beginOperation(QString kind, QString path);
+
+    /**
+     * End the synchronous part of an operation, with its outcome.
+     * The report is completed now, or when the last of its models has
+     * finished.
+     */
+    void endOperation(int operation, bool ok);
+
+    /**
+     * Time a phase, from construction to destruction, attributing it
+     * to the given operation, or to the current one if none is given.
+     * Does nothing if there is no operation in progress.
+     */
+    class PhaseTimer {
+    public:
+        PhaseTimer(QString phase, int operation = -1);
+        ~PhaseTimer();
+    private:
+        QString m_phase;
+        int m_operation;
+        qint64 m_startNs;
+        long m_startKB;
+    };
+
+    /**
+     * Record that background work of the given kind (e.g.
+     * "audio-decode", "derivation", "alignment") has started for a
+     * model, as part of the given operation. The detail may name a
+     * file or transform. Ignored if the operation is -1, or its
+     * report is no longer open.
+     */
+    void modelStarted(int operation, ModelId model,
+                      QString kind, QString detail);
+
+    /**
+     * Record that work of the given kind has finished for a model.
+     * Work other than alignment is also taken to have finished when
+     * the model is ready, or has been released.
+     */
+    void modelFinished(ModelId model, QString kind, bool ok);
+    
+    /**
+     * Return the most recently completed report, or an empty string
+     * if none has been completed yet.
+     */
+    QString getLastReport() const;
+
+    /**
+     * Return the resident memory size of this process in kilobytes,
+     * or -1 if it is not known.
+     */
+    static long getResidentMemoryKB();
+
+signals:
+    void reportComplete(QString report);
+
+private slots:
+    void checkPendingModels();
+
+private:
+    SessionStatistics();
+
+    struct Phase {
+        Phase() : count(0), totalNs(0), maxNs(0), memoryDeltaKB(0) { }
+        int count;
+        qint64 totalNs;
+        qint64 maxNs;
+        long memoryDeltaKB;
+    };
+
+    struct ModelWork {
+        ModelWork() : startNs(0), endNs(0), finished(false), ok(false) { }
+        ModelId model;
+        QString kind;
+        QString detail;
+        QString type;
+        QString name;
+        qint64 startNs;
+        qint64 endNs;
+        bool finished;
+        bool ok;
+    };
+
+    struct Operation {
+        Operation() : startNs(0), endNs(0), ended(false), ok(false),
+                      startKB(-1), endKB(-1), peakKB(-1) { }
+        QString kind;
+        QString path;
+        QDateTime started;
+        qint64 startNs;
+        qint64 endNs;
+        bool ended;
+        bool ok;
+        long startKB;
+        long endKB;
+        long peakKB;
+        std::vector<QString> phaseOrder;
+        std::map<QString, Phase> phases;
+        std::vector<ModelWork> models;
+    };
+
+    mutable QMutex m_mutex;
+    std::map<int, Operation> m_operations; // those whose reports are open
+    int m_nextId;
+    int m_current;
+    bool m_polling;
+    QString m_lastReport;
+
+    void recordPhase(int operation, QString phase, qint64 ns,
+                     long startKB, long endKB);
+    void sampleMemory(Operation &op, long kb);
+    QString takeReportIfComplete(int operation); // with m_mutex held
+    static qint64 now();
+    static QString makeReport(const Operation &op);
+};
+
+#endif